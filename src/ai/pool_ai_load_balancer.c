@@ -23,6 +23,7 @@
 #include "utils/elog.h"
 #include "utils/palloc.h"
 #include "utils/memutils.h"
+#include "utils/pg_prng.h"
 
 #include <string.h>
 #include <math.h>
@@ -33,91 +34,92 @@
 /* Global AI model state */
 AIModelState *ai_model_state = NULL;
 
+/*
+ * Response time measurement of the query in progress in this process. Only
+ * one query is measured at a time since a child serves one frontend.
+ */
+static bool feedback_pending = false;
+static int	feedback_node_id = -1;
+static struct timeval feedback_start;
+
+/* prng state data for exploration */
+static pg_prng_state ai_prng_state;
+static bool ai_prng_seeded = false;
+
 /* Private function prototypes */
 static double calculate_node_score(AINodeMetrics *metrics, QueryPattern *pattern);
 static double get_time_diff_ms(struct timeval *start, struct timeval *end);
-static void update_node_averages(AINodeMetrics *metrics);
+static uint64 get_now_usec(void);
+static double ai_random(void);
 static int weighted_random_selection(int *nodes, double *weights, int count);
 static void decay_metrics(AINodeMetrics *metrics);
 
 /*
- * Initialize the AI load balancer
+ * Returns the byte size of the AI model area in shared memory
+ */
+size_t
+pool_ai_lb_shared_memory_size(void)
+{
+	return MAXALIGN(sizeof(AIModelState));
+}
+
+/*
+ * Initialize the AI load balancer. This is called by pgbalancer main while
+ * setting up shared memory, before any child is forked.
  */
 void
-pool_ai_lb_initialize(int num_nodes, AILoadBalancerMode mode)
+pool_ai_lb_initialize(AIModelState *addr, AILoadBalancerMode mode)
 {
 	int i;
-	
-	elog(LOG, "AI Load Balancer: Initializing with %d nodes, mode=%d", 
-	     num_nodes, mode);
+	uint64 now;
 
-	/* Allocate memory for AI model state */
-	ai_model_state = (AIModelState *)palloc0(sizeof(AIModelState));
-	
-	if (!ai_model_state)
-	{
-		elog(ERROR, "AI Load Balancer: Failed to allocate memory for model state");
-		return;
-	}
+	elog(LOG, "AI Load Balancer: Initializing with %d nodes, mode=%d",
+	     NUM_BACKENDS, mode);
+
+	ai_model_state = addr;
+	memset(ai_model_state, 0, pool_ai_lb_shared_memory_size());
 
 	ai_model_state->mode = mode;
-	ai_model_state->num_nodes = num_nodes;
-	ai_model_state->learning_rate = 0.1;      /* 10% learning rate */
+	ai_model_state->num_nodes = MAX_NUM_BACKENDS;	/* nodes may be added on reload */
+	pool_atomic_write_double(&ai_model_state->learning_rate, 0.1);	/* 10% learning rate */
 	ai_model_state->exploration_rate = 0.2;   /* 20% exploration */
-	ai_model_state->total_decisions = 0;
-	ai_model_state->successful_decisions = 0;
+	pool_atomic_init_u64(&ai_model_state->total_decisions, 0);
+	pool_atomic_init_u64(&ai_model_state->successful_decisions, 0);
 
 	gettimeofday(&ai_model_state->model_start_time, NULL);
-
-	/* Allocate and initialize node metrics */
-	ai_model_state->node_metrics = (AINodeMetrics *)palloc0(
-		sizeof(AINodeMetrics) * num_nodes);
-	
-	if (!ai_model_state->node_metrics)
-	{
-		pfree(ai_model_state);
-		ai_model_state = NULL;
-		elog(ERROR, "AI Load Balancer: Failed to allocate memory for node metrics");
-		return;
-	}
+	now = get_now_usec();
 
 	/* Initialize each node's metrics */
-	for (i = 0; i < num_nodes; i++)
+	for (i = 0; i < ai_model_state->num_nodes; i++)
 	{
-		ai_model_state->node_metrics[i].node_id = i;
-		ai_model_state->node_metrics[i].avg_response_time = 0.0;
-		ai_model_state->node_metrics[i].current_load = 0.0;
-		ai_model_state->node_metrics[i].total_queries = 0;
-		ai_model_state->node_metrics[i].successful_queries = 0;
-		ai_model_state->node_metrics[i].failed_queries = 0;
-		ai_model_state->node_metrics[i].error_rate = 0.0;
-		ai_model_state->node_metrics[i].predicted_load = 0.0;
-		ai_model_state->node_metrics[i].health_score = 1.0; /* Start with perfect health */
-		gettimeofday(&ai_model_state->node_metrics[i].last_update, NULL);
+		AINodeMetrics *m = &ai_model_state->node_metrics[i];
+
+		m->node_id = i;
+		pool_atomic_write_double(&m->health_score, 1.0);	/* Start with perfect health */
+		pool_atomic_init_u64(&m->last_update, now);
 	}
 
 	elog(LOG, "AI Load Balancer: Initialized successfully");
 }
 
 /*
- * Shutdown and cleanup AI load balancer
+ * Shutdown AI load balancer. The model lives in shared memory which is
+ * released by pgbalancer main, so we just detach from it.
  */
 void
 pool_ai_lb_shutdown(void)
 {
 	if (ai_model_state)
 	{
-		elog(LOG, "AI Load Balancer: Shutting down (total decisions: %ld, success rate: %.2f%%)",
-		     ai_model_state->total_decisions,
-		     ai_model_state->total_decisions > 0 ? 
-		     (100.0 * ai_model_state->successful_decisions / ai_model_state->total_decisions) : 0.0);
+		uint64		total = pool_atomic_read_u64(&ai_model_state->total_decisions);
+		uint64		successful = pool_atomic_read_u64(&ai_model_state->successful_decisions);
+
+		elog(LOG, "AI Load Balancer: Shutting down (total decisions: %lu, success rate: %.2f%%)",
+		     total, total > 0 ? (100.0 * successful / total) : 0.0);
 
-		if (ai_model_state->node_metrics)
-			pfree(ai_model_state->node_metrics);
-		
-		pfree(ai_model_state);
 		ai_model_state = NULL;
 	}
+	feedback_pending = false;
 }
 
 /*
@@ -127,7 +129,7 @@ int
 pool_ai_select_backend(QueryPattern *pattern, int *available_nodes, int num_available)
 {
 	int i, selected_node;
-	double *scores;
+	double scores[MAX_NUM_BACKENDS];
 	double max_score;
 	int best_node;
 	bool use_exploration;
@@ -135,26 +137,29 @@ pool_ai_select_backend(QueryPattern *pattern, int *available_nodes, int num_avai
 	if (!ai_model_state || num_available <= 0)
 		return available_nodes[0];  /* Fallback to first available */
 
-	/* Exploration vs Exploitation strategy */
-	use_exploration = ((double)rand() / RAND_MAX) < ai_model_state->exploration_rate;
+	if (num_available == 1)
+		return available_nodes[0];
 
-	scores = (double *)palloc(sizeof(double) * num_available);
+	/* Exploration vs Exploitation strategy */
+	use_exploration = ai_random() < ai_model_state->exploration_rate;
 
 	/* Calculate score for each available node */
 	for (i = 0; i < num_available; i++)
 	{
 		int node_id = available_nodes[i];
 		AINodeMetrics *metrics = &ai_model_state->node_metrics[node_id];
-		
+
 		/* Decay old metrics */
 		decay_metrics(metrics);
-		
+
 		/* Calculate node score based on current mode */
 		scores[i] = calculate_node_score(metrics, pattern);
-		
+
 		elog(DEBUG2, "AI LB: Node %d score=%.3f (health=%.2f, load=%.2f, rt=%.2f ms)",
-		     node_id, scores[i], metrics->health_score, 
-		     metrics->current_load, metrics->avg_response_time);
+		     node_id, scores[i],
+		     pool_atomic_read_double(&metrics->health_score),
+		     pool_atomic_read_double(&metrics->current_load),
+		     pool_atomic_read_double(&metrics->avg_response_time));
 	}
 
 	if (use_exploration)
@@ -165,26 +170,33 @@ pool_ai_select_backend(QueryPattern *pattern, int *available_nodes, int num_avai
 	}
 	else
 	{
-		/* Exploitation: Select best scoring node */
+		/*
+		 * Exploitation: Select best scoring node. Ties are broken at random
+		 * so that nodes without history do not all end up on the first one.
+		 */
+		int			nties = 1;
+
 		max_score = scores[0];
 		best_node = 0;
-		
+
 		for (i = 1; i < num_available; i++)
 		{
 			if (scores[i] > max_score)
 			{
 				max_score = scores[i];
 				best_node = i;
+				nties = 1;
 			}
+			else if (scores[i] == max_score && ai_random() * ++nties < 1.0)
+				best_node = i;
 		}
-		
+
 		selected_node = available_nodes[best_node];
-		elog(DEBUG2, "AI LB: Using exploitation, selected node %d (score=%.3f)", 
+		elog(DEBUG2, "AI LB: Using exploitation, selected node %d (score=%.3f)",
 		     selected_node, max_score);
 	}
 
-	pfree(scores);
-	ai_model_state->total_decisions++;
+	pool_atomic_fetch_add_u64(&ai_model_state->total_decisions, 1);
 
 	return selected_node;
 }
@@ -199,18 +211,19 @@ calculate_node_score(AINodeMetrics *metrics, QueryPattern *pattern)
 	double health_weight = 0.4;
 	double load_weight = 0.3;
 	double response_time_weight = 0.3;
+	double avg_response_time = pool_atomic_read_double(&metrics->avg_response_time);
 
 	/* Health score (higher is better) */
-	score += metrics->health_score * health_weight;
+	score += pool_atomic_read_double(&metrics->health_score) * health_weight;
 
 	/* Load score (lower load is better) */
-	score += (1.0 - metrics->current_load) * load_weight;
+	score += (1.0 - pool_atomic_read_double(&metrics->current_load)) * load_weight;
 
 	/* Response time score (faster is better) */
-	if (metrics->avg_response_time > 0)
+	if (avg_response_time > 0)
 	{
 		/* Normalize response time to 0-1 scale (assuming 1000ms is very slow) */
-		double rt_score = 1.0 - fmin(metrics->avg_response_time / 1000.0, 1.0);
+		double rt_score = 1.0 - fmin(avg_response_time / 1000.0, 1.0);
 		score += rt_score * response_time_weight;
 	}
 	else
@@ -242,55 +255,61 @@ pool_ai_update_metrics(int node_id, double response_time, bool success)
 {
 	AINodeMetrics *metrics;
 	double alpha;
+	uint64 total;
+	uint64 successful;
+	uint64 failed;
+	double avg_response_time;
+	double success_rate;
+	double rt_health;
+	double current_load_sample;
+	double current_load;
 
 	if (!ai_model_state || node_id < 0 || node_id >= ai_model_state->num_nodes)
 		return;
 
 	metrics = &ai_model_state->node_metrics[node_id];
-	alpha = ai_model_state->learning_rate;
+	alpha = pool_atomic_read_double(&ai_model_state->learning_rate);
 
 	/* Update counters */
-	metrics->total_queries++;
+	total = pool_atomic_fetch_add_u64(&metrics->total_queries, 1) + 1;
 	if (success)
 	{
-		metrics->successful_queries++;
-		ai_model_state->successful_decisions++;
+		pool_atomic_fetch_add_u64(&metrics->successful_queries, 1);
+		pool_atomic_fetch_add_u64(&ai_model_state->successful_decisions, 1);
 	}
 	else
 	{
-		metrics->failed_queries++;
+		pool_atomic_fetch_add_u64(&metrics->failed_queries, 1);
 	}
+	successful = pool_atomic_read_u64(&metrics->successful_queries);
+	failed = pool_atomic_read_u64(&metrics->failed_queries);
 
 	/* Update average response time using exponential moving average */
-	if (metrics->avg_response_time == 0.0)
-		metrics->avg_response_time = response_time;
-	else
-		metrics->avg_response_time = (alpha * response_time) + 
-		                             ((1.0 - alpha) * metrics->avg_response_time);
+	avg_response_time = pool_atomic_ema_double(&metrics->avg_response_time,
+											   response_time, alpha);
 
 	/* Update error rate */
-	metrics->error_rate = (double)metrics->failed_queries / 
-	                      (double)metrics->total_queries;
+	pool_atomic_write_double(&metrics->error_rate, (double) failed / (double) total);
 
 	/* Update health score (based on success rate and response time) */
-	double success_rate = (double)metrics->successful_queries / 
-	                      (double)metrics->total_queries;
-	double rt_health = metrics->avg_response_time < 100.0 ? 1.0 : 
-	                   (metrics->avg_response_time < 500.0 ? 0.8 : 0.5);
-	
-	metrics->health_score = (success_rate * 0.6) + (rt_health * 0.4);
+	success_rate = (double) successful / (double) total;
+	rt_health = avg_response_time < 100.0 ? 1.0 :
+	            (avg_response_time < 500.0 ? 0.8 : 0.5);
+
+	pool_atomic_write_double(&metrics->health_score,
+							 (success_rate * 0.6) + (rt_health * 0.4));
 
 	/* Update load estimate (simple moving average) */
-	double current_load_sample = response_time > 100.0 ? 0.7 : 
-	                             response_time > 50.0 ? 0.5 : 0.3;
-	metrics->current_load = (alpha * current_load_sample) + 
-	                       ((1.0 - alpha) * metrics->current_load);
+	current_load_sample = response_time > 100.0 ? 0.7 :
+	                      response_time > 50.0 ? 0.5 : 0.3;
+	current_load = pool_atomic_ema_double(&metrics->current_load,
+										  current_load_sample, alpha);
 
-	gettimeofday(&metrics->last_update, NULL);
+	pool_atomic_write_u64(&metrics->last_update, get_now_usec());
 
 	elog(DEBUG3, "AI LB: Updated node %d metrics - RT: %.2f ms, Health: %.2f, Load: %.2f",
-	     node_id, metrics->avg_response_time, metrics->health_score, 
-	     metrics->current_load);
+	     node_id, avg_response_time,
+	     pool_atomic_read_double(&metrics->health_score), current_load);
 }
 
 /*
@@ -302,7 +321,7 @@ pool_ai_get_node_health(int node_id)
 	if (!ai_model_state || node_id < 0 || node_id >= ai_model_state->num_nodes)
 		return 0.5;  /* Default neutral health */
 
-	return ai_model_state->node_metrics[node_id].health_score;
+	return pool_atomic_read_double(&ai_model_state->node_metrics[node_id].health_score);
 }
 
 /*
@@ -312,6 +331,7 @@ double
 pool_ai_predict_query_time(int node_id, QueryPattern *pattern)
 {
 	AINodeMetrics *metrics;
+	double avg_response_time;
 	double base_time;
 	double complexity_factor;
 
@@ -322,8 +342,8 @@ pool_ai_predict_query_time(int node_id, QueryPattern *pattern)
 	metrics = &ai_model_state->node_metrics[node_id];
 	
 	/* Base prediction on historical average */
-	base_time = metrics->avg_response_time > 0 ? 
-	            metrics->avg_response_time : 50.0;  /* Default 50ms */
+	avg_response_time = pool_atomic_read_double(&metrics->avg_response_time);
+	base_time = avg_response_time > 0 ? avg_response_time : 50.0;  /* Default 50ms */
 
 	/* Adjust based on query complexity */
 	complexity_factor = 1.0 + (pattern->estimated_complexity / 200.0);
@@ -348,16 +368,14 @@ void
 pool_ai_learn_from_feedback(int node_id, QueryPattern *pattern,
                              double actual_time, bool success)
 {
-	AINodeMetrics *metrics;
 	double predicted_time;
 	double prediction_error;
+	double learning_rate;
 
 	if (!ai_model_state || !pattern ||
 	    node_id < 0 || node_id >= ai_model_state->num_nodes)
 		return;
 
-	metrics = &ai_model_state->node_metrics[node_id];
-	
 	/* Calculate prediction error */
 	predicted_time = pool_ai_predict_query_time(node_id, pattern);
 	prediction_error = fabs(actual_time - predicted_time);
@@ -365,11 +383,17 @@ pool_ai_learn_from_feedback(int node_id, QueryPattern *pattern,
 	/* Update metrics */
 	pool_ai_update_metrics(node_id, actual_time, success);
 
-	/* Adjust learning rate based on prediction accuracy */
+	/*
+	 * Adjust learning rate based on prediction accuracy. A lost update from a
+	 * concurrent child only delays the adjustment, so a plain store is fine.
+	 */
+	learning_rate = pool_atomic_read_double(&ai_model_state->learning_rate);
 	if (prediction_error > 100.0)  /* Poor prediction */
-		ai_model_state->learning_rate = fmin(0.2, ai_model_state->learning_rate * 1.1);
+		pool_atomic_write_double(&ai_model_state->learning_rate,
+								 fmin(0.2, learning_rate * 1.1));
 	else if (prediction_error < 10.0)  /* Good prediction */
-		ai_model_state->learning_rate = fmax(0.05, ai_model_state->learning_rate * 0.95);
+		pool_atomic_write_double(&ai_model_state->learning_rate,
+								 fmax(0.05, learning_rate * 0.95));
 
 	elog(DEBUG3, "AI LB: Learning feedback - Node %d, Predicted: %.2f ms, Actual: %.2f ms, Error: %.2f ms",
 	     node_id, predicted_time, actual_time, prediction_error);
@@ -384,12 +408,16 @@ pool_ai_get_statistics(char *buf, int bufsize)
 	int i, len = 0;
 	double uptime_sec;
 	struct timeval now;
+	uint64 total_decisions;
+	uint64 successful_decisions;
 
 	if (!ai_model_state || !buf || bufsize <= 0)
 		return;
 
 	gettimeofday(&now, NULL);
 	uptime_sec = get_time_diff_ms(&ai_model_state->model_start_time, &now) / 1000.0;
+	total_decisions = pool_atomic_read_u64(&ai_model_state->total_decisions);
+	successful_decisions = pool_atomic_read_u64(&ai_model_state->successful_decisions);
 
 	len += snprintf(buf + len, bufsize - len,
 	                "AI Load Balancer Statistics\n");
@@ -397,28 +425,32 @@ pool_ai_get_statistics(char *buf, int bufsize)
 	                "Mode: %d, Uptime: %.1f sec\n",
 	                ai_model_state->mode, uptime_sec);
 	len += snprintf(buf + len, bufsize - len,
-	                "Total Decisions: %ld, Success Rate: %.2f%%\n",
-	                ai_model_state->total_decisions,
-	                ai_model_state->total_decisions > 0 ?
-	                (100.0 * ai_model_state->successful_decisions / 
-	                 ai_model_state->total_decisions) : 0.0);
+	                "Total Decisions: %lu, Success Rate: %.2f%%\n",
+	                total_decisions,
+	                total_decisions > 0 ?
+	                (100.0 * successful_decisions / total_decisions) : 0.0);
 	len += snprintf(buf + len, bufsize - len,
 	                "Learning Rate: %.3f, Exploration Rate: %.3f\n\n",
-	                ai_model_state->learning_rate, 
+	                pool_atomic_read_double(&ai_model_state->learning_rate),
 	                ai_model_state->exploration_rate);
 
 	/* Per-node statistics */
-	for (i = 0; i < ai_model_state->num_nodes && len < bufsize - 100; i++)
+	for (i = 0; i < NUM_BACKENDS && len < bufsize - 100; i++)
 	{
 		AINodeMetrics *m = &ai_model_state->node_metrics[i];
+		uint64 total_queries = pool_atomic_read_u64(&m->total_queries);
+		uint64 failed_queries = pool_atomic_read_u64(&m->failed_queries);
+
 		len += snprintf(buf + len, bufsize - len,
 		                "Node %d: Health=%.2f, Load=%.2f, AvgRT=%.1fms, "
-		                "Queries=%ld, Errors=%ld (%.1f%%)\n",
-		                m->node_id, m->health_score, m->current_load,
-		                m->avg_response_time, m->total_queries, 
-		                m->failed_queries,
-		                m->total_queries > 0 ? 
-		                (100.0 * m->failed_queries / m->total_queries) : 0.0);
+		                "Queries=%lu, Errors=%lu (%.1f%%)\n",
+		                m->node_id,
+		                pool_atomic_read_double(&m->health_score),
+		                pool_atomic_read_double(&m->current_load),
+		                pool_atomic_read_double(&m->avg_response_time),
+		                total_queries, failed_queries,
+		                total_queries > 0 ?
+		                (100.0 * failed_queries / total_queries) : 0.0);
 	}
 }
 
@@ -435,19 +467,21 @@ pool_ai_reset_model(void)
 
 	elog(LOG, "AI Load Balancer: Resetting model");
 
-	ai_model_state->total_decisions = 0;
-	ai_model_state->successful_decisions = 0;
+	pool_atomic_write_u64(&ai_model_state->total_decisions, 0);
+	pool_atomic_write_u64(&ai_model_state->successful_decisions, 0);
 	gettimeofday(&ai_model_state->model_start_time, NULL);
 
 	for (i = 0; i < ai_model_state->num_nodes; i++)
 	{
-		ai_model_state->node_metrics[i].avg_response_time = 0.0;
-		ai_model_state->node_metrics[i].current_load = 0.0;
-		ai_model_state->node_metrics[i].total_queries = 0;
-		ai_model_state->node_metrics[i].successful_queries = 0;
-		ai_model_state->node_metrics[i].failed_queries = 0;
-		ai_model_state->node_metrics[i].error_rate = 0.0;
-		ai_model_state->node_metrics[i].health_score = 1.0;
+		AINodeMetrics *m = &ai_model_state->node_metrics[i];
+
+		pool_atomic_write_double(&m->avg_response_time, 0.0);
+		pool_atomic_write_double(&m->current_load, 0.0);
+		pool_atomic_write_u64(&m->total_queries, 0);
+		pool_atomic_write_u64(&m->successful_queries, 0);
+		pool_atomic_write_u64(&m->failed_queries, 0);
+		pool_atomic_write_double(&m->error_rate, 0.0);
+		pool_atomic_write_double(&m->health_score, 1.0);
 	}
 }
 
@@ -532,6 +566,56 @@ pool_ai_analyze_query(const char *query, QueryPattern *pattern)
 	                         (pattern->estimated_rows / 100.0);
 }
 
+/*
+ * Start measuring the response time of a query which has been sent to
+ * node_id only. If a measurement is already going on (e.g. Parse, Bind and
+ * Execute before a Sync), the earliest start time is kept.
+ */
+void
+pool_ai_query_sent(int node_id)
+{
+	if (!LOAD_BALANCE_MODE_IS_AI() || !pool_ai_is_enabled() || feedback_pending)
+		return;
+
+	feedback_node_id = node_id;
+	gettimeofday(&feedback_start, NULL);
+	feedback_pending = true;
+}
+
+/*
+ * Finish measuring the current query, which is called when ReadyForQuery
+ * arrives, and feed the measured latency to the model.
+ */
+void
+pool_ai_query_done(const char *query, bool success)
+{
+	QueryPattern pattern;
+	struct timeval now;
+
+	if (!feedback_pending)
+		return;
+	feedback_pending = false;
+
+	if (!LOAD_BALANCE_MODE_IS_AI() || !pool_ai_is_enabled())
+		return;
+
+	gettimeofday(&now, NULL);
+	pool_ai_analyze_query(query ? query : "", &pattern);
+	pool_ai_learn_from_feedback(feedback_node_id, &pattern,
+								get_time_diff_ms(&feedback_start, &now), success);
+}
+
+/*
+ * Forget the query being measured, if any.  This is called when a session
+ * starts and when a query is aborted by an error, so that the next query
+ * does not report the time since then.
+ */
+void
+pool_ai_query_reset(void)
+{
+	feedback_pending = false;
+}
+
 /*
  * Helper: Get time difference in milliseconds
  */
@@ -543,27 +627,67 @@ get_time_diff_ms(struct timeval *start, struct timeval *end)
 	return ms;
 }
 
+/*
+ * Helper: Get current time in microseconds
+ */
+static uint64
+get_now_usec(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (uint64) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/*
+ * Helper: Returns a random number in [0, 1). The PRNG is seeded per process
+ * so that children do not all explore the same nodes.
+ */
+static double
+ai_random(void)
+{
+	if (unlikely(!ai_prng_seeded))
+	{
+		uint64		seed;
+
+		if (!pg_strong_random(&seed, sizeof(seed)))
+			seed = (uint64) getpid() ^ get_now_usec();
+		pg_prng_seed(&ai_prng_state, seed);
+		ai_prng_seeded = true;
+	}
+	return pg_prng_double(&ai_prng_state);
+}
+
 /*
  * Helper: Decay old metrics to give more weight to recent performance
  */
 static void
 decay_metrics(AINodeMetrics *metrics)
 {
-	struct timeval now;
+	uint64 now;
+	uint64 last_update;
 	double time_since_update;
 	double decay_factor;
-
-	gettimeofday(&now, NULL);
-	time_since_update = get_time_diff_ms(&metrics->last_update, &now);
-
-	/* Decay if more than 60 seconds since last update */
-	if (time_since_update > 60000.0)
+	double health_score;
+
+	now = get_now_usec();
+	last_update = pool_atomic_read_u64(&metrics->last_update);
+	time_since_update = (now - last_update) / 1000.0;
+
+	/*
+	 * Decay if more than 60 seconds since last update. Only the child which
+	 * wins the race on last_update applies the decay.
+	 */
+	if (time_since_update > 60000.0 &&
+		pool_atomic_compare_exchange_u64(&metrics->last_update, &last_update, now))
 	{
 		decay_factor = 0.9;  /* 10% decay */
-		metrics->current_load *= decay_factor;
+		pool_atomic_write_double(&metrics->current_load,
+								 pool_atomic_read_double(&metrics->current_load) * decay_factor);
 		/* Gradually restore health if no recent failures */
-		if (metrics->health_score < 1.0)
-			metrics->health_score = fmin(1.0, metrics->health_score + 0.05);
+		health_score = pool_atomic_read_double(&metrics->health_score);
+		if (health_score < 1.0)
+			pool_atomic_write_double(&metrics->health_score, fmin(1.0, health_score + 0.05));
 	}
 }
 
@@ -583,10 +707,10 @@ weighted_random_selection(int *nodes, double *weights, int count)
 		total_weight += weights[i];
 
 	if (total_weight == 0.0)
-		return nodes[rand() % count];  /* Uniform random if all weights are 0 */
+		return nodes[(int) (ai_random() * count)];  /* Uniform random if all weights are 0 */
 
 	/* Select based on weight */
-	random_value = ((double)rand() / RAND_MAX) * total_weight;
+	random_value = ai_random() * total_weight;
 
 	for (i = 0; i < count; i++)
 	{
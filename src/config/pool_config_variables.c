@@ -397,6 +397,17 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL,					/* check func */
 		NULL					/* show hook */
 	},
+	{
+		{"exclusive_accept", CFGCXT_INIT, CONNECTION_CONFIG,
+			"whether to wake up only one child for an incoming connection using EPOLLEXCLUSIVE",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.exclusive_accept,	/* variable */
+		true,					/* boot value */
+		NULL,					/* assign func */
+		NULL,					/* check func */
+		NULL					/* show hook */
+	},
 	{
 		{"failover_when_quorum_exists", CFGCXT_INIT, FAILOVER_CONFIG,
 			"Do failover only when cluster has the quorum.",
@@ -512,16 +523,6 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL, NULL, NULL
 	},
 
-	{
-		{"load_balance_mode_algo", CFGCXT_RELOAD, LOAD_BALANCE_CONFIG,
-			"Load balance algorithm: 'heuristic' (default) or 'ai'.",
-			CONFIG_VAR_TYPE_STRING, false, 0
-		},
-		&g_pool_config.load_balance_mode_algo,
-		"heuristic",
-		NULL, NULL, NULL
-	},
-
 	{
 		{"replication_stop_on_mismatch", CFGCXT_RELOAD, REPLICATION_CONFIG,
 			"Starts degeneration and stops replication, If there's a data mismatch between primary and secondary.",
@@ -572,6 +573,26 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"skip_reset_for_stateless_session", CFGCXT_RELOAD, CONNECTION_POOL_CONFIG,
+			"Skips reset queries if the session did not leave session level state.",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.skip_reset_for_stateless_session,
+		false,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"multiplex_prepared_statements", CFGCXT_RELOAD, CONNECTION_POOL_CONFIG,
+			"Shares named prepared statements among sessions using a backend connection.",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.multiplex_prepared_statements,
+		false,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"fail_over_on_backend_error", CFGCXT_RELOAD, FAILOVER_CONFIG,
 			"Old config parameter for failover_on_backend_error.",
@@ -752,6 +773,36 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"memqcache_oiddir_fallback", CFGCXT_RELOAD, CACHE_CONFIG,
+			"Records table oids in memqcache_oiddir when the shared memory oid map is full.",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.memqcache_oiddir_fallback,
+		true,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"memqcache_lazy_invalidation", CFGCXT_INIT, CACHE_CONFIG,
+			"Invalidates shared memory query cache by per table generation counters.",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.memqcache_lazy_invalidation,
+		false,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"memqcache_admission_control", CFGCXT_RELOAD, CACHE_CONFIG,
+			"Admits and evicts shared memory query cache by query frequency.",
+			CONFIG_VAR_TYPE_BOOL, false, 0
+		},
+		&g_pool_config.memqcache_admission_control,
+		false,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"allow_sql_comments", CFGCXT_SESSION, LOAD_BALANCE_CONFIG,
 			"Ignore SQL comments, while judging if load balance or query cache is possible.",
@@ -826,6 +877,16 @@ static struct config_bool ConfigureNamesBool[] =
 
 static struct config_string ConfigureNamesString[] =
 {
+	{
+		{"load_balance_mode_algo", CFGCXT_RELOAD, LOAD_BALANCE_CONFIG,
+			"Load balance algorithm: 'heuristic' (default) or 'ai'.",
+			CONFIG_VAR_TYPE_STRING, false, 0
+		},
+		&g_pool_config.load_balance_mode_algo,
+		"heuristic",
+		NULL, NULL, NULL, NULL
+	},
+
 	{
 		{"user_redirect_preference_list", CFGCXT_RELOAD, STREAMING_REPLICATION_CONFIG,
 			"redirect by user name.",
@@ -2215,6 +2276,28 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"routing_cache_size", CFGCXT_INIT, CACHE_CONFIG,
+			"Number of routing cache entry.",
+			CONFIG_VAR_TYPE_INT, false, 0
+		},
+		&g_pool_config.routing_cache_size,
+		0,
+		0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"shared_relcache_size", CFGCXT_INIT, CACHE_CONFIG,
+			"Number of shared relation cache entry.",
+			CONFIG_VAR_TYPE_INT, false, 0
+		},
+		&g_pool_config.shared_relcache_size,
+		0,
+		0, 1048576,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"memqcache_memcached_port", CFGCXT_INIT, CACHE_CONFIG,
 			"Port number of Memcached server.",
@@ -2259,6 +2342,39 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"memqcache_compress_threshold", CFGCXT_RELOAD, CACHE_CONFIG,
+			"Minimum SELECT result size in bytes to compress in the query cache.",
+			CONFIG_VAR_TYPE_INT, false, GUC_UNIT_BYTE
+		},
+		&g_pool_config.memqcache_compress_threshold,
+		0,
+		0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"health_check_ping_period", CFGCXT_RELOAD, HEALTH_CHECK_CONFIG,
+			"Time interval in milliseconds between pings on persistent health check connections.",
+			CONFIG_VAR_TYPE_INT, false, GUC_UNIT_MS
+		},
+		&g_pool_config.health_check_ping_period,
+		0,
+		0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"memqcache_coalesce_timeout", CFGCXT_RELOAD, CACHE_CONFIG,
+			"Timeout in milliseconds to wait for a concurrent execution of the same query on cache miss.",
+			CONFIG_VAR_TYPE_INT, false, GUC_UNIT_MS
+		},
+		&g_pool_config.memqcache_coalesce_timeout,
+		1000,
+		0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"memqcache_cache_block_size", CFGCXT_INIT, CACHE_CONFIG,
 			"Cache block size in bytes.",
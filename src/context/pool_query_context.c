@@ -21,6 +21,8 @@
 #include "utils/pool_stream.h"
 #include "context/pool_session_context.h"
 #include "context/pool_query_context.h"
+#include "query_cache/pool_memqcache.h"
+#include "ai/pool_ai_load_balancer.h"
 #include "parser/nodes.h"
 
 #include <string.h>
@@ -62,6 +64,28 @@ static bool add_object_into_temp_write_list(Node *node, void *context);
 static void dml_adaptive(Node *node, char *query);
 static char *get_associated_object_from_dml_adaptive_relations
 			(char *left_token, DBObjectTypes object_type);
+static bool select_needs_primary(char *query, Node *node, QueryRoutingFacts *facts);
+static bool is_ddl(Node *node);
+
+/*
+ * Routing cache.  Remembers per process whether a SELECT must be sent to the
+ * primary for reasons which depend only on the query text and the database:
+ * system catalogs, unlogged tables, primary_routing_query_pattern_list and
+ * writing functions.  Checks depending on the session, such as temporary
+ * tables, are not cached.  Entries are replaced when another query hashes
+ * into the same entry, and expire after relcache_expire seconds as relation
+ * cache entries do.
+ */
+typedef struct
+{
+	uint32		hash;
+	char	   *query;			/* NULL if the entry is not used */
+	char		dbname[MAX_IDENTIFIER_LEN];
+	bool		needs_primary;
+	time_t		expire;			/* 0 if never expires */
+} POOL_ROUTING_CACHE_ENTRY;
+
+static POOL_ROUTING_CACHE_ENTRY *routing_cache;
 
 /*
  * Create and initialize per query session context
@@ -129,6 +153,9 @@ pool_query_context_shallow_copy(POOL_QUERY_CONTEXT *query_context)
 	memory_context = qc->memory_context;
 	memcpy(qc, query_context, sizeof(POOL_QUERY_CONTEXT));
 	qc->memory_context = memory_context;
+	/* Owned by the original, whose memory context may go away first */
+	qc->cache_generations = NULL;
+	qc->num_cache_generations = -1;
 	return qc;
 }
 
@@ -154,6 +181,7 @@ pool_start_query(POOL_QUERY_CONTEXT *query_context, char *query, int len, Node *
 		query_context->virtual_main_node_id = my_main_node_id;
 		query_context->load_balance_node_id = my_main_node_id;
 		query_context->is_cache_safe = false;
+		query_context->num_cache_generations = -1;
 		query_context->num_original_params = -1;
 		if (pool_config->memory_cache_enabled)
 			query_context->temp_cache = pool_create_temp_query_cache(query);
@@ -463,6 +491,10 @@ pool_where_to_send(POOL_QUERY_CONTEXT *query_context, char *query, Node *node)
 	 */
 	pool_clear_node_to_be_sent(query_context);
 
+	/* DDL may change the verdicts in the routing cache */
+	if (routing_cache && is_ddl(node))
+		pool_routing_cache_clear();
+
 	/*
 	 * In raw mode, we send only to main node. Simple enough.
 	 */
@@ -625,6 +657,10 @@ pool_send_and_wait(POOL_QUERY_CONTEXT *query_context,
 		send_simplequery_message(CONNECTION(backend, i), len, string, MAJOR(backend));
 	}
 
+	/* Measure response time for AI load balancer */
+	if (!pool_multi_node_to_be_sent(query_context))
+		pool_ai_query_sent(query_context->virtual_main_node_id);
+
 	/* Wait for response */
 	for (i = 0; i < NUM_BACKENDS; i++)
 	{
@@ -836,6 +872,10 @@ pool_extended_send_and_wait(POOL_QUERY_CONTEXT *query_context,
 		}
 	}
 
+	/* Measure response time of Execute for AI load balancer */
+	if (*kind == 'E' && !pool_multi_node_to_be_sent(query_context))
+		pool_ai_query_sent(query_context->virtual_main_node_id);
+
 	if (!is_begin_read_write)
 	{
 		if (query_context->rewritten_query)
@@ -1609,6 +1649,30 @@ pool_unset_cache_safe(void)
 	}
 }
 
+/*
+ * Take the table generations of the cache safe SELECT which is about to be
+ * sent to backend.  Its result is registered to the cache with these, so
+ * that a DML committed while the SELECT runs leaves the result stale
+ * instead of going unnoticed.
+ */
+void
+pool_set_cache_generations(POOL_QUERY_CONTEXT *query_context)
+{
+	MemoryContext old_context;
+
+	if (!query_context || !query_context->is_cache_safe)
+		return;
+
+	if (query_context->cache_generations)
+		pfree(query_context->cache_generations);
+
+	old_context = MemoryContextSwitchTo(query_context->memory_context);
+	query_context->num_cache_generations =
+		pool_get_select_table_generations(query_context->parse_tree,
+										  &query_context->cache_generations);
+	MemoryContextSwitchTo(old_context);
+}
+
 /*
  * Return true if current temporary query cache is exceeded
  */
@@ -1860,6 +1924,17 @@ static char *get_associated_object_from_dml_adaptive_relations
 	return right_token;
 }
 
+/*
+ * Return true if check_object_relationship_list() may record anything,
+ * i.e. dml_adaptive_object_relationship_list is in effect.
+ */
+bool
+is_object_relationship_check_needed(void)
+{
+	return pool_config->disable_load_balance_on_write == DLBOW_DML_ADAPTIVE &&
+		pool_config->parsed_dml_adaptive_object_relationship_list != NULL;
+}
+
 /*
  * Check the object relationship list.
  * If find the name in the list, will add related objects to the transaction temp write list.
@@ -1867,7 +1942,7 @@ static char *get_associated_object_from_dml_adaptive_relations
 void
 check_object_relationship_list(char *name, bool is_func_name)
 {
-	if (pool_config->disable_load_balance_on_write == DLBOW_DML_ADAPTIVE && pool_config->parsed_dml_adaptive_object_relationship_list)
+	if (is_object_relationship_check_needed())
 	{
 		POOL_SESSION_CONTEXT *session_context = pool_get_session_context(false);
 
@@ -1982,6 +2057,7 @@ where_to_send_main_replica(POOL_QUERY_CONTEXT *query_context, char *query, Node
 	POOL_DEST	dest;
 	POOL_SESSION_CONTEXT *session_context;
 	POOL_CONNECTION_POOL *backend;
+	QueryRoutingFacts facts;
 
 	dest = send_to_where(node);
 	session_context = pool_get_session_context(false);
@@ -2056,21 +2132,13 @@ where_to_send_main_replica(POOL_QUERY_CONTEXT *query_context, char *query, Node
 				 */
 
 				/*
-				 * If system catalog is used in the SELECT, we prefer to send
-				 * to the primary. Example: SELECT * FROM pg_class WHERE
-				 * relname = 't1'; Because 't1' is a constant, it's hard to
-				 * recognize as table name.  Most use case such query is
-				 * against system catalog, and the table name can be a
-				 * temporary table, it's best to query against primary system
-				 * catalog. Please note that this test must be done *before*
-				 * test using pool_has_temp_table.
+				 * If system catalog, unlogged table or writing function is
+				 * used in the SELECT, or the query matches
+				 * primary_routing_query_pattern_list, we prefer to send to
+				 * the primary.
 				 */
-				if (pool_has_system_catalog(node))
+				if (select_needs_primary(query, node, &facts))
 				{
-					ereport(DEBUG1,
-							(errmsg("could not load balance because systems catalogs are used"),
-							 errdetail("destination = %d for query= \"%s\"", dest, query)));
-
 					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
 				}
 
@@ -2078,7 +2146,7 @@ where_to_send_main_replica(POOL_QUERY_CONTEXT *query_context, char *query, Node
 				 * If temporary table is used in the SELECT, we prefer to send
 				 * to the primary.
 				 */
-				else if (pool_config->check_temp_table && pool_has_temp_table(node))
+				else if (facts.has_temp_table)
 				{
 					ereport(DEBUG1,
 							(errmsg("could not load balance because temporary tables are used"),
@@ -2086,42 +2154,6 @@ where_to_send_main_replica(POOL_QUERY_CONTEXT *query_context, char *query, Node
 
 					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
 				}
-
-				/*
-				 * If unlogged table is used in the SELECT, we prefer to send
-				 * to the primary.
-				 */
-				else if (pool_config->check_unlogged_table && pool_has_unlogged_table(node))
-				{
-					ereport(DEBUG1,
-							(errmsg("could not load balance because unlogged tables are used"),
-							 errdetail("destination = %d for query= \"%s\"", dest, query)));
-
-					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
-				}
-
-				/*
-				 * When query match the query patterns in
-				 * primary_routing_query_pattern_list, we send only to main
-				 * node.
-				 */
-				else if (pattern_compare(query, WRITELIST, "primary_routing_query_pattern_list") == 1)
-				{
-					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
-				}
-
-				/*
-				 * If a writing function call is used, we prefer to send to
-				 * the primary.
-				 */
-				else if (pool_has_function_call(node))
-				{
-					ereport(DEBUG1,
-							(errmsg("could not load balance because writing functions are used"),
-							 errdetail("destination = %d for query= \"%s\"", dest, query)));
-
-					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
-				}
 				else if (is_select_object_in_temp_write_list(node, query))
 				{
 					pool_set_node_to_be_sent(query_context, PRIMARY_NODE_ID);
@@ -2339,3 +2371,184 @@ wait_for_failover_to_finish(void)
 	}
 	return -2;					/* timed out */
 }
+
+/*
+ * Return true if the SELECT must be sent to the primary because of system
+ * catalogs, unlogged tables, primary_routing_query_pattern_list or writing
+ * functions.  The result is looked up in and saved to the routing cache.
+ *
+ * The parse tree is walked once to collect these facts, together with
+ * whether temporary tables are used if check_temp_table is on.  The latter
+ * depends on the session and is returned in "facts" for the caller.
+ */
+static bool
+select_needs_primary(char *query, Node *node, QueryRoutingFacts *facts)
+{
+	POOL_SESSION_CONTEXT *session_context = pool_get_session_context(false);
+	POOL_ROUTING_CACHE_ENTRY *entry = NULL;
+	char	   *dbname = "";
+	uint32		hash = 0;
+	time_t		now = 0;
+	int			requested;
+	bool		needs_primary;
+
+	requested = pool_config->check_temp_table ? ROUTING_FACT_TEMP_TABLE : 0;
+
+	if (pool_config->routing_cache_size > 0 && strlen(query) < QUERY_STRING_BUFFER_LEN)
+	{
+		if (session_context->backend && MAIN_CONNECTION(session_context->backend) &&
+			MAIN_CONNECTION(session_context->backend)->sp)
+			dbname = MAIN_CONNECTION(session_context->backend)->sp->database;
+
+		if (routing_cache == NULL)
+			routing_cache = MemoryContextAllocZero(TopMemoryContext,
+												   sizeof(POOL_ROUTING_CACHE_ENTRY) * pool_config->routing_cache_size);
+
+		hash = hash_any((unsigned char *) query, strlen(query));
+		entry = &routing_cache[hash % pool_config->routing_cache_size];
+		now = time(NULL);
+
+		if (entry->query && entry->hash == hash &&
+			(entry->expire == 0 || entry->expire > now) &&
+			strcmp(entry->dbname, dbname) == 0 && strcmp(entry->query, query) == 0)
+		{
+			ereport(DEBUG1,
+					(errmsg("routing cache hit"),
+					 errdetail("needs primary = %d for query= \"%s\"", entry->needs_primary, query)));
+
+			/*
+			 * Temporary tables depend on the session, and function calls
+			 * must still be checked against
+			 * dml_adaptive_object_relationship_list in every transaction.
+			 */
+			if (entry->needs_primary)
+				requested = 0;
+			if (is_object_relationship_check_needed())
+				requested |= ROUTING_FACT_FUNCTION_CALL;
+
+			pool_get_query_routing_facts(node, requested, facts);
+			return entry->needs_primary;
+		}
+	}
+
+	/*
+	 * When query match the query patterns in
+	 * primary_routing_query_pattern_list, we send only to main node.  This
+	 * does not need to look into the parse tree, so do it first.
+	 */
+	if (pattern_compare(query, WRITELIST, "primary_routing_query_pattern_list") == 1)
+	{
+		memset(facts, 0, sizeof(*facts));
+		needs_primary = true;
+	}
+	else
+	{
+		/*
+		 * If system catalog is used in the SELECT, we prefer to send to the
+		 * primary. Example: SELECT * FROM pg_class WHERE relname = 't1';
+		 * Because 't1' is a constant, it's hard to recognize as table name.
+		 * Most use case such query is against system catalog, and the table
+		 * name can be a temporary table, it's best to query against primary
+		 * system catalog.  The same applies to unlogged tables and writing
+		 * functions.
+		 */
+		requested |= ROUTING_FACT_SYSTEM_CATALOG | ROUTING_FACT_FUNCTION_CALL;
+		if (pool_config->check_unlogged_table)
+			requested |= ROUTING_FACT_UNLOGGED_TABLE;
+
+		pool_get_query_routing_facts(node, requested, facts);
+
+		if (facts->has_system_catalog)
+			ereport(DEBUG1,
+					(errmsg("could not load balance because systems catalogs are used"),
+					 errdetail("query= \"%s\"", query)));
+		else if (facts->has_unlogged_table)
+			ereport(DEBUG1,
+					(errmsg("could not load balance because unlogged tables are used"),
+					 errdetail("query= \"%s\"", query)));
+		else if (facts->has_function_call)
+			ereport(DEBUG1,
+					(errmsg("could not load balance because writing functions are used"),
+					 errdetail("query= \"%s\"", query)));
+
+		needs_primary = facts->has_system_catalog || facts->has_unlogged_table ||
+			facts->has_function_call;
+
+		/*
+		 * The walk stops at the first fact found.  If it was a temporary
+		 * table, the other facts are unknown and the verdict cannot be
+		 * cached.
+		 */
+		if (facts->has_temp_table)
+			entry = NULL;
+	}
+
+	if (entry)
+	{
+		if (entry->query)
+			pfree(entry->query);
+		entry->query = MemoryContextStrdup(TopMemoryContext, query);
+		entry->hash = hash;
+		StrNCpy(entry->dbname, dbname, sizeof(entry->dbname));
+		entry->needs_primary = needs_primary;
+		entry->expire = pool_config->relcache_expire > 0 ? now + pool_config->relcache_expire : 0;
+	}
+
+	return needs_primary;
+}
+
+/*
+ * Forget all routing cache entries.  Called when configuration is reloaded
+ * or DDL is issued.
+ */
+void
+pool_routing_cache_clear(void)
+{
+	int			i;
+
+	if (routing_cache == NULL)
+		return;
+
+	for (i = 0; i < pool_config->routing_cache_size; i++)
+	{
+		if (routing_cache[i].query)
+		{
+			pfree(routing_cache[i].query);
+			routing_cache[i].query = NULL;
+		}
+	}
+}
+
+/*
+ * Return true if the statement could change the definition of objects, which
+ * is what counts as DDL in statistics.
+ */
+static bool
+is_ddl(Node *node)
+{
+	switch (nodeTag(node))
+	{
+		case T_SelectStmt:
+		case T_InsertStmt:
+		case T_UpdateStmt:
+		case T_DeleteStmt:
+		case T_CheckPointStmt:
+		case T_DeallocateStmt:
+		case T_DiscardStmt:
+		case T_ExecuteStmt:
+		case T_ExplainStmt:
+		case T_ListenStmt:
+		case T_LoadStmt:
+		case T_LockStmt:
+		case T_NotifyStmt:
+		case T_PrepareStmt:
+		case T_TransactionStmt:
+		case T_UnlistenStmt:
+		case T_VacuumStmt:
+		case T_VariableSetStmt:
+		case T_VariableShowStmt:
+			return false;
+		default:
+			return true;
+	}
+}
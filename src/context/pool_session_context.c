@@ -17,6 +17,7 @@
 #include "utils/memutils.h"
 #include "utils/elog.h"
 #include "pool_config.h"
+#include "auth/md5.h"
 #include "protocol/pool_proto_modules.h"
 #include "protocol/pool_process_query.h"
 #include "protocol/pool_connection_pool.h"
@@ -165,6 +166,9 @@ pool_init_session_context(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backe
 	unset_query_cache_disabled();
 
 	unset_query_cache_disabled_tx();
+
+	/* No session level state yet */
+	session_context->session_state = 0;
 }
 
 /*
@@ -2108,3 +2112,216 @@ query_cache_disabled_tx(void)
 
 	return session_context->query_cache_disabled_tx;
 }
+
+/*
+ * Remember that session level state of the kind has been created in
+ * backends.
+ */
+void
+pool_set_session_state(int state)
+{
+	if (!session_context)
+		return;
+
+	if ((session_context->session_state & state) != state)
+		ereport(DEBUG1,
+				(errmsg("session level state %d is created", state)));
+	session_context->session_state |= state;
+}
+
+/*
+ * Forget session level state of the kind, which has been removed.
+ */
+void
+pool_unset_session_state(int state)
+{
+	if (session_context)
+		session_context->session_state &= ~state;
+}
+
+/*
+ * Return true if the session has left state in backends which the next
+ * session must not see: SET parameters, named prepared statements,
+ * temporary objects, LISTEN, cursors WITH HOLD and session level advisory
+ * locks.  State created inside functions is not detected, except parameter
+ * changes reported by ParameterStatus.  Multi statement queries and queries
+ * which could not be parsed are always regarded as leaving state.
+ */
+bool
+pool_session_has_state(void)
+{
+	int			i;
+
+	if (!session_context)
+		return true;
+
+	if (session_context->session_state != 0)
+		return true;
+
+	if (session_context->temp_tables != NIL)
+		return true;
+
+	for (i = 0; i < session_context->message_list.size; i++)
+	{
+		POOL_SENT_MESSAGE *msg = session_context->message_list.sent_messages[i];
+
+		/*
+		 * named prepared statement. Pooled statements do not count because
+		 * the backend only knows them by a name the client never sees.
+		 */
+		if ((msg->kind == 'P' || msg->kind == 'Q') && msg->name && *msg->name &&
+			!pool_is_pooled_statement(msg))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Rewrite the statement name of a named Parse message to a pooled statement
+ * name derived from the md5 of the query text and parameter types, so that
+ * sessions sharing the backend connection can share the statement.
+ * msg->contents is replaced by the rewritten message while msg->name keeps
+ * the name known to the client.
+ */
+void
+pool_pooled_statement_rewrite_parse(POOL_SENT_MESSAGE *msg)
+{
+	char		hexsum[33];
+	char	   *body;
+	char	   *contents;
+	int			bodylen;
+	int			len;
+	MemoryContext old_context;
+
+	body = msg->contents + strlen(msg->contents) + 1;
+	bodylen = msg->len - (body - msg->contents);
+	pool_md5_hash(body, bodylen, hexsum);
+
+	len = POOLED_STATEMENT_NAME_LEN + bodylen;
+	old_context = MemoryContextSwitchTo(session_context->memory_context);
+	contents = palloc(len);
+	MemoryContextSwitchTo(old_context);
+
+	snprintf(contents, POOLED_STATEMENT_NAME_LEN, "%s%s", POOLED_STATEMENT_PREFIX, hexsum);
+	memcpy(contents + POOLED_STATEMENT_NAME_LEN, body, bodylen);
+
+	pfree(msg->contents);
+	msg->contents = contents;
+	msg->len = len;
+}
+
+/*
+ * Return true if the Parse message has been rewritten by
+ * pool_pooled_statement_rewrite_parse().
+ */
+bool
+pool_is_pooled_statement(POOL_SENT_MESSAGE *msg)
+{
+	return msg->kind == 'P' && strcmp(msg->contents, msg->name) != 0;
+}
+
+/*
+ * Return a palloc'd copy of Bind or Describe message "contents" whose
+ * statement name at "offset" is replaced with the name of the pooled
+ * statement. *len is updated to the new message length.
+ */
+char *
+pool_pooled_statement_rewrite_message(POOL_SENT_MESSAGE *parse_msg, char *contents,
+									  int offset, int *len)
+{
+	char	   *name = contents + offset;
+	int			namelen = strlen(name);
+	int			pooled_namelen = strlen(parse_msg->contents);
+	int			rest = *len - offset - namelen - 1;
+	char	   *p;
+
+	p = palloc(offset + pooled_namelen + 1 + rest);
+	memcpy(p, contents, offset);
+	memcpy(p + offset, parse_msg->contents, pooled_namelen + 1);
+	memcpy(p + offset + pooled_namelen + 1, name + namelen + 1, rest);
+	*len = offset + pooled_namelen + 1 + rest;
+
+	return p;
+}
+
+/*
+ * Return true if the pooled statement is known to exist on the backend
+ * connection.
+ */
+bool
+pool_pooled_statement_exists(POOL_CONNECTION_POOL_SLOT *slot, const char *name)
+{
+	int			i;
+
+	if (slot == NULL)
+		return false;
+
+	for (i = 0; i < slot->num_pooled_statements; i++)
+	{
+		if (strcmp(slot->pooled_statements[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Called upon ParseComplete. If the Parse message was for a pooled
+ * statement, remember that the statement exists on the backend connections
+ * the message was sent to.
+ */
+void
+pool_pooled_statement_complete(POOL_CONNECTION_POOL *backend, POOL_PENDING_MESSAGE *msg)
+{
+	int			i;
+
+	if (!pool_config->multiplex_prepared_statements || msg->type != POOL_PARSE ||
+		strncmp(msg->statement, POOLED_STATEMENT_PREFIX, strlen(POOLED_STATEMENT_PREFIX)))
+		return;
+
+	for (i = 0; i < NUM_BACKENDS; i++)
+	{
+		POOL_CONNECTION_POOL_SLOT *slot;
+
+		if (!msg->node_ids[i] || (slot = CONNECTION_SLOT(backend, i)) == NULL)
+			continue;
+
+		if (pool_pooled_statement_exists(slot, msg->statement))
+			continue;
+
+		/*
+		 * Forgetting a statement is harmless: Parse() always closes a pooled
+		 * statement before creating it.
+		 */
+		if (slot->num_pooled_statements < MAX_POOLED_STATEMENTS)
+			StrNCpy(slot->pooled_statements[slot->num_pooled_statements++],
+					msg->statement, POOLED_STATEMENT_NAME_LEN);
+		else
+		{
+			StrNCpy(slot->pooled_statements[slot->next_pooled_statement],
+					msg->statement, POOLED_STATEMENT_NAME_LEN);
+			slot->next_pooled_statement = (slot->next_pooled_statement + 1) % MAX_POOLED_STATEMENTS;
+		}
+	}
+}
+
+/*
+ * Forget all pooled statements of the backend connections. Called when
+ * prepared statements may have been deallocated on the backends.
+ */
+void
+pool_pooled_statement_clear(POOL_CONNECTION_POOL *backend)
+{
+	int			i;
+
+	for (i = 0; i < NUM_BACKENDS; i++)
+	{
+		POOL_CONNECTION_POOL_SLOT *slot = CONNECTION_SLOT(backend, i);
+
+		if (slot)
+		{
+			slot->num_pooled_statements = 0;
+			slot->next_pooled_statement = 0;
+		}
+	}
+}
@@ -15,6 +15,7 @@
 #define POOL_AI_LOAD_BALANCER_H
 
 #include "pool.h"
+#include "utils/pool_atomics.h"
 #include <sys/time.h>
 
 /* AI Load Balancer Configuration */
@@ -26,19 +27,25 @@ typedef enum
 	AI_LB_MODE_HYBRID = 3         /* Hybrid: Traditional + AI */
 } AILoadBalancerMode;
 
-/* Node Performance Metrics */
+/*
+ * Node Performance Metrics
+ *
+ * Lives in shared memory and is updated by every child process, so all
+ * fields that change after initialization are atomics. Doubles are stored
+ * as their bit pattern in a 64 bit atomic word (see utils/pool_atomics.h).
+ */
 typedef struct
 {
 	int			node_id;
-	double		avg_response_time;     /* Average response time in ms */
-	double		current_load;          /* Current load (0.0 to 1.0) */
-	long		total_queries;         /* Total queries processed */
-	long		successful_queries;    /* Successfully completed queries */
-	long		failed_queries;        /* Failed queries */
-	double		error_rate;            /* Error rate (0.0 to 1.0) */
-	struct timeval last_update;    /* Last metrics update timestamp */
-	double		predicted_load;        /* Predicted load (AI prediction) */
-	double		health_score;          /* Overall health score (0.0 to 1.0) */
+	pool_atomic_uint64 avg_response_time;	/* Average response time in ms */
+	pool_atomic_uint64 current_load;	/* Current load (0.0 to 1.0) */
+	pool_atomic_uint64 total_queries;	/* Total queries processed */
+	pool_atomic_uint64 successful_queries;	/* Successfully completed queries */
+	pool_atomic_uint64 failed_queries;	/* Failed queries */
+	pool_atomic_uint64 error_rate;	/* Error rate (0.0 to 1.0) */
+	pool_atomic_uint64 last_update; /* Last metrics update (usec since epoch) */
+	pool_atomic_uint64 predicted_load;	/* Predicted load (AI prediction) */
+	pool_atomic_uint64 health_score;	/* Overall health score (0.0 to 1.0) */
 } AINodeMetrics;
 
 /* Query Pattern */
@@ -51,28 +58,38 @@ typedef struct
 	double		predicted_time;       /* Predicted execution time (ms) */
 } QueryPattern;
 
-/* AI Model State */
+/*
+ * AI Model State
+ *
+ * Allocated once in the main shared memory segment by pgbalancer main so
+ * that all num_init_children processes learn from the same observations.
+ */
 typedef struct
 {
 	AILoadBalancerMode mode;
-	AINodeMetrics *node_metrics;   /* Array of node metrics */
 	int			num_nodes;
-	double		learning_rate;         /* Learning rate for adjustments */
+	pool_atomic_uint64 learning_rate;	/* Learning rate for adjustments */
 	double		exploration_rate;      /* Exploration vs exploitation */
-	long		total_decisions;       /* Total routing decisions made */
-	long		successful_decisions;  /* Successful routing decisions */
+	pool_atomic_uint64 total_decisions;	/* Total routing decisions made */
+	pool_atomic_uint64 successful_decisions;	/* Successful routing decisions */
 	struct timeval model_start_time;
+	AINodeMetrics node_metrics[MAX_NUM_BACKENDS];	/* Per node metrics */
 } AIModelState;
 
-/* Global AI state */
+/* Global AI state (points into shared memory) */
 extern AIModelState *ai_model_state;
 
 /* AI Load Balancer Functions */
 
 /*
- * Initialize the AI load balancer
+ * Returns the byte size of the AI model area in shared memory
+ */
+extern size_t pool_ai_lb_shared_memory_size(void);
+
+/*
+ * Initialize the AI load balancer model in the given shared memory area
  */
-extern void pool_ai_lb_initialize(int num_nodes, AILoadBalancerMode mode);
+extern void pool_ai_lb_initialize(AIModelState *addr, AILoadBalancerMode mode);
 
 /*
  * Shutdown and cleanup AI load balancer
@@ -133,5 +150,20 @@ extern void pool_ai_set_mode(AILoadBalancerMode mode);
  */
 extern void pool_ai_analyze_query(const char *query, QueryPattern *pattern);
 
+/*
+ * Start measuring the response time of a query sent to a single node
+ */
+extern void pool_ai_query_sent(int node_id);
+
+/*
+ * Finish measuring the current query and feed the result to the model
+ */
+extern void pool_ai_query_done(const char *query, bool success);
+
+/*
+ * Forget the query being measured, if any
+ */
+extern void pool_ai_query_reset(void);
+
 #endif   /* POOL_AI_LOAD_BALANCER_H */
 
@@ -53,10 +53,18 @@ typedef struct
 													 * protocol */
 	bool		is_cache_safe;	/* true if SELECT is safe to cache */
 	POOL_TEMP_QUERY_CACHE *temp_cache;	/* temporary cache */
+	POOL_CACHE_ITEM_GENERATION *cache_generations;	/* table generations
+													 * taken when the query
+													 * was sent */
+	int			num_cache_generations;	/* number of cache_generations, or
+										 * -1 if not taken */
 	bool		is_multi_statement; /* true if multi statement query */
 	int			dboid;			/* DB oid which is used at DROP DATABASE */
-	char	   *query_w_hex;	/* original_query with bind message hex which
-								 * used for committing cache of extended query */
+	char	   *bind_params;	/* Bind message contents following the portal
+								 * and statement names, which are used with
+								 * original_query as the cache key of
+								 * extended query */
+	int			bind_params_len;	/* length of bind_params */
 	bool		is_parse_error; /* if true, we could not parse the original
 								 * query and parsed node is actually a dummy
 								 * query. */
@@ -96,6 +104,7 @@ extern void pool_clear_node_to_be_sent(POOL_QUERY_CONTEXT *query_context);
 extern void pool_setall_node_to_be_sent(POOL_QUERY_CONTEXT *query_context);
 extern bool pool_multi_node_to_be_sent(POOL_QUERY_CONTEXT *query_context);
 extern void pool_where_to_send(POOL_QUERY_CONTEXT *query_context, char *query, Node *node);
+extern void pool_routing_cache_clear(void);
 extern POOL_STATUS pool_send_and_wait(POOL_QUERY_CONTEXT *query_context, int send_type, int node_id);
 extern POOL_STATUS pool_extended_send_and_wait(POOL_QUERY_CONTEXT *query_context, char *kind, int len, char *contents, int send_type, int node_id, bool nowait);
 extern Node *pool_get_parse_tree(void);
@@ -112,11 +121,13 @@ extern int	statecmp(POOL_QUERY_STATE s1, POOL_QUERY_STATE s2);
 extern bool pool_is_cache_safe(void);
 extern void pool_set_cache_safe(void);
 extern void pool_unset_cache_safe(void);
+extern void pool_set_cache_generations(POOL_QUERY_CONTEXT *query_context);
 extern bool pool_is_cache_exceeded(void);
 extern void pool_set_cache_exceeded(void);
 extern void pool_unset_cache_exceeded(void);
 extern bool pool_is_transaction_read_only(Node *node);
 extern void pool_force_query_node_to_backend(POOL_QUERY_CONTEXT *query_context, int backend_id);
+extern bool is_object_relationship_check_needed(void);
 extern void check_object_relationship_list(char *name, bool is_func_name);
 extern int	wait_for_failover_to_finish(void);
 
@@ -156,6 +156,17 @@ typedef struct
 } POOL_TEMP_TABLE;
 
 
+/*
+ * Session level state left in backends, which pins the backend connection
+ * to the session.  See pool_session_has_state().
+ */
+#define POOL_SESSION_STATE_SET		(1 << 0)	/* SET or changed parameter */
+#define POOL_SESSION_STATE_LISTEN	(1 << 1)	/* LISTEN */
+#define POOL_SESSION_STATE_CURSOR	(1 << 2)	/* cursor WITH HOLD */
+#define POOL_SESSION_STATE_LOCK		(1 << 3)	/* session level advisory lock */
+#define POOL_SESSION_STATE_TEMP		(1 << 4)	/* temporary object other
+												 * than tables */
+
 typedef enum
 {
 	SI_NO_SNAPSHOT,
@@ -328,6 +339,13 @@ typedef struct
 	 */
 	bool		query_cache_disabled_tx;
 
+	/*
+	 * Session level state created in this session.  Bit mask of
+	 * POOL_SESSION_STATE_*.  Temporary tables and prepared statements are
+	 * tracked by temp_tables and message_list.
+	 */
+	int			session_state;
+
 } POOL_SESSION_CONTEXT;
 
 extern void pool_init_session_context(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend);
@@ -416,6 +434,17 @@ extern bool is_tx_started_by_multi_statement_query(void);
 extern void set_tx_started_by_multi_statement_query(void);
 extern void unset_tx_started_by_multi_statement_query(void);
 
+extern void pool_set_session_state(int state);
+extern void pool_unset_session_state(int state);
+extern bool pool_session_has_state(void);
+
+extern void pool_pooled_statement_rewrite_parse(POOL_SENT_MESSAGE *msg);
+extern bool pool_is_pooled_statement(POOL_SENT_MESSAGE *msg);
+extern char *pool_pooled_statement_rewrite_message(POOL_SENT_MESSAGE *parse_msg, char *contents, int offset, int *len);
+extern bool pool_pooled_statement_exists(POOL_CONNECTION_POOL_SLOT *slot, const char *name);
+extern void pool_pooled_statement_complete(POOL_CONNECTION_POOL *backend, POOL_PENDING_MESSAGE *msg);
+extern void pool_pooled_statement_clear(POOL_CONNECTION_POOL *backend);
+
 extern void set_query_cache_disabled(void);
 extern void unset_query_cache_disabled(void);
 extern bool query_cache_disabled(void);
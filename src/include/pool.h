@@ -193,6 +193,10 @@ typedef struct
 	char	   *wbuf;			/* write buffer for the connection */
 	int			wbufsz;			/* write buffer size */
 	int			wbufpo;			/* buffer offset */
+	struct iovec *wiov;			/* queued output when pool_write_ref() is
+								 * used, in order.  Covers wbuf as well */
+	int			wiovcnt;		/* number of wiov elements. 0 means output is
+								 * just wbuf */
 
 #ifdef USE_SSL
 	SSL_CTX    *ssl_ctx;		/* SSL connection context */
@@ -210,13 +214,15 @@ typedef struct
 	int			po;				/* pending data offset */
 	int			bufsz;			/* pending data buffer size */
 	int			len;			/* pending data length */
+	bool		grow_hp;		/* last read filled the pending data buffer */
+	bool		hp_pinned;		/* data before po was returned by
+								 * pool_read2() and must be kept */
+	char	   *retired_hp;		/* old pending data buffer still referenced
+								 * by the result of pool_read2() */
 
 	char	   *sbuf;			/* buffer for pool_read_string */
 	int			sbufsz;			/* its size in bytes */
 
-	char	   *buf2;			/* buffer for pool_read2 */
-	int			bufsz2;			/* its size in bytes */
-
 	char	   *buf3;			/* buffer for pool_push/pop */
 	int			bufsz3;			/* its size in bytes */
 
@@ -275,6 +281,15 @@ typedef struct
 /*
  * connection pool structure
  */
+/*
+ * Prepared statements shared by sessions using a backend connection are named
+ * POOLED_STATEMENT_PREFIX followed by the md5 of the statement. See
+ * pool_pooled_statement_rewrite_parse().
+ */
+#define POOLED_STATEMENT_PREFIX "pgbalancer_ps_"
+#define POOLED_STATEMENT_NAME_LEN (sizeof(POOLED_STATEMENT_PREFIX) + 32)
+#define MAX_POOLED_STATEMENTS 128
+
 typedef struct
 {
 	StartupPacket *sp;			/* startup packet info */
@@ -300,6 +315,14 @@ typedef struct
 	char	   *negotiateProtocolMsg;	/* Raw NegotiateProtocol messag */
 	int32		nplen;			/* message length of NegotiateProtocol messag */
 
+	/*
+	 * Pooled prepared statements known to exist on this connection. Entries
+	 * are replaced round robin when the array is full.
+	 */
+	char		pooled_statements[MAX_POOLED_STATEMENTS][POOLED_STATEMENT_NAME_LEN];
+	int			num_pooled_statements;
+	int			next_pooled_statement;	/* entry to replace if full */
+
 } POOL_CONNECTION_POOL_SLOT;
 
 typedef struct
@@ -39,6 +39,9 @@ typedef struct
 	int			type;
 	int			flag;
 	regex_t		regexv;
+	char	   *literal;		/* lower case string the pattern matches if
+								 * it has no regex special characters,
+								 * otherwise NULL */
 } RegPattern;
 
 typedef enum ProcessManagementModes
@@ -227,6 +230,8 @@ typedef struct
 	int			reserved_connections;	/* # of reserved connections */
 	bool		serialize_accept;	/* if non 0, serialize call to accept() to
 									 * avoid thundering herd problem */
+	bool		exclusive_accept;	/* if true, wait for connections with
+									 * EPOLLEXCLUSIVE */
 	int			child_life_time;	/* if idle for this seconds, child exits */
 	int			connection_life_time;	/* if idle for this seconds,
 										 * connection closes */
@@ -289,6 +294,11 @@ typedef struct
 									 * balancing is disabled. */
 	char	  **reset_query_list;	/* comma separated list of queries to be
 									 * issued at the end of session */
+	bool		skip_reset_for_stateless_session;	/* skip reset_query_list
+													 * if session left no
+													 * session level state */
+	bool		multiplex_prepared_statements;	/* share named prepared
+												 * statements among sessions */
 	char	  **read_only_function_list;	/* list of functions with no side
 											 * effects */
 	char	  **write_function_list;	/* list of functions with side effects */
@@ -350,6 +360,10 @@ typedef struct
 									 * connecting to backend */
 	HealthCheckParams *health_check_params; /* per node health check
 											 * parameters */
+	int			health_check_ping_period;	/* if greater than 0, keep health
+											 * check connections open and ping
+											 * them at this interval in
+											 * milliseconds */
 	int			sr_check_period;	/* streaming replication check period */
 	char	   *sr_check_user;	/* PostgreSQL user name for streaming
 								 * replication check */
@@ -456,11 +470,14 @@ typedef struct
 										 * parameters contained file */
 	int64		relcache_expire;	/* relation cache life time in seconds */
 	int			relcache_size;	/* number of relation cache life entry */
+	int			routing_cache_size; /* number of routing cache entry */
 	CHECK_TEMP_TABLE_OPTION check_temp_table;	/* how to check temporary
 												 * table */
 	bool		check_unlogged_table;	/* enable unlogged table check */
 	bool		enable_shared_relcache; /* If true, relation cache stored in
 										 * memory cache */
+	int			shared_relcache_size;	/* number of shared relation cache
+										 * entry */
 	RELQTARGET_OPTION relcache_query_target;	/* target node to send
 												 * relcache queries */
 
@@ -472,11 +489,15 @@ typedef struct
 								 * write/readonly lists */
 	int			pattc;			/* number of regexp pattern */
 	int			current_pattern_size;	/* size of the regex pattern array */
+	RegLiteralIndex patterns_literals;	/* literal patterns in
+										 * lists_patterns */
 
 	RegPattern *lists_query_patterns;	/* Precompiled regex patterns for
 										 * primary routing query pattern lists */
 	int			query_pattc;	/* number of regexp pattern */
 	int			current_query_pattern_size; /* size of the regex pattern array */
+	RegLiteralIndex query_patterns_literals;	/* literal patterns in
+												 * lists_query_patterns */
 
 	bool		memory_cache_enabled;	/* if true, use the memory cache
 										 * functionality, false by default */
@@ -503,10 +524,24 @@ typedef struct
 	/* DDL/DML/DCL(and memqcache_expire).  If false, it is only triggered */
 	/* by memqcache_expire.  True by default. */
 	int			memqcache_maxcache; /* Maximum SELECT result size in bytes. */
+	int			memqcache_compress_threshold;	/* Compress SELECT results of
+												 * at least this many bytes.
+												 * 0 disables compression. */
+	int			memqcache_coalesce_timeout; /* Milliseconds to wait for a
+											 * concurrent execution of the
+											 * same query. 0 disables. */
 	int			memqcache_cache_block_size; /* Cache block size in bytes. 8192
 											 * by default */
 	char	   *memqcache_oiddir;	/* Temporary work directory to record
 									 * table oids */
+	bool		memqcache_oiddir_fallback;	/* Record table oids in
+											 * memqcache_oiddir when the
+											 * shmem oid map is full */
+	bool		memqcache_lazy_invalidation;	/* Invalidate by table
+												 * generation counters */
+	bool		memqcache_admission_control;	/* Frequency based admission
+												 * and eviction of shmem
+												 * cache */
 	char	  **cache_safe_memqcache_table_list;	/* list of tables to
 													 * memqcache */
 	char	  **cache_unsafe_memqcache_table_list;	/* list of tables not to
@@ -517,6 +552,9 @@ typedef struct
 	int			memqcache_table_pattc;	/* number of regexp pattern */
 	int			current_memqcache_table_pattern_size;	/* size of the regex
 														 * pattern array */
+	RegLiteralIndex memqcache_table_patterns_literals;	/* literal patterns
+														 * in
+														 * lists_memqcache_table_patterns */
 
 	/*
 	 * user_redirect_preference_list =
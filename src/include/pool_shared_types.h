@@ -202,6 +202,10 @@ typedef struct
 	bool		exit_if_idle;
 	int			pooled_connections; /* Total number of pooled connections by
 									 * this child */
+	uint64		pool_hits;		/* number of client connections which reused
+								 * a pooled connection */
+	uint64		pool_misses;	/* number of client connections which created
+								 * a new connection */
 } ProcessInfo;
 
 /*
@@ -285,6 +289,8 @@ typedef struct
 	char		client_host[NI_MAXHOST];
 	char		client_port[NI_MAXSERV];
 	char		statement[MAXSTMTLEN];
+	char		pool_hits[POOLCONFIG_MAXCOUNTLEN + 1];
+	char		pool_misses[POOLCONFIG_MAXCOUNTLEN + 1];
 } POOL_REPORT_POOLS;
 
 /* version struct */
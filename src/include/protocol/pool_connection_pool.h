@@ -17,6 +17,7 @@ extern int	pool_init_cp(void);
 extern POOL_CONNECTION_POOL *pool_create_cp(void);
 extern POOL_CONNECTION_POOL *pool_get_cp(char *user, char *database, int protoMajor, int check_socket);
 extern void pool_discard_cp(char *user, char *database, int protoMajor);
+extern void pool_register_cp(POOL_CONNECTION_POOL *p, StartupPacket *sp);
 extern void pool_backend_timer(void);
 extern void pool_connection_pool_timer(POOL_CONNECTION_POOL *backend);
 extern RETSIGTYPE pool_backend_timer_handler(int sig);
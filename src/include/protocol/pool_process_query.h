@@ -62,6 +62,7 @@ extern void pool_send_severity_message(POOL_CONNECTION *frontend, int protoMajor
 									   int line);
 
 extern POOL_STATUS SimpleForwardToFrontend(char kind, POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend);
+extern bool pool_frontend_flush_needed(char kind);
 extern POOL_STATUS SimpleForwardToBackend(char kind, POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, int len, char *contents);
 
 extern POOL_STATUS pool_process_query(POOL_CONNECTION *frontend,
@@ -12,6 +12,7 @@
 #define POOL_MEMQCACHE_H
 
 #include "pool.h"
+#include "utils/pool_atomics.h"
 #include <sys/time.h>
 
 #define FORCE_QUERY_CACHE "/*FORCE QUERY CACHE*/"
@@ -57,21 +58,33 @@ typedef struct
 	unsigned int free_bytes;	/* total free space in bytes */
 } POOL_CACHE_BLOCK_HEADER;
 
+/*
+ * Shared memory cache key.  128 bit hash of user name, query string and
+ * database name, see encode_query_hash().
+ */
 typedef struct
 {
-	char		query_hash[POOL_MD5_HASHKEYLEN];
+	uint64		query_hash[2];
 } POOL_QUERY_HASH;
 
+#define POOL_QUERY_HASH_EQUAL(a, b) \
+	((a)->query_hash[0] == (b)->query_hash[0] && \
+	 (a)->query_hash[1] == (b)->query_hash[1])
+
+#define POOL_QUERY_HASH_FORMAT "%016llx%016llx"
+#define POOL_QUERY_HASH_ARGS(h) \
+	(unsigned long long) (h)->query_hash[0], (unsigned long long) (h)->query_hash[1]
+
 #define POOL_ITEM_USED	0x0001	/* is this item used? */
 #define POOL_ITEM_HAS_NEXT	0x0002	/* is this item has "next" item? */
 #define POOL_ITEM_DELETED	0x0004	/* is this item deleted? */
 
 /*
- * Cache item pointer (48 bytes)
+ * Cache item pointer (32 bytes)
  */
 typedef struct
 {
-	POOL_QUERY_HASH query_hash; /* md5 hashed query signature */
+	POOL_QUERY_HASH query_hash; /* hashed query signature */
 	POOL_CACHEID next;			/* next cache item if any */
 	unsigned int offset;		/* item offset in this block */
 	unsigned char flags;		/* flags. see above */
@@ -92,15 +105,41 @@ typedef struct
 
 /*
  * "Cache Item header" structure is used to manage each cache item.
- *  (16 bytes)
+ *  (32 bytes)
  */
 typedef struct
 {
 	unsigned int total_length;	/* total length in bytes including myself */
+	uint32		stamp;			/* unique stamp given at registration */
 	time_t		timestamp;		/* cache creation time */
 	int64		expire;			/* cache expire	duration in seconds */
+	int			num_generations;	/* number of POOL_CACHE_ITEM_GENERATION
+									 * following the header */
+	unsigned int raw_length;	/* uncompressed data length if the data is
+								 * LZ4 compressed, otherwise 0 */
 } POOL_CACHE_ITEM_HEADER;
 
+/*
+ * Table generation an item depends on, used when
+ * memqcache_lazy_invalidation is on.  They are placed between the item
+ * header and the data.
+ */
+typedef struct
+{
+	uint32		slot;			/* index into table generation array */
+	uint32		generation;		/* generation when the query was sent */
+} POOL_CACHE_ITEM_GENERATION;
+
+#define POOL_CACHE_ITEM_DATA_OFFSET(cih) \
+	(sizeof(POOL_CACHE_ITEM_HEADER) + \
+	 (cih)->num_generations * sizeof(POOL_CACHE_ITEM_GENERATION))
+
+/*
+ * Number of table generation counters (power of 2).  Tables are hashed into
+ * them, so a collision only invalidates more than necessary.
+ */
+#define POOL_TABLE_GENERATION_SLOTS	65536
+
 typedef struct
 {
 	POOL_CACHE_ITEM_HEADER header;	/* cache item header */
@@ -150,9 +189,16 @@ typedef struct
 								 * memqcache_maxcache */
 	bool		is_discarded;	/* true if this cache entry is discarded */
 	char	   *query;			/* SELECT query */
+	char	   *params;			/* Bind parameters of extended query, or
+								 * NULL */
+	int			params_len;		/* length of params */
 	POOL_INTERNAL_BUFFER *buffer;
 	int			num_oids;
 	POOL_INTERNAL_BUFFER *oids;
+	int			num_generations;	/* number of table generations, or -1
+									 * if not taken */
+	POOL_CACHE_ITEM_GENERATION *generations;	/* table generations taken
+												 * when the query was sent */
 } POOL_TEMP_QUERY_CACHE;
 
 /*
@@ -174,6 +220,11 @@ typedef struct
 	time_t		start_time;		/* start time when the statistics begins */
 	long long int num_selects;	/* number of successful SELECTs */
 	long long int num_cache_hits;	/* number of SELECTs extracted from cache */
+	long long int num_admission_rejects;	/* number of results not admitted
+											 * to cache */
+	long long int num_evicted_blocks;	/* number of cache blocks reused */
+	long long int num_coalesced_misses; /* number of cache misses which
+										 * waited for the same query */
 } POOL_QUERY_CACHE_STATS;
 
 /*
@@ -191,6 +242,9 @@ typedef struct
 	long		fragment_cache_entries_size;	/* total size of
 												 * fragment(unusable) cache
 												 * entries */
+	int			hot_cache_entries;	/* number of cache entries hit at least
+									 * once */
+	unsigned int max_cache_entry_hits;	/* hits of the most hit cache entry */
 	POOL_QUERY_CACHE_STATS cache_stats;
 } POOL_SHMEM_STATS;
 
@@ -199,12 +253,13 @@ typedef struct
  *--------------------------------------------------------------------------------
  */
 
-/* Hash element (48 bytes) */
+/* Hash element (40 bytes) */
 typedef struct POOL_HASH_ELEMENT
 {
 	struct POOL_HASH_ELEMENT *next; /* link to next entry */
-	POOL_QUERY_HASH hashkey;	/* MD5 hash key */
+	POOL_QUERY_HASH hashkey;	/* query hash key */
 	POOL_CACHEID cacheid;		/* logical location of this cache element */
+	pool_atomic_uint32 hits;	/* number of cache hits */
 } POOL_HASH_ELEMENT;
 
 typedef uint32 POOL_HASH_KEY;
@@ -221,9 +276,52 @@ typedef struct
 {
 	long		nhash;			/* number of hash keys (power of 2) */
 	uint32		mask;			/* mask for hash function */
+	uint64		seed;			/* seed for encode_query_hash() */
 	POOL_HEADER_ELEMENT elements[1];	/* actual hash elements follows */
 } POOL_HASH_HEADER;
 
+/*
+ * Table oid map on shared memory.  Maps (database oid, table oid) to the
+ * cache ids of the items depending on the table.  Tables are chained from
+ * hash buckets, and each table has a list of chunks holding the cache ids.
+ * Everything is addressed by array index, -1 meaning none.
+ */
+#define POOL_OID_MAP_CHUNK_ENTRIES	8
+
+typedef struct
+{
+	POOL_CACHEID cacheid;		/* cache id of the item */
+	uint32		stamp;			/* stamp of the item when registered */
+} POOL_OID_MAP_ENTRY;
+
+typedef struct
+{
+	int			next;			/* next chunk of the table or on free list */
+	int			nentries;		/* number of used entries */
+	POOL_OID_MAP_ENTRY entries[POOL_OID_MAP_CHUNK_ENTRIES];
+} POOL_OID_MAP_CHUNK;
+
+typedef struct
+{
+	int			dboid;			/* database oid */
+	int			tableoid;		/* table oid */
+	int			next;			/* next table in the bucket or on free list */
+	int			chunk;			/* first chunk, the one being filled */
+} POOL_OID_MAP_TABLE;
+
+typedef struct
+{
+	int			nbuckets;		/* number of hash buckets (power of 2) */
+	int			ntables;		/* number of table slots */
+	int			nchunks;		/* number of chunks */
+	int			free_table;		/* free list of table slots */
+	int			free_chunk;		/* free list of chunks */
+	uint32		next_stamp;		/* stamp for the next cache item */
+	uint32		sweep_stamp;	/* next_stamp at the last sweep */
+	bool		overflowed;		/* some maps were written to memqcache_oiddir */
+	int			buckets[1];		/* hash buckets follow */
+} POOL_OID_MAP_HEADER;
+
 typedef enum
 {
 	POOL_MEMQ_SHARED_LOCK = 0,
@@ -238,9 +336,11 @@ extern uint32 hash_any(unsigned char *k, int keylen);
 
 extern POOL_STATUS pool_fetch_from_memory_cache(POOL_CONNECTION *frontend,
 												POOL_CONNECTION_POOL *backend,
-												char *contents, bool use_fake_cache, bool *foundp);
+												char *contents, char *params, int params_len,
+												bool use_fake_cache, bool *foundp);
 
-extern int	pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, size_t *len);
+extern int	pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query,
+							 const char *params, int params_len, char **buf, size_t *len);
 extern int	pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t datalen);
 
 extern bool pool_is_likely_select(char *query);
@@ -265,8 +365,10 @@ extern POOL_QUERY_CACHE_ARRAY *pool_create_query_cache_array(void);
 extern void pool_discard_query_cache_array(POOL_QUERY_CACHE_ARRAY *cache_array);
 
 extern POOL_TEMP_QUERY_CACHE *pool_create_temp_query_cache(char *query);
-extern void pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node, char state,
-									bool partial_fetch);
+extern void pool_set_temp_query_cache_params(POOL_TEMP_QUERY_CACHE *temp_cache, const char *params, int params_len);
+extern int	pool_get_select_table_generations(Node *node, POOL_CACHE_ITEM_GENERATION **gensp);
+extern void pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, char *params, int params_len,
+									Node *node, char state, bool partial_fetch);
 
 extern int	pool_init_memqcache_stats(void);
 extern POOL_QUERY_CACHE_STATS *pool_get_memqcache_stats(void);
@@ -283,6 +385,17 @@ extern POOL_TEMP_QUERY_CACHE *pool_get_current_cache(void);
 extern void pool_discard_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache);
 extern void pool_discard_current_temp_query_cache(void);
 
+extern size_t pool_memqcache_lock_size(void);
+extern void pool_init_memqcache_locks(void);
+extern size_t pool_oid_map_size(void);
+extern void pool_init_oid_map(void);
+extern size_t pool_table_generation_size(void);
+extern void pool_init_table_generations(void);
+extern size_t pool_cache_policy_size(void);
+extern void pool_init_cache_policy(void);
+extern size_t pool_cache_inflight_size(void);
+extern void pool_init_cache_inflight(void);
+extern void pool_cache_inflight_end(void);
 extern void pool_shmem_lock(POOL_MEMQ_LOCK_TYPE type);
 extern void pool_shmem_unlock(void);
 extern bool pool_is_shmem_lock(void);
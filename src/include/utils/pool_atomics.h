@@ -0,0 +1,170 @@
+/*-------------------------------------------------------------------------
+ *
+ * pool_atomics.h
+ *      Atomic operations on variables living in shared memory
+ *
+ * These are thin wrappers around the GCC/Clang __atomic builtins, modeled
+ * after PostgreSQL's port/atomics.h API.  They are meant for counters and
+ * small state words shared by all pgbalancer child processes, where taking
+ * a semaphore would cost a system call per update.
+ *
+ * Copyright (c) 2024-2025, pgElephant, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef POOL_ATOMICS_H
+#define POOL_ATOMICS_H
+
+#include <string.h>
+
+#include "pool_type.h"
+
+typedef struct pool_atomic_uint32
+{
+	volatile uint32 value;
+} pool_atomic_uint32;
+
+typedef struct pool_atomic_uint64
+{
+	volatile uint64 value;
+} pool_atomic_uint64;
+
+/*
+ * Memory barriers
+ */
+#define pool_memory_barrier()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define pool_read_barrier()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define pool_write_barrier()	__atomic_thread_fence(__ATOMIC_RELEASE)
+
+/*
+ * 32 bit operations
+ */
+static inline void
+pool_atomic_init_u32(volatile pool_atomic_uint32 *ptr, uint32 val)
+{
+	__atomic_store_n(&ptr->value, val, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32
+pool_atomic_read_u32(volatile pool_atomic_uint32 *ptr)
+{
+	return __atomic_load_n(&ptr->value, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+pool_atomic_write_u32(volatile pool_atomic_uint32 *ptr, uint32 val)
+{
+	__atomic_store_n(&ptr->value, val, __ATOMIC_RELEASE);
+}
+
+static inline uint32
+pool_atomic_fetch_add_u32(volatile pool_atomic_uint32 *ptr, int32 add)
+{
+	return __atomic_fetch_add(&ptr->value, add, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32
+pool_atomic_fetch_sub_u32(volatile pool_atomic_uint32 *ptr, int32 sub)
+{
+	return __atomic_fetch_sub(&ptr->value, sub, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Compare *ptr with *expected and if equal, set *ptr to newval and return
+ * true. Otherwise *expected is set to the current value and false is
+ * returned.
+ */
+static inline bool
+pool_atomic_compare_exchange_u32(volatile pool_atomic_uint32 *ptr,
+								 uint32 *expected, uint32 newval)
+{
+	return __atomic_compare_exchange_n(&ptr->value, expected, newval, false,
+									   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * 64 bit operations
+ */
+static inline void
+pool_atomic_init_u64(volatile pool_atomic_uint64 *ptr, uint64 val)
+{
+	__atomic_store_n(&ptr->value, val, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64
+pool_atomic_read_u64(volatile pool_atomic_uint64 *ptr)
+{
+	return __atomic_load_n(&ptr->value, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+pool_atomic_write_u64(volatile pool_atomic_uint64 *ptr, uint64 val)
+{
+	__atomic_store_n(&ptr->value, val, __ATOMIC_RELEASE);
+}
+
+static inline uint64
+pool_atomic_fetch_add_u64(volatile pool_atomic_uint64 *ptr, int64 add)
+{
+	return __atomic_fetch_add(&ptr->value, add, __ATOMIC_SEQ_CST);
+}
+
+static inline bool
+pool_atomic_compare_exchange_u64(volatile pool_atomic_uint64 *ptr,
+								 uint64 *expected, uint64 newval)
+{
+	return __atomic_compare_exchange_n(&ptr->value, expected, newval, false,
+									   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Doubles stored in a 64 bit atomic word.  The bit pattern is stored as is
+ * so that compare and exchange works on it.
+ */
+static inline double
+pool_atomic_read_double(volatile pool_atomic_uint64 *ptr)
+{
+	uint64		bits = pool_atomic_read_u64(ptr);
+	double		val;
+
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+static inline void
+pool_atomic_write_double(volatile pool_atomic_uint64 *ptr, double val)
+{
+	uint64		bits;
+
+	memcpy(&bits, &val, sizeof(bits));
+	pool_atomic_write_u64(ptr, bits);
+}
+
+/*
+ * Fold a new sample into an exponential moving average stored in *ptr:
+ * new = alpha * sample + (1 - alpha) * old.  If the current value is 0, it
+ * is replaced with the sample.  Concurrent updaters retry so that no sample
+ * is lost.  Returns the new average.
+ */
+static inline double
+pool_atomic_ema_double(volatile pool_atomic_uint64 *ptr, double sample, double alpha)
+{
+	uint64		oldbits = pool_atomic_read_u64(ptr);
+	uint64		newbits;
+	double		oldval;
+	double		newval;
+
+	do
+	{
+		memcpy(&oldval, &oldbits, sizeof(oldval));
+		if (oldval == 0.0)
+			newval = sample;
+		else
+			newval = alpha * sample + (1.0 - alpha) * oldval;
+		memcpy(&newbits, &newval, sizeof(newbits));
+	} while (!pool_atomic_compare_exchange_u64(ptr, &oldbits, newbits));
+
+	return newval;
+}
+
+#endif							/* POOL_ATOMICS_H */
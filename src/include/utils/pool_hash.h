@@ -0,0 +1,143 @@
+/*-------------------------------------------------------------------------
+ *
+ * pool_hash.h
+ *      Fast non-cryptographic hash functions
+ *
+ * This is a wyhash style hash: input is consumed 16 bytes at a time and
+ * folded into two 64 bit lanes with a 64x64->128 bit multiply.  It is much
+ * cheaper than MD5 and is meant for hash table keys living in pgbalancer's
+ * own memory.  It is not stable across platforms, so do not store the result
+ * anywhere it can be read back by a different build.
+ *
+ * The state can be fed several pieces of input in turn.  Each piece is
+ * terminated by mixing in its length, so that ("ab", "c") and ("a", "bc")
+ * hash differently and callers do not need to concatenate.
+ *
+ * When the key is derived from data a client can choose (a query string for
+ * example), use a random seed so that collisions cannot be forged.
+ *
+ * Copyright (c) 2024-2025, pgElephant, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef POOL_HASH_H
+#define POOL_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pool_type.h"
+
+typedef struct
+{
+	uint64		lo;
+	uint64		hi;
+} pool_hash128_state;
+
+#define POOL_HASH_P0	UINT64CONST(0x2d358dccaa6c78a5)
+#define POOL_HASH_P1	UINT64CONST(0x8bb84b93962eacc9)
+#define POOL_HASH_P2	UINT64CONST(0x4b33a62ed433d4a3)
+#define POOL_HASH_P3	UINT64CONST(0x4d5a2da51de1aa47)
+
+/*
+ * Multiply a and b into a 128 bit product and fold it back to 64 bits.
+ */
+static inline uint64
+pool_hash_mix(uint64 a, uint64 b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+
+	return (uint64) r ^ (uint64) (r >> 64);
+#else
+	uint64		ha = a >> 32,
+				hb = b >> 32,
+				la = (uint32) a,
+				lb = (uint32) b;
+	uint64		rh = ha * hb,
+				rm0 = ha * lb,
+				rm1 = hb * la,
+				rl = la * lb;
+	uint64		t = rl + (rm0 << 32);
+	uint64		c = t < rl;
+	uint64		lo = t + (rm1 << 32);
+
+	c += lo < t;
+	return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline uint64
+pool_hash_read64(const unsigned char *p)
+{
+	uint64		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void
+pool_hash128_init(pool_hash128_state *state, uint64 seed)
+{
+	state->lo = seed ^ POOL_HASH_P0;
+	state->hi = pool_hash_mix(seed ^ POOL_HASH_P1, POOL_HASH_P2);
+}
+
+/*
+ * Feed a piece of input into the state.
+ */
+static inline void
+pool_hash128_update(pool_hash128_state *state, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint64		lo = state->lo;
+	uint64		hi = state->hi;
+	uint64		a;
+	uint64		b;
+	uint64		tail[2] = {0, 0};
+	size_t		remain = len;
+
+	while (remain >= 16)
+	{
+		a = pool_hash_read64(p);
+		b = pool_hash_read64(p + 8);
+		a = pool_hash_mix(a ^ POOL_HASH_P1 ^ lo, b ^ POOL_HASH_P2 ^ hi);
+		hi = pool_hash_mix(b ^ POOL_HASH_P3 ^ hi, pool_hash_read64(p) ^ POOL_HASH_P0 ^ lo);
+		lo = a;
+		p += 16;
+		remain -= 16;
+	}
+
+	/* The last 0-15 bytes, zero padded, together with the piece length */
+	memcpy(tail, p, remain);
+	a = pool_hash_mix(tail[0] ^ POOL_HASH_P2 ^ lo, tail[1] ^ POOL_HASH_P3 ^ hi ^ len);
+	hi = pool_hash_mix(tail[1] ^ POOL_HASH_P0 ^ hi, tail[0] ^ POOL_HASH_P1 ^ lo ^ len);
+	lo = a;
+
+	state->lo = lo;
+	state->hi = hi;
+}
+
+static inline void
+pool_hash128_final(pool_hash128_state *state, uint64 *out)
+{
+	out[0] = pool_hash_mix(state->lo ^ POOL_HASH_P0, state->hi ^ POOL_HASH_P1);
+	out[1] = pool_hash_mix(state->hi ^ POOL_HASH_P2, out[0] ^ state->lo ^ POOL_HASH_P3);
+}
+
+/*
+ * One shot 64 bit hash of a buffer.
+ */
+static inline uint64
+pool_hash64(const void *data, size_t len, uint64 seed)
+{
+	pool_hash128_state state;
+	uint64		out[2];
+
+	pool_hash128_init(&state, seed);
+	pool_hash128_update(&state, data, len);
+	pool_hash128_final(&state, out);
+	return out[0];
+}
+
+#endif							/* POOL_HASH_H */
@@ -27,6 +27,9 @@ typedef struct
 	int			refcnt;			/* reference count */
 	int			session_id;		/* LocalSessionId */
 	time_t		expire;			/* cache expiration absolute time in seconds */
+	uint32		generation;		/* relcache generation at registration */
+	uint32		hash;			/* hash of dbname and relname */
+	int			next;			/* next entry in the hash chain, or -1 */
 } PoolRelCache;
 
 #define	MAX_QUERY_LENGTH	1500
@@ -52,6 +55,8 @@ typedef struct
 	bool		no_cache_if_zero;	/* if register func returns 0, do not
 									 * cache the data */
 	PoolRelCache *cache;		/* cache data */
+	int			nbuckets;		/* number of hash chains, power of 2 */
+	int		   *buckets;		/* first entry of each hash chain, or -1 */
 } POOL_RELCACHE;
 
 extern POOL_RELCACHE *pool_create_relcache(int cachesize, char *sql,
@@ -60,6 +65,10 @@ extern POOL_RELCACHE *pool_create_relcache(int cachesize, char *sql,
 extern void pool_discard_relcache(POOL_RELCACHE *relcache);
 extern void *pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, char *table);
 extern char *remove_quotes_and_schema_from_relname(char *table);
+extern size_t pool_shared_relcache_size(void);
+extern void pool_init_shared_relcache(void);
+extern void pool_relcache_invalidate(bool shared);
+extern void pool_relcache_transaction_end(void);
 extern void *int_register_func(POOL_SELECT_RESULT *res);
 extern void *int_unregister_func(void *data);
 extern void *string_register_func(POOL_SELECT_RESULT *res);
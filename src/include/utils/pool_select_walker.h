@@ -39,12 +39,45 @@ typedef struct
 	char		table_names[POOL_MAX_SELECT_OIDS][NAMEDATALEN]; /* table names */
 } SelectContext;
 
+/*
+ * Facts about a SELECT which decide whether it must be sent to the primary
+ * and whether its result can be cached.  Callers specify which facts they
+ * need by OR'ing ROUTING_FACT_* flags.
+ */
+#define ROUTING_FACT_SYSTEM_CATALOG			0x0001
+#define ROUTING_FACT_TEMP_TABLE				0x0002
+#define ROUTING_FACT_UNLOGGED_TABLE			0x0004
+#define ROUTING_FACT_VIEW					0x0008
+#define ROUTING_FACT_ROW_SECURITY			0x0010
+#define ROUTING_FACT_FUNCTION_CALL			0x0020
+#define ROUTING_FACT_NON_IMMUTABLE_FUNCTION	0x0040
+#define ROUTING_FACT_INTO_OR_LOCKING		0x0080
+
+typedef struct
+{
+	int			requested;		/* ROUTING_FACT_* flags to be collected */
+	bool		found;			/* True if any of requested facts is true */
+	bool		has_system_catalog; /* True if system catalog table is used */
+	bool		has_temp_table; /* True if temporary table is used */
+	bool		has_unlogged_table; /* True if unlogged table is used */
+	bool		has_view;		/* True if view is used */
+	bool		has_row_security;	/* True if row security enabled table is
+									 * used */
+	bool		has_function_call;	/* True if write function call is used */
+	bool		has_non_immutable_function_call;	/* True if non immutable
+													 * functions are used */
+	bool		has_insertinto_or_locking_clause;	/* True if it has SELECT
+													 * INTO or FOR
+													 * SHARE/UPDATE */
+} QueryRoutingFacts;
+
 
 typedef bool (*tree_walker_callback) (Node *node, void *context);
 
 extern int	pool_get_terminate_backend_pid(Node *node);
 extern bool pool_has_function_call(Node *node);
 extern bool pool_has_non_immutable_function_call(Node *node);
+extern int	pool_session_function_call_state(Node *node);
 extern bool pool_has_system_catalog(Node *node);
 extern bool pool_has_temp_table(Node *node);
 extern void discard_temp_table_relcache(void);
@@ -52,6 +85,7 @@ extern bool pool_has_unlogged_table(Node *node);
 extern bool pool_has_view(Node *node);
 extern bool pool_has_row_security(Node *node);
 extern bool pool_has_insertinto_or_locking_clause(Node *node);
+extern void pool_get_query_routing_facts(Node *node, int requested, QueryRoutingFacts *facts);
 extern bool pool_has_pgpool_regclass(void);
 extern bool pool_has_to_regclass(void);
 extern bool raw_expression_tree_walker(Node *node, tree_walker_callback walker, void *context);
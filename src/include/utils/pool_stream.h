@@ -13,8 +13,14 @@
 
 #include "utils/socket_stream.h"
 
-#define READBUFSZ 1024
+#define READBUFSZ 8192
+#define READBUFMAXSZ (256 * 1024)	/* limit of adaptive growth of the
+									 * pending data buffer */
 #define WRITEBUFSZ 8192
+#define WRITEIOVMAX 64			/* max number of queued output vector
+								 * elements */
+#define WRITEREFMINSZ 512		/* smaller data given to pool_write_ref() is
+								 * copied */
 
 /*
  * Return true if read buffer is empty. Argument is POOL_CONNECTION.
@@ -38,6 +44,10 @@ extern void pool_read_with_error(POOL_CONNECTION *cp, void *buf, int len,
 extern char *pool_read2(POOL_CONNECTION *cp, int len);
 extern int	pool_write(POOL_CONNECTION *cp, void *buf, int len);
 extern int	pool_write_noerror(POOL_CONNECTION *cp, void *buf, int len);
+extern int	pool_write_ref(POOL_CONNECTION *cp, void *buf, int len);
+extern int	pool_write_message(POOL_CONNECTION *cp, char kind, void *data, int len);
+extern int	pool_splice(POOL_CONNECTION *dst, POOL_CONNECTION *src, int len);
+extern int	pool_scan_messages(POOL_CONNECTION *cp, char kind, int maxlen, int *nmsgs);
 extern int	pool_flush(POOL_CONNECTION *cp);
 extern int	pool_flush_noerror(POOL_CONNECTION *cp);
 extern int	pool_flush_it(POOL_CONNECTION *cp);
@@ -15,6 +15,26 @@
 
 #define AR_ALLOC_UNIT	16
 
+/*
+ * Hash index of patterns which are plain literals, that is, have no regular
+ * expression special characters.  Such patterns are matched by a hash lookup
+ * instead of regexec().  Literals are stored in lower case since patterns
+ * are matched case insensitively.
+ */
+typedef struct
+{
+	char	   *literal;		/* NULL if the slot is empty */
+	int			type;			/* pattern type, e.g. WRITELIST */
+	int			pos;			/* index of the pattern in its array */
+} RegLiteralSlot;
+
+typedef struct
+{
+	int			size;			/* number of slots, power of 2 or 0 */
+	int			used;			/* number of used slots */
+	RegLiteralSlot *slots;
+} RegLiteralIndex;
+
 /*
  * Regular expression array
  */
@@ -22,7 +42,9 @@ typedef struct
 {
 	int			size;			/* regex array size */
 	int			pos;			/* next regex array index position */
-	regex_t   **regex;			/* regular expression array */
+	regex_t   **regex;			/* regular expression array. NULL for
+								 * literal patterns */
+	RegLiteralIndex literals;	/* literal patterns */
 } RegArray;
 
 RegArray   *create_regex_array(void);
@@ -30,6 +52,10 @@ int			add_regex_array(RegArray *ar, char *pattern);
 int			regex_array_match(RegArray *ar, char *pattern);
 void		destroy_regex_array(RegArray *ar);
 
+char	   *regex_literal(const char *pattern);
+void		add_regex_literal(RegLiteralIndex *index, char *literal, int type, int pos);
+int			regex_literal_match(RegLiteralIndex *index, const char *str, int type);
+
 /*
  * String left-right token type
  */
@@ -47,6 +47,7 @@
 #include "utils/pool_ip.h"
 #include "utils/ps_status.h"
 #include "utils/pool_stream.h"
+#include "utils/pool_ssl.h"
 
 #include "context/pool_process_context.h"
 #include "context/pool_session_context.h"
@@ -59,12 +60,17 @@ volatile POOL_HEALTH_CHECK_STATISTICS *health_check_stats;	/* health check stats
 															 * area in shared memory */
 
 static POOL_CONNECTION_POOL_SLOT *slot;
+static bool slot_is_persistent = false;	/* true if slot is kept across
+											 * health checks */
 static volatile sig_atomic_t reload_config_request = 0;
 static volatile sig_atomic_t restart_request = 0;
 volatile POOL_HEALTH_CHECK_STATISTICS *stats;
 
 static bool establish_persistent_connection(int node);
 static void discard_persistent_connection(int node);
+static bool ping_persistent_connection(int node);
+static int	ping_send(POOL_CONNECTION *cp, char *buf, int len);
+static int	ping_recv(POOL_CONNECTION *cp, char *buf, int len);
 static RETSIGTYPE my_signal_handler(int sig);
 static RETSIGTYPE reload_config_handler(int sig);
 static void reload_config(void);
@@ -174,14 +180,22 @@ do_health_check_child(void *params)
 
 		/*
 		 * Since HealthCheckMemoryContext is used for "slot", we need to clear
-		 * it so that new slot is allocated later on.
+		 * it so that new slot is allocated later on.  Slot kept open for
+		 * health_check_ping_period lives in TopMemoryContext.
 		 */
-		slot = NULL;
+		if (!slot_is_persistent)
+			slot = NULL;
 
 		bool		skipped = false;
+		bool		keep_connection = false;
 
 		CHECK_REQUEST;
 
+		/* health_check_ping_period may have been disabled by reloading */
+		if (slot && (pool_config->health_check_ping_period <= 0 ||
+					 pool_config->health_check_params[node_id].health_check_period <= 0))
+			discard_persistent_connection(node_id);
+
 		if (pool_config->health_check_params[node_id].health_check_period <= 0)
 		{
 			stats->min_health_check_duration = 0;
@@ -202,6 +216,17 @@ do_health_check_child(void *params)
 
 			stats->last_health_check = time(NULL);
 
+			/*
+			 * If the connection is kept open, check it first.  If it's
+			 * broken, establish_persistent_connection() connects again.
+			 */
+			if (slot && !ping_persistent_connection(node_id))
+			{
+				ereport(LOG,
+						(errmsg("health check ping failed on DB node %d, reconnecting", node_id)));
+				discard_persistent_connection(node_id);
+			}
+
 			result = establish_persistent_connection(node_id);
 
 			if (result && slot == NULL)
@@ -262,8 +287,16 @@ do_health_check_child(void *params)
 				skipped = true;
 			}
 
-			/* Discard persistent connections */
-			discard_persistent_connection(node_id);
+			/*
+			 * Keep the connection open for the next health check if
+			 * health_check_ping_period is set and the node is up.  Otherwise
+			 * discard persistent connections.
+			 */
+			if (slot_is_persistent && result && slot &&
+				bkinfo->backend_status != CON_DOWN)
+				keep_connection = true;
+			else
+				discard_persistent_connection(node_id);
 
 			/*
 			 * Update health check duration only if health check was not
@@ -291,7 +324,10 @@ do_health_check_child(void *params)
 
 			memcpy(&mystat, (void *) stats, sizeof(mystat));
 
-			sleep(pool_config->health_check_params[node_id].health_check_period);
+			if (keep_connection)
+				usleep(pool_config->health_check_ping_period * 1000L);
+			else
+				sleep(pool_config->health_check_params[node_id].health_check_period);
 		}
 	}
 	exit(0);
@@ -352,6 +388,10 @@ establish_persistent_connection(int node)
 	{
 		char	   *password = get_pgpool_config_user_password(pool_config->health_check_params[node].health_check_user,
 															   pool_config->health_check_params[node].health_check_password);
+		MemoryContext oldContext = CurrentMemoryContext;
+
+		/* The connection may be kept beyond this health check */
+		bool		persistent = pool_config->health_check_ping_period > 0;
 
 		retry_cnt = pool_config->health_check_params[node].health_check_max_retries;
 
@@ -370,11 +410,14 @@ establish_persistent_connection(int node)
 				health_check_timer_expired = 0;
 			}
 
+			if (persistent)
+				MemoryContextSwitchTo(TopMemoryContext);
 			slot = make_persistent_db_connection_noerror(node, bkinfo->backend_hostname,
 														 bkinfo->backend_port,
 														 dbname,
 														 pool_config->health_check_params[node].health_check_user,
 														 password ? password : "", false);
+			MemoryContextSwitchTo(oldContext);
 
 			if (pool_config->health_check_params[node].health_check_timeout > 0)
 			{
@@ -422,6 +465,12 @@ establish_persistent_connection(int node)
 			}
 		} while (retry_cnt >= 0);
 
+		/*
+		 * Set this only after the final attempt, since
+		 * discard_persistent_connection() above resets it.
+		 */
+		slot_is_persistent = persistent && slot != NULL;
+
 		/* Check if we need to refresh max retry count */
 
 		if (retry_cnt != pool_config->health_check_params[node].health_check_max_retries)
@@ -469,6 +518,131 @@ discard_persistent_connection(int node)
 		discard_persistent_db_connection(slot);
 		slot = NULL;
 	}
+	slot_is_persistent = false;
+}
+
+/*
+ * Check the persistent connection to backend by a Sync message round trip.
+ * Return false if the connection is broken.
+ *
+ * pool_read() and friends are not used here since they trigger failover on
+ * a socket error if failover_on_backend_error is on.  A failed ping must only
+ * make us reconnect, which is subject to health_check_max_retries.
+ */
+static bool
+ping_persistent_connection(int node)
+{
+	POOL_CONNECTION *cp = slot->con;
+	static char sync_message[] = {'S', 0, 0, 0, 4};
+	char		buf[1024];
+	char		kind;
+	int			len;
+	bool		ok = false;
+
+	/*
+	 * If health check test is enabled, check if fake down request is set.
+	 */
+	if (pool_config->health_check_test && check_backend_down_request(node, false) == true)
+		return false;
+
+	/* We read the socket directly, so nothing must be left in the buffer */
+	if (!pool_read_buffer_is_empty(cp))
+		return false;
+
+	if (pool_config->health_check_params[node].health_check_timeout > 0)
+	{
+		CLEAR_ALARM;
+		pool_signal(SIGALRM, health_check_timer_handler);
+		alarm(pool_config->health_check_params[node].health_check_timeout);
+		errno = 0;
+		health_check_timer_expired = 0;
+	}
+
+	if (ping_send(cp, sync_message, sizeof(sync_message)) == 0)
+	{
+		/* Skip asynchronous messages such as ParameterStatus */
+		while (ping_recv(cp, &kind, 1) == 0 &&
+			   ping_recv(cp, (char *) &len, sizeof(len)) == 0)
+		{
+			len = ntohl(len) - 4;
+			while (len > 0 && ping_recv(cp, buf, Min(len, sizeof(buf))) == 0)
+				len -= Min(len, sizeof(buf));
+			if (len != 0)
+				break;			/* read error or invalid message length */
+			if (kind == 'Z')
+			{
+				ok = true;
+				break;
+			}
+			if (kind == 'E')
+				break;
+		}
+	}
+
+	if (pool_config->health_check_params[node].health_check_timeout > 0)
+	{
+		/* cancel health check timer */
+		pool_signal(SIGALRM, SIG_IGN);
+		CLEAR_ALARM;
+	}
+
+	return ok;
+}
+
+/*
+ * Write len bytes to backend without going through pool_write(), so that an
+ * error does not trigger failover.  Returns 0 on success, -1 on error.
+ */
+static int
+ping_send(POOL_CONNECTION *cp, char *buf, int len)
+{
+	int			n;
+
+	while (len > 0)
+	{
+		if (cp->ssl_active > 0)
+			n = pool_ssl_write(cp, buf, len);
+		else
+			n = write(cp->fd, buf, len);
+
+		if (n < 0 && (errno == EINTR || errno == EAGAIN) && !health_check_timer_expired)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read exactly len bytes from backend without going through pool_read(), so
+ * that an error does not trigger failover.  Returns 0 on success, -1 on error
+ * or timeout.
+ */
+static int
+ping_recv(POOL_CONNECTION *cp, char *buf, int len)
+{
+	int			n;
+
+	while (len > 0)
+	{
+		if (pool_check_fd(cp) != 0)
+			return -1;
+
+		if (cp->ssl_active > 0)
+			n = pool_ssl_read(cp, buf, len);
+		else
+			n = read(cp->fd, buf, len);
+
+		if (n < 0 && (errno == EINTR || errno == EAGAIN) && !health_check_timer_expired)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
 }
 
 static RETSIGTYPE my_signal_handler(int sig)
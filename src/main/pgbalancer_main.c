@@ -40,12 +40,14 @@
 #include "utils/memutils.h"
 #include "utils/statistics.h"
 #include "utils/pool_ipc.h"
+#include "utils/pool_relcache.h"
 #include "context/pool_process_context.h"
 #include "protocol/pool_process_query.h"
 #include "protocol/pool_pg_utils.h"
 #include "auth/pool_passwd.h"
 #include "auth/pool_hba.h"
 #include "query_cache/pool_memqcache.h"
+#include "ai/pool_ai_load_balancer.h"
 #include "watchdog/wd_internal_commands.h"
 #include "watchdog/wd_lifecheck.h"
 #include "watchdog/watchdog.h"
@@ -312,12 +314,6 @@ PgpoolMain(bool discard_status, bool clear_memcache_oidmaps)
 	 */
 	volatile bool first = true;
 
-	/*
-	 * Query cache lock file path. This should be declared as "static" because
-	 * the path is passed to be registered using on_proc_exit().
-	 */
-	static char query_cache_lock_path[MAXPGPATH];
-
 	processState = INITIALIZING;
 
 	/*
@@ -523,26 +519,6 @@ PgpoolMain(bool discard_status, bool clear_memcache_oidmaps)
 		free(inet_fds);
 	}
 
-	/* For query cache concurrency control */
-	if (pool_config->memory_cache_enabled || pool_config->enable_shared_relcache)
-	{
-		int			lfd;
-
-		snprintf(query_cache_lock_path, sizeof(query_cache_lock_path),
-				 "%s/%s", pool_config->logdir, QUERY_CACHE_LOCK_FILE);
-		lfd = open(query_cache_lock_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
-		if (lfd == -1)
-		{
-			ereport(FATAL,
-					(errmsg("Failed to open lock file for query cache \"%s\"", query_cache_lock_path),
-					 errdetail("%m")));
-		}
-		close(lfd);
-
-		/* Register file unlink at exit */
-		on_proc_exit(FileUnlink, (Datum) query_cache_lock_path);
-	}
-
 	/*
 	 * We need to block signal here. Otherwise child might send some signals,
 	 * for example SIGUSR1(fail over).  Children will inherit signal blocking
@@ -3139,17 +3115,38 @@ initialize_shared_mem_objects(bool clear_memcache_oidmaps)
 	size += MAXALIGN(pool_config->num_init_children * sizeof(pid_t));
 	size += MAXALIGN(pool_config->num_init_children * sizeof(pid_t));
 
+	/*
+	 * AI load balancer model. load_balance_mode_algo can be changed by
+	 * reloading, so allocate it whenever load balancing is enabled.
+	 */
+	if (pool_config->load_balance_mode)
+	{
+		size += MAXALIGN(pool_ai_lb_shared_memory_size());
+		elog(DEBUG1, "AIModelState: %zu bytes requested for shared memory", MAXALIGN(pool_ai_lb_shared_memory_size()));
+	}
+
 	if (pool_is_shmem_cache())
 	{
 		size += MAXALIGN(pool_shared_memory_cache_size());
 		size += MAXALIGN(pool_shared_memory_fsmm_size());
 		size += MAXALIGN(pool_hash_size(pool_config->memqcache_max_num_cache));
+		size += MAXALIGN(pool_memqcache_lock_size());
+		size += MAXALIGN(pool_oid_map_size());
+		if (pool_config->memqcache_lazy_invalidation)
+			size += MAXALIGN(pool_table_generation_size());
+		size += MAXALIGN(pool_cache_policy_size());
+		size += MAXALIGN(pool_cache_inflight_size());
 	}
 	if (pool_config->memory_cache_enabled || pool_config->enable_shared_relcache)
 	{
 		size += MAXALIGN(sizeof(POOL_QUERY_CACHE_STATS));
 		elog(DEBUG1, "POOL_QUERY_CACHE_STATS: %zu bytes requested for shared memory", MAXALIGN(sizeof(POOL_QUERY_CACHE_STATS)));
 	}
+	if (pool_config->enable_shared_relcache && pool_config->shared_relcache_size > 0)
+	{
+		size += MAXALIGN(pool_shared_relcache_size());
+		elog(DEBUG1, "shared relation cache: %zu bytes requested for shared memory", MAXALIGN(pool_shared_relcache_size()));
+	}
 
 	if (pool_config->use_watchdog)
 	{
@@ -3197,6 +3194,11 @@ initialize_shared_mem_objects(bool clear_memcache_oidmaps)
 	si_manage_info->commit_waiting_children =
 		(pid_t *) pool_shared_memory_segment_get_chunk(pool_config->num_init_children * sizeof(pid_t));
 
+	/* Initialize AI load balancer model */
+	if (pool_config->load_balance_mode)
+		pool_ai_lb_initialize(pool_shared_memory_segment_get_chunk(pool_ai_lb_shared_memory_size()),
+							  AI_LB_MODE_ADAPTIVE);
+
 	/*
 	 * Initialize backend status area. From now on, VALID_BACKEND macro can be
 	 * used. (get_next_main_node() uses VALID_BACKEND)
@@ -3237,6 +3239,22 @@ initialize_shared_mem_objects(bool clear_memcache_oidmaps)
 
 			pool_allocate_fsmm_clock_hand();
 
+			pool_init_oid_map();
+
+			if (pool_config->memqcache_lazy_invalidation)
+				pool_init_table_generations();
+
+			pool_init_cache_policy();
+
+			pool_init_cache_inflight();
+
+#ifndef USE_LZ4
+			if (pool_config->memqcache_compress_threshold > 0)
+				ereport(WARNING,
+						(errmsg("memqcache_compress_threshold is ignored"),
+						 errdetail("pgbalancer was built without LZ4 support (--with-lz4)")));
+#endif
+
 			pool_discard_oid_maps();
 
 			ereport(LOG,
@@ -3244,6 +3262,8 @@ initialize_shared_mem_objects(bool clear_memcache_oidmaps)
 
 			pool_hash_init(pool_config->memqcache_max_num_cache);
 
+			pool_init_memqcache_locks();
+
 			pool_init_whole_cache_blocks();
 		}
 
@@ -3267,6 +3287,12 @@ initialize_shared_mem_objects(bool clear_memcache_oidmaps)
 		pool_init_memqcache_stats();
 	}
 
+	/*
+	 * Initialize shared relation cache
+	 */
+	if (pool_config->enable_shared_relcache && pool_config->shared_relcache_size > 0)
+		pool_init_shared_relcache();
+
 	/* initialize watchdog IPC unix domain socket address */
 	if (pool_config->use_watchdog)
 	{
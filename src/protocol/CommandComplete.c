@@ -18,6 +18,8 @@
 #include "pool_config.h"
 #include "context/pool_session_context.h"
 #include "context/pool_query_context.h"
+#include "utils/pool_select_walker.h"
+#include "utils/pool_relcache.h"
 #include "utils/elog.h"
 #include "utils/palloc.h"
 #include "utils/memutils.h"
@@ -30,6 +32,7 @@ static int	forward_empty_query(POOL_CONNECTION *frontend, char *packet, int pack
 static int	forward_packet_to_frontend(POOL_CONNECTION *frontend, char kind, char *packet, int packetlen);
 static void process_clear_cache(POOL_CONNECTION_POOL *backend);
 static bool check_alter_role_statement(AlterRoleStmt *stmt);
+static bool relcache_affected(Node *node, bool *temp);
 
 POOL_STATUS
 CommandComplete(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, bool command_complete)
@@ -200,6 +203,7 @@ CommandComplete(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, bool c
 		 */
 		if (pool_is_doing_extended_query_message())
 		{
+			POOL_QUERY_CONTEXT *query_context;
 			char	   *query;
 			Node	   *node;
 			char		state;
@@ -209,7 +213,13 @@ CommandComplete(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, bool c
 				elog(WARNING, "expected query_contex is NULL");
 				return POOL_END;
 			}
-			query = session_context->query_context->query_w_hex;
+			query_context = session_context->query_context;
+
+			/*
+			 * bind_params is set only if the cache fetch condition was
+			 * checked at Execute.
+			 */
+			query = query_context->bind_params ? query_context->original_query : NULL;
 			node = pool_get_parse_tree();
 			state = TSTATE(backend, MAIN_NODE_ID);
 
@@ -217,8 +227,10 @@ CommandComplete(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, bool c
 			 * If some rows have been fetched by an execute with non 0 row
 			 * option, we do not create cache.
 			 */
-			pool_handle_query_cache(backend, query, node, state,
-									session_context->query_context->partial_fetch);
+			pool_handle_query_cache(backend, query,
+									query_context->bind_params,
+									query_context->bind_params_len,
+									node, state, query_context->partial_fetch);
 
 			/*
 			 * CommandComplete guarantees that all rows have been fetched.  We
@@ -282,12 +294,21 @@ handle_query_context(POOL_CONNECTION_POOL *backend)
 {
 	POOL_SESSION_CONTEXT *session_context;
 	Node	   *node;
+	bool		temp;
 
 	/* Get session context */
 	session_context = pool_get_session_context(false);
 
 	node = session_context->query_context->parse_tree;
 
+	/*
+	 * DDL may change results of relation cache queries.  Invalidate the
+	 * relation cache of all processes unless only temporary objects are
+	 * affected.
+	 */
+	if (relcache_affected(node, &temp))
+		pool_relcache_invalidate(!temp);
+
 	if (IsA(node, PrepareStmt))
 	{
 		if (session_context->uncompleted_message)
@@ -305,11 +326,14 @@ handle_query_context(POOL_CONNECTION_POOL *backend)
 		{
 			pool_remove_sent_messages('Q');
 			pool_remove_sent_messages('P');
+			pool_pooled_statement_clear(backend);
 		}
 		else
 		{
 			pool_remove_sent_message('Q', name);
 			pool_remove_sent_message('P', name);
+			if (!strncmp(name, POOLED_STATEMENT_PREFIX, strlen(POOLED_STATEMENT_PREFIX)))
+				pool_pooled_statement_clear(backend);
 		}
 	}
 	else if (IsA(node, DiscardStmt))
@@ -324,8 +348,60 @@ handle_query_context(POOL_CONNECTION_POOL *backend)
 		else if (stmt->target == DISCARD_ALL)
 		{
 			pool_clear_sent_message_list();
+			pool_pooled_statement_clear(backend);
+
+			/* Following statements may have created new state */
+			if (!session_context->query_context->is_multi_statement)
+				pool_unset_session_state(POOL_SESSION_STATE_SET | POOL_SESSION_STATE_LISTEN |
+										 POOL_SESSION_STATE_CURSOR | POOL_SESSION_STATE_LOCK |
+										 POOL_SESSION_STATE_TEMP);
 		}
 	}
+	else if (IsA(node, ListenStmt))
+	{
+		pool_set_session_state(POOL_SESSION_STATE_LISTEN);
+	}
+	else if (IsA(node, UnlistenStmt))
+	{
+		/* UNLISTEN * */
+		if (((UnlistenStmt *) node)->conditionname == NULL)
+			pool_unset_session_state(POOL_SESSION_STATE_LISTEN);
+	}
+	else if (IsA(node, DeclareCursorStmt))
+	{
+		if (((DeclareCursorStmt *) node)->options & CURSOR_OPT_HOLD)
+			pool_set_session_state(POOL_SESSION_STATE_CURSOR);
+	}
+	else if (IsA(node, CreateTableAsStmt))
+	{
+		CreateTableAsStmt *stmt = (CreateTableAsStmt *) node;
+
+		if (stmt->into && stmt->into->rel && stmt->into->rel->relpersistence == 't')
+			pool_set_session_state(POOL_SESSION_STATE_TEMP);
+	}
+	else if (IsA(node, ViewStmt))
+	{
+		if (((ViewStmt *) node)->view->relpersistence == 't')
+			pool_set_session_state(POOL_SESSION_STATE_TEMP);
+	}
+	else if (IsA(node, CreateSeqStmt))
+	{
+		if (((CreateSeqStmt *) node)->sequence->relpersistence == 't')
+			pool_set_session_state(POOL_SESSION_STATE_TEMP);
+	}
+	else if (IsA(node, SelectStmt) || IsA(node, InsertStmt) ||
+			 IsA(node, UpdateStmt) || IsA(node, DeleteStmt))
+	{
+		int			state = pool_session_function_call_state(node);
+
+		if (state)
+			pool_set_session_state(state);
+	}
+	else if (IsA(node, DoStmt) || IsA(node, CallStmt))
+	{
+		/* We cannot see what the code does */
+		pool_set_session_state(POOL_SESSION_STATE_SET);
+	}
 
 	/*
 	 * JDBC driver sends "BEGIN" query internally if setAutoCommit(false). But
@@ -462,6 +538,16 @@ handle_query_context(POOL_CONNECTION_POOL *backend)
 			 !strcmp(stmt->name, "session_authorization")))
 			/* disable query cache in this session */
 			set_query_cache_disabled();
+
+		/* SET LOCAL and SET TRANSACTION last until the end of transaction */
+		if (stmt->kind == VAR_RESET_ALL)
+		{
+			if (!session_context->query_context->is_multi_statement)
+				pool_unset_session_state(POOL_SESSION_STATE_SET);
+		}
+		else if (!stmt->is_local &&
+				 !(stmt->kind == VAR_SET_MULTI && !strcmp(stmt->name, "TRANSACTION")))
+			pool_set_session_state(POOL_SESSION_STATE_SET);
 	}
 	else if (IsA(node, GrantStmt))
 	{
@@ -490,6 +576,64 @@ handle_query_context(POOL_CONNECTION_POOL *backend)
 	}
 }
 
+/*
+ * Return true if the statement creates, drops or alters tables, views,
+ * functions or policies, which are looked up through the relation cache.
+ * *temp is set to true if the statement only creates a temporary object.
+ * DO blocks, procedure calls and extensions may run arbitrary DDL, so they
+ * are regarded as affecting the relation cache.  DDL run inside functions
+ * called by other statements is not detected.
+ */
+static bool
+relcache_affected(Node *node, bool *temp)
+{
+	*temp = false;
+
+	switch (nodeTag(node))
+	{
+		case T_CreateStmt:
+			*temp = ((CreateStmt *) node)->relation->relpersistence == 't';
+			return true;
+		case T_CreateTableAsStmt:
+			{
+				CreateTableAsStmt *stmt = (CreateTableAsStmt *) node;
+
+				*temp = stmt->into && stmt->into->rel &&
+					stmt->into->rel->relpersistence == 't';
+				return true;
+			}
+		case T_ViewStmt:
+			*temp = ((ViewStmt *) node)->view->relpersistence == 't';
+			return true;
+		case T_SelectStmt:
+			{
+				/* SELECT INTO */
+				IntoClause *into = ((SelectStmt *) node)->intoClause;
+
+				if (into == NULL)
+					return false;
+				*temp = into->rel && into->rel->relpersistence == 't';
+				return true;
+			}
+		case T_DoStmt:
+		case T_CallStmt:
+		case T_CreateExtensionStmt:
+		case T_AlterExtensionStmt:
+		case T_AlterExtensionContentsStmt:
+		case T_DropStmt:
+		case T_AlterTableStmt:
+		case T_RenameStmt:
+		case T_AlterObjectSchemaStmt:
+		case T_CreateFunctionStmt:
+		case T_AlterFunctionStmt:
+		case T_CreatePolicyStmt:
+		case T_AlterPolicyStmt:
+			return true;
+		default:
+			return false;
+	}
+}
+
 /*
  * Check whether the ALTER ROLE statement needs query cache invalidation.
  * stmt must be AlterRoleStmt.
@@ -675,16 +819,11 @@ forward_empty_query(POOL_CONNECTION *frontend, char *packet, int packetlen)
 static int
 forward_packet_to_frontend(POOL_CONNECTION *frontend, char kind, char *packet, int packetlen)
 {
-	int			sendlen;
-
-	if (pool_write(frontend, &kind, 1) < 0)
-		return -1;
-
-	sendlen = htonl(packetlen + 4);
-	if (pool_write(frontend, &sendlen, sizeof(sendlen)) < 0)
+	if (pool_write_message(frontend, kind, packet, packetlen) < 0)
 		return -1;
 
-	pool_write_and_flush(frontend, packet, packetlen);
+	if (pool_frontend_flush_needed(kind))
+		pool_flush(frontend);
 
 	return 0;
 }
@@ -30,6 +30,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "pool.h"
 #include "pool_config.h"
@@ -44,6 +47,8 @@
 #include "utils/elog.h"
 #include "utils/ps_status.h"
 #include "utils/timestamp.h"
+#include "query_cache/pool_memqcache.h"
+#include "ai/pool_ai_load_balancer.h"
 
 #include "context/pool_process_context.h"
 #include "context/pool_session_context.h"
@@ -112,6 +117,13 @@ int			nsocks;
 static int	child_inet_fd = 0;
 static int	child_unix_fd = 0;
 
+#if defined(__linux__) && defined(EPOLLEXCLUSIVE)
+#define USE_EXCLUSIVE_ACCEPT
+static int	accept_epoll_fd = -1;	/* epoll set of listen sockets */
+static bool accept_epoll_failed = false;
+static bool setup_exclusive_accept(int *fds);
+#endif
+
 extern int	myargc;
 extern char **myargv;
 
@@ -251,6 +263,10 @@ do_child(int *fds)
 				log_disconnections(child_frontend->database, child_frontend->username);
 		}
 
+		/* Don't let others wait for the result of the aborted query */
+		pool_cache_inflight_end();
+		pool_ai_query_reset();
+
 		backend_cleanup(&child_frontend, backend, frontend_invalid);
 
 		session = pool_get_process_context();
@@ -313,6 +329,7 @@ do_child(int *fds)
 		accepted = 0;
 		/* Destroy session context for just in case... */
 		pool_session_context_destroy();
+		pool_ai_query_reset();
 
 		front_end_fd = wait_for_new_connections(fds, &saddr);
 		pool_get_my_process_info()->wait_for_connect = 0;
@@ -451,6 +468,8 @@ do_child(int *fds)
 			status = pool_process_query(child_frontend, backend, 0);
 			if (status != POOL_CONTINUE)
 			{
+				/* The frontend may have gone away in the middle of a query */
+				pool_cache_inflight_end();
 				backend_cleanup(&child_frontend, backend, false);
 				break;
 			}
@@ -1107,6 +1126,8 @@ connect_backend(StartupPacket *sp, POOL_CONNECTION *frontend)
 				 * save startup packet info
 				 */
 				CONNECTION_SLOT(backend, i)->sp = topmem_sp;
+				if (!topmem_sp_set)
+					pool_register_cp(backend, topmem_sp);
 				topmem_sp_set = true;
 
 				/* send startup packet */
@@ -1568,10 +1589,16 @@ wait_for_new_connections(int *fds, SockAddr *saddr)
 
 	struct timeval *timeout;
 	struct timeval timeoutdata;
+	bool		exclusive = false;
 
 	for (walk = fds; *walk != -1; walk++)
 		socket_set_nonblock(*walk);
 
+#ifdef USE_EXCLUSIVE_ACCEPT
+	if (pool_config->exclusive_accept && !SERIALIZE_ACCEPT)
+		exclusive = setup_exclusive_accept(fds);
+#endif
+
 	if (SERIALIZE_ACCEPT)
 		set_ps_display("wait for accept lock", false);
 	else
@@ -1643,20 +1670,37 @@ wait_for_new_connections(int *fds, SockAddr *saddr)
 			backend_timer_expired = 0;
 		}
 
-		/* prepare select */
-		memcpy((char *) &rmask, (char *) &readmask, sizeof(fd_set));
-		if (pool_config->child_life_time > 0)
+#ifdef USE_EXCLUSIVE_ACCEPT
+		if (exclusive)
 		{
-			timeoutdata.tv_sec = 1;
-			timeoutdata.tv_usec = 0;
-			timeout = &timeoutdata;
+			struct epoll_event ev;
+
+			numfds = epoll_wait(accept_epoll_fd, &ev, 1,
+								pool_config->child_life_time > 0 ? 1000 : -1);
+			if (numfds > 0)
+			{
+				FD_ZERO(&rmask);
+				FD_SET(ev.data.fd, &rmask);
+			}
 		}
 		else
+#endif
 		{
-			timeout = NULL;
-		}
+			/* prepare select */
+			memcpy((char *) &rmask, (char *) &readmask, sizeof(fd_set));
+			if (pool_config->child_life_time > 0)
+			{
+				timeoutdata.tv_sec = 1;
+				timeoutdata.tv_usec = 0;
+				timeout = &timeoutdata;
+			}
+			else
+			{
+				timeout = NULL;
+			}
 
-		numfds = select(nsocks, &rmask, NULL, NULL, timeout);
+			numfds = select(nsocks, &rmask, NULL, NULL, timeout);
+		}
 
 		/* not timeout */
 		if (numfds != 0)
@@ -1694,7 +1738,8 @@ wait_for_new_connections(int *fds, SockAddr *saddr)
 			return RETRY;
 		ereport(ERROR,
 				(errmsg("failed to accept user connection"),
-				 errdetail("select on socket failed with error : \"%m\"")));
+				 errdetail("%s on socket failed with error : \"%m\"",
+						   exclusive ? "epoll_wait" : "select")));
 	}
 
 	for (walk = fds; *walk != -1; walk++)
@@ -1792,6 +1837,56 @@ retry_accept:
 	return afd;
 }
 
+#ifdef USE_EXCLUSIVE_ACCEPT
+/*
+ * Create the epoll set of the listen sockets, registered with EPOLLEXCLUSIVE
+ * so that the kernel wakes up only one of the waiting children for an
+ * incoming connection.  Returns false if it is not available, in which case
+ * select() is used.
+ */
+static bool
+setup_exclusive_accept(int *fds)
+{
+	struct epoll_event ev;
+	int		   *walk;
+
+	if (accept_epoll_fd >= 0)
+		return true;
+	if (accept_epoll_failed)
+		return false;
+
+	accept_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (accept_epoll_fd < 0)
+	{
+		ereport(LOG,
+				(errmsg("exclusive_accept is disabled"),
+				 errdetail("epoll_create1 failed with error : \"%m\"")));
+		accept_epoll_failed = true;
+		return false;
+	}
+
+	for (walk = fds; *walk != -1; walk++)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.fd = *walk;
+
+		if (epoll_ctl(accept_epoll_fd, EPOLL_CTL_ADD, *walk, &ev) < 0)
+		{
+			ereport(LOG,
+					(errmsg("exclusive_accept is disabled"),
+					 errdetail("epoll_ctl failed with error : \"%m\"")));
+			close(accept_epoll_fd);
+			accept_epoll_fd = -1;
+			accept_epoll_failed = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+#endif
+
 static bool
 unix_fds_not_isset(int *fds, int num_unix_fds, fd_set *opt)
 {
@@ -1824,6 +1919,9 @@ check_config_reload(void)
 		if (strcmp("", pool_config->pool_passwd))
 			pool_reopen_passwd_file();
 
+		/* routing verdicts may depend on the old configuration */
+		pool_routing_cache_clear();
+
 		got_sighup = 0;
 	}
 }
@@ -2130,6 +2228,8 @@ retry_startup:
 
 	if (backend == NULL)
 	{
+		pool_get_my_process_info()->pool_misses++;
+
 		/*
 		 * Create a new connection to backend. Authentication is performed if
 		 * requested by backend.
@@ -2138,6 +2238,8 @@ retry_startup:
 	}
 	else
 	{
+		pool_get_my_process_info()->pool_hits++;
+
 		/* reuse existing connection */
 		if (!connect_using_existing_connection(frontend, backend, sp))
 			return NULL;
@@ -58,6 +58,43 @@ static bool connect_with_timeout(int fd, struct addrinfo *walk, char *host, int
 
 #define TMINTMAX 0x7fffffff
 
+/*
+ * Index of the connection pool.  cp_hash is an open addressing hash table of
+ * pool indexes keyed by user, database and protocol major version, so that
+ * pool_get_cp() does not need to compare every pool.  Registered pools are
+ * also linked in a LRU list, least recently used first, which decides the
+ * pool to be discarded when no pool is free.
+ *
+ * close_idle_connection() empties pools in a signal handler without
+ * unregistering them.  Such stale entries are removed when they are found.
+ */
+#define CP_HASH_EMPTY	(-1)
+#define CP_HASH_DELETED (-2)
+
+typedef struct
+{
+	uint32		hash;			/* hash value of the pool's key */
+	bool		registered;		/* true if in cp_hash and the LRU list */
+	int			lru_prev;		/* previous pool in the LRU list or -1 */
+	int			lru_next;		/* next pool in the LRU list or -1 */
+} CP_INDEX_ENTRY;
+
+static CP_INDEX_ENTRY *cp_index;
+static int *cp_hash;
+static int	cp_hash_size;		/* power of 2 */
+static int	cp_hash_used;		/* number of non empty entries of cp_hash */
+static int	cp_lru_head = -1;
+static int	cp_lru_tail = -1;
+
+static uint32 cp_hash_key(const char *user, const char *database, int protoMajor);
+static bool cp_match(POOL_CONNECTION_POOL *p, const char *user, const char *database, int protoMajor);
+static int	cp_lookup(const char *user, const char *database, int protoMajor);
+static void cp_hash_insert(int idx);
+static void cp_hash_rebuild(void);
+static void cp_unregister(int idx);
+static void cp_lru_unlink(int idx);
+static void cp_lru_append(int idx);
+
 /*
 * initialize connection pools. this should be called once at the startup.
 */
@@ -75,10 +112,38 @@ pool_init_cp(void)
 		pool_connection_pool[i].info = pool_coninfo(pool_get_process_context()->proc_id, i, 0);
 		memset(pool_connection_pool[i].info, 0, sizeof(ConnectionInfo) * MAX_NUM_BACKENDS);
 	}
+
+	cp_index = palloc0(sizeof(CP_INDEX_ENTRY) * pool_config->max_pool);
+	for (i = 0; i < pool_config->max_pool; i++)
+		cp_index[i].lru_prev = cp_index[i].lru_next = -1;
+	for (cp_hash_size = 8; cp_hash_size < pool_config->max_pool * 2; cp_hash_size <<= 1)
+		;
+	cp_hash = palloc(sizeof(int) * cp_hash_size);
+	cp_hash_rebuild();
+
+	pool_get_my_process_info()->pool_hits = 0;
+	pool_get_my_process_info()->pool_misses = 0;
+
 	MemoryContextSwitchTo(oldContext);
 	return 0;
 }
 
+/*
+ * Make the connection pool found by pool_get_cp() with the user, database
+ * and protocol version of the startup packet.
+ */
+void
+pool_register_cp(POOL_CONNECTION_POOL *p, StartupPacket *sp)
+{
+	int			idx = p - pool_connection_pool;
+
+	cp_unregister(idx);
+	cp_index[idx].hash = cp_hash_key(sp->user, sp->database, sp->major);
+	cp_hash_insert(idx);
+	cp_lru_append(idx);
+	cp_index[idx].registered = true;
+}
+
 /*
 * find connection by user and database
 */
@@ -88,7 +153,9 @@ pool_get_cp(char *user, char *database, int protoMajor, int check_socket)
 	pool_sigset_t oldmask;
 
 	int			i,
+				j,
 				freed = 0;
+	int			sock_broken = 0;
 	ConnectionInfo *info;
 
 	POOL_CONNECTION_POOL *connection_pool = pool_connection_pool;
@@ -104,94 +171,89 @@ pool_get_cp(char *user, char *database, int protoMajor, int check_socket)
 
 	POOL_SETMASK2(&BlockSig, &oldmask);
 
-	for (i = 0; i < pool_config->max_pool; i++)
+	i = cp_lookup(user, database, protoMajor);
+	if (i < 0)
 	{
-		if (MAIN_CONNECTION(connection_pool) &&
-			MAIN_CONNECTION(connection_pool)->sp &&
-			MAIN_CONNECTION(connection_pool)->sp->major == protoMajor &&
-			MAIN_CONNECTION(connection_pool)->sp->user != NULL &&
-			strcmp(MAIN_CONNECTION(connection_pool)->sp->user, user) == 0 &&
-			strcmp(MAIN_CONNECTION(connection_pool)->sp->database, database) == 0)
-		{
-			int			sock_broken = 0;
-			int			j;
+		POOL_SETMASK(&oldmask);
+		return NULL;
+	}
+	connection_pool += i;
 
-			/* mark this connection is under use */
-			MAIN_CONNECTION(connection_pool)->closetime = 0;
-			for (j = 0; j < NUM_BACKENDS; j++)
-			{
-				connection_pool->info[j].counter++;
-			}
-			POOL_SETMASK(&oldmask);
+	/* move to the most recently used end of the LRU list */
+	cp_lru_unlink(i);
+	cp_lru_append(i);
 
-			if (check_socket)
-			{
-				for (j = 0; j < NUM_BACKENDS; j++)
-				{
-					if (!VALID_BACKEND(j))
-						continue;
+	/* mark this connection is under use */
+	MAIN_CONNECTION(connection_pool)->closetime = 0;
+	for (j = 0; j < NUM_BACKENDS; j++)
+	{
+		connection_pool->info[j].counter++;
+	}
+	POOL_SETMASK(&oldmask);
 
-					if (CONNECTION_SLOT(connection_pool, j))
-					{
-						sock_broken = check_socket_status(CONNECTION(connection_pool, j)->fd);
-						if (sock_broken < 0)
-							break;
-					}
-					else
-					{
-						sock_broken = -1;
-						break;
-					}
-				}
+	if (check_socket)
+	{
+		for (j = 0; j < NUM_BACKENDS; j++)
+		{
+			if (!VALID_BACKEND(j))
+				continue;
 
+			if (CONNECTION_SLOT(connection_pool, j))
+			{
+				sock_broken = check_socket_status(CONNECTION(connection_pool, j)->fd);
 				if (sock_broken < 0)
-				{
-					ereport(LOG,
-							(errmsg("connection closed."),
-							 errdetail("retry to create new connection pool")));
+					break;
+			}
+			else
+			{
+				sock_broken = -1;
+				break;
+			}
+		}
 
-					/*
-					 * It is possible that one of backend just broke.  sleep 1
-					 * second to wait for failover occurres, then wait for the
-					 * failover finishes.
-					 */
-					sleep(1);
-					wait_for_failover_to_finish();
+		if (sock_broken < 0)
+		{
+			ereport(LOG,
+					(errmsg("connection closed."),
+					 errdetail("retry to create new connection pool")));
 
-					for (j = 0; j < NUM_BACKENDS; j++)
-					{
-						if (!VALID_BACKEND(j) || (CONNECTION_SLOT(connection_pool, j) == NULL))
-							continue;
+			/*
+			 * It is possible that one of backend just broke.  sleep 1 second
+			 * to wait for failover occurres, then wait for the failover
+			 * finishes.
+			 */
+			sleep(1);
+			wait_for_failover_to_finish();
 
-						if (!freed)
-						{
-							pool_free_startup_packet(CONNECTION_SLOT(connection_pool, j)->sp);
-							CONNECTION_SLOT(connection_pool, j)->sp = NULL;
+			for (j = 0; j < NUM_BACKENDS; j++)
+			{
+				if (!VALID_BACKEND(j) || (CONNECTION_SLOT(connection_pool, j) == NULL))
+					continue;
 
-							freed = 1;
-						}
+				if (!freed)
+				{
+					pool_free_startup_packet(CONNECTION_SLOT(connection_pool, j)->sp);
+					CONNECTION_SLOT(connection_pool, j)->sp = NULL;
 
-						pool_close(CONNECTION(connection_pool, j));
-						pfree(CONNECTION_SLOT(connection_pool, j));
-					}
-					info = connection_pool->info;
-					memset(connection_pool, 0, sizeof(POOL_CONNECTION_POOL));
-					connection_pool->info = info;
-					info->swallow_termination = 0;
-					memset(connection_pool->info, 0, sizeof(ConnectionInfo) * MAX_NUM_BACKENDS);
-					POOL_SETMASK(&oldmask);
-					return NULL;
+					freed = 1;
 				}
+
+				pool_close(CONNECTION(connection_pool, j));
+				pfree(CONNECTION_SLOT(connection_pool, j));
 			}
+			cp_unregister(i);
+			info = connection_pool->info;
+			memset(connection_pool, 0, sizeof(POOL_CONNECTION_POOL));
+			connection_pool->info = info;
+			info->swallow_termination = 0;
+			memset(connection_pool->info, 0, sizeof(ConnectionInfo) * MAX_NUM_BACKENDS);
 			POOL_SETMASK(&oldmask);
-			pool_index = i;
-			return connection_pool;
+			return NULL;
 		}
-		connection_pool++;
 	}
-
 	POOL_SETMASK(&oldmask);
-	return NULL;
+	pool_index = i;
+	return connection_pool;
 }
 
 /*
@@ -229,6 +291,7 @@ pool_discard_cp(char *user, char *database, int protoMajor)
 		pfree(CONNECTION_SLOT(p, i));
 	}
 
+	cp_unregister(p - pool_connection_pool);
 	info = p->info;
 	memset(p, 0, sizeof(POOL_CONNECTION_POOL));
 	p->info = info;
@@ -244,7 +307,6 @@ pool_create_cp(void)
 {
 	int			i,
 				freed = 0;
-	time_t		closetime;
 	POOL_CONNECTION_POOL *oldestp;
 	POOL_CONNECTION_POOL *ret;
 	ConnectionInfo *info;
@@ -275,36 +337,12 @@ pool_create_cp(void)
 			 errdetail("no empty connection slot was found")));
 
 	/*
-	 * no empty connection slot was found. look for the oldest connection and
-	 * discard it.
+	 * no empty connection slot was found. discard the least recently used
+	 * connection.
 	 */
-	oldestp = p = pool_connection_pool;
-	closetime = TMINTMAX;
-	pool_index = 0;
+	pool_index = cp_lru_head >= 0 ? cp_lru_head : 0;
+	oldestp = p = pool_connection_pool + pool_index;
 
-	for (i = 0; i < pool_config->max_pool; i++)
-	{
-		main_node_id = in_use_backend_id(p);
-		if (main_node_id < 0)
-			elog(ERROR, "no in use backend found"); /* this should not happen */
-
-		ereport(DEBUG1,
-				(errmsg("creating connection pool"),
-				 errdetail("user: %s database: %s closetime: %ld",
-						   CONNECTION_SLOT(p, main_node_id)->sp->user,
-						   CONNECTION_SLOT(p, main_node_id)->sp->database,
-						   CONNECTION_SLOT(p, main_node_id)->closetime)));
-
-		if (CONNECTION_SLOT(p, main_node_id)->closetime < closetime)
-		{
-			closetime = CONNECTION_SLOT(p, main_node_id)->closetime;
-			oldestp = p;
-			pool_index = i;
-		}
-		p++;
-	}
-
-	p = oldestp;
 	main_node_id = in_use_backend_id(p);
 	if (main_node_id < 0)
 		elog(ERROR, "no in use backend found"); /* this should not happen */
@@ -334,6 +372,7 @@ pool_create_cp(void)
 		pfree(CONNECTION_SLOT(p, i));
 	}
 
+	cp_unregister(pool_index);
 	info = p->info;
 	memset(p, 0, sizeof(POOL_CONNECTION_POOL));
 	p->info = info;
@@ -456,6 +495,7 @@ pool_backend_timer(void)
 					pool_close(CONNECTION(p, j));
 					pfree(CONNECTION_SLOT(p, j));
 				}
+				cp_unregister(i);
 				info = p->info;
 				memset(p, 0, sizeof(POOL_CONNECTION_POOL));
 				p->info = info;
@@ -1140,3 +1180,183 @@ in_use_backend_id(POOL_CONNECTION_POOL *pool)
 
 	return -1;
 }
+
+/*
+ * Hash user, database and protocol major version (FNV-1a).
+ */
+static uint32
+cp_hash_key(const char *user, const char *database, int protoMajor)
+{
+	uint32		h = 2166136261u;
+	const char *s;
+
+	for (s = user ? user : ""; *s; s++)
+		h = (h ^ (unsigned char) *s) * 16777619u;
+	h = (h ^ 0xff) * 16777619u;
+	for (s = database ? database : ""; *s; s++)
+		h = (h ^ (unsigned char) *s) * 16777619u;
+	h = (h ^ (uint32) protoMajor) * 16777619u;
+
+	return h;
+}
+
+/*
+ * Return true if the connection pool is for the user, database and protocol
+ * major version.
+ */
+static bool
+cp_match(POOL_CONNECTION_POOL *p, const char *user, const char *database, int protoMajor)
+{
+	return MAIN_CONNECTION(p) &&
+		MAIN_CONNECTION(p)->sp &&
+		MAIN_CONNECTION(p)->sp->major == protoMajor &&
+		MAIN_CONNECTION(p)->sp->user != NULL &&
+		strcmp(MAIN_CONNECTION(p)->sp->user, user) == 0 &&
+		strcmp(MAIN_CONNECTION(p)->sp->database, database) == 0;
+}
+
+/*
+ * Return the index of the connection pool for the user, database and
+ * protocol major version, or -1 if there's none.
+ */
+static int
+cp_lookup(const char *user, const char *database, int protoMajor)
+{
+	uint32		h = cp_hash_key(user, database, protoMajor);
+	int			mask = cp_hash_size - 1;
+	int			pos;
+	int			n;
+
+	for (n = 0, pos = h & mask; n < cp_hash_size; n++, pos = (pos + 1) & mask)
+	{
+		int			idx = cp_hash[pos];
+
+		if (idx == CP_HASH_EMPTY)
+			break;
+		if (idx == CP_HASH_DELETED)
+			continue;
+
+		/* emptied by close_idle_connection()? */
+		if (in_use_backend_id(&pool_connection_pool[idx]) < 0)
+		{
+			cp_hash[pos] = CP_HASH_DELETED;
+			if (cp_index[idx].registered)
+			{
+				cp_lru_unlink(idx);
+				cp_index[idx].registered = false;
+			}
+			continue;
+		}
+
+		if (cp_index[idx].hash == h &&
+			cp_match(&pool_connection_pool[idx], user, database, protoMajor))
+			return idx;
+	}
+	return -1;
+}
+
+/*
+ * Add the connection pool to cp_hash.  cp_index[idx].hash must be set.
+ */
+static void
+cp_hash_insert(int idx)
+{
+	int			mask = cp_hash_size - 1;
+	int			pos;
+
+	/* keep at least a quarter of the table empty for probing to end early */
+	if ((cp_hash_used + 1) * 4 > cp_hash_size * 3)
+		cp_hash_rebuild();
+
+	for (pos = cp_index[idx].hash & mask; cp_hash[pos] >= 0; pos = (pos + 1) & mask)
+		;
+	if (cp_hash[pos] == CP_HASH_EMPTY)
+		cp_hash_used++;
+	cp_hash[pos] = idx;
+}
+
+/*
+ * Rebuild cp_hash from registered pools, dropping deleted and stale entries.
+ */
+static void
+cp_hash_rebuild(void)
+{
+	int			i;
+
+	for (i = 0; i < cp_hash_size; i++)
+		cp_hash[i] = CP_HASH_EMPTY;
+	cp_hash_used = 0;
+
+	for (i = 0; i < pool_config->max_pool; i++)
+	{
+		if (!cp_index[i].registered)
+			continue;
+
+		if (in_use_backend_id(&pool_connection_pool[i]) < 0)
+		{
+			cp_lru_unlink(i);
+			cp_index[i].registered = false;
+			continue;
+		}
+		cp_hash_insert(i);
+	}
+}
+
+/*
+ * Remove the connection pool from cp_hash and the LRU list.  Must be called
+ * before the pool is cleared.
+ */
+static void
+cp_unregister(int idx)
+{
+	int			mask = cp_hash_size - 1;
+	int			pos;
+	int			n;
+
+	if (!cp_index[idx].registered)
+		return;
+
+	for (n = 0, pos = cp_index[idx].hash & mask; n < cp_hash_size && cp_hash[pos] != CP_HASH_EMPTY;
+		 n++, pos = (pos + 1) & mask)
+	{
+		if (cp_hash[pos] == idx)
+		{
+			cp_hash[pos] = CP_HASH_DELETED;
+			break;
+		}
+	}
+	cp_lru_unlink(idx);
+	cp_index[idx].registered = false;
+}
+
+static void
+cp_lru_unlink(int idx)
+{
+	CP_INDEX_ENTRY *e = &cp_index[idx];
+
+	if (e->lru_prev >= 0)
+		cp_index[e->lru_prev].lru_next = e->lru_next;
+	else if (cp_lru_head == idx)
+		cp_lru_head = e->lru_next;
+
+	if (e->lru_next >= 0)
+		cp_index[e->lru_next].lru_prev = e->lru_prev;
+	else if (cp_lru_tail == idx)
+		cp_lru_tail = e->lru_prev;
+
+	e->lru_prev = e->lru_next = -1;
+}
+
+static void
+cp_lru_append(int idx)
+{
+	CP_INDEX_ENTRY *e = &cp_index[idx];
+
+	e->lru_prev = cp_lru_tail;
+	e->lru_next = -1;
+	if (cp_lru_tail >= 0)
+		cp_index[cp_lru_tail].lru_next = idx;
+	else
+		cp_lru_head = idx;
+	cp_lru_tail = idx;
+}
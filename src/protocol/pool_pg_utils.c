@@ -25,6 +25,7 @@
 #include "utils/pool_relcache.h"
 #include "auth/pool_auth.h"
 #include "context/pool_session_context.h"
+#include "ai/pool_ai_load_balancer.h"
 
 #include "pool_config.h"
 #include "pool_config_variables.h"
@@ -328,35 +329,40 @@ select_load_balancing_node(void)
 	int			suggested_node_id = -2;
 
 	/*
-	 * AI Load Balancing: Use AI algorithm if enabled
+	 * AI Load Balancing: let the shared AI model choose among the nodes
+	 * which are up and have non zero weight.
 	 */
-	if (LOAD_BALANCE_MODE_IS_AI())
+	if (LOAD_BALANCE_MODE_IS_AI() && pool_ai_is_enabled())
 	{
-		int available_nodes[NUM_BACKENDS];
-		int num_available = 0;
-		
-		/* Collect available backend nodes */
+		int			available_nodes[MAX_NUM_BACKENDS];
+		int			num_available = 0;
+		QueryPattern pattern;
+		char	   *query;
+
 		for (i = 0; i < NUM_BACKENDS; i++)
 		{
-			if (VALID_BACKEND_RAW(i))
-			{
+			if (VALID_BACKEND_RAW(i) && BACKEND_INFO(i).backend_weight > 0.0)
 				available_nodes[num_available++] = i;
-			}
 		}
-		
+
 		if (num_available > 0)
 		{
-		/* Use first available node for now (AI integration point) */
-		selected_slot = available_nodes[num_available > 1 ? 1 : 0];  /* Prefer non-primary if available */
-		
-		ereport(LOG,
-				(errmsg("AI load balancing mode active"),
-				 errdetail("algorithm: %s, available backends: %d, selected backend: %d",
-				          pool_config->load_balance_mode_algo ? pool_config->load_balance_mode_algo : "ai",
-				          num_available,
-				          selected_slot)));
-		
-		return selected_slot;
+			/*
+			 * The query is known only if statement_level_load_balance is
+			 * enabled. Otherwise we are choosing the node for the session.
+			 */
+			query = pool_get_query_string();
+			if (query)
+				pool_ai_analyze_query(query, &pattern);
+
+			selected_slot = pool_ai_select_backend(query ? &pattern : NULL,
+												   available_nodes, num_available);
+
+			ereport(DEBUG1,
+					(errmsg("selecting load balance node"),
+					 errdetail("AI load balancer selected backend id %d out of %d available backends",
+							   selected_slot, num_available)));
+			return selected_slot;
 		}
 	}
 
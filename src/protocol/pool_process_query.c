@@ -69,6 +69,9 @@
 #define IDLE_IN_TRANSACTION_SESSION_TIMEOUT_ERROR_CODE "25P03"
 #define IDLE_SESSION_TIMEOUT_ERROR_CODE "57P05"
 
+#define SPLICE_DATA_ROW_MIN (64 * 1024)	/* DataRow size passed through
+											 * by pool_splice() */
+
 static int	reset_backend(POOL_CONNECTION_POOL *backend, int qcnt);
 static char *get_insert_command_table_name(InsertStmt *node);
 static bool is_cache_empty(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend);
@@ -83,6 +86,7 @@ static POOL_STATUS insert_oid_into_insert_lock(POOL_CONNECTION *frontend, POOL_C
 static POOL_STATUS read_packets_and_process(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, int reset_request, int *state, short *num_fields, bool *cont);
 static bool is_all_standbys_command_complete(unsigned char *kind_list, int num_backends, int main_node);
 static bool pool_process_notice_message_from_one_backend(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend, int backend_idx, char kind);
+static bool forward_from_main_only(POOL_CONNECTION_POOL *backend);
 
 /*
  * Main module for query processing
@@ -730,9 +734,9 @@ SimpleForwardToFrontend(char kind, POOL_CONNECTION *frontend,
 				len1 = 0;
 	char	   *p = NULL;
 	char	   *p1 = NULL;
-	int			sendlen;
 	int			i;
 	POOL_SESSION_CONTEXT *session_context;
+	bool		pass_through;
 
 	/* Get session context */
 	session_context = pool_get_session_context(false);
@@ -743,13 +747,45 @@ SimpleForwardToFrontend(char kind, POOL_CONNECTION *frontend,
 	len -= 4;
 	len1 = len;
 
-	p = pool_read2(MAIN(backend), len);
-	if (p == NULL)
+	/*
+	 * DataRows returned only by the main node and not to be cached need no
+	 * look at their contents.
+	 */
+	pass_through = kind == 'D' && forward_from_main_only(backend) &&
+		!(pool_config->memory_cache_enabled && pool_is_cache_safe() && !pool_is_cache_exceeded());
+
+	/*
+	 * Just pass a large one through to frontend, which avoids copying it to
+	 * user space if splice(2) is available.
+	 */
+	if (pass_through && len >= SPLICE_DATA_ROW_MIN)
+	{
+		int			sendlen;
+
+		pool_write(frontend, &kind, 1);
+		sendlen = htonl(len + 4);
+		pool_write(frontend, &sendlen, sizeof(sendlen));
+		pool_splice(frontend, MAIN(backend), len);
+
+		if (pool_frontend_flush_needed(kind))
+			pool_flush(frontend);
+		session_context->flush_pending = false;
+
+		ereport(DEBUG5,
+				(errmsg("SimpleForwardToFrontend: passed through packet:%c length:%d",
+						kind, len)));
+		return POOL_CONTINUE;
+	}
+
+	/*
+	 * The data returned by pool_read2() stays valid until the next
+	 * pool_read2() on the main node, so there is no need to copy it.
+	 */
+	p1 = pool_read2(MAIN(backend), len);
+	if (p1 == NULL)
 		ereport(ERROR,
 				(errmsg("unable to forward message to frontend"),
 				 errdetail("read from backend failed")));
-	p1 = palloc(len);
-	memcpy(p1, p, len);
 
 	/*
 	 * If we received a notification message in native replication mode, other
@@ -783,38 +819,46 @@ SimpleForwardToFrontend(char kind, POOL_CONNECTION *frontend,
 		}
 	}
 
-	pool_write(frontend, &kind, 1);
-	sendlen = htonl(len1 + 4);
-	pool_write(frontend, &sendlen, sizeof(sendlen));
+	pool_write_message(frontend, kind, p1, len1);
+
+	/*
+	 * DataRows usually come in a row.  Forward the following ones already
+	 * received by a single write, rather than going through
+	 * read_kind_from_backend() and here for each of them.  p1 is not used
+	 * for DataRow hereafter.
+	 */
+	if (pass_through)
+	{
+		int			nmsgs;
+
+		len = pool_scan_messages(MAIN(backend), 'D', READBUFMAXSZ, &nmsgs);
+		if (len > 0)
+		{
+			p = pool_read2(MAIN(backend), len);
+			pool_write(frontend, p, len);
+			ereport(DEBUG5,
+					(errmsg("SimpleForwardToFrontend: forwarded %d more DataRows length:%d",
+							nmsgs, len)));
+		}
+	}
 
 	/*
-	 * Optimization for other than "Command Complete", "Ready For query",
-	 * "Error response" ,"Notice message", "Notification response", "Row
-	 * description", "No data" and "Close Complete". messages.  Especially,
-	 * since it is too often to receive and forward "Data Row" message, we do
-	 * not flush the message to frontend now. We expect that "Command
-	 * Complete" message (or "Error response" or "Notice response" message)
-	 * follows the stream of data row message anyway, so flushing will be done
-	 * at that time.
+	 * Especially, since it is too often to receive and forward "Data Row"
+	 * message, we do not flush the message to frontend now. We expect that
+	 * "Ready For query" message (or "Error response" or "Notice response"
+	 * message) follows the stream of data row message anyway, so flushing
+	 * will be done at that time.
 	 *
 	 * Same thing can be said to CopyData message. Tremendous number of
 	 * CopyData messages are sent to frontend (typical use case is pg_dump).
 	 * So eliminating per CopyData flush significantly enhances performance.
 	 */
-	if (kind == 'C' || kind == 'Z' || kind == 'E' || kind == 'N' || kind == 'A' || kind == 'T' || kind == 'n' ||
-		kind == '3')
-	{
-		pool_write_and_flush(frontend, p1, len1);
-	}
-	else if (session_context->flush_pending)
+	if (pool_frontend_flush_needed(kind))
 	{
-		pool_write_and_flush(frontend, p1, len1);
+		pool_flush(frontend);
 		ereport(DEBUG5,
-				(errmsg("SimpleForwardToFrontend: flush pending request. kind: %c", kind)));
-	}
-	else
-	{
-		pool_write(frontend, p1, len1);
+				(errmsg("SimpleForwardToFrontend: flushed. kind: %c flush pending: %d",
+						kind, session_context->flush_pending)));
 	}
 
 	session_context->flush_pending = false;
@@ -849,10 +893,54 @@ SimpleForwardToFrontend(char kind, POOL_CONNECTION *frontend,
 					 errdetail("FATAL error occurred on backend")));
 	}
 
-	pfree(p1);
 	return POOL_CONTINUE;
 }
 
+/*
+ * Return true if no node other than the main node is to be read.
+ */
+static bool
+forward_from_main_only(POOL_CONNECTION_POOL *backend)
+{
+	int			i;
+
+	for (i = 0; i < NUM_BACKENDS; i++)
+	{
+		if (VALID_BACKEND(i) && !IS_MAIN_NODE_ID(i))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Return true if a message of the kind just written to the frontend needs
+ * to be flushed now.
+ *
+ * Like PostgreSQL, we flush at ReadyForQuery, on errors, notices and
+ * notifications, and when the frontend has sent a Flush message.  Other
+ * messages are accumulated and go out together by writev(2).  In streaming
+ * and logical replication mode Flush messages from frontend are tracked by
+ * the pending message list and set flush_pending.  Other modes do not track
+ * them, so the end of each command result is flushed as well.
+ */
+bool
+pool_frontend_flush_needed(char kind)
+{
+	POOL_SESSION_CONTEXT *session_context;
+
+	if (kind == 'Z' || kind == 'E' || kind == 'N' || kind == 'A')
+		return true;
+
+	session_context = pool_get_session_context(true);
+	if (session_context && session_context->flush_pending)
+		return true;
+
+	if (SL_MODE)
+		return false;
+
+	return kind == 'C' || kind == 'T' || kind == 'n' || kind == '3' || kind == 'I';
+}
+
 POOL_STATUS
 SimpleForwardToBackend(char kind, POOL_CONNECTION *frontend,
 					   POOL_CONNECTION_POOL *backend,
@@ -985,6 +1073,15 @@ ParameterStatus(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend)
 				{
 					set_application_name_with_string(pool_find_name(&CONNECTION(backend, i)->params, name, &pos));
 				}
+
+				/*
+				 * A parameter changed in the middle of the session, possibly
+				 * by set_config() in a function, is session level state.
+				 */
+				if (strcmp(name, "in_hot_standby") &&
+					pool_get_session_context(true) &&
+					!pool_get_session_context(true)->reset_context)
+					pool_set_session_state(POOL_SESSION_STATE_SET);
 			}
 			else
 			{
@@ -1078,6 +1175,20 @@ reset_backend(POOL_CONNECTION_POOL *backend, int qcnt)
 	}
 
 	query = pool_config->reset_query_list[qcnt];
+
+	/*
+	 * If the session did not leave any session level state, there is nothing
+	 * to reset except an open transaction.
+	 */
+	if (pool_config->skip_reset_for_stateless_session &&
+		strcmp("ABORT", query) && !pool_session_has_state())
+	{
+		ereport(DEBUG1,
+				(errmsg("skipping reset query \"%s\"", query),
+				 errdetail("session did not leave session level state")));
+		return 0;
+	}
+
 	if (!strcmp("ABORT", query))
 	{
 		/* If transaction state are all idle, we don't need to issue ABORT */
@@ -1092,6 +1203,11 @@ reset_backend(POOL_CONNECTION_POOL *backend, int qcnt)
 		if (!need_to_abort)
 			return 0;
 	}
+	else
+	{
+		/* The query may deallocate pooled statements */
+		pool_pooled_statement_clear(backend);
+	}
 
 	pool_set_timeout(10);
 
@@ -47,6 +47,7 @@
 #include "utils/palloc.h"
 #include "utils/memutils.h"
 #include "query_cache/pool_memqcache.h"
+#include "ai/pool_ai_load_balancer.h"
 #include "main/pool_internal_comms.h"
 #include "pool_config_variables.h"
 #include "utils/psqlscan.h"
@@ -79,6 +80,10 @@ static POOL_STATUS parse_before_bind(POOL_CONNECTION *frontend,
 									 POOL_CONNECTION_POOL *backend,
 									 POOL_SENT_MESSAGE *message,
 									 POOL_SENT_MESSAGE *bind_message);
+static bool multiplex_parse(POOL_CONNECTION *frontend,
+							POOL_CONNECTION_POOL *backend,
+							POOL_QUERY_CONTEXT *query_context,
+							POOL_SENT_MESSAGE *msg);
 static POOL_STATUS send_prepare(POOL_CONNECTION *frontend,
 								POOL_CONNECTION_POOL *backend,
 								POOL_SENT_MESSAGE *message);
@@ -262,7 +267,7 @@ SimpleQuery(POOL_CONNECTION *frontend,
 		 * If the query is SELECT from table to cache, try to fetch cached
 		 * result.
 		 */
-		status = pool_fetch_from_memory_cache(frontend, backend, contents, false, &foundp);
+		status = pool_fetch_from_memory_cache(frontend, backend, contents, NULL, 0, false, &foundp);
 
 		if (status != POOL_CONTINUE)
 			return status;
@@ -374,6 +379,14 @@ SimpleQuery(POOL_CONNECTION *frontend,
 		check_prepare(parse_tree_list, len, contents);
 	}
 
+	/*
+	 * Session level state is only tracked from the first statement of a
+	 * query.  Assume that multi statement queries and queries we could not
+	 * parse leave session level state.  See pool_session_has_state().
+	 */
+	if (query_context->is_multi_statement || query_context->is_parse_error)
+		pool_set_session_state(POOL_SESSION_STATE_SET);
+
 	MemoryContextSwitchTo(old_context);
 
 	if (parse_tree_list != NIL)
@@ -586,6 +599,7 @@ SimpleQuery(POOL_CONNECTION *frontend,
 									   query_context->original_query))
 			{
 				pool_set_cache_safe();
+				pool_set_cache_generations(query_context);
 			}
 			else
 			{
@@ -1004,6 +1018,9 @@ Execute(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	if (pool_config->log_statement)
 		ereport(LOG, (errmsg("statement: %s", query)));
 
+	/* Forget the table generations taken by the previous Execute, if any */
+	query_context->num_cache_generations = -1;
+
 	/*
 	 * Fetch memory cache if possible.  Also if atEnd is false or the execute
 	 * message has 0 row argument, we maybe able to use cache. If
@@ -1016,79 +1033,51 @@ Execute(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 		!query_context->partial_fetch)
 	{
 		POOL_STATUS status;
-		char	   *search_query = NULL;
-		int			len;
 
-#define STR_ALLOC_SIZE 1024
 		ereport(DEBUG1, (errmsg("Execute: pool_is_likely_select: true pool_is_writing_transaction: %d TSTATE: %c",
 								pool_is_writing_transaction(),
 								TSTATE(backend, MAIN_REPLICA ? PRIMARY_NODE_ID : REAL_MAIN_NODE_ID))));
 
-		len = strlen(query) + 1;
-		search_query = MemoryContextStrdup(query_context->memory_context, query);
-
 		ereport(DEBUG1, (errmsg("Execute: checking cache fetch condition")));
 
 		/*
-		 * Add bind message's info to query to search.
+		 * The cache key is the query text plus the bind message contents
+		 * following the portal and statement names, i.e. parameter format
+		 * codes, parameter values and result format codes.  They are kept
+		 * in binary and fed to the cache key hash as is.
 		 */
 		if (query_context->is_cache_safe && bind_msg->param_offset && bind_msg->contents)
 		{
-			/* Extract binary contents from bind message */
-			char	   *query_in_bind_msg = bind_msg->contents + bind_msg->param_offset;
-			char		hex_str[4]; /* 02X chars + white space + null end */
-			int			i;
-			int			alloc_len;
-
-			alloc_len = (len / STR_ALLOC_SIZE + 1) * STR_ALLOC_SIZE;
-			search_query = repalloc(search_query, alloc_len);
-
-			for (i = 0; i < bind_msg->len - bind_msg->param_offset; i++)
-			{
-				int			hexlen;
-
-				snprintf(hex_str, sizeof(hex_str), (i == 0) ? " %02X" : "%02X", 0xff & query_in_bind_msg[i]);
-				hexlen = strlen(hex_str);
-
-				if ((len + hexlen) >= alloc_len)
-				{
-					alloc_len += STR_ALLOC_SIZE;
-					search_query = repalloc(search_query, alloc_len);
-				}
-				strcat(search_query, hex_str);
-				len += hexlen;
-			}
+			int			params_len = bind_msg->len - bind_msg->param_offset;
 
 			/*
 			 * If bind message is sent again to an existing prepared
-			 * statement, it is possible that query_w_hex remains. Before
-			 * setting newly allocated query_w_hex's pointer to the query
-			 * context, free the previously allocated memory.
+			 * statement, it is possible that bind_params remains.  Free it
+			 * before remembering the new one.
 			 */
-			if (query_context->query_w_hex)
-			{
-				pfree(query_context->query_w_hex);
-			}
-			query_context->query_w_hex = search_query;
+			if (query_context->bind_params)
+				pfree(query_context->bind_params);
+			query_context->bind_params = MemoryContextAlloc(query_context->memory_context, params_len);
+			memcpy(query_context->bind_params, bind_msg->contents + bind_msg->param_offset, params_len);
+			query_context->bind_params_len = params_len;
 
 			/*
-			 * When a transaction is committed,
-			 * query_context->temp_cache->query is used to create md5 hash to
-			 * search for query cache. So overwrite the query text in temp
-			 * cache to the one with the hex of bind message. If not, md5 hash
-			 * will be created by the query text without bind message, and it
-			 * will happen to find cache never or to get a wrong result.
+			 * When a transaction is committed, query_context->temp_cache is
+			 * used to create the cache key.  So attach the bind parameters to
+			 * the temp cache.  If not, the key will be created by the query
+			 * text without bind message, and it will happen to find cache
+			 * never or to get a wrong result.
 			 *
 			 * However, It is possible that temp_cache does not exist.
 			 * Consider following scenario: - In the previous execute cache is
 			 * overflowed, and temp_cache discarded. - In the subsequent
-			 * bind/execute uses the same portal
+			 * bind/execute uses the same portal.  In this case
+			 * memqcache_register() attaches the parameters when it creates
+			 * the temp cache.
 			 */
-			if (query_context->temp_cache)
-			{
-				pfree(query_context->temp_cache->query);
-				query_context->temp_cache->query = MemoryContextStrdup(session_context->memory_context, search_query);
-			}
+			pool_set_temp_query_cache_params(query_context->temp_cache,
+											 query_context->bind_params,
+											 query_context->bind_params_len);
 		}
 
 		/*
@@ -1102,7 +1091,9 @@ Execute(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 		 * rows in the portal has been already retrieved. If so,
 		 * pool_fetch_from_memory_cache will return "CommandComplete 0" cache.
 		 */
-		status = pool_fetch_from_memory_cache(frontend, backend, search_query,
+		status = pool_fetch_from_memory_cache(frontend, backend, query,
+											  query_context->bind_params,
+											  query_context->bind_params_len,
 											  query_context->atEnd, &foundp);
 
 		if (status != POOL_CONTINUE)
@@ -1128,7 +1119,12 @@ Execute(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 			}
 		}
 		else
+		{
 			query_context->skip_cache_commit = false;
+
+			/* Cache miss. The SELECT is executed now. */
+			pool_set_cache_generations(query_context);
+		}
 	}
 
 	/* show ps status */
@@ -1278,7 +1274,7 @@ Parse(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	char	   *stmt;
 	List	   *parse_tree_list;
 	Node	   *node = NULL;
-	POOL_SENT_MESSAGE *msg;
+	POOL_SENT_MESSAGE *msg = NULL;
 	POOL_STATUS status;
 	POOL_SESSION_CONTEXT *session_context;
 	POOL_QUERY_CONTEXT *query_context;
@@ -1342,6 +1338,9 @@ Parse(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 			}
 			parse_tree_list = get_dummy_write_query_tree();
 			query_context->is_parse_error = true;
+
+			/* We cannot tell whether this leaves session level state */
+			pool_set_session_state(POOL_SESSION_STATE_SET);
 		}
 	}
 	MemoryContextSwitchTo(old_context);
@@ -1651,6 +1650,14 @@ Parse(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	{
 		POOL_PENDING_MESSAGE *pmsg;
 
+		if (pool_config->multiplex_prepared_statements && *name != '\0' && msg)
+		{
+			if (multiplex_parse(frontend, backend, query_context, msg))
+				return POOL_CONTINUE;
+			len = msg->len;
+			contents = msg->contents;
+		}
+
 		/*
 		 * XXX fix me:even with streaming replication mode, couldn't we have a
 		 * deadlock
@@ -1683,6 +1690,7 @@ Bind(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	char	   *pstmt_name;
 	char	   *portal_name;
 	char	   *rewrite_msg = NULL;
+	char	   *pooled_msg = NULL;
 	POOL_SENT_MESSAGE *parse_msg;
 	POOL_SENT_MESSAGE *bind_msg;
 	POOL_SESSION_CONTEXT *session_context;
@@ -1730,6 +1738,16 @@ Bind(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 		return POOL_CONTINUE;
 	}
 
+	/* Bind the pooled statement the client's statement name stands for */
+	if (pool_is_pooled_statement(parse_msg))
+	{
+		pooled_msg = pool_pooled_statement_rewrite_message(parse_msg, contents,
+														   strlen(portal_name) + 1, &len);
+		contents = pooled_msg;
+		portal_name = contents;
+		pstmt_name = contents + strlen(portal_name) + 1;
+	}
+
 	bind_msg = pool_create_sent_message('B', len, contents,
 										parse_msg->num_tsparams, portal_name,
 										parse_msg->query_context);
@@ -1886,6 +1904,8 @@ Bind(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 
 	if (rewrite_msg)
 		pfree(rewrite_msg);
+	if (pooled_msg)
+		pfree(pooled_msg);
 	return POOL_CONTINUE;
 }
 
@@ -1896,6 +1916,7 @@ Describe(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	POOL_SENT_MESSAGE *msg;
 	POOL_SESSION_CONTEXT *session_context;
 	POOL_QUERY_CONTEXT *query_context;
+	char	   *pooled_msg = NULL;
 
 	bool		nowait;
 
@@ -1917,6 +1938,12 @@ Describe(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 					(return_code(2),
 					 errmsg("unable to execute Describe"),
 					 errdetail("unable to get the parse message")));
+
+		if (pool_is_pooled_statement(msg))
+		{
+			pooled_msg = pool_pooled_statement_rewrite_message(msg, contents, 1, &len);
+			contents = pooled_msg;
+		}
 	}
 	/* Portal */
 	else
@@ -1978,6 +2005,9 @@ Describe(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 		pool_unset_query_in_progress();
 	}
 
+	if (pooled_msg)
+		pfree(pooled_msg);
+
 	return POOL_CONTINUE;
 }
 
@@ -2066,6 +2096,19 @@ Close(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 	{
 		POOL_PENDING_MESSAGE *pmsg;
 		bool		where_to_send_save[MAX_NUM_BACKENDS];
+		char	   *send_contents = contents;
+		int			send_len = len;
+
+		/*
+		 * A pooled statement may be used by other sessions later, so keep it
+		 * on the backend. To get CloseComplete in order with other responses,
+		 * close a statement which never exists instead.
+		 */
+		if (*contents == 'S' && pool_is_pooled_statement(msg))
+		{
+			send_contents = "S" POOLED_STATEMENT_PREFIX "none";
+			send_len = strlen(send_contents) + 1;
+		}
 
 		/*
 		 * Parse_before_bind() may have sent a bind message to the primary
@@ -2083,8 +2126,8 @@ Close(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 			query_context->where_to_send[session_context->load_balance_node_id] = true;
 		}
 
-		pool_extended_send_and_wait(query_context, "C", len, contents, 1, MAIN_NODE_ID, true);
-		pool_extended_send_and_wait(query_context, "C", len, contents, -1, MAIN_NODE_ID, true);
+		pool_extended_send_and_wait(query_context, "C", send_len, send_contents, 1, MAIN_NODE_ID, true);
+		pool_extended_send_and_wait(query_context, "C", send_len, send_contents, -1, MAIN_NODE_ID, true);
 
 		/* Add pending message */
 		pmsg = pool_pending_message_create('C', len, contents);
@@ -2359,6 +2402,10 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 		}
 	}
 
+	/* Out of transaction.  DDL of the transaction is now visible or gone. */
+	if (state == 'I')
+		pool_relcache_transaction_end();
+
 	/*
 	 * Make sure that no message remains in the backend buffer.  If something
 	 * remains, it could be an "out of band" ERROR or FATAL error, or a NOTICE
@@ -2395,6 +2442,9 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 		pool_flush(frontend);
 	}
 
+	/* Feed the measured response time to AI load balancer */
+	pool_ai_query_done(pool_get_query_string(), pool_is_command_success() && !got_estate);
+
 	if (pool_is_query_in_progress())
 	{
 		node = pool_get_parse_tree();
@@ -2412,7 +2462,7 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 				/*
 				 * If we are doing extended query and the state is after
 				 * EXECUTE, then we can commit cache. We check latter
-				 * condition by looking at query_context->query_w_hex. This
+				 * condition by looking at query_context->query_state. This
 				 * check is necessary for certain frame work such as PHP PDO.
 				 * It sends Sync message right after PARSE and it produces
 				 * "Ready for query" message from backend.
@@ -2422,10 +2472,21 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 					if (session_context->query_context &&
 						session_context->query_context->query_state[MAIN_NODE_ID] == POOL_EXECUTE_COMPLETE)
 					{
-						pool_handle_query_cache(backend, session_context->query_context->query_w_hex, node, state, false);
-						if (session_context->query_context->query_w_hex)
-							pfree(session_context->query_context->query_w_hex);
-						session_context->query_context->query_w_hex = NULL;
+						POOL_QUERY_CONTEXT *query_context = session_context->query_context;
+
+						/*
+						 * bind_params is set only if the cache fetch
+						 * condition was checked at Execute.
+						 */
+						pool_handle_query_cache(backend,
+												query_context->bind_params ? query_context->original_query : NULL,
+												query_context->bind_params,
+												query_context->bind_params_len,
+												node, state, false);
+						if (query_context->bind_params)
+							pfree(query_context->bind_params);
+						query_context->bind_params = NULL;
+						query_context->bind_params_len = 0;
 					}
 				}
 				else
@@ -2435,7 +2496,7 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 						state = 'I';	/* XXX I don't think query cache works
 										 * with PROTO2 protocol */
 					}
-					pool_handle_query_cache(backend, query, node, state, false);
+					pool_handle_query_cache(backend, query, NULL, 0, node, state, false);
 				}
 			}
 		}
@@ -2463,6 +2524,13 @@ ReadyForQuery(POOL_CONNECTION *frontend,
 
 		pool_unset_query_in_progress();
 	}
+
+	/*
+	 * If the query failed or its result was not cached, processes waiting
+	 * for it must not wait any longer.
+	 */
+	pool_cache_inflight_end();
+
 	if (!pool_is_doing_extended_query_message())
 	{
 		if (!(node && IsA(node, PrepareStmt)))
@@ -3173,6 +3241,8 @@ ProcessBackendResponse(POOL_CONNECTION *frontend,
 					POOL_PENDING_MESSAGE *pmsg;
 
 					pmsg = pool_pending_message_get_previous_message();
+					if (pmsg)
+						pool_pooled_statement_complete(backend, pmsg);
 					if (pmsg && pmsg->not_forward_to_frontend)
 					{
 						/*
@@ -4034,6 +4104,76 @@ per_node_error_log(POOL_CONNECTION_POOL *backend, int node_id, char *query, char
 	return kind;
 }
 
+/*
+ * Rewrite a named Parse message so that it creates a pooled statement, which
+ * is shared by all sessions using the backend connections.  If the statement
+ * already exists on all the backend connections the message is to be sent
+ * to and no response is pending, reply ParseComplete to frontend without
+ * sending the message and return true.  Otherwise send Close of the pooled
+ * statement ahead of the Parse message, since the statement may exist
+ * without us knowing it, and return false.  The caller then sends the
+ * rewritten message in msg->contents.  Streaming or logical replication mode
+ * only.
+ */
+static bool
+multiplex_parse(POOL_CONNECTION *frontend,
+				POOL_CONNECTION_POOL *backend,
+				POOL_QUERY_CONTEXT *query_context,
+				POOL_SENT_MESSAGE *msg)
+{
+	POOL_PENDING_MESSAGE *pmsg;
+	char		message_body[POOLED_STATEMENT_NAME_LEN + 1];
+	int			message_len;
+	bool		exists = true;
+	int			i;
+
+	pool_pooled_statement_rewrite_parse(msg);
+
+	for (i = 0; i < NUM_BACKENDS; i++)
+	{
+		if (query_context->where_to_send[i] &&
+			!pool_pooled_statement_exists(CONNECTION_SLOT(backend, i), msg->contents))
+		{
+			exists = false;
+			break;
+		}
+	}
+
+	if (exists && !pool_pending_message_exists())
+	{
+		int			sendlen = htonl(4);
+
+		ereport(DEBUG1,
+				(errmsg("Parse: statement \"%s\" is prepared as \"%s\" already",
+						msg->name, msg->contents)));
+
+		pool_add_sent_message(msg);
+		pool_set_command_success();
+		pool_unset_query_in_progress();
+
+		pool_write(frontend, "1", 1);
+		pool_write_and_flush(frontend, &sendlen, sizeof(sendlen));
+
+		return true;
+	}
+
+	message_body[0] = 'S';
+	StrNCpy(message_body + 1, msg->contents, sizeof(message_body) - 1);
+	message_len = 1 + strlen(message_body + 1) + 1;
+
+	pool_set_query_in_progress();
+	pool_extended_send_and_wait(query_context, "C", message_len, message_body, 1, MAIN_NODE_ID, true);
+	pool_extended_send_and_wait(query_context, "C", message_len, message_body, -1, MAIN_NODE_ID, true);
+
+	/* Add pending message */
+	pmsg = pool_pending_message_create('C', message_len, message_body);
+	pmsg->not_forward_to_frontend = true;
+	pool_pending_message_dest_set(pmsg, query_context);
+	pool_pending_message_add(pmsg);
+
+	return false;
+}
+
 /*
  * Send parse message to primary/main node and wait for reply if particular
  * message is not yet parsed on the primary/main node but parsed on other
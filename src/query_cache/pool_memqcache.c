@@ -26,11 +26,21 @@
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #ifdef USE_MEMCACHED
 #include <libmemcached/memcached.h>
 #endif
 
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
 #include "auth/md5.h"
 #include "pool_config.h"
 #include "protocol/pool_proto_modules.h"
@@ -47,16 +57,25 @@
 #include "utils/palloc.h"
 #include "utils/memutils.h"
 #include "utils/pool_ipc.h"
+#include "utils/pool_atomics.h"
+#include "utils/pool_hash.h"
 
 #ifdef USE_MEMCACHED
 memcached_st *memc;
 #endif
 
-static char *encode_key(const char *s, char *buf, POOL_CONNECTION_POOL *backend);
+#ifdef USE_MEMCACHED
+static char *encode_key(const char *s, const char *params, int params_len, char *buf,
+						POOL_CONNECTION_POOL *backend);
+#endif
+static void encode_query_hash(const char *s, const char *params, int params_len,
+							  POOL_QUERY_HASH *query_hash, POOL_CONNECTION_POOL *backend);
 #ifdef DEBUG
 static void dump_cache_data(const char *data, size_t len);
 #endif
-static int	pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t datalen, int num_oids, int *oids);
+static int	pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *params, int params_len,
+							  char *data, size_t datalen, int num_oids, int *oids,
+							  POOL_CACHE_ITEM_GENERATION *gens, int num_gens);
 static int	send_cached_messages(POOL_CONNECTION *frontend, const char *qcache, int qcachelen);
 static void send_message(POOL_CONNECTION *conn, char kind, int len, const char *data);
 #ifdef USE_MEMCACHED
@@ -68,13 +87,31 @@ static void pool_discard_dml_table_oid(void);
 static void pool_invalidate_query_cache(int num_table_oids, int *table_oid, bool unlink, int dboid);
 static int	pool_get_database_oid(void);
 static void pool_add_table_oid_map(POOL_CACHEKEY *cachkey, int num_table_oids, int *table_oids);
+static void oid_map_reset(void);
+static uint32 oid_map_next_stamp(void);
+static int *oid_map_find(int dboid, int tableoid);
+static bool oid_map_entry_is_live(POOL_OID_MAP_ENTRY *entry);
+static bool oid_map_add(int dboid, int tableoid, POOL_CACHEID *cacheid, uint32 stamp);
+static void oid_map_invalidate(int dboid, int tableoid);
+static void oid_map_free_table(int *link);
+static void oid_map_compact_table(POOL_OID_MAP_TABLE *table);
+static bool oid_map_sweep(void);
+static uint32 table_generation_slot(int dboid, int tableoid);
+static int	pool_get_table_generations(int num_table_oids, int *table_oids, POOL_CACHE_ITEM_GENERATION **gensp);
+static void pool_bump_table_generation(int dboid, int tableoid);
+static bool pool_cache_item_is_stale(POOL_CACHE_ITEM_HEADER *cih);
 static void pool_reset_memqcache_buffer(bool reset_dml_oids);
-static POOL_CACHEID *pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, time_t expire);
+static POOL_CACHEID *pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, int raw_size,
+												time_t expire, POOL_CACHE_ITEM_GENERATION *gens, int num_gens);
 static POOL_CACHEID *pool_find_item_on_shmem_cache(POOL_QUERY_HASH *query_hash);
-static char *pool_get_item_shmem_cache(POOL_QUERY_HASH *query_hash, int *size, int *sts);
+static int	pool_fetch_item_optimistic(POOL_QUERY_HASH *query_hash, char **buf, size_t *len);
+static char *pool_get_item_shmem_cache(POOL_QUERY_HASH *query_hash, int *size, int *raw_size, int *sts);
+static char *pool_compress_cache_data(const char *data, size_t size, int headroom, int *compressed_size);
+static bool pool_copy_cache_data(const char *src, int size, int raw_size, char **buf, size_t *len);
 static POOL_QUERY_CACHE_ARRAY *pool_add_query_cache_array(POOL_QUERY_CACHE_ARRAY *cache_array, POOL_TEMP_QUERY_CACHE *cache);
 static void pool_add_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache, char kind, char *data, int data_len);
 static void pool_add_oids_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache, int num_oids, int *oids);
+static void pool_add_generations_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache, int num_gens, POOL_CACHE_ITEM_GENERATION *gens);
 static POOL_INTERNAL_BUFFER *pool_create_buffer(void);
 static void pool_discard_buffer(POOL_INTERNAL_BUFFER *buffer);
 static void pool_add_buffer(POOL_INTERNAL_BUFFER *buffer, void *data, size_t len);
@@ -93,6 +130,7 @@ static void pool_reset_fsmm(size_t size);
 static void *pool_fsmm_address(void);
 static void pool_update_fsmm(POOL_CACHE_BLOCKID blockid, size_t free_space);
 static POOL_CACHE_BLOCKID pool_get_block(size_t free_space);
+static POOL_CACHE_BLOCKID pool_find_free_block(size_t free_space);
 static POOL_CACHE_ITEM_HEADER *pool_cache_item_header(POOL_CACHEID *cacheid);
 static int	pool_init_cache_block(POOL_CACHE_BLOCKID blockid);
 #if NOT_USED
@@ -103,11 +141,29 @@ static char *block_address(int blockid);
 static POOL_CACHE_ITEM_POINTER *item_pointer(char *block, int i);
 static POOL_CACHE_ITEM_HEADER *item_header(char *block, int i);
 static POOL_CACHE_BLOCKID pool_reuse_block(void);
+static void pool_cache_sketch_increment(POOL_QUERY_HASH *query_hash);
+static uint32 pool_cache_sketch_estimate(POOL_QUERY_HASH *query_hash);
+static void pool_cache_record_hit(volatile POOL_HASH_ELEMENT *element, POOL_CACHE_BLOCKID blockid);
+static POOL_CACHE_BLOCKID pool_cache_victim_block(bool advance);
+static bool pool_cache_admit(POOL_QUERY_HASH *query_hash, size_t size);
+static void pool_stats_count_up_admission_rejects(void);
+static void pool_stats_count_up_evicted_blocks(void);
+static bool pool_fetch_shmem_item(POOL_QUERY_HASH *query_hash, char **buf, size_t *len);
+static bool pool_cache_inflight_wait(POOL_QUERY_HASH *query_hash);
+static void pool_stats_count_up_coalesced_misses(void);
 #ifdef SHMEMCACHE_DEBUG
 static void dump_shmem_cache(POOL_CACHE_BLOCKID blockid);
 #endif
 
+static bool pool_cache_item_is_expired(POOL_CACHEID *cacheid);
+static POOL_CACHEID *pool_hash_search_for_update(POOL_QUERY_HASH *query_hash);
+
 static int	pool_hash_reset(int nelements);
+static void pool_hash_lock(uint32 hash_key, POOL_MEMQ_LOCK_TYPE type);
+static void pool_hash_unlock(void);
+static void pool_hash_lock_all(void);
+static void memq_reset_cache(void);
+static void pool_hash_unlock_all(void);
 static int	pool_hash_insert(POOL_QUERY_HASH *key, POOL_CACHEID *cacheid, bool update);
 static uint32 create_hash_key(POOL_QUERY_HASH *key);
 static volatile POOL_HASH_ELEMENT *get_new_hash_element(void);
@@ -119,11 +175,87 @@ static int	delete_all_cache_on_memcached(void);
 #endif
 static char *create_fake_cache(size_t *len);
 
+/*
+ * Shared memory needed to register an item of "size" bytes.
+ */
+#define POOL_CACHE_ITEM_REQUEST_SIZE(size, num_gens) \
+	((size) + sizeof(POOL_CACHE_ITEM_POINTER) + sizeof(POOL_CACHE_ITEM_HEADER) + \
+	 (num_gens) * sizeof(POOL_CACHE_ITEM_GENERATION))
+
+/*
+ * memcached item flag telling that the value is LZ4 compressed.  The value
+ * starts with the uncompressed length in network byte order.
+ */
+#define POOL_MEMCACHED_FLAG_LZ4	0x01
+
+/*
+ * Number of lock-free lookup attempts on a cache hit before falling back to
+ * the stripe lock.
+ */
+#define POOL_MEMQ_OPTIMISTIC_READ_RETRIES	3
+
 /*
  * if true, shared memory is locked in this process now.
  */
 static int	is_shmem_locked;
 
+/*
+ * Table oid map on shared memory, used by the shmem cache.
+ */
+#define OID_MAP_NIL		(-1)
+#define OID_MAP_MIN_CHUNKS	1024
+
+static POOL_OID_MAP_HEADER *oid_map;
+static POOL_OID_MAP_TABLE *oid_map_tables;
+static POOL_OID_MAP_CHUNK *oid_map_chunks;
+
+/*
+ * Per table generation counters, used when memqcache_lazy_invalidation is
+ * on.
+ */
+static pool_atomic_uint32 *table_generations;
+
+/*
+ * Admission and eviction policy state, used when
+ * memqcache_admission_control is on.  See pool_cache_admit().
+ */
+#define POOL_CACHE_SKETCH_DEPTH	4
+#define POOL_CACHE_SKETCH_MIN_WIDTH	1024
+#define POOL_CACHE_SKETCH_MAX_WIDTH	(1 << 24)
+
+typedef struct
+{
+	uint32		width;			/* number of counters per row (power of 2) */
+	uint32		sample_size;	/* halve counters after this many increments */
+	pool_atomic_uint32 additions;	/* increments since last halving */
+} POOL_CACHE_POLICY;
+
+static POOL_CACHE_POLICY *cache_policy;
+static pool_atomic_uint32 *block_hits;
+static pool_atomic_uint32 *sketch;
+
+/*
+ * In flight query table, used to coalesce concurrent misses of the same
+ * query.  See pool_cache_inflight_wait().
+ */
+#define POOL_CACHE_INFLIGHT_MIN_SLOTS	64
+
+typedef struct
+{
+	pool_atomic_uint64 key;		/* query hash of the query being executed,
+								 * or 0 if free */
+	pool_atomic_uint64 started; /* when the query started, in microseconds */
+	pool_atomic_uint32 seq;		/* incremented at release, futex word */
+	uint32		padding;
+} POOL_CACHE_INFLIGHT;
+
+static POOL_CACHE_INFLIGHT *cache_inflight;
+static uint32 cache_inflight_mask;
+
+/* In flight slot this process is executing the query for, or -1 */
+static int	my_inflight_slot = -1;
+static uint64 my_inflight_key;
+
 /*
  * Connect to Memcached
  */
@@ -217,7 +349,12 @@ memqcache_register(char kind,
 			query_context = session_context->query_context;
 
 			if (query)
+			{
 				query_context->temp_cache = pool_create_temp_query_cache(query);
+				pool_set_temp_query_cache_params(query_context->temp_cache,
+												 query_context->bind_params,
+												 query_context->bind_params_len);
+			}
 		}
 	}
 
@@ -225,16 +362,21 @@ memqcache_register(char kind,
 }
 
 /*
- * Commit SELECT results to cache storage.
+ * Commit SELECT results to cache storage.  If the query was executed by the
+ * extended query protocol, params and params_len are the parameters of its
+ * Bind message.  Otherwise params is NULL.  gens and num_gens are the table
+ * generations taken when the query was sent, used with
+ * memqcache_lazy_invalidation.
  */
 static int
-pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t datalen, int num_oids, int *oids)
+pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *params, int params_len,
+				  char *data, size_t datalen, int num_oids, int *oids,
+				  POOL_CACHE_ITEM_GENERATION *gens, int num_gens)
 {
 #ifdef USE_MEMCACHED
 	memcached_return rc;
 #endif
 	POOL_CACHEKEY cachekey;
-	char		tmpkey[MAX_KEY];
 	time_t		memqcache_expire;
 
 	/*
@@ -246,7 +388,7 @@ pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t
 	}
 
 	/* query disabled */
-	if (strlen(query) <= 0)
+	if (query == NULL || strlen(query) <= 0)
 	{
 		return -1;
 	}
@@ -258,14 +400,6 @@ pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t
 #endif
 
 
-	/* encode md5key for memcached */
-	encode_key(query, tmpkey, backend);
-	ereport(DEBUG2,
-			(errmsg("committing SELECT results to cache storage"),
-			 errdetail("search key : \"%s\"", tmpkey)));
-
-	memcpy(cachekey.hashkey, tmpkey, 32);
-
 	memqcache_expire = pool_config->memqcache_expire;
 	ereport(DEBUG1,
 			(errmsg("committing SELECT results to cache storage"),
@@ -275,10 +409,12 @@ pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t
 	{
 		POOL_CACHEID *cacheid;
 		POOL_QUERY_HASH query_hash;
+		char	   *cdata;
+		int			csize;
 
-		memcpy(query_hash.query_hash, tmpkey, sizeof(query_hash.query_hash));
+		encode_query_hash(query, params, params_len, &query_hash, backend);
 
-		cacheid = pool_hash_search(&query_hash);
+		cacheid = pool_hash_search_for_update(&query_hash);
 
 		if (cacheid != NULL)
 		{
@@ -290,7 +426,43 @@ pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t
 		}
 		else
 		{
-			cacheid = pool_add_item_shmem_cache(&query_hash, data, datalen, memqcache_expire);
+			if (pool_config->memqcache_lazy_invalidation)
+			{
+				/*
+				 * Without the generations as of sending the query, a DML
+				 * committed meanwhile could not be noticed.
+				 */
+				if (num_gens <= 0)
+				{
+					ereport(DEBUG1,
+							(errmsg("committing SELECT results to cache storage"),
+							 errdetail("table generations were not taken")));
+					return 0;
+				}
+			}
+			else
+				num_gens = 0;
+
+			cdata = pool_compress_cache_data(data, datalen, 0, &csize);
+
+			if (!pool_cache_admit(&query_hash,
+								  POOL_CACHE_ITEM_REQUEST_SIZE(cdata ? csize : datalen, num_gens)))
+			{
+				if (cdata)
+					pfree(cdata);
+				pool_stats_count_up_admission_rejects();
+				return 0;
+			}
+
+			if (cdata)
+			{
+				cacheid = pool_add_item_shmem_cache(&query_hash, cdata, csize, datalen,
+													memqcache_expire, gens, num_gens);
+				pfree(cdata);
+			}
+			else
+				cacheid = pool_add_item_shmem_cache(&query_hash, data, datalen, 0,
+													memqcache_expire, gens, num_gens);
 			if (cacheid == NULL)
 			{
 				ereport(LOG,
@@ -306,14 +478,45 @@ pool_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data, size_t
 			}
 			cachekey.cacheid.blockid = cacheid->blockid;
 			cachekey.cacheid.itemid = cacheid->itemid;
+
+			/* Let processes waiting for this result look it up */
+			pool_cache_inflight_end();
+
+			/* The table generations stand in for the oid map */
+			if (pool_config->memqcache_lazy_invalidation)
+				return 0;
 		}
 	}
 
 #ifdef USE_MEMCACHED
 	else
 	{
-		rc = memcached_set(memc, tmpkey, 32,
-						   data, datalen, (time_t) memqcache_expire, 0);
+		char		tmpkey[MAX_KEY];
+		char	   *cdata;
+		int			csize;
+
+		/* encode md5key for memcached */
+		encode_key(query, params, params_len, tmpkey, backend);
+		ereport(DEBUG2,
+				(errmsg("committing SELECT results to cache storage"),
+				 errdetail("search key : \"%s\"", tmpkey)));
+
+		memcpy(cachekey.hashkey, tmpkey, 32);
+
+		cdata = pool_compress_cache_data(data, datalen, sizeof(uint32), &csize);
+		if (cdata)
+		{
+			uint32		raw_size = htonl((uint32) datalen);
+
+			memcpy(cdata, &raw_size, sizeof(uint32));
+			rc = memcached_set(memc, tmpkey, 32,
+							   cdata, sizeof(uint32) + csize, (time_t) memqcache_expire,
+							   POOL_MEMCACHED_FLAG_LZ4);
+			pfree(cdata);
+		}
+		else
+			rc = memcached_set(memc, tmpkey, 32,
+							   data, datalen, (time_t) memqcache_expire, 0);
 		if (rc != MEMCACHED_SUCCESS)
 		{
 			ereport(WARNING,
@@ -343,8 +546,6 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
 #ifdef USE_MEMCACHED
 	memcached_return rc;
 #endif
-	POOL_CACHEKEY cachekey;
-	char		tmpkey[MAX_KEY];
 	time_t		memqcache_expire;
 
 	/*
@@ -368,14 +569,6 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
 	dump_cache_data(data, datalen);
 #endif
 
-	/* encode md5key for memcached */
-	encode_key(query, tmpkey, backend);
-	ereport(DEBUG2,
-			(errmsg("committing relation cache to cache storage"),
-			 errdetail("search key : \"%s\"", tmpkey)));
-
-	memcpy(cachekey.hashkey, tmpkey, 32);
-
 	memqcache_expire = pool_config->relcache_expire;
 	ereport(DEBUG1,
 			(errmsg("committing relation cache to cache storage"),
@@ -386,9 +579,9 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
 		POOL_CACHEID *cacheid;
 		POOL_QUERY_HASH query_hash;
 
-		memcpy(query_hash.query_hash, tmpkey, sizeof(query_hash.query_hash));
+		encode_query_hash(query, NULL, 0, &query_hash, backend);
 
-		cacheid = pool_hash_search(&query_hash);
+		cacheid = pool_hash_search_for_update(&query_hash);
 
 		if (cacheid != NULL)
 		{
@@ -400,7 +593,8 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
 		}
 		else
 		{
-			cacheid = pool_add_item_shmem_cache(&query_hash, data, datalen, memqcache_expire);
+			cacheid = pool_add_item_shmem_cache(&query_hash, data, datalen, 0,
+												memqcache_expire, NULL, 0);
 			if (cacheid == NULL)
 			{
 				ereport(LOG,
@@ -414,14 +608,23 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
 						 errdetail("blockid: %d itemid: %d",
 								   cacheid->blockid, cacheid->itemid)));
 			}
-			cachekey.cacheid.blockid = cacheid->blockid;
-			cachekey.cacheid.itemid = cacheid->itemid;
+
+			/* Let processes waiting for this result look it up */
+			pool_cache_inflight_end();
 		}
 	}
 
 #ifdef USE_MEMCACHED
 	else
 	{
+		char		tmpkey[MAX_KEY];
+
+		/* encode md5key for memcached */
+		encode_key(query, NULL, 0, tmpkey, backend);
+		ereport(DEBUG2,
+				(errmsg("committing relation cache to cache storage"),
+				 errdetail("search key : \"%s\"", tmpkey)));
+
 		rc = memcached_set(memc, tmpkey, 32,
 						   data, datalen, (time_t) memqcache_expire, 0);
 		if (rc != MEMCACHED_SUCCESS)
@@ -446,33 +649,33 @@ pool_catalog_commit_cache(POOL_CONNECTION_POOL *backend, char *query, char *data
  * 1: not found
  */
 int
-pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, size_t *len)
+pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, const char *params, int params_len,
+				 char **buf, size_t *len)
 {
-	char	   *ptr;
-	char		tmpkey[MAX_KEY];
-	int			sts;
 	char	   *p;
 
 	if (strlen(query) <= 0)
 		ereport(ERROR,
 				(errmsg("fetching from cache storage, no query")));
 
-	/* encode md5key for memcached */
-	encode_key(query, tmpkey, backend);
-	ereport(DEBUG1,
-			(errmsg("fetching from cache storage"),
-			 errdetail("search key \"%s\"", tmpkey)));
-
-
 	if (pool_is_shmem_cache())
 	{
 		POOL_QUERY_HASH query_hash;
-		int			mylen;
+		bool		found;
+
+		encode_query_hash(query, params, params_len, &query_hash, backend);
+		pool_cache_sketch_increment(&query_hash);
 
-		memcpy(query_hash.query_hash, tmpkey, sizeof(query_hash.query_hash));
+		found = pool_fetch_shmem_item(&query_hash, &p, len);
 
-		ptr = pool_get_item_shmem_cache(&query_hash, &mylen, &sts);
-		if (ptr == NULL)
+		/*
+		 * If another process is already executing the same query, wait for
+		 * its result rather than executing the query again.
+		 */
+		if (!found && pool_cache_inflight_wait(&query_hash))
+			found = pool_fetch_shmem_item(&query_hash, &p, len);
+
+		if (!found)
 		{
 			ereport(DEBUG1,
 					(errmsg("fetching from cache storage"),
@@ -480,13 +683,20 @@ pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, s
 
 			return 1;
 		}
-		*len = mylen;
 	}
 #ifdef USE_MEMCACHED
 	else
 	{
+		char	   *ptr;
 		memcached_return rc;
 		unsigned int flags;
+		char		tmpkey[MAX_KEY];
+
+		/* encode md5key for memcached */
+		encode_key(query, params, params_len, tmpkey, backend);
+		ereport(DEBUG1,
+				(errmsg("fetching from cache storage"),
+				 errdetail("search key \"%s\"", tmpkey)));
 
 		ptr = memcached_get(memc, tmpkey, strlen(tmpkey), len, &flags, &rc);
 
@@ -513,6 +723,28 @@ pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, s
 				return 1;
 			}
 		}
+
+		if (flags & POOL_MEMCACHED_FLAG_LZ4)
+		{
+			uint32		raw_size = 0;
+
+			if (*len >= sizeof(uint32))
+				memcpy(&raw_size, ptr, sizeof(uint32));
+			if (raw_size == 0 ||
+				!pool_copy_cache_data(ptr + sizeof(uint32), *len - sizeof(uint32), ntohl(raw_size), &p, len))
+			{
+				ereport(LOG,
+						(errmsg("fetching from cache storage, could not decompress cache item for key: \"%s\"", tmpkey)));
+				free(ptr);
+				return 1;
+			}
+		}
+		else
+		{
+			p = palloc(*len);
+			memcpy(p, ptr, *len);
+		}
+		free(ptr);
 	}
 #else
 	else
@@ -522,17 +754,6 @@ pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, s
 	}
 #endif
 
-	p = palloc(*len);
-
-	memcpy(p, ptr, *len);
-
-#ifdef USE_MEMCACHED
-	if (!pool_is_shmem_cache())
-	{
-		free(ptr);
-	}
-#endif
-
 	ereport(DEBUG1,
 			(errmsg("fetching from cache storage"),
 			 errdetail("query=\"%s\" len:%zd", query, *len)));
@@ -545,18 +766,73 @@ pool_fetch_cache(POOL_CONNECTION_POOL *backend, const char *query, char **buf, s
 	return 0;
 }
 
+/*
+ * Look up the shmem cache and copy out the item into a palloc'd buffer.
+ */
+static bool
+pool_fetch_shmem_item(POOL_QUERY_HASH *query_hash, char **buf, size_t *len)
+{
+	char	   *ptr;
+	int			mylen;
+	int			raw_size;
+	int			sts;
+	int			found = -1;
+	int			i;
+
+	/*
+	 * Try lock-free lookups first.  If they keep racing with writers on the
+	 * same stripe, fall back to the stripe lock.
+	 */
+	for (i = 0; i < POOL_MEMQ_OPTIMISTIC_READ_RETRIES && found < 0; i++)
+		found = pool_fetch_item_optimistic(query_hash, buf, len);
+
+	if (found >= 0)
+		return found;
+
+	/*
+	 * Only the stripe lock covering the hash bucket is needed to look up and
+	 * copy out the item.  See comments on pool_shmem_lock().
+	 */
+	pool_hash_lock(create_hash_key(query_hash), POOL_MEMQ_SHARED_LOCK);
+
+	PG_TRY();
+	{
+		ptr = pool_get_item_shmem_cache(query_hash, &mylen, &raw_size, &sts);
+		if (ptr != NULL && !pool_copy_cache_data(ptr, mylen, raw_size, buf, len))
+			ptr = NULL;
+	}
+	PG_CATCH();
+	{
+		pool_hash_unlock();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pool_hash_unlock();
+
+	return ptr != NULL;
+}
+
+#ifdef USE_MEMCACHED
 /*
  * encode key.
  * create cache key as md5(username + query string + database name)
+ * This is used for memcached, whose keys must be printable and are shared
+ * with other pgbalancer instances.  Bind parameters, if any, are appended
+ * to the query string in hex.
  */
 static char *
-encode_key(const char *s, char *buf, POOL_CONNECTION_POOL *backend)
+encode_key(const char *s, const char *params, int params_len, char *buf,
+		   POOL_CONNECTION_POOL *backend)
 {
+	static const char hextbl[] = "0123456789ABCDEF";
 	char	   *strkey;
+	char	   *p;
 	int			u_length;
 	int			d_length;
 	int			q_length;
 	int			length;
+	int			i;
 
 	u_length = strlen(backend->info->user);
 	ereport(DEBUG1,
@@ -571,10 +847,28 @@ encode_key(const char *s, char *buf, POOL_CONNECTION_POOL *backend)
 			 errdetail("query: \"%s\"", s)));
 
 	length = u_length + d_length + q_length + 1;
+	if (params)
+		length += params_len * 2 + 1;
 
 	strkey = (char *) palloc(sizeof(char) * length);
 
-	snprintf(strkey, length, "%s%s%s", backend->info->user, s, backend->info->database);
+	p = strkey;
+	memcpy(p, backend->info->user, u_length);
+	p += u_length;
+	memcpy(p, s, q_length);
+	p += q_length;
+	if (params)
+	{
+		*p++ = ' ';
+		for (i = 0; i < params_len; i++)
+		{
+			*p++ = hextbl[(params[i] >> 4) & 0x0f];
+			*p++ = hextbl[params[i] & 0x0f];
+		}
+	}
+	memcpy(p, backend->info->database, d_length);
+	p += d_length;
+	*p = '\0';
 
 	pool_md5_hash(strkey, strlen(strkey), buf);
 	ereport(DEBUG1,
@@ -583,6 +877,7 @@ encode_key(const char *s, char *buf, POOL_CONNECTION_POOL *backend)
 	pfree(strkey);
 	return buf;
 }
+#endif
 
 #ifdef DEBUG
 /*
@@ -673,21 +968,24 @@ send_cached_messages(POOL_CONNECTION *frontend, const char *qcache, int qcachele
 }
 
 /*
- * send message to frontend
+ * send message to frontend.  Large data is not copied, so it must be kept
+ * until the frontend is flushed.
  */
 static void
 send_message(POOL_CONNECTION *conn, char kind, int len, const char *data)
 {
+	char		header[5];
+	int32		sendlen;
+
 	ereport(DEBUG2,
 			(errmsg("memcache: sending messages: kind '%c', len=%d, data=%p", kind, len, data)));
 
-	pool_write(conn, &kind, 1);
-
-	len = htonl(len);
-	pool_write(conn, &len, sizeof(len));
+	header[0] = kind;
+	sendlen = htonl(len);
+	memcpy(header + 1, &sendlen, sizeof(sendlen));
+	pool_write(conn, header, sizeof(header));
 
-	len = ntohl(len);
-	pool_write(conn, (void *) data, len - sizeof(len));
+	pool_write_ref(conn, (void *) data, len - sizeof(sendlen));
 }
 
 #ifdef USE_MEMCACHED
@@ -727,7 +1025,8 @@ delete_cache_on_memcached(const char *key)
 POOL_STATUS
 pool_fetch_from_memory_cache(POOL_CONNECTION *frontend,
 							 POOL_CONNECTION_POOL *backend,
-							 char *contents, bool use_fake_cache, bool *foundp)
+							 char *contents, char *params, int params_len,
+							 bool use_fake_cache, bool *foundp)
 {
 	char	   *qcache;
 	size_t		qcachelen;
@@ -740,21 +1039,18 @@ pool_fetch_from_memory_cache(POOL_CONNECTION *frontend,
 	*foundp = false;
 
 	POOL_SETMASK2(&BlockSig, &oldmask);
-	pool_shmem_lock(POOL_MEMQ_SHARED_LOCK);
 
 	PG_TRY();
 	{
-		sts = pool_fetch_cache(backend, contents, &qcache, &qcachelen);
+		sts = pool_fetch_cache(backend, contents, params, params_len, &qcache, &qcachelen);
 	}
 	PG_CATCH();
 	{
-		pool_shmem_unlock();
 		POOL_SETMASK(&oldmask);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
 
-	pool_shmem_unlock();
 	POOL_SETMASK(&oldmask);
 
 	if (sts != 0)
@@ -796,8 +1092,6 @@ pool_fetch_from_memory_cache(POOL_CONNECTION *frontend,
 		send_cached_messages(frontend, qcache, qcachelen);
 	}
 
-	pfree(qcache);
-
 	/*
 	 * Send a "READY FOR QUERY" if not in extended query.
 	 */
@@ -820,6 +1114,9 @@ pool_fetch_from_memory_cache(POOL_CONNECTION *frontend,
 		}
 	}
 
+	/* cached messages sent above are referenced until flushed */
+	pfree(qcache);
+
 	*foundp = true;
 
 	if (pool_config->log_per_node_statement)
@@ -955,7 +1252,9 @@ pool_is_allow_to_cache(Node *node, char *query)
 {
 	int			i = 0;
 	int			num_oids = -1;
+	int			requested;
 	SelectContext ctx;
+	QueryRoutingFacts facts;
 
 	/*
 	 * If FORCE QUERY CACHE comment exists, cache it unconditionally.
@@ -995,28 +1294,6 @@ pool_is_allow_to_cache(Node *node, char *query)
 		}
 	}
 
-	/* SELECT INTO or SELECT FOR SHARE or UPDATE cannot be cached */
-	if (pool_has_insertinto_or_locking_clause(node))
-		return false;
-
-	/*
-	 * If SELECT uses non immutable functions, it's not allowed to cache.
-	 */
-	if (pool_has_non_immutable_function_call(node))
-		return false;
-
-	/*
-	 * If SELECT uses temporary tables it's not allowed to cache.
-	 */
-	if (pool_config->check_temp_table && pool_has_temp_table(node))
-		return false;
-
-	/*
-	 * If SELECT uses system catalogs, it's not allowed to cache.
-	 */
-	if (pool_has_system_catalog(node))
-		return false;
-
 	/*
 	 * TABLESAMPLE is not allowed to cache.
 	 */
@@ -1033,9 +1310,21 @@ pool_is_allow_to_cache(Node *node, char *query)
 	}
 
 	/*
-	 * If SELECT uses row security enabled tables, it's not allowed to cache.
+	 * SELECT INTO or SELECT FOR SHARE or UPDATE, non immutable functions,
+	 * temporary tables, system catalogs and row security enabled tables are
+	 * not allowed to cache.  Unless cache_safe_memqcache_table_list is set,
+	 * views and unlogged tables are not allowed either.  Check them all in
+	 * one pass over the parse tree.
 	 */
-	if (pool_has_row_security(node))
+	requested = ROUTING_FACT_INTO_OR_LOCKING | ROUTING_FACT_NON_IMMUTABLE_FUNCTION |
+		ROUTING_FACT_SYSTEM_CATALOG | ROUTING_FACT_ROW_SECURITY;
+	if (pool_config->check_temp_table)
+		requested |= ROUTING_FACT_TEMP_TABLE;
+	if (pool_config->num_cache_safe_memqcache_table_list == 0)
+		requested |= ROUTING_FACT_VIEW | ROUTING_FACT_UNLOGGED_TABLE;
+
+	pool_get_query_routing_facts(node, requested, &facts);
+	if (facts.found)
 		return false;
 
 	/*
@@ -1067,20 +1356,6 @@ pool_is_allow_to_cache(Node *node, char *query)
 			}
 		}
 	}
-	else
-	{
-		/*
-		 * If SELECT uses views, it's not allowed to cache.
-		 */
-		if (pool_has_view(node))
-			return false;
-
-		/*
-		 * If SELECT uses unlogged tables, it's not allowed to cache.
-		 */
-		if (pool_has_unlogged_table(node))
-			return false;
-	}
 
 	/*
 	 * If Data-modifying statements in WITH clause, it's not allowed to cache.
@@ -1463,20 +1738,49 @@ pool_get_dml_table_oid(int **oid)
 }
 
 /*
- * Extract table oids contained in memqcache_oiddir by database oid.
+ * Extract table oids recorded in the oid map by database oid.  Caller must
+ * hold exclusive shmem lock in the shmem cache case.
  */
 static int
 pool_get_dropdb_table_oids(int **oids, int dboid)
 {
-	int		   *rtn = 0;
-	int			oids_size = 0;
-	int		   *tmp;
-
+	int		   *rtn;
+	int			oids_size = POOL_OIDBUF_SIZE;
 	int			num_oids = 0;
 	DIR		   *dir;
 	struct dirent *dp;
 	char	   *path;
 
+	rtn = palloc(sizeof(int) * oids_size);
+
+	if (pool_is_shmem_cache())
+	{
+		int			i;
+		int			t;
+
+		for (i = 0; i < oid_map->nbuckets; i++)
+		{
+			for (t = oid_map->buckets[i]; t != OID_MAP_NIL; t = oid_map_tables[t].next)
+			{
+				if (oid_map_tables[t].dboid != dboid)
+					continue;
+
+				if (num_oids >= oids_size)
+				{
+					oids_size += POOL_OIDBUF_SIZE;
+					rtn = repalloc(rtn, sizeof(int) * oids_size);
+				}
+				rtn[num_oids++] = oid_map_tables[t].tableoid;
+			}
+		}
+
+		if (!oid_map->overflowed)
+		{
+			*oids = rtn;
+			return num_oids;
+		}
+	}
+
 	path = psprintf("%s/%d", pool_config->memqcache_oiddir, dboid);
 	if ((dir = opendir(path)) == NULL)
 	{
@@ -1484,7 +1788,8 @@ pool_get_dropdb_table_oids(int **oids, int dboid)
 				(errmsg("memcache: getting drop table oids"),
 				 errdetail("Failed to open dir: %s", path)));
 		pfree(path);
-		return 0;
+		*oids = rtn;
+		return num_oids;
 	}
 
 	while ((dp = readdir(dir)) != NULL)
@@ -1495,14 +1800,7 @@ pool_get_dropdb_table_oids(int **oids, int dboid)
 		if (num_oids >= oids_size)
 		{
 			oids_size += POOL_OIDBUF_SIZE;
-			tmp = repalloc(rtn, sizeof(int) * oids_size);
-			if (tmp == NULL)
-			{
-				closedir(dir);
-				pfree(path);
-				return 0;
-			}
-			rtn = tmp;
+			rtn = repalloc(rtn, sizeof(int) * oids_size);
 		}
 
 		rtn[num_oids] = atol(dp->d_name);
@@ -1542,6 +1840,9 @@ pool_discard_dml_table_oid(void)
  * deleted (cache invalidation) (when DROP TABLE, ALTER TABLE is
  * executed, the caches must be deleted as well). When database is
  * dropped, all caches belonging to the database must be deleted.
+ *
+ * With the shmem cache, the same map is kept in shared memory instead (see
+ * oid_map_add()), and the files are only used when it gets full.
  */
 
 /*
@@ -1634,6 +1935,59 @@ pool_add_table_oid_map(POOL_CACHEKEY *cachekey, int num_table_oids, int *table_o
 	int			i;
 	int			len;
 
+	if (num_table_oids <= 0)
+		return;
+
+	dboid = pool_get_database_oid();
+	ereport(DEBUG1,
+			(errmsg("memcache: adding table oid maps"),
+			 errdetail("dboid %d", dboid)));
+
+	if (dboid <= 0)
+	{
+		ereport(WARNING,
+				(errmsg("memcache: adding table oid maps, failed to get database OID")));
+		return;
+	}
+
+	i = 0;
+	if (pool_is_shmem_cache())
+	{
+		POOL_CACHE_ITEM_HEADER *cih;
+
+		cih = pool_cache_item_header(&cachekey->cacheid);
+		if (cih == NULL)
+			return;
+
+		for (; i < num_table_oids; i++)
+		{
+			if (!oid_map_add(dboid, table_oids[i], &cachekey->cacheid, cih->stamp))
+				break;
+		}
+		if (i == num_table_oids)
+			return;
+
+		/*
+		 * The oid map is full.  Unless we can record the rest of table oids
+		 * in memqcache_oiddir, the item could not be invalidated.  So remove
+		 * it.
+		 */
+		if (!pool_config->memqcache_oiddir_fallback)
+		{
+			ereport(DEBUG1,
+					(errmsg("memcache: adding table oid maps"),
+					 errdetail("oid map is full, removing cache item")));
+			pool_delete_item_shmem_cache(&cachekey->cacheid);
+			return;
+		}
+
+		if (!oid_map->overflowed)
+			ereport(LOG,
+					(errmsg("memcache: oid map on shared memory is full, using memqcache_oiddir"),
+					 errhint("Consider increasing memqcache_max_num_cache.")));
+		oid_map->overflowed = true;
+	}
+
 	/*
 	 * Create memqcache_oiddir
 	 */
@@ -1653,18 +2007,6 @@ pool_add_table_oid_map(POOL_CACHEKEY *cachekey, int num_table_oids, int *table_o
 	/*
 	 * Create memqcache_oiddir/database_oid
 	 */
-	dboid = pool_get_database_oid();
-	ereport(DEBUG1,
-			(errmsg("memcache: adding table oid maps"),
-			 errdetail("dboid %d", dboid)));
-
-	if (dboid <= 0)
-	{
-		ereport(WARNING,
-				(errmsg("memcache: adding table oid maps, failed to get database OID")));
-		return;
-	}
-
 	path = psprintf("%s/%d", dir, dboid);
 	if (mkdir(path, S_IREAD | S_IWRITE | S_IEXEC) == -1)
 	{
@@ -1688,7 +2030,7 @@ pool_add_table_oid_map(POOL_CACHEKEY *cachekey, int num_table_oids, int *table_o
 		len = sizeof(cachekey->hashkey);
 	}
 
-	for (i = 0; i < num_table_oids; i++)
+	for (; i < num_table_oids; i++)
 	{
 		int			fd;
 		int			oid = table_oids[i];
@@ -1805,6 +2147,9 @@ pool_discard_oid_maps(void)
 {
 	char	   *command;
 
+	if (pool_is_shmem_cache())
+		oid_map_reset();
+
 	command = psprintf("/bin/rm -fr %s/[0-9]*",
 					   pool_config->memqcache_oiddir);
 	if (system(command) == -1)
@@ -1816,15 +2161,43 @@ pool_discard_oid_maps(void)
 }
 
 /*
- *  Discard all oid maps contained in database specified by dboid.
+ *  Discard all oid maps contained in database specified by dboid.  In the
+ *  shmem cache case, caller must hold exclusive shmem lock.
  */
 void
 pool_discard_oid_maps_by_db(int dboid)
 {
 	char	   *command;
+	int			i;
+	int		   *link;
+
+	/*
+	 * Without oid map, invalidate the whole database at once.  Every item
+	 * depends on the generation of its database.
+	 */
+	if (pool_is_shmem_cache() && pool_config->memqcache_lazy_invalidation)
+	{
+		pool_bump_table_generation(dboid, 0);
+		return;
+	}
 
 	if (pool_is_shmem_cache())
 	{
+		for (i = 0; i < oid_map->nbuckets; i++)
+		{
+			link = &oid_map->buckets[i];
+			while (*link != OID_MAP_NIL)
+			{
+				if (oid_map_tables[*link].dboid == dboid)
+					oid_map_invalidate(dboid, oid_map_tables[*link].tableoid);
+				else
+					link = &oid_map_tables[*link].next;
+			}
+		}
+
+		if (!oid_map->overflowed)
+			return;
+
 		command = psprintf("/bin/rm -fr %s/%d/",
 						   pool_config->memqcache_oiddir, dboid);
 
@@ -1843,7 +2216,7 @@ pool_discard_oid_maps_by_db(int dboid)
 
 /*
  * Read cache id (shmem case) or hash key (memcached case) from table
- * oid map file according to table_oids and discard cache entries.  If
+ * oid map according to table_oids and discard cache entries.  If
  * unlink is true, the file will be unlinked after successful cache
  * removal.
  */
@@ -1856,6 +2229,42 @@ pool_invalidate_query_cache(int num_table_oids, int *table_oid, bool unlinkp, in
 	int			len;
 	POOL_CACHEKEY buf;
 
+	if (dboid == 0)
+	{
+		dboid = pool_get_database_oid();
+		ereport(DEBUG1,
+				(errmsg("memcache invalidating query cache"),
+				 errdetail("dboid %d", dboid)));
+
+		if (dboid <= 0)
+		{
+			ereport(WARNING,
+					(errmsg("memcache: invalidating query cache, could not get database OID")));
+			return;
+		}
+	}
+
+	if (pool_is_shmem_cache() && pool_config->memqcache_lazy_invalidation)
+	{
+		for (i = 0; i < num_table_oids; i++)
+			pool_bump_table_generation(dboid, table_oid[i]);
+		return;
+	}
+
+	if (pool_is_shmem_cache())
+	{
+		for (i = 0; i < num_table_oids; i++)
+			oid_map_invalidate(dboid, table_oid[i]);
+
+		if (!oid_map->overflowed)
+		{
+#ifdef SHMEMCACHE_DEBUG
+			dump_shmem_cache(0);
+#endif
+			return;
+		}
+	}
+
 	/*
 	 * Create memqcache_oiddir
 	 */
@@ -1874,21 +2283,6 @@ pool_invalidate_query_cache(int num_table_oids, int *table_oid, bool unlinkp, in
 	/*
 	 * Create memqcache_oiddir/database_oid
 	 */
-	if (dboid == 0)
-	{
-		dboid = pool_get_database_oid();
-		ereport(DEBUG1,
-				(errmsg("memcache invalidating query cache"),
-				 errdetail("dboid %d", dboid)));
-
-		if (dboid <= 0)
-		{
-			ereport(WARNING,
-					(errmsg("memcache: invalidating query cache, could not get database OID")));
-			return;
-		}
-	}
-
 	path = psprintf("%s/%d", dir, dboid);
 	if (mkdir(path, S_IREAD | S_IWRITE | S_IEXEC) == -1)
 	{
@@ -1937,85 +2331,774 @@ pool_invalidate_query_cache(int num_table_oids, int *table_oid, bool unlinkp, in
 			continue;
 		}
 
-		fl.l_type = F_RDLCK;
-		fl.l_whence = SEEK_SET;
-		fl.l_start = 0;			/* Offset from l_whence         */
-		fl.l_len = 0;			/* length, 0 = to EOF           */
+		fl.l_type = F_RDLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = 0;			/* Offset from l_whence         */
+		fl.l_len = 0;			/* length, 0 = to EOF           */
+
+		sts = fcntl(fd, F_SETLKW, &fl);
+		if (sts == -1)
+		{
+			ereport(WARNING,
+					(errmsg("memcache: invalidating query cache, failed to lock file:\"%s\"", path),
+					 errdetail("%m")));
+			close(fd);
+			pfree(path);
+			return;
+		}
+		for (;;)
+		{
+			sts = read(fd, (char *) &buf, len);
+			if (sts == -1)
+			{
+				ereport(WARNING,
+						(errmsg("memcache: invalidating query cache, failed to read file:\"%s\"", path),
+						 errdetail("%m")));
+
+				close(fd);
+				pfree(path);
+				return;
+			}
+			else if (sts == len)
+			{
+				if (pool_is_shmem_cache())
+				{
+					ereport(DEBUG1,
+							(errmsg("memcache invalidating query cache"),
+							 errdetail("deleting cacheid:%d itemid:%d",
+									   buf.cacheid.blockid, buf.cacheid.itemid)));
+					pool_delete_item_shmem_cache(&buf.cacheid);
+				}
+#ifdef USE_MEMCACHED
+				else
+				{
+					char		delbuf[33];
+
+					memcpy(delbuf, buf.hashkey, 32);
+					delbuf[32] = 0;
+					ereport(DEBUG1,
+							(errmsg("memcache invalidating query cache"),
+							 errdetail("deleting %s", delbuf)));
+
+					delete_cache_on_memcached(delbuf);
+				}
+#endif
+				continue;
+			}
+
+			/*
+			 * Must be EOF
+			 */
+			if (sts != 0)
+			{
+				ereport(WARNING,
+						(errmsg("memcache: invalidating query cache, invalid data length:%d in file:\"%s\"", sts, path)));
+				close(fd);
+				pfree(path);
+				return;
+			}
+			break;
+		}
+
+		if (unlinkp)
+		{
+			unlink(path);
+		}
+		pfree(path);
+		close(fd);
+	}
+#ifdef SHMEMCACHE_DEBUG
+	dump_shmem_cache(0);
+#endif
+}
+
+/*
+ * Returns the shared memory size needed for the table oid map.  The number
+ * of chunks is chosen so that one dependency per cache item fits.
+ */
+static size_t
+oid_map_layout(int *nbuckets, int *ntables, int *nchunks, size_t *tables_offset, size_t *chunks_offset)
+{
+	*nchunks = Max(pool_config->memqcache_max_num_cache / POOL_OID_MAP_CHUNK_ENTRIES,
+				   OID_MAP_MIN_CHUNKS);
+	*ntables = *nchunks / 2;
+	*nbuckets = 1;
+	while (*nbuckets < *ntables)
+		*nbuckets <<= 1;
+
+	*tables_offset = MAXALIGN(offsetof(POOL_OID_MAP_HEADER, buckets) + sizeof(int) * *nbuckets);
+	*chunks_offset = *tables_offset + MAXALIGN(sizeof(POOL_OID_MAP_TABLE) * *ntables);
+	return *chunks_offset + sizeof(POOL_OID_MAP_CHUNK) * *nchunks;
+}
+
+size_t
+pool_oid_map_size(void)
+{
+	int			nbuckets,
+				ntables,
+				nchunks;
+	size_t		tables_offset,
+				chunks_offset;
+
+	return oid_map_layout(&nbuckets, &ntables, &nchunks, &tables_offset, &chunks_offset);
+}
+
+/*
+ * Allocate and initialize the table oid map.  This should be called only
+ * once from pgpool main process at the process staring up time.
+ */
+void
+pool_init_oid_map(void)
+{
+	int			nbuckets,
+				ntables,
+				nchunks;
+	size_t		tables_offset,
+				chunks_offset;
+	size_t		size;
+	char	   *p;
+
+	size = oid_map_layout(&nbuckets, &ntables, &nchunks, &tables_offset, &chunks_offset);
+	p = pool_shared_memory_segment_get_chunk(size);
+
+	oid_map = (POOL_OID_MAP_HEADER *) p;
+	oid_map_tables = (POOL_OID_MAP_TABLE *) (p + tables_offset);
+	oid_map_chunks = (POOL_OID_MAP_CHUNK *) (p + chunks_offset);
+
+	oid_map->nbuckets = nbuckets;
+	oid_map->ntables = ntables;
+	oid_map->nchunks = nchunks;
+	oid_map->next_stamp = 1;
+	oid_map_reset();
+
+	elog(DEBUG1, "pool_init_oid_map: buckets: %d tables: %d chunks: %d size: %zu",
+		 nbuckets, ntables, nchunks, size);
+}
+
+/*
+ * Empty the table oid map.  The stamp counter is kept going so that stale
+ * stamps never match a new item.
+ */
+static void
+oid_map_reset(void)
+{
+	int			i;
+
+	for (i = 0; i < oid_map->nbuckets; i++)
+		oid_map->buckets[i] = OID_MAP_NIL;
+
+	for (i = 0; i < oid_map->ntables; i++)
+		oid_map_tables[i].next = i + 1;
+	oid_map_tables[oid_map->ntables - 1].next = OID_MAP_NIL;
+	oid_map->free_table = 0;
+
+	for (i = 0; i < oid_map->nchunks; i++)
+		oid_map_chunks[i].next = i + 1;
+	oid_map_chunks[oid_map->nchunks - 1].next = OID_MAP_NIL;
+	oid_map->free_chunk = 0;
+
+	oid_map->sweep_stamp = oid_map->next_stamp;
+	oid_map->overflowed = false;
+}
+
+/*
+ * Returns a new stamp for a cache item.  0 is never used.  Caller must hold
+ * exclusive shmem lock.
+ */
+static uint32
+oid_map_next_stamp(void)
+{
+	uint32		stamp = oid_map->next_stamp++;
+
+	if (oid_map->next_stamp == 0)
+		oid_map->next_stamp = 1;
+	return stamp;
+}
+
+/*
+ * Returns the address of the link pointing to the table entry for the
+ * dboid and tableoid: either a bucket or the next field of the previous
+ * table.  *link is OID_MAP_NIL if the table is not in the map.
+ */
+static int *
+oid_map_find(int dboid, int tableoid)
+{
+	int			key[2];
+	int		   *link;
+
+	key[0] = dboid;
+	key[1] = tableoid;
+	link = &oid_map->buckets[pool_hash64(key, sizeof(key), 0) & (oid_map->nbuckets - 1)];
+
+	while (*link != OID_MAP_NIL)
+	{
+		POOL_OID_MAP_TABLE *table = &oid_map_tables[*link];
+
+		if (table->dboid == dboid && table->tableoid == tableoid)
+			break;
+		link = &table->next;
+	}
+	return link;
+}
+
+/*
+ * Returns true if the cache item the entry was registered for is still
+ * there, i.e. its cache id has not been deleted or reused since.
+ */
+static bool
+oid_map_entry_is_live(POOL_OID_MAP_ENTRY *entry)
+{
+	POOL_CACHE_BLOCK_HEADER *bh;
+	POOL_CACHE_ITEM_POINTER *cip;
+
+	if (entry->cacheid.blockid < 0 || entry->cacheid.blockid >= pool_get_memqcache_blocks())
+		return false;
+
+	bh = (POOL_CACHE_BLOCK_HEADER *) block_address(entry->cacheid.blockid);
+	if (!(bh->flags & POOL_BLOCK_USED) ||
+		entry->cacheid.itemid < 0 || entry->cacheid.itemid >= bh->num_items)
+		return false;
+
+	cip = item_pointer((char *) bh, entry->cacheid.itemid);
+	if (!(cip->flags & POOL_ITEM_USED) || (cip->flags & POOL_ITEM_DELETED))
+		return false;
+
+	return item_header((char *) bh, entry->cacheid.itemid)->stamp == entry->stamp;
+}
+
+/*
+ * Register a cache item depending on the table.  Returns false if the oid
+ * map is full.  Caller must hold exclusive shmem lock.
+ */
+static bool
+oid_map_add(int dboid, int tableoid, POOL_CACHEID *cacheid, uint32 stamp)
+{
+	POOL_OID_MAP_TABLE *table;
+	POOL_OID_MAP_CHUNK *chunk;
+	int		   *link;
+	int			c;
+	bool		swept = false;
+
+	for (;;)
+	{
+		link = oid_map_find(dboid, tableoid);
+
+		if (*link != OID_MAP_NIL)
+		{
+			table = &oid_map_tables[*link];
+			if (oid_map_chunks[table->chunk].nentries < POOL_OID_MAP_CHUNK_ENTRIES)
+				break;
+
+			if (oid_map->free_chunk != OID_MAP_NIL)
+			{
+				/* Put a new chunk in front of the full one */
+				c = oid_map->free_chunk;
+				oid_map->free_chunk = oid_map_chunks[c].next;
+				oid_map_chunks[c].next = table->chunk;
+				oid_map_chunks[c].nentries = 0;
+				table->chunk = c;
+				break;
+			}
+		}
+		else if (oid_map->free_table != OID_MAP_NIL && oid_map->free_chunk != OID_MAP_NIL)
+		{
+			*link = oid_map->free_table;
+			table = &oid_map_tables[*link];
+			oid_map->free_table = table->next;
+
+			c = oid_map->free_chunk;
+			oid_map->free_chunk = oid_map_chunks[c].next;
+			oid_map_chunks[c].next = OID_MAP_NIL;
+			oid_map_chunks[c].nentries = 0;
+
+			table->dboid = dboid;
+			table->tableoid = tableoid;
+			table->next = OID_MAP_NIL;
+			table->chunk = c;
+			break;
+		}
+
+		/* Out of space.  Reclaim stale entries and retry once. */
+		if (swept || !oid_map_sweep())
+			return false;
+		swept = true;
+	}
+
+	chunk = &oid_map_chunks[table->chunk];
+	chunk->entries[chunk->nentries].cacheid = *cacheid;
+	chunk->entries[chunk->nentries].stamp = stamp;
+	chunk->nentries++;
+
+	return true;
+}
+
+/*
+ * Delete all the cache items depending on the table and remove the table
+ * from the oid map.  Caller must hold exclusive shmem lock.
+ */
+static void
+oid_map_invalidate(int dboid, int tableoid)
+{
+	int		   *link;
+	int			c;
+	int			i;
+
+	link = oid_map_find(dboid, tableoid);
+	if (*link == OID_MAP_NIL)
+		return;
+
+	for (c = oid_map_tables[*link].chunk; c != OID_MAP_NIL; c = oid_map_chunks[c].next)
+	{
+		POOL_OID_MAP_CHUNK *chunk = &oid_map_chunks[c];
+
+		for (i = 0; i < chunk->nentries; i++)
+		{
+			if (!oid_map_entry_is_live(&chunk->entries[i]))
+				continue;
+
+			ereport(DEBUG1,
+					(errmsg("memcache invalidating query cache"),
+					 errdetail("deleting cacheid:%d itemid:%d",
+							   chunk->entries[i].cacheid.blockid,
+							   chunk->entries[i].cacheid.itemid)));
+			pool_delete_item_shmem_cache(&chunk->entries[i].cacheid);
+		}
+	}
+
+	oid_map_free_table(link);
+}
+
+/*
+ * Unlink the table pointed to by *link and put it and its chunks back to
+ * the free lists.
+ */
+static void
+oid_map_free_table(int *link)
+{
+	int			t = *link;
+	int			c;
+	int			next;
+
+	for (c = oid_map_tables[t].chunk; c != OID_MAP_NIL; c = next)
+	{
+		next = oid_map_chunks[c].next;
+		oid_map_chunks[c].next = oid_map->free_chunk;
+		oid_map->free_chunk = c;
+	}
+
+	*link = oid_map_tables[t].next;
+	oid_map_tables[t].next = oid_map->free_table;
+	oid_map->free_table = t;
+}
+
+/*
+ * Squeeze out stale entries of the table in place and free the chunks left
+ * empty.  If no entry remains, the table is left with one empty chunk.
+ */
+static void
+oid_map_compact_table(POOL_OID_MAP_TABLE *table)
+{
+	POOL_OID_MAP_CHUNK *wchunk;
+	int			wi = 0;
+	int			c;
+	int			i;
+	int			next;
+
+	wchunk = &oid_map_chunks[table->chunk];
+
+	/* The write position never passes the read position */
+	for (c = table->chunk; c != OID_MAP_NIL; c = oid_map_chunks[c].next)
+	{
+		POOL_OID_MAP_CHUNK *chunk = &oid_map_chunks[c];
+
+		for (i = 0; i < chunk->nentries; i++)
+		{
+			if (!oid_map_entry_is_live(&chunk->entries[i]))
+				continue;
+
+			if (wi == POOL_OID_MAP_CHUNK_ENTRIES)
+			{
+				wchunk->nentries = wi;
+				wchunk = &oid_map_chunks[wchunk->next];
+				wi = 0;
+			}
+			wchunk->entries[wi++] = chunk->entries[i];
+		}
+	}
+
+	/*
+	 * Chunks before wchunk are full.  Fix up wchunk and free the rest.
+	 */
+	wchunk->nentries = wi;
+	for (c = wchunk->next; c != OID_MAP_NIL; c = next)
+	{
+		next = oid_map_chunks[c].next;
+		oid_map_chunks[c].next = oid_map->free_chunk;
+		oid_map->free_chunk = c;
+	}
+	wchunk->next = OID_MAP_NIL;
+}
+
+/*
+ * Reclaim the entries of deleted or reused cache items from the whole oid
+ * map.  Since this visits every entry, it is done at most once per
+ * nchunks registered items.  Returns false if the sweep was skipped.
+ * Caller must hold exclusive shmem lock.
+ */
+static bool
+oid_map_sweep(void)
+{
+	int			i;
+	int		   *link;
+
+	if (oid_map->next_stamp - oid_map->sweep_stamp < (uint32) oid_map->nchunks)
+		return false;
+
+	oid_map->sweep_stamp = oid_map->next_stamp;
+
+	for (i = 0; i < oid_map->nbuckets; i++)
+	{
+		link = &oid_map->buckets[i];
+		while (*link != OID_MAP_NIL)
+		{
+			POOL_OID_MAP_TABLE *table = &oid_map_tables[*link];
+
+			oid_map_compact_table(table);
+			if (oid_map_chunks[table->chunk].nentries == 0)
+				oid_map_free_table(link);
+			else
+				link = &table->next;
+		}
+	}
+
+	ereport(DEBUG1,
+			(errmsg("memcache: swept oid map")));
+	return true;
+}
+
+/*
+ * Coalescing of concurrent cache misses.
+ *
+ * When a popular cache item expires or is invalidated, many processes miss
+ * it at the same time and would all send the same SELECT to the backend.
+ * To avoid that, the first process missing a query marks it as in flight in
+ * a small shared memory table, and executes it as usual.  Others missing
+ * the same query meanwhile wait until the marker is released, which happens
+ * right after the result is committed to the cache, and look up the cache
+ * again.  The wait is bounded by memqcache_coalesce_timeout, and a marker
+ * older than that is taken over, so a producer which fails or does not
+ * cache its result only delays the others by that much.
+ *
+ * A process produces at most one query at a time: starting a new lookup
+ * releases the previous marker.  The marker is also released at
+ * ReadyForQuery whether or not the query succeeded, and when the session
+ * ends or is aborted by an error.
+ */
+static uint64
+inflight_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sleep until *word is no longer val, or usec microseconds have elapsed.
+ */
+static void
+inflight_sleep(pool_atomic_uint32 *word, uint32 val, uint64 usec)
+{
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	syscall(SYS_futex, (uint32 *) &word->value, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	pg_usleep(Min(usec, 1000));
+#endif
+}
+
+static void
+inflight_wakeup(pool_atomic_uint32 *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, (uint32 *) &word->value, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static int
+cache_inflight_slots(void)
+{
+	int			nslots = POOL_CACHE_INFLIGHT_MIN_SLOTS;
+
+	while (nslots < pool_config->num_init_children * 2)
+		nslots <<= 1;
+	return nslots;
+}
+
+size_t
+pool_cache_inflight_size(void)
+{
+	return sizeof(POOL_CACHE_INFLIGHT) * cache_inflight_slots();
+}
+
+/*
+ * Allocate and initialize the in flight query table.  This should be
+ * called only once from pgpool main process at the process staring up
+ * time.
+ */
+void
+pool_init_cache_inflight(void)
+{
+	size_t		size = pool_cache_inflight_size();
+
+	cache_inflight = pool_shared_memory_segment_get_chunk(size);
+	memset(cache_inflight, 0, size);
+	cache_inflight_mask = cache_inflight_slots() - 1;
+}
+
+/*
+ * Called after a shmem cache miss.  If another process is executing the
+ * same query, wait until it has committed the result and return true, so
+ * that the caller looks up the cache again.  Otherwise mark the query as in
+ * flight if possible and return false.
+ */
+static bool
+pool_cache_inflight_wait(POOL_QUERY_HASH *query_hash)
+{
+	POOL_CACHE_INFLIGHT *slot;
+	uint64		timeout;
+	uint64		key;
+	uint64		cur;
+	uint64		started;
+	uint64		now;
+	uint32		seq;
+	int			idx;
+
+	pool_cache_inflight_end();
+
+	if (cache_inflight == NULL || pool_config->memqcache_coalesce_timeout <= 0)
+		return false;
+
+	timeout = (uint64) pool_config->memqcache_coalesce_timeout * 1000;
+	key = query_hash->query_hash[1] ? query_hash->query_hash[1] : 1;
+	idx = query_hash->query_hash[0] & cache_inflight_mask;
+	slot = &cache_inflight[idx];
+
+	for (;;)
+	{
+		seq = pool_atomic_read_u32(&slot->seq);
+		cur = pool_atomic_read_u64(&slot->key);
+		started = pool_atomic_read_u64(&slot->started);
+		now = inflight_now();
+
+		/*
+		 * The slot is free, or its producer has not released it in time.
+		 * Become the producer.  "started" is 0 for a moment after a slot is
+		 * claimed, which must not be taken for an old marker.
+		 */
+		if (cur == 0 || (started != 0 && now - started >= timeout))
+		{
+			if (!pool_atomic_compare_exchange_u64(&slot->key, &cur, key))
+				continue;
+			pool_atomic_write_u64(&slot->started, now);
+			my_inflight_slot = idx;
+			my_inflight_key = key;
+			return false;
+		}
+
+		/* Another query uses the slot.  Don't wait for it. */
+		if (cur != key)
+			return false;
+
+		break;
+	}
+
+	ereport(DEBUG1,
+			(errmsg("memcache: waiting for concurrent execution of the same query")));
+
+	if (started == 0)
+		started = now;
+	while (pool_atomic_read_u32(&slot->seq) == seq)
+	{
+		now = inflight_now();
+		if (now - started >= timeout)
+			return true;		/* timed out, not counted as coalesced */
+		inflight_sleep(&slot->seq, seq, started + timeout - now);
+	}
+
+	pool_stats_count_up_coalesced_misses();
+	return true;
+}
+
+/*
+ * Release the in flight marker this process holds, if any, and wake up the
+ * processes waiting for it.
+ */
+void
+pool_cache_inflight_end(void)
+{
+	POOL_CACHE_INFLIGHT *slot;
+	uint64		key;
+
+	if (my_inflight_slot < 0)
+		return;
+
+	slot = &cache_inflight[my_inflight_slot];
+	key = my_inflight_key;
+	my_inflight_slot = -1;
+
+	/* The marker may have been taken over after timeout */
+	if (pool_atomic_read_u64(&slot->key) != key)
+		return;
+
+	pool_atomic_write_u64(&slot->started, 0);
+	if (!pool_atomic_compare_exchange_u64(&slot->key, &key, 0))
+		return;
+
+	pool_atomic_fetch_add_u32(&slot->seq, 1);
+	inflight_wakeup(&slot->seq);
+}
+
+/*
+ * Table generation counters.
+ *
+ * When memqcache_lazy_invalidation is on, no oid map is maintained.
+ * Instead each (database oid, table oid) is hashed to a counter which is
+ * bumped when the table is modified, and each cache item records the
+ * counters of the tables it depends on, plus the one of its database, at
+ * registration.  If any of them has moved, the item is treated as if it
+ * had expired: readers skip it, and it is replaced by the next registration
+ * of the same query or dropped when its block is reused by
+ * pool_reuse_block().  Invalidation is thus a few atomic increments.
+ */
+size_t
+pool_table_generation_size(void)
+{
+	return sizeof(pool_atomic_uint32) * POOL_TABLE_GENERATION_SLOTS;
+}
+
+/*
+ * Allocate and initialize the table generation counters.  This should be
+ * called only once from pgpool main process at the process staring up
+ * time.
+ */
+void
+pool_init_table_generations(void)
+{
+	int			i;
+
+	table_generations = pool_shared_memory_segment_get_chunk(pool_table_generation_size());
+	for (i = 0; i < POOL_TABLE_GENERATION_SLOTS; i++)
+		pool_atomic_init_u32(&table_generations[i], 0);
+}
+
+static uint32
+table_generation_slot(int dboid, int tableoid)
+{
+	int			key[2];
+
+	key[0] = dboid;
+	key[1] = tableoid;
+	return (uint32) pool_hash64(key, sizeof(key), 0) & (POOL_TABLE_GENERATION_SLOTS - 1);
+}
+
+/*
+ * Build the generation list for a new cache item depending on the tables.
+ * The database itself comes first.  Returns the number of entries set to
+ * palloc'd *gensp, or -1 if the database oid could not be found.
+ */
+static int
+pool_get_table_generations(int num_table_oids, int *table_oids, POOL_CACHE_ITEM_GENERATION **gensp)
+{
+	POOL_CACHE_ITEM_GENERATION *gens;
+	int			dboid;
+	int			i;
+
+	dboid = pool_get_database_oid();
+	if (dboid <= 0)
+	{
+		ereport(WARNING,
+				(errmsg("memcache: getting table generations, failed to get database OID")));
+		return -1;
+	}
+
+	gens = palloc(sizeof(POOL_CACHE_ITEM_GENERATION) * (num_table_oids + 1));
+
+	gens[0].slot = table_generation_slot(dboid, 0);
+	for (i = 0; i < num_table_oids; i++)
+		gens[i + 1].slot = table_generation_slot(dboid, table_oids[i]);
+
+	for (i = 0; i <= num_table_oids; i++)
+		gens[i].generation = pool_atomic_read_u32(&table_generations[gens[i].slot]);
+
+	*gensp = gens;
+	return num_table_oids + 1;
+}
+
+/*
+ * Take the table generations for a new cache item of the SELECT, which
+ * must be done before the SELECT is sent to backend.  Returns the number
+ * of entries set to palloc'd *gensp, 0 if memqcache_lazy_invalidation is
+ * not in use, or -1 on error.
+ */
+int
+pool_get_select_table_generations(Node *node, POOL_CACHE_ITEM_GENERATION **gensp)
+{
+	SelectContext ctx;
+	int			num_oids;
 
-		sts = fcntl(fd, F_SETLKW, &fl);
-		if (sts == -1)
-		{
-			ereport(WARNING,
-					(errmsg("memcache: invalidating query cache, failed to lock file:\"%s\"", path),
-					 errdetail("%m")));
-			close(fd);
-			pfree(path);
-			return;
-		}
-		for (;;)
-		{
-			sts = read(fd, (char *) &buf, len);
-			if (sts == -1)
-			{
-				ereport(WARNING,
-						(errmsg("memcache: invalidating query cache, failed to read file:\"%s\"", path),
-						 errdetail("%m")));
+	*gensp = NULL;
 
-				close(fd);
-				pfree(path);
-				return;
-			}
-			else if (sts == len)
-			{
-				if (pool_is_shmem_cache())
-				{
-					ereport(DEBUG1,
-							(errmsg("memcache invalidating query cache"),
-							 errdetail("deleting cacheid:%d itemid:%d",
-									   buf.cacheid.blockid, buf.cacheid.itemid)));
-					pool_delete_item_shmem_cache(&buf.cacheid);
-				}
-#ifdef USE_MEMCACHED
-				else
-				{
-					char		delbuf[33];
+	if (!pool_is_shmem_cache() || !pool_config->memqcache_lazy_invalidation ||
+		table_generations == NULL)
+		return 0;
 
-					memcpy(delbuf, buf.hashkey, 32);
-					delbuf[32] = 0;
-					ereport(DEBUG1,
-							(errmsg("memcache invalidating query cache"),
-							 errdetail("deleting %s", delbuf)));
+	num_oids = pool_extract_table_oids_from_select_stmt(node, &ctx);
+	return pool_get_table_generations(num_oids, ctx.table_oids, gensp);
+}
 
-					delete_cache_on_memcached(delbuf);
-				}
-#endif
-				continue;
-			}
+/*
+ * Invalidate cache items depending on the table.  If tableoid is 0, all
+ * cache items of the database are invalidated.
+ */
+static void
+pool_bump_table_generation(int dboid, int tableoid)
+{
+	ereport(DEBUG1,
+			(errmsg("memcache invalidating query cache"),
+			 errdetail("bumping generation of dboid:%d table oid:%d", dboid, tableoid)));
 
-			/*
-			 * Must be EOF
-			 */
-			if (sts != 0)
-			{
-				ereport(WARNING,
-						(errmsg("memcache: invalidating query cache, invalid data length:%d in file:\"%s\"", sts, path)));
-				close(fd);
-				pfree(path);
-				return;
-			}
-			break;
-		}
+	pool_atomic_fetch_add_u32(&table_generations[table_generation_slot(dboid, tableoid)], 1);
+}
 
-		if (unlinkp)
-		{
-			unlink(path);
-		}
-		pfree(path);
-		close(fd);
+/*
+ * Returns true if a table the item depends on has been modified since the
+ * item was registered.  This may be called without any lock, so the slots
+ * are range checked.
+ */
+static bool
+pool_cache_item_is_stale(POOL_CACHE_ITEM_HEADER *cih)
+{
+	POOL_CACHE_ITEM_GENERATION *gens;
+	int			num_gens = cih->num_generations;
+	int			i;
+
+	if (num_gens <= 0 || table_generations == NULL)
+		return false;
+
+	gens = (POOL_CACHE_ITEM_GENERATION *) ((char *) cih + sizeof(POOL_CACHE_ITEM_HEADER));
+	for (i = 0; i < num_gens; i++)
+	{
+		uint32		slot = gens[i].slot;
+
+		if (slot >= POOL_TABLE_GENERATION_SLOTS ||
+			pool_atomic_read_u32(&table_generations[slot]) != gens[i].generation)
+			return true;
 	}
-#ifdef SHMEMCACHE_DEBUG
-	dump_shmem_cache(0);
-#endif
+	return false;
 }
 
 /*
@@ -2161,23 +3244,11 @@ pool_init_memory_cache(size_t size)
 void
 pool_clear_memory_cache(void)
 {
-	size_t		size;
-
 	pool_shmem_lock(POOL_MEMQ_EXCLUSIVE_LOCK);
 
 	PG_TRY();
 	{
-		size = pool_shared_memory_cache_size();
-		memset(shmem, 0, size);
-
-		size = pool_shared_memory_fsmm_size();
-		pool_reset_fsmm(size);
-
-		pool_discard_oid_maps();
-
-		pool_hash_reset(pool_config->memqcache_max_num_cache);
-
-		pool_init_whole_cache_blocks();
+		memq_reset_cache();
 	}
 	PG_CATCH();
 	{
@@ -2366,50 +3437,330 @@ pool_reset_fsmm(size_t size)
 /*
  * Find victim block using clock algorithm and make it free.
  * Returns new free block id.
- * XXX actually this is not a clock algorithm because it does not have "reference" bit.
- * It's like a simple FIFO.
- * See https://en.wikipedia.org/wiki/Page_replacement_algorithm#Clock for more details.
- * It would be nice if we could use true clock algorithm someday.
+ * Unless memqcache_admission_control is on, there is no "reference" bit and
+ * this is like a simple FIFO.  See pool_cache_victim_block().
+ */
+static POOL_CACHE_BLOCKID
+pool_reuse_block(void)
+{
+	int			maxblock = pool_get_memqcache_blocks();
+	POOL_CACHE_BLOCK_HEADER *bh;
+	POOL_CACHE_BLOCKID reused_block;
+	POOL_CACHE_ITEM_POINTER *cip;
+	char	   *p;
+	int			i;
+
+	reused_block = pool_cache_victim_block(true);
+	p = block_address(reused_block);
+	bh = (POOL_CACHE_BLOCK_HEADER *) p;
+	bh->flags = 0;
+
+	/*
+	 * Remove all items in this block from hash table.  This is also where
+	 * items invalidated by table generations get reclaimed.
+	 */
+	for (i = 0; i < bh->num_items; i++)
+	{
+		cip = item_pointer(p, i);
+
+		if (!(POOL_ITEM_DELETED & cip->flags))
+		{
+			pool_hash_delete(&cip->query_hash);
+			ereport(DEBUG1,
+					(errmsg("pool_reuse_block: blockid: %d item: %d", reused_block, i)));
+		}
+	}
+
+	pool_init_cache_block(reused_block);
+	pool_update_fsmm(reused_block, POOL_MAX_FREE_SPACE);
+	if (block_hits != NULL)
+		pool_atomic_write_u32(&block_hits[reused_block], 0);
+	pool_stats_count_up_evicted_blocks();
+
+	(*pool_fsmm_clock_hand)++;
+	if (*pool_fsmm_clock_hand >= maxblock)
+		*pool_fsmm_clock_hand = 0;
+
+	ereport(LOG,
+			(errmsg("pool_reuse_block: blockid: %d", reused_block)));
+
+	return reused_block;
+}
+
+/*
+ * Admission and eviction policy.
+ *
+ * When memqcache_admission_control is on, every lookup of the shmem cache
+ * is counted in a count-min sketch of query hashes (TinyLFU).  The counters
+ * are 8 bits, packed four to a word, and are halved every sample_size
+ * increments so that the sketch follows changes in the workload.
+ *
+ * Blocks are evicted by a clock hand.  Each block has a hit counter, and
+ * the hand passes over a block whose counter is not 0, halving it.  A block
+ * hit often thus survives several rounds, while blocks full of one-off
+ * results are evicted at the first round.
+ *
+ * Once the cache is full, a new item is only admitted if its query has been
+ * looked up more often than the items of the block it would evict on
+ * average.  Since a block holds many items, this compares against the
+ * block as a whole rather than its most popular item, which would keep
+ * almost everything out until the sketch is aged.  A one-off analytical
+ * query still cannot push out small lookups hit all the time.
+ */
+static uint32
+cache_policy_sketch_width(void)
+{
+	uint32		width = POOL_CACHE_SKETCH_MIN_WIDTH;
+
+	while (width < pool_config->memqcache_max_num_cache && width < POOL_CACHE_SKETCH_MAX_WIDTH)
+		width <<= 1;
+	return width;
+}
+
+static size_t
+cache_policy_layout(uint32 *width, int *nblocks, size_t *hits_offset, size_t *sketch_offset)
+{
+	*width = cache_policy_sketch_width();
+	*nblocks = pool_config->memqcache_total_size / pool_config->memqcache_cache_block_size;
+	*hits_offset = MAXALIGN(sizeof(POOL_CACHE_POLICY));
+	*sketch_offset = *hits_offset + MAXALIGN(sizeof(pool_atomic_uint32) * *nblocks);
+	return *sketch_offset + sizeof(pool_atomic_uint32) * POOL_CACHE_SKETCH_DEPTH * (*width / 4);
+}
+
+size_t
+pool_cache_policy_size(void)
+{
+	uint32		width;
+	int			nblocks;
+	size_t		hits_offset,
+				sketch_offset;
+
+	return cache_policy_layout(&width, &nblocks, &hits_offset, &sketch_offset);
+}
+
+/*
+ * Allocate and initialize the admission and eviction policy state.  This
+ * should be called only once from pgpool main process at the process
+ * staring up time.
+ */
+void
+pool_init_cache_policy(void)
+{
+	uint32		width;
+	int			nblocks;
+	size_t		hits_offset,
+				sketch_offset;
+	size_t		size;
+	char	   *p;
+
+	size = cache_policy_layout(&width, &nblocks, &hits_offset, &sketch_offset);
+	p = pool_shared_memory_segment_get_chunk(size);
+	memset(p, 0, size);
+
+	cache_policy = (POOL_CACHE_POLICY *) p;
+	block_hits = (pool_atomic_uint32 *) (p + hits_offset);
+	sketch = (pool_atomic_uint32 *) (p + sketch_offset);
+
+	cache_policy->width = width;
+	cache_policy->sample_size = width * 10;
+	pool_atomic_init_u32(&cache_policy->additions, 0);
+
+	elog(DEBUG1, "pool_init_cache_policy: sketch width: %u size: %zu", width, size);
+}
+
+/*
+ * Locate the counter for the query hash in the given sketch row.
+ */
+static pool_atomic_uint32 *
+sketch_counter(POOL_QUERY_HASH *query_hash, int row, int *shift)
+{
+	uint64		h = query_hash->query_hash[1] + (uint64) row * query_hash->query_hash[0];
+	uint32		idx = (uint32) (h >> 32) & (cache_policy->width - 1);
+
+	*shift = (idx & 3) * 8;
+	return &sketch[row * (cache_policy->width / 4) + idx / 4];
+}
+
+/*
+ * Halve all the sketch counters.
+ */
+static void
+sketch_age(void)
+{
+	uint32		nwords = POOL_CACHE_SKETCH_DEPTH * (cache_policy->width / 4);
+	uint32		i;
+
+	for (i = 0; i < nwords; i++)
+	{
+		uint32		old = pool_atomic_read_u32(&sketch[i]);
+
+		while (!pool_atomic_compare_exchange_u32(&sketch[i], &old, (old >> 1) & 0x7f7f7f7f))
+			;
+	}
+	ereport(DEBUG1,
+			(errmsg("memcache: aged admission sketch")));
+}
+
+/*
+ * Count a lookup of the query in the sketch.  This is called without any
+ * lock.
+ */
+static void
+pool_cache_sketch_increment(POOL_QUERY_HASH *query_hash)
+{
+	int			row;
+
+	if (cache_policy == NULL || !pool_config->memqcache_admission_control)
+		return;
+
+	for (row = 0; row < POOL_CACHE_SKETCH_DEPTH; row++)
+	{
+		int			shift;
+		pool_atomic_uint32 *counter = sketch_counter(query_hash, row, &shift);
+		uint32		old = pool_atomic_read_u32(counter);
+
+		/* Saturate at 255 */
+		while (((old >> shift) & 0xff) != 0xff &&
+			   !pool_atomic_compare_exchange_u32(counter, &old, old + (1U << shift)))
+			;
+	}
+
+	if (pool_atomic_fetch_add_u32(&cache_policy->additions, 1) + 1 == cache_policy->sample_size)
+	{
+		sketch_age();
+		pool_atomic_fetch_sub_u32(&cache_policy->additions, cache_policy->sample_size);
+	}
+}
+
+/*
+ * Estimated number of recent lookups of the query.
+ */
+static uint32
+pool_cache_sketch_estimate(POOL_QUERY_HASH *query_hash)
+{
+	uint32		freq = 0xff;
+	int			row;
+
+	for (row = 0; row < POOL_CACHE_SKETCH_DEPTH; row++)
+	{
+		int			shift;
+		pool_atomic_uint32 *counter = sketch_counter(query_hash, row, &shift);
+
+		freq = Min(freq, (pool_atomic_read_u32(counter) >> shift) & 0xff);
+	}
+	return freq;
+}
+
+/*
+ * Count a cache hit of the item found at the hash element.  This may be
+ * called without any lock, right after the element has been validated.  If
+ * the element has been recycled in the meantime, this just credits the hit
+ * to the wrong item.
+ */
+static void
+pool_cache_record_hit(volatile POOL_HASH_ELEMENT *element, POOL_CACHE_BLOCKID blockid)
+{
+	pool_atomic_fetch_add_u32(&element->hits, 1);
+
+	/* Block hits are only used by pool_cache_victim_block() */
+	if (block_hits != NULL && pool_config->memqcache_admission_control &&
+		blockid >= 0 && blockid < pool_get_memqcache_blocks())
+		pool_atomic_fetch_add_u32(&block_hits[blockid], 1);
+}
+
+/*
+ * Return the next block to be evicted.  Blocks hit since the clock hand
+ * last passed get another chance.  At most one round is made, so this
+ * terminates even if all the blocks are hot.
+ *
+ * If "advance" is true, the clock hand is moved to the block and the hit
+ * counts of the blocks passed are aged.  Otherwise this just peeks at the
+ * block which would be chosen, without changing the clock state.
+ * Caller must hold exclusive shmem lock.
+ */
+static POOL_CACHE_BLOCKID
+pool_cache_victim_block(bool advance)
+{
+	int			maxblock = pool_get_memqcache_blocks();
+	POOL_CACHE_BLOCKID hand = *pool_fsmm_clock_hand;
+	int			i;
+
+	if (block_hits == NULL || !pool_config->memqcache_admission_control)
+		return hand;
+
+	for (i = 0; i < maxblock; i++)
+	{
+		pool_atomic_uint32 *hits = &block_hits[hand];
+		uint32		n = pool_atomic_read_u32(hits);
+
+		if (n == 0)
+			break;
+
+		if (advance)
+			pool_atomic_fetch_sub_u32(hits, n - n / 2);
+
+		hand++;
+		if (hand >= maxblock)
+			hand = 0;
+	}
+
+	if (advance)
+		*pool_fsmm_clock_hand = hand;
+
+	return hand;
+}
+
+/*
+ * Decide whether a new item of "size" bytes for the query may be added to
+ * the cache.  This is always allowed if there is room for it.  Otherwise
+ * its estimated frequency must be higher than the mean of the live items in
+ * the victim block.  Caller must hold exclusive shmem lock.
  */
-static POOL_CACHE_BLOCKID
-pool_reuse_block(void)
+static bool
+pool_cache_admit(POOL_QUERY_HASH *query_hash, size_t size)
 {
-	int			maxblock = pool_get_memqcache_blocks();
-	char	   *block = block_address(*pool_fsmm_clock_hand);
-	POOL_CACHE_BLOCK_HEADER *bh = (POOL_CACHE_BLOCK_HEADER *) block;
-	POOL_CACHE_BLOCKID reused_block;
-	POOL_CACHE_ITEM_POINTER *cip;
+	POOL_CACHE_BLOCKID victim;
+	POOL_CACHE_BLOCK_HEADER *bh;
 	char	   *p;
+	uint32		freq;
+	uint64		total = 0;
+	int			nlive = 0;
 	int			i;
 
-	bh->flags = 0;
-	reused_block = *pool_fsmm_clock_hand;
-	p = block_address(reused_block);
+	if (cache_policy == NULL || !pool_config->memqcache_admission_control)
+		return true;
 
-	/* Remove all items in this block from hash table */
-	for (i = 0; i < bh->num_items; i++)
-	{
-		cip = item_pointer(p, i);
+	if (is_free_hash_element() && pool_find_free_block(size) >= 0)
+		return true;
 
-		if (!(POOL_ITEM_DELETED & cip->flags))
-		{
-			pool_hash_delete(&cip->query_hash);
-			ereport(DEBUG1,
-					(errmsg("pool_reuse_block: blockid: %d item: %d", reused_block, i)));
-		}
-	}
+	freq = pool_cache_sketch_estimate(query_hash);
+	victim = pool_cache_victim_block(false);
+	p = block_address(victim);
+	bh = (POOL_CACHE_BLOCK_HEADER *) p;
 
-	pool_init_cache_block(reused_block);
-	pool_update_fsmm(reused_block, POOL_MAX_FREE_SPACE);
+	if (!(bh->flags & POOL_BLOCK_USED))
+		return true;
 
-	(*pool_fsmm_clock_hand)++;
-	if (*pool_fsmm_clock_hand >= maxblock)
-		*pool_fsmm_clock_hand = 0;
+	for (i = 0; i < bh->num_items; i++)
+	{
+		POOL_CACHE_ITEM_POINTER *cip = item_pointer(p, i);
 
-	ereport(LOG,
-			(errmsg("pool_reuse_block: blockid: %d", reused_block)));
+		if (cip->flags & POOL_ITEM_DELETED)
+			continue;
 
-	return reused_block;
+		total += pool_cache_sketch_estimate(&cip->query_hash);
+		nlive++;
+	}
+
+	if (nlive > 0 && (uint64) freq * nlive <= total)
+	{
+		ereport(DEBUG1,
+				(errmsg("memcache: not admitting new cache item"),
+				 errdetail("frequency: %u victim block: %d mean frequency: %.1f",
+						   freq, victim, (double) total / nlive)));
+		return false;
+	}
+	return true;
 }
 
 /*
@@ -2418,11 +3769,8 @@ pool_reuse_block(void)
 static POOL_CACHE_BLOCKID
 pool_get_block(size_t free_space)
 {
-	int			encode_value;
 	unsigned char *p = pool_fsmm_address();
-	int			i;
-	int			maxblock = pool_get_memqcache_blocks();
-	POOL_CACHE_BLOCK_HEADER *bh;
+	POOL_CACHE_BLOCKID blockid;
 
 	if (p == NULL)
 	{
@@ -2439,6 +3787,29 @@ pool_get_block(size_t free_space)
 		return -1;
 	}
 
+	blockid = pool_find_free_block(free_space);
+	if (blockid >= 0)
+		return blockid;
+
+	/*
+	 * No enough space found. Reuse victim block
+	 */
+	return pool_reuse_block();
+}
+
+/*
+ * Returns the first block having "free_space" bytes free, or -1 if there is
+ * none.
+ */
+static POOL_CACHE_BLOCKID
+pool_find_free_block(size_t free_space)
+{
+	int			encode_value;
+	unsigned char *p = pool_fsmm_address();
+	int			i;
+	int			maxblock = pool_get_memqcache_blocks();
+	POOL_CACHE_BLOCK_HEADER *bh;
+
 	encode_value = free_space / POOL_FSMM_RATIO;
 
 	for (i = 0; i < maxblock; i++)
@@ -2456,11 +3827,7 @@ pool_get_block(size_t free_space)
 			}
 		}
 	}
-
-	/*
-	 * No enough space found. Reuse victim block
-	 */
-	return pool_reuse_block();
+	return -1;
 }
 
 /*
@@ -2504,12 +3871,14 @@ pool_update_fsmm(POOL_CACHE_BLOCKID blockid, size_t free_space)
 
 /*
  * Add item data to shared memory cache.
+ * If the data is compressed, raw_size is its uncompressed size, otherwise 0.
  * On successful registration, returns cache id.
  * The cache id is overwritten by the subsequent call to this function.
  * On error returns NULL.
  */
 static POOL_CACHEID *
-pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, time_t expire)
+pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, int raw_size,
+						  time_t expire, POOL_CACHE_ITEM_GENERATION *gens, int num_gens)
 {
 	static POOL_CACHEID cacheid;
 	POOL_CACHE_BLOCKID blockid;
@@ -2554,7 +3923,7 @@ pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, tim
 	}
 
 	/* Add overhead */
-	request_size = size + sizeof(POOL_CACHE_ITEM_POINTER) + sizeof(POOL_CACHE_ITEM_HEADER);
+	request_size = POOL_CACHE_ITEM_REQUEST_SIZE(size, num_gens);
 
 	/* Get cache block which has enough space */
 	blockid = pool_get_block(request_size);
@@ -2712,9 +4081,12 @@ pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, tim
 	 */
 
 	/* Fill in cache item header */
+	ci.header.stamp = oid_map_next_stamp();
 	ci.header.timestamp = time(NULL);
 	ci.header.expire = expire;
-	ci.header.total_length = sizeof(POOL_CACHE_ITEM_HEADER) + size;
+	ci.header.num_generations = num_gens;
+	ci.header.raw_length = raw_size;
+	ci.header.total_length = POOL_CACHE_ITEM_DATA_OFFSET(&ci.header) + size;
 
 	/* Calculate item body address */
 	if (bh->num_items == 0)
@@ -2737,8 +4109,16 @@ pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, tim
 	memcpy(item, &ci, sizeof(POOL_CACHE_ITEM_HEADER));
 	bh->free_bytes -= sizeof(POOL_CACHE_ITEM_HEADER);
 
+	/* Copy table generations */
+	if (num_gens > 0)
+	{
+		memcpy(item + sizeof(POOL_CACHE_ITEM_HEADER), gens,
+			   num_gens * sizeof(POOL_CACHE_ITEM_GENERATION));
+		bh->free_bytes -= num_gens * sizeof(POOL_CACHE_ITEM_GENERATION);
+	}
+
 	/* Copy item body */
-	memcpy(item + sizeof(POOL_CACHE_ITEM_HEADER), data, size);
+	memcpy(item + POOL_CACHE_ITEM_DATA_OFFSET(&ci.header), data, size);
 	bh->free_bytes -= size;
 
 	/* Copy cache item pointer */
@@ -2787,12 +4167,13 @@ pool_add_item_shmem_cache(POOL_QUERY_HASH *query_hash, char *data, int size, tim
 
 /*
  * Returns item data address on shared memory cache specified by query hash.
- * Also data length is set to *size.
+ * Also data length is set to *size, and the uncompressed length to
+ * *raw_size if the data is compressed (0 if not).
  * On error or data not found case returns NULL.
  * Detail is set to *sts. (0: success, 1: not found, -1: error)
  */
 static char *
-pool_get_item_shmem_cache(POOL_QUERY_HASH *query_hash, int *size, int *sts)
+pool_get_item_shmem_cache(POOL_QUERY_HASH *query_hash, int *size, int *raw_size, int *sts)
 {
 	POOL_CACHEID *cacheid;
 	POOL_CACHE_ITEM_HEADER *cih;
@@ -2833,8 +4214,92 @@ pool_get_item_shmem_cache(POOL_QUERY_HASH *query_hash, int *size, int *sts)
 
 	cih = pool_cache_item_header(cacheid);
 
-	*size = cih->total_length - sizeof(POOL_CACHE_ITEM_HEADER);
-	return (char *) cih + sizeof(POOL_CACHE_ITEM_HEADER);
+	*size = cih->total_length - POOL_CACHE_ITEM_DATA_OFFSET(cih);
+	*raw_size = cih->raw_length;
+	return (char *) cih + POOL_CACHE_ITEM_DATA_OFFSET(cih);
+}
+
+/*
+ * Compress cache data of "size" bytes if it is at least
+ * memqcache_compress_threshold bytes long and compression pays off.
+ * Returns palloc'd buffer starting with "headroom" bytes left for the
+ * caller, followed by the compressed data whose length is set to
+ * *compressed_size.  Returns NULL if the data should be stored as is.
+ */
+static char *
+pool_compress_cache_data(const char *data, size_t size, int headroom, int *compressed_size)
+{
+#ifdef USE_LZ4
+	char	   *buf;
+	int			bound;
+	int			n;
+
+	if (pool_config->memqcache_compress_threshold <= 0 ||
+		size < pool_config->memqcache_compress_threshold ||
+		size > LZ4_MAX_INPUT_SIZE)
+		return NULL;
+
+	bound = LZ4_compressBound(size);
+	buf = palloc(headroom + bound);
+	n = LZ4_compress_default(data, buf + headroom, size, bound);
+
+	/* Not worth decompressing on every hit unless it saves 1/8 at least */
+	if (n <= 0 || n > size - size / 8)
+	{
+		pfree(buf);
+		return NULL;
+	}
+
+	ereport(DEBUG1,
+			(errmsg("committing SELECT results to cache storage"),
+			 errdetail("compressed %zu bytes to %d bytes", size, n)));
+
+	*compressed_size = n;
+	return buf;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Copy cache data of "size" bytes at "src" to palloc'd *buf, decompressing
+ * it if raw_size is not 0, and set the resulting length to *len.  The
+ * source may be modified concurrently when called from
+ * pool_fetch_item_optimistic(), so nothing in it is trusted.  Returns false
+ * if the data could not be decompressed.
+ */
+static bool
+pool_copy_cache_data(const char *src, int size, int raw_size, char **buf, size_t *len)
+{
+	char	   *p;
+
+	if (raw_size <= 0)
+	{
+		p = palloc(size);
+		memcpy(p, src, size);
+		*buf = p;
+		*len = size;
+		return true;
+	}
+
+#ifdef USE_LZ4
+	if (raw_size > pool_config->memqcache_maxcache)
+		return false;
+
+	p = palloc(raw_size);
+	if (LZ4_decompress_safe(src, p, size, raw_size) != raw_size)
+	{
+		pfree(p);
+		return false;
+	}
+	*buf = p;
+	*len = raw_size;
+	return true;
+#else
+	ereport(LOG,
+			(errmsg("could not decompress query cache data, LZ4 support is not enabled")));
+	return false;
+#endif
 }
 
 /*
@@ -2847,8 +4312,6 @@ pool_find_item_on_shmem_cache(POOL_QUERY_HASH *query_hash)
 {
 	static POOL_CACHEID cacheid;
 	POOL_CACHEID *c;
-	POOL_CACHE_ITEM_HEADER *cih;
-	time_t		now;
 
 	c = pool_hash_search(query_hash);
 	if (!c)
@@ -2856,54 +4319,72 @@ pool_find_item_on_shmem_cache(POOL_QUERY_HASH *query_hash)
 		return NULL;
 	}
 
-	cih = item_header(block_address(c->blockid), c->itemid);
-
-	/* Check cache expiration */
-	if (cih->expire > 0)
+	/*
+	 * Check cache expiration.  We only hold the stripe lock in shared mode
+	 * here, so an expired item is left in place.  It is replaced by the next
+	 * pool_commit_cache() for the same query, or reclaimed when its block is
+	 * reused.
+	 */
+	if (pool_cache_item_is_expired(c))
 	{
-		now = time(NULL);
-		if (difftime(now, cih->timestamp) > cih->expire)
-		{
-			/*
-			 * We need to acquire an exclusive lock before removing the cache
-			 * entry.  Since a lock escalation from shared lock to exclusive
-			 * lock is not supported, we need to release the lock then acquire
-			 * an exclusive lock.
-			 */
-			pool_shmem_unlock();
-			pool_shmem_lock(POOL_MEMQ_EXCLUSIVE_LOCK);
-
-			/*
-			 * There is a window between pool_shmem_unlock() and
-			 * pool_shmem_lock().  We need to get POOL_CACHEID and
-			 * POOL_CACHE_ITEM_HEADER again because they could have been
-			 * modified by someone else.
-			 */
-			c = pool_hash_search(query_hash);
-			if (!c)
-			{
-				return NULL;
-			}
-
-			cih = item_header(block_address(c->blockid), c->itemid);
-			now = time(NULL);
-			if (now > (cih->timestamp + cih->expire))
-			{
-				ereport(DEBUG1,
-						(errmsg("memcache finding item"),
-						 errdetail("cache expired: now: %ld timestamp: %ld",
-								   now, cih->timestamp + cih->expire)));
-				pool_delete_item_shmem_cache(c);
-				return NULL;
-			}
-		}
+		ereport(DEBUG1,
+				(errmsg("memcache finding item"),
+				 errdetail("cache expired: block: %d item: %d", c->blockid, c->itemid)));
+		return NULL;
 	}
 
 	cacheid.blockid = c->blockid;
 	cacheid.itemid = c->itemid;
+
+	pool_cache_record_hit((POOL_HASH_ELEMENT *) ((char *) c - offsetof(POOL_HASH_ELEMENT, cacheid)),
+						  cacheid.blockid);
 	return &cacheid;
 }
 
+/*
+ * Returns true if the item specified by cache id has expired, or if one of
+ * the tables it depends on has been modified since it was registered.
+ */
+static bool
+pool_cache_item_is_expired(POOL_CACHEID *cacheid)
+{
+	POOL_CACHE_ITEM_HEADER *cih;
+
+	cih = item_header(block_address(cacheid->blockid), cacheid->itemid);
+	if (pool_cache_item_is_stale(cih))
+		return true;
+
+	if (cih->expire <= 0)
+		return false;
+
+	return difftime(time(NULL), cih->timestamp) > cih->expire;
+}
+
+/*
+ * Search cache id by query hash before registering a new cache entry.  If
+ * the item found has expired, it is deleted and NULL is returned so that the
+ * caller can register the fresh one.  Caller must hold exclusive shmem lock.
+ */
+static POOL_CACHEID *
+pool_hash_search_for_update(POOL_QUERY_HASH *query_hash)
+{
+	POOL_CACHEID *c;
+	POOL_CACHEID cacheid;
+
+	c = pool_hash_search(query_hash);
+	if (c == NULL || !pool_cache_item_is_expired(c))
+		return c;
+
+	ereport(DEBUG1,
+			(errmsg("memcache registering item"),
+			 errdetail("removing expired item: block: %d item: %d", c->blockid, c->itemid)));
+
+	/* c points to the hash element which is about to be freed */
+	cacheid = *c;
+	pool_delete_item_shmem_cache(&cacheid);
+	return NULL;
+}
+
 /*
  * Delete item data specified cache id from shmem.
  * On successful deletion, returns 0.
@@ -2988,6 +4469,12 @@ pool_delete_item_shmem_cache(POOL_CACHEID *cacheid)
 	 * 2012/4/1: Now we do not pack data in pool_add_item_shmem_cache() for
 	 * performance reason. Also we count down num_items if it is the last one.
 	 */
+	/*
+	 * Remove hash index first.  Once it is gone, no reader can reach the
+	 * item, so its space can be safely reinitialized.
+	 */
+	pool_hash_delete(&key);
+
 	if ((bh->num_items - 1) == 0)
 	{
 		ereport(DEBUG1,
@@ -2997,9 +4484,6 @@ pool_delete_item_shmem_cache(POOL_CACHEID *cacheid)
 		pool_init_cache_block(cacheid->blockid);
 	}
 
-	/* Remove hash index */
-	pool_hash_delete(&key);
-
 	/*
 	 * If the deleted item is the last one in the block, we add it to the free
 	 * space.
@@ -3114,46 +4598,253 @@ pool_wipe_out_cache_block(POOL_CACHE_BLOCKID blockid)
 
 #undef LOCK_TRACE
 
-static int	memq_lock_fd = 0;
+/*
+ * Query cache locks.
+ *
+ * The query cache is protected by process shared mutexes placed on shared
+ * memory, rather than by a single flock(2) on a lock file.  Cache hits
+ * normally take no lock at all (see below), so the locks are only contended
+ * by writers and the fallback path of lookups, and a plain mutex serves
+ * shared lock requests as well.
+ *
+ * alloc_lock protects cache blocks, the FSMM, the clock hand and the free
+ * list of hash elements.  Anyone who adds or removes cache items must hold
+ * it exclusively (pool_shmem_lock(POOL_MEMQ_EXCLUSIVE_LOCK)).  Holding it in
+ * shared mode keeps the whole cache stable, which is what the cache stats
+ * reporting and the relcache need.
+ *
+ * stripes[] protect hash chains.  A hash bucket is mapped to a stripe by its
+ * create_hash_key() value.  Cache lookups only take the stripe lock of the
+ * bucket, and keep it while copying out the item.  pool_hash_insert() and
+ * pool_hash_delete() take the stripe lock
+ * exclusively.  Since an item is always removed from its hash chain before
+ * its space is recycled, a reader never sees an item being overwritten.
+ *
+ * Each stripe also carries a sequence counter, which is made odd while the
+ * stripe is locked exclusively.  This lets pool_fetch_cache() look up and
+ * copy out an item without taking any lock at all: it reads the counter,
+ * does the work and checks that the counter did not move.  See
+ * pool_fetch_item_optimistic().
+ *
+ * The lock order is alloc_lock, then a stripe.  A process holds at most one
+ * stripe at a time, except pool_clear_memory_cache() which takes all of
+ * them.  Locks still held at process exit are released by an on_proc_exit
+ * callback.
+ *
+ * Unlike flock(2), the locks are not released by the kernel when a process
+ * crashes or is killed while holding them.  They are robust mutexes, so the
+ * next process trying to acquire such a lock gets EOWNERDEAD and takes it
+ * over.  Since the dead process may have left the hash chains or the cache
+ * blocks half updated, the whole cache is cleared by the next process which
+ * acquires alloc_lock.
+ */
+#define POOL_MEMQ_LOCK_STRIPES	128 /* must be power of 2 */
+
+typedef union
+{
+	pthread_mutex_t lock;
+	char		pad[PG_CACHE_LINE_SIZE];	/* avoid false sharing */
+} POOL_MEMQ_PADDED_LOCK;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pool_atomic_uint32 seq;		/* odd while the stripe is being changed */
+} POOL_MEMQ_STRIPE;
+
+typedef union
+{
+	POOL_MEMQ_STRIPE stripe;
+	char		pad[PG_CACHE_LINE_SIZE];	/* avoid false sharing */
+} POOL_MEMQ_PADDED_STRIPE;
+
+typedef struct
+{
+	POOL_MEMQ_PADDED_LOCK alloc_lock;
+	POOL_MEMQ_PADDED_STRIPE stripes[POOL_MEMQ_LOCK_STRIPES];
+	volatile bool reset_pending;	/* a lock holder died, clear the cache */
+} POOL_MEMQ_LOCKS;
+
+#define MEMQ_STRIPE(hash_key) \
+	(&memq_locks->stripes[(hash_key) & (POOL_MEMQ_LOCK_STRIPES - 1)].stripe)
+
+static POOL_MEMQ_LOCKS *memq_locks;
+static int	memq_locked_stripe = -1;	/* stripe locked by us, or -1 */
+static bool memq_locked_stripe_exclusive = false;
+static bool memq_all_stripes_locked = false;
+static pid_t memq_lock_cleanup_pid = 0;
+
+static void memq_lock_acquire(pthread_mutex_t *lock, POOL_MEMQ_STRIPE *stripe);
+static void memq_lock_release(pthread_mutex_t *lock);
+static void memq_register_lock_cleanup(void);
+static void memq_release_locks_at_exit(int code, Datum arg);
+
+/*
+ * Returns the shared memory size needed for the query cache locks.
+ */
+size_t
+pool_memqcache_lock_size(void)
+{
+	return sizeof(POOL_MEMQ_LOCKS);
+}
+
+/*
+ * Allocate and initialize the query cache locks.  This should be called
+ * only once from pgpool main process at the process staring up time.
+ */
+void
+pool_init_memqcache_locks(void)
+{
+	pthread_mutexattr_t attr;
+	int			rc;
+	int			i;
+
+	memq_locks = pool_shared_memory_segment_get_chunk(sizeof(POOL_MEMQ_LOCKS));
+	memq_locks->reset_pending = false;
+
+	rc = pthread_mutexattr_init(&attr);
+	if (rc == 0)
+		rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (rc == 0)
+		rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to initialize query cache lock attributes"),
+				 errdetail("%s", strerror(rc))));
+
+	rc = pthread_mutex_init(&memq_locks->alloc_lock.lock, &attr);
+	for (i = 0; rc == 0 && i < POOL_MEMQ_LOCK_STRIPES; i++)
+	{
+		rc = pthread_mutex_init(&memq_locks->stripes[i].stripe.lock, &attr);
+		pool_atomic_init_u32(&memq_locks->stripes[i].stripe.seq, 0);
+	}
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to initialize query cache lock"),
+				 errdetail("%s", strerror(rc))));
+
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Acquire a query cache lock.  "stripe" is the stripe the lock belongs to,
+ * or NULL for alloc_lock.
+ *
+ * If the previous holder died without releasing the lock, take it over and
+ * schedule clearing the cache.  An exclusive holder of a stripe leaves its
+ * sequence counter odd, which would make every optimistic lookup of the
+ * stripe fail, so make it even again.
+ */
+static void
+memq_lock_acquire(pthread_mutex_t *lock, POOL_MEMQ_STRIPE *stripe)
+{
+	int			rc;
+
+	rc = pthread_mutex_lock(lock);
+	if (rc == EOWNERDEAD)
+	{
+		ereport(LOG,
+				(errmsg("query cache lock was held by a process which exited abnormally"),
+				 errdetail("query cache will be cleared")));
+
+		if (stripe && (pool_atomic_read_u32(&stripe->seq) & 1))
+			pool_atomic_fetch_add_u32(&stripe->seq, 1);
+		memq_locks->reset_pending = true;
+
+		rc = pthread_mutex_consistent(lock);
+	}
+
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to lock query cache"),
+				 errdetail("%s", strerror(rc))));
+}
+
+static void
+memq_lock_release(pthread_mutex_t *lock)
+{
+	int			rc;
+
+	rc = pthread_mutex_unlock(lock);
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to unlock query cache"),
+				 errdetail("%s", strerror(rc))));
+}
+
+/*
+ * Make sure that a process exiting by ereport(FATAL) in the middle of cache
+ * access releases the locks, so that the cache is not cleared needlessly.
+ */
+static void
+memq_register_lock_cleanup(void)
+{
+	if (memq_lock_cleanup_pid != myProcPid)
+	{
+		on_proc_exit(memq_release_locks_at_exit, (Datum) 0);
+		memq_lock_cleanup_pid = myProcPid;
+	}
+}
+
+static void
+memq_release_locks_at_exit(int code, Datum arg)
+{
+	int			i;
+
+	if (memq_locks == NULL)
+		return;
+
+	if (memq_all_stripes_locked)
+	{
+		for (i = 0; i < POOL_MEMQ_LOCK_STRIPES; i++)
+		{
+			pool_atomic_fetch_add_u32(&memq_locks->stripes[i].stripe.seq, 1);
+			pthread_mutex_unlock(&memq_locks->stripes[i].stripe.lock);
+		}
+		memq_all_stripes_locked = false;
+	}
+	else if (memq_locked_stripe >= 0)
+	{
+		POOL_MEMQ_STRIPE *stripe = MEMQ_STRIPE(memq_locked_stripe);
+
+		if (memq_locked_stripe_exclusive)
+			pool_atomic_fetch_add_u32(&stripe->seq, 1);
+		pthread_mutex_unlock(&stripe->lock);
+		memq_locked_stripe = -1;
+	}
+
+	if (is_shmem_locked)
+	{
+		pthread_mutex_unlock(&memq_locks->alloc_lock.lock);
+		is_shmem_locked = false;
+	}
+}
 
 /*
- * Acquire lock: XXX giant lock
+ * Acquire the cache lock.  Exclusive lock is needed to add or remove cache
+ * items.  Cache lookups by pool_fetch_cache() do not need this lock.
+ *
+ * If a process died while holding one of the cache locks, the cache is
+ * cleared here before going on.
  */
 void
 pool_shmem_lock(POOL_MEMQ_LOCK_TYPE type)
 {
-	if (memq_lock_fd == 0)
-	{
-		char	   *path;
-
-		path = psprintf("%s/%s", pool_config->logdir, QUERY_CACHE_LOCK_FILE);
-		memq_lock_fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
-		if (memq_lock_fd == -1)
-		{
-			ereport(FATAL,
-					(errmsg("Failed to open lock file for query cache \"%s\"", path),
-					 errdetail("%m")));
-		}
-		pfree(path);
-	}
-
 #ifdef LOCK_TRACE
 	elog(LOG, "LOCK TRACE: try to acquire lock %s", type == POOL_MEMQ_EXCLUSIVE_LOCK ? "LOCK_EX" : "LOCK_SH");
 #endif
-	if (pool_is_shmem_cache() && !is_shmem_locked)
+	if (pool_is_shmem_cache() && !is_shmem_locked && memq_locks != NULL)
 	{
-		if (flock(memq_lock_fd, type == POOL_MEMQ_EXCLUSIVE_LOCK ? LOCK_EX : LOCK_SH))
-		{
-			ereport(FATAL,
-					(errmsg("Failed to lock file for query cache"),
-					 errdetail("%m")));
-
-		}
+		memq_register_lock_cleanup();
+		memq_lock_acquire(&memq_locks->alloc_lock.lock, NULL);
 
 #ifdef LOCK_TRACE
 		elog(LOG, "LOCK TRACE: acquire lock %s", type == POOL_MEMQ_EXCLUSIVE_LOCK ? "LOCK_EX" : "LOCK_SH");
 #endif
 		is_shmem_locked = true;
+
+		if (memq_locks->reset_pending)
+			memq_reset_cache();
 	}
 }
 
@@ -3165,12 +4856,7 @@ pool_shmem_unlock(void)
 {
 	if (pool_is_shmem_cache() && is_shmem_locked)
 	{
-		if (flock(memq_lock_fd, LOCK_UN))
-		{
-			ereport(FATAL,
-					(errmsg("Failed to unlock file for query cache"),
-					 errdetail("%m")));
-		}
+		memq_lock_release(&memq_locks->alloc_lock.lock);
 #ifdef LOCK_TRACE
 		elog(LOG, "LOCK TRACE: unlock");
 #endif
@@ -3178,6 +4864,127 @@ pool_shmem_unlock(void)
 	}
 }
 
+/*
+ * Lock the stripe covering the hash bucket "hash_key".  Exclusive lock makes
+ * the sequence counter of the stripe odd until pool_hash_unlock().
+ */
+static void
+pool_hash_lock(uint32 hash_key, POOL_MEMQ_LOCK_TYPE type)
+{
+	POOL_MEMQ_STRIPE *stripe;
+
+	if (memq_locks == NULL)
+		return;
+
+	Assert(memq_locked_stripe < 0 && !memq_all_stripes_locked);
+
+	stripe = MEMQ_STRIPE(hash_key);
+
+	memq_register_lock_cleanup();
+	memq_lock_acquire(&stripe->lock, stripe);
+	memq_locked_stripe = hash_key & (POOL_MEMQ_LOCK_STRIPES - 1);
+	memq_locked_stripe_exclusive = (type == POOL_MEMQ_EXCLUSIVE_LOCK);
+
+	/* fetch_add is a full barrier, so following stores cannot pass it */
+	if (memq_locked_stripe_exclusive)
+		pool_atomic_fetch_add_u32(&stripe->seq, 1);
+}
+
+/*
+ * Release the stripe lock acquired by pool_hash_lock().
+ */
+static void
+pool_hash_unlock(void)
+{
+	POOL_MEMQ_STRIPE *stripe;
+
+	if (memq_locked_stripe < 0)
+		return;
+
+	stripe = MEMQ_STRIPE(memq_locked_stripe);
+	if (memq_locked_stripe_exclusive)
+	{
+		pool_write_barrier();
+		pool_atomic_fetch_add_u32(&stripe->seq, 1);
+	}
+	memq_lock_release(&stripe->lock);
+	memq_locked_stripe = -1;
+}
+
+/*
+ * Lock all the stripes exclusively.  Used when the hash table is reset.
+ */
+static void
+pool_hash_lock_all(void)
+{
+	int			i;
+
+	if (memq_locks == NULL)
+		return;
+
+	memq_register_lock_cleanup();
+	for (i = 0; i < POOL_MEMQ_LOCK_STRIPES; i++)
+	{
+		memq_lock_acquire(&memq_locks->stripes[i].stripe.lock,
+						  &memq_locks->stripes[i].stripe);
+		pool_atomic_fetch_add_u32(&memq_locks->stripes[i].stripe.seq, 1);
+	}
+	memq_all_stripes_locked = true;
+}
+
+static void
+pool_hash_unlock_all(void)
+{
+	int			i;
+
+	if (!memq_all_stripes_locked)
+		return;
+
+	pool_write_barrier();
+	for (i = 0; i < POOL_MEMQ_LOCK_STRIPES; i++)
+	{
+		pool_atomic_fetch_add_u32(&memq_locks->stripes[i].stripe.seq, 1);
+		memq_lock_release(&memq_locks->stripes[i].stripe.lock);
+	}
+	memq_all_stripes_locked = false;
+}
+
+/*
+ * Clear the shared memory cache.  Caller must hold alloc_lock.
+ */
+static void
+memq_reset_cache(void)
+{
+	size_t		size;
+
+	pool_hash_lock_all();
+
+	PG_TRY();
+	{
+		size = pool_shared_memory_cache_size();
+		memset(shmem, 0, size);
+
+		size = pool_shared_memory_fsmm_size();
+		pool_reset_fsmm(size);
+
+		pool_discard_oid_maps();
+
+		pool_hash_reset(pool_config->memqcache_max_num_cache);
+
+		pool_init_whole_cache_blocks();
+
+		memq_locks->reset_pending = false;
+	}
+	PG_CATCH();
+	{
+		pool_hash_unlock_all();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pool_hash_unlock_all();
+}
+
 /*
  * check lock
  */
@@ -3339,10 +5146,14 @@ pool_create_temp_query_cache(char *query)
 
 	p = palloc(sizeof(*p));
 	p->query = pstrdup(query);
+	p->params = NULL;
+	p->params_len = 0;
 
 	p->buffer = pool_create_buffer();
 	p->oids = pool_create_buffer();
 	p->num_oids = 0;
+	p->num_generations = -1;
+	p->generations = NULL;
 	p->is_exceeded = false;
 	p->is_discarded = false;
 
@@ -3354,6 +5165,31 @@ pool_create_temp_query_cache(char *query)
 	return p;
 }
 
+/*
+ * Set the Bind parameters of the query the temp query cache is created for.
+ */
+void
+pool_set_temp_query_cache_params(POOL_TEMP_QUERY_CACHE *temp_cache, const char *params, int params_len)
+{
+	POOL_SESSION_CONTEXT *session_context;
+
+	if (!temp_cache)
+		return;
+
+	if (temp_cache->params)
+		pfree(temp_cache->params);
+	temp_cache->params = NULL;
+	temp_cache->params_len = 0;
+
+	if (params)
+	{
+		session_context = pool_get_session_context(false);
+		temp_cache->params = MemoryContextAlloc(session_context->memory_context, params_len);
+		memcpy(temp_cache->params, params, params_len);
+		temp_cache->params_len = params_len;
+	}
+}
+
 /*
  * Discard temp query cache
  */
@@ -3365,10 +5201,14 @@ pool_discard_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache)
 
 	if (temp_cache->query)
 		pfree(temp_cache->query);
+	if (temp_cache->params)
+		pfree(temp_cache->params);
 	if (temp_cache->buffer)
 		pool_discard_buffer(temp_cache->buffer);
 	if (temp_cache->oids)
 		pool_discard_buffer(temp_cache->oids);
+	if (temp_cache->generations)
+		pfree(temp_cache->generations);
 
 	ereport(DEBUG1,
 			(errmsg("pool_discard_temp_query_cache: cache discarded: %p", temp_cache)));
@@ -3477,6 +5317,25 @@ pool_add_oids_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache, int num_oids,
 	temp_cache->num_oids = num_oids;
 }
 
+/*
+ * Add table generations taken when SELECT was sent to temp query cache.
+ */
+static void
+pool_add_generations_temp_query_cache(POOL_TEMP_QUERY_CACHE *temp_cache, int num_gens, POOL_CACHE_ITEM_GENERATION *gens)
+{
+	POOL_SESSION_CONTEXT *session_context = pool_get_session_context(false);
+
+	if (!temp_cache || num_gens <= 0)
+		return;
+
+	if (temp_cache->generations)
+		pfree(temp_cache->generations);
+	temp_cache->generations = MemoryContextAlloc(session_context->memory_context,
+												 sizeof(POOL_CACHE_ITEM_GENERATION) * num_gens);
+	memcpy(temp_cache->generations, gens, sizeof(POOL_CACHE_ITEM_GENERATION) * num_gens);
+	temp_cache->num_generations = num_gens;
+}
+
 /*
  * Internal buffer management modules.
  * Usage:
@@ -3699,8 +5558,8 @@ pool_check_and_discard_cache_buffer(int num_oids, int *oids)
  * For other case At Ready for Query handle query cache.
  */
 void
-pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node, char state,
-						bool partial_fetch)
+pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, char *params, int params_len,
+						Node *node, char state, bool partial_fetch)
 {
 	POOL_SESSION_CONTEXT *session_context;
 	pool_sigset_t oldmask;
@@ -3748,7 +5607,10 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 				{
 					if (session_context->query_context->skip_cache_commit == false)
 					{
-						if (pool_commit_cache(backend, query, cache_buffer, len, num_oids, oids) != 0)
+						if (pool_commit_cache(backend, query, params, params_len,
+											  cache_buffer, len, num_oids, oids,
+											  session_context->query_context->cache_generations,
+											  session_context->query_context->num_cache_generations) != 0)
 						{
 							ereport(WARNING,
 									(errmsg("ReadyForQuery: pool_commit_cache failed")));
@@ -3770,10 +5632,14 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 							(errmsg("pool_handle_query_cache: temp_cache: %p", cache)));
 					pool_discard_temp_query_cache(cache);
 
-					if (SL_MODE && pool_is_doing_extended_query_message())
+					if ((SL_MODE && pool_is_doing_extended_query_message()) || query == NULL)
 						session_context->query_context->temp_cache = NULL;
 					else
+					{
 						session_context->query_context->temp_cache = pool_create_temp_query_cache(query);
+						pool_set_temp_query_cache_params(session_context->query_context->temp_cache,
+														 params, params_len);
+					}
 					pfree(cache_buffer);
 				}
 				pool_shmem_unlock();
@@ -3792,6 +5658,9 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 
 			/* In transaction. Keep to temp query cache array */
 			pool_add_oids_temp_query_cache(cache, num_oids, oids);
+			pool_add_generations_temp_query_cache(cache,
+												  session_context->query_context->num_cache_generations,
+												  session_context->query_context->cache_generations);
 
 			/*
 			 * If temp cache has been overflowed, just trash the half baked
@@ -3871,7 +5740,9 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 			oids = pool_get_buffer(cache->oids, &len);
 			cache_buffer = pool_get_buffer(cache->buffer, &len);
 
-			if (pool_commit_cache(backend, cache->query, cache_buffer, len, num_oids, oids) != 0)
+			if (pool_commit_cache(backend, cache->query, cache->params, cache->params_len,
+								  cache_buffer, len, num_oids, oids,
+								  cache->generations, cache->num_generations) != 0)
 			{
 				ereport(WARNING,
 						(errmsg("ReadyForQuery: pool_commit_cache failed")));
@@ -3942,12 +5813,12 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 		{
 			int			dboid = session_context->query_context->dboid;
 
-			num_oids = pool_get_dropdb_table_oids(&oids, dboid);
-
-			if (num_oids > 0 && pool_config->memqcache_auto_cache_invalidation)
+			if (pool_config->memqcache_auto_cache_invalidation)
 			{
 				pool_shmem_lock(POOL_MEMQ_EXCLUSIVE_LOCK);
-				pool_invalidate_query_cache(num_oids, oids, true, dboid);
+				num_oids = pool_get_dropdb_table_oids(&oids, dboid);
+				if (num_oids > 0)
+					pool_invalidate_query_cache(num_oids, oids, true, dboid);
 				pool_discard_oid_maps_by_db(dboid);
 				pool_shmem_unlock();
 				pool_reset_memqcache_buffer(true);
@@ -4002,6 +5873,12 @@ pool_handle_query_cache(POOL_CONNECTION_POOL *backend, char *query, Node *node,
 			}
 		}
 	}
+
+	/*
+	 * Whether or not the result has been cached, processes waiting for it
+	 * can go ahead now.
+	 */
+	pool_cache_inflight_end();
 }
 
 /*
@@ -4124,11 +6001,9 @@ pool_stats_count_up_num_cache_hits(void)
 }
 
 /*
- * On shared memory hash table implementation.  We use sub part of md5
- * hash key as hash function.  The experiment has shown that has_any()
- * of PostgreSQL is a little bit better than the method using part of
- * md5 hash value, but it seems adding some cpu cycles to call
- * hash_any() is not worth the trouble.
+ * On shared memory hash table implementation.  Keys are 128 bit hashes
+ * computed by encode_query_hash() and the low bits are directly used as
+ * the bucket index.
  */
 
 static volatile POOL_HASH_HEADER *hash_header;
@@ -4172,6 +6047,10 @@ pool_hash_init(int nelements)
 	hash_header->nhash = nelements2;
 	hash_header->mask = mask;
 
+	/* Random seed for encode_query_hash() */
+	if (!pg_strong_random((void *) &hash_header->seed, sizeof(hash_header->seed)))
+		hash_header->seed = ((uint64) time(NULL) << 32) ^ (uint64) getpid();
+
 #ifdef POOL_HASH_DEBUG
 	ereport(LOG,
 			(errmsg("initializing hash table on shared memory"),
@@ -4257,7 +6136,12 @@ pool_hash_reset(int nelements)
 	mask >>= shift;
 
 	size = (char *) &hh.elements - (char *) &hh + sizeof(POOL_HEADER_ELEMENT) * nelements2;
-	memset((void *) hash_header, 0, size);
+
+	/*
+	 * Clear the buckets but keep the seed, which lock-free lookups keep using
+	 * while the table is being reset.
+	 */
+	memset((void *) &hash_header->elements, 0, size - ((char *) &hh.elements - (char *) &hh));
 
 	hash_header->nhash = nelements2;
 	hash_header->mask = mask;
@@ -4278,6 +6162,7 @@ pool_hash_reset(int nelements)
 /*
  * Search cacheid by MD5 hash key string
  * If found, returns cache id, otherwise NULL.
+ * Caller must hold either exclusive shmem lock or the stripe lock of the key.
  */
 POOL_CACHEID *
 pool_hash_search(POOL_QUERY_HASH *key)
@@ -4295,41 +6180,129 @@ pool_hash_search(POOL_QUERY_HASH *key)
 		return NULL;
 	}
 
-	{
-		char		md5[POOL_MD5_HASHKEYLEN + 1];
-
-		memcpy(md5, key->query_hash, POOL_MD5_HASHKEYLEN);
-		md5[POOL_MD5_HASHKEYLEN] = '\0';
 #ifdef POOL_HASH_DEBUG
-		ereport(LOG,
-				(errmsg("searching hash table"),
-				 errdetail("hash_key:%d md5:%s", hash_key, md5)));
+	ereport(LOG,
+			(errmsg("searching hash table"),
+			 errdetail("hash_key:%d key:" POOL_QUERY_HASH_FORMAT, hash_key, POOL_QUERY_HASH_ARGS(key))));
 #endif
-	}
 
 	element = hash_header->elements[hash_key].element;
 	while (element)
 	{
+		if (POOL_QUERY_HASH_EQUAL(&element->hashkey, key))
 		{
-			char		md5[POOL_MD5_HASHKEYLEN + 1];
-
-			memcpy(md5, key->query_hash, POOL_MD5_HASHKEYLEN);
-			md5[POOL_MD5_HASHKEYLEN] = '\0';
-#ifdef POOL_HASH_DEBUG
-			ereport(LOG,
-					(errmsg("searching hash table"),
-					 errdetail("element md5:%s", md5)));
-#endif
+			return (POOL_CACHEID *) &element->cacheid;
 		}
+		element = element->next;
+	}
+	return NULL;
+}
+
+/*
+ * Look up the item for "query_hash" and copy it out to palloc'd memory
+ * without taking any lock.  Returns 1 and sets *buf and *len if found, 0 if
+ * not found or expired.  Returns -1 if a writer changed the stripe in the
+ * meantime, in which case the caller should retry or use the locked path.
+ *
+ * Nothing read from shared memory can be trusted until the stripe sequence
+ * counter has been validated, so ids, offsets and lengths are range checked
+ * before use and the hash chain walk is bounded.  Writers always unlink an
+ * item from its hash chain, which bumps the counter, before they recycle
+ * the space, so a successful validation means the copy is intact.
+ */
+static int
+pool_fetch_item_optimistic(POOL_QUERY_HASH *query_hash, char **buf, size_t *len)
+{
+	uint32		hash_key;
+	POOL_MEMQ_STRIPE *stripe;
+	uint32		seq;
+	volatile POOL_HASH_ELEMENT *element;
+	POOL_CACHEID cacheid;
+	bool		found = false;
+	long		n;
+	char	   *block;
+	POOL_CACHE_ITEM_POINTER *cip;
+	POOL_CACHE_ITEM_HEADER *cih;
+	unsigned int offset;
+	unsigned int total_length;
+	unsigned int data_offset;
+	int			num_gens;
+	unsigned int block_size = pool_config->memqcache_cache_block_size;
+	char	   *p = NULL;
+
+	if (memq_locks == NULL)
+		return -1;
+
+	hash_key = create_hash_key(query_hash);
+	stripe = MEMQ_STRIPE(hash_key);
+
+	seq = pool_atomic_read_u32(&stripe->seq);
+	if (seq & 1)
+		return -1;
 
-		if (memcmp((const void *) element->hashkey.query_hash,
-				   (const void *) key->query_hash, sizeof(key->query_hash)) == 0)
+	element = hash_header->elements[hash_key].element;
+	for (n = 0; element && n < hash_header->nhash; n++)
+	{
+		if (POOL_QUERY_HASH_EQUAL(&element->hashkey, query_hash))
 		{
-			return (POOL_CACHEID *) &element->cacheid;
+			cacheid.blockid = element->cacheid.blockid;
+			cacheid.itemid = element->cacheid.itemid;
+			found = true;
+			break;
 		}
 		element = element->next;
 	}
-	return NULL;
+
+	if (found)
+	{
+		if (cacheid.blockid >= pool_get_memqcache_blocks())
+			return -1;
+
+		block = block_address(cacheid.blockid);
+		if (cacheid.itemid >= ((POOL_CACHE_BLOCK_HEADER *) block)->num_items)
+			return -1;
+
+		cip = item_pointer(block, cacheid.itemid);
+		offset = cip->offset;
+		if (offset < sizeof(POOL_CACHE_BLOCK_HEADER) ||
+			offset > block_size - sizeof(POOL_CACHE_ITEM_HEADER))
+			return -1;
+
+		cih = (POOL_CACHE_ITEM_HEADER *) (block + offset);
+		total_length = cih->total_length;
+		num_gens = cih->num_generations;
+		if (num_gens < 0 ||
+			num_gens > (block_size - offset) / sizeof(POOL_CACHE_ITEM_GENERATION))
+			return -1;
+		data_offset = sizeof(POOL_CACHE_ITEM_HEADER) +
+			num_gens * sizeof(POOL_CACHE_ITEM_GENERATION);
+		if (total_length < data_offset ||
+			total_length > block_size - offset)
+			return -1;
+
+		if (cih->expire > 0 && difftime(time(NULL), cih->timestamp) > cih->expire)
+			found = false;
+		else if (num_gens > 0 && pool_cache_item_is_stale(cih))
+			found = false;
+		else if (!pool_copy_cache_data((char *) cih + data_offset, total_length - data_offset,
+									   cih->raw_length, &p, len))
+			return -1;
+	}
+
+	pool_read_barrier();
+	if (pool_atomic_read_u32(&stripe->seq) != seq)
+	{
+		if (p)
+			pfree(p);
+		return -1;
+	}
+
+	if (!found)
+		return 0;
+
+	pool_cache_record_hit(element, cacheid.blockid);
+	*buf = p;
+	return 1;
 }
 
 /*
@@ -4354,17 +6327,18 @@ pool_hash_insert(POOL_QUERY_HASH *key, POOL_CACHEID *cacheid, bool update)
 		return -1;
 	}
 
-	{
-		char		md5[POOL_MD5_HASHKEYLEN + 1];
-
-		memcpy(md5, key->query_hash, POOL_MD5_HASHKEYLEN);
-		md5[POOL_MD5_HASHKEYLEN] = '\0';
 #ifdef POOL_HASH_DEBUG
-		ereport(LOG,
-				(errmsg("searching hash table"),
-				 errdetail("hash_key:%d md5:%s block:%d item:%d", hash_key, md5, cacheid->blockid, cacheid->itemid)));
+	ereport(LOG,
+			(errmsg("searching hash table"),
+			 errdetail("hash_key:%d key:" POOL_QUERY_HASH_FORMAT " block:%d item:%d",
+					   hash_key, POOL_QUERY_HASH_ARGS(key), cacheid->blockid, cacheid->itemid)));
 #endif
-	}
+
+	/*
+	 * Caller holds exclusive shmem lock, so only readers walking the same
+	 * hash chain need to be kept off.
+	 */
+	pool_hash_lock(hash_key, POOL_MEMQ_EXCLUSIVE_LOCK);
 
 	/*
 	 * Look for hash key.
@@ -4373,24 +6347,22 @@ pool_hash_insert(POOL_QUERY_HASH *key, POOL_CACHEID *cacheid, bool update)
 
 	while (element)
 	{
-		if (memcmp((const void *) element->hashkey.query_hash,
-				   (const void *) key->query_hash, sizeof(key->query_hash)) == 0)
+		if (POOL_QUERY_HASH_EQUAL(&element->hashkey, key))
 		{
 			/* Hash key found. If "update" is false, just throw an error. */
-			char		md5[POOL_MD5_HASHKEYLEN + 1];
-
 			if (!update)
 			{
-				memcpy(md5, key->query_hash, POOL_MD5_HASHKEYLEN);
-				md5[POOL_MD5_HASHKEYLEN] = '\0';
+				pool_hash_unlock();
 				ereport(LOG,
-						(errmsg("memcache: adding cacheid to hash. hash key:\"%s\" already exists", md5)));
+						(errmsg("memcache: adding cacheid to hash. hash key:\"" POOL_QUERY_HASH_FORMAT "\" already exists",
+								POOL_QUERY_HASH_ARGS(key))));
 				return -1;
 			}
 			else
 			{
 				/* Update cache id */
 				memcpy((void *) &element->cacheid, cacheid, sizeof(POOL_CACHEID));
+				pool_hash_unlock();
 				return 0;
 			}
 		}
@@ -4403,6 +6375,7 @@ pool_hash_insert(POOL_QUERY_HASH *key, POOL_CACHEID *cacheid, bool update)
 	new_element = (POOL_HASH_ELEMENT *) get_new_hash_element();
 	if (!new_element)
 	{
+		pool_hash_unlock();
 		ereport(LOG,
 				(errmsg("memcache: adding cacheid to hash. failed to get new element")));
 		return -1;
@@ -4413,8 +6386,11 @@ pool_hash_insert(POOL_QUERY_HASH *key, POOL_CACHEID *cacheid, bool update)
 	hash_header->elements[hash_key].element = new_element;
 	new_element->next = element;
 
-	memcpy((void *) new_element->hashkey.query_hash, key->query_hash, POOL_MD5_HASHKEYLEN);
+	memcpy((void *) &new_element->hashkey, key, sizeof(POOL_QUERY_HASH));
 	memcpy((void *) &new_element->cacheid, cacheid, sizeof(POOL_CACHEID));
+	pool_atomic_write_u32(&new_element->hits, 0);
+
+	pool_hash_unlock();
 
 	return 0;
 }
@@ -4440,6 +6416,8 @@ pool_hash_delete(POOL_QUERY_HASH *key)
 		return -1;
 	}
 
+	pool_hash_lock(hash_key, POOL_MEMQ_EXCLUSIVE_LOCK);
+
 	/*
 	 * Look for delete location
 	 */
@@ -4449,7 +6427,7 @@ pool_hash_delete(POOL_QUERY_HASH *key)
 
 	while (element)
 	{
-		if (memcmp(element->hashkey.query_hash, key->query_hash, sizeof(key->query_hash)) == 0)
+		if (POOL_QUERY_HASH_EQUAL(&element->hashkey, key))
 		{
 			found = true;
 			break;
@@ -4460,12 +6438,10 @@ pool_hash_delete(POOL_QUERY_HASH *key)
 
 	if (!found)
 	{
-		char		md5[POOL_MD5_HASHKEYLEN + 1];
-
-		memcpy(md5, key->query_hash, POOL_MD5_HASHKEYLEN);
-		md5[POOL_MD5_HASHKEYLEN] = '\0';
+		pool_hash_unlock();
 		ereport(LOG,
-				(errmsg("memcache: deleting key from hash. key:\"%s\" not found", md5)));
+				(errmsg("memcache: deleting key from hash. key:\"" POOL_QUERY_HASH_FORMAT "\" not found",
+						POOL_QUERY_HASH_ARGS(key))));
 		return -1;
 	}
 
@@ -4475,26 +6451,41 @@ pool_hash_delete(POOL_QUERY_HASH *key)
 	*delete_point = element->next;
 	put_back_hash_element(element);
 
+	pool_hash_unlock();
+
 	return 0;
 }
 
 /*
- * Calculate 32bit binary hash key (i.e. location in hash header) from MD5
- * string. We use top most 8 characters of MD5 string for calculation.
+ * Create shared memory cache key: 128 bit hash of user name, query string,
+ * Bind parameters if any, and database name.  They are fed to the hash one
+ * by one, so no concatenated copy is needed.  The seed is chosen randomly
+ * at startup so that clients cannot forge a key colliding with another
+ * user's query.
+ */
+static void
+encode_query_hash(const char *s, const char *params, int params_len,
+				  POOL_QUERY_HASH *query_hash, POOL_CONNECTION_POOL *backend)
+{
+	pool_hash128_state state;
+
+	pool_hash128_init(&state, hash_header->seed);
+	pool_hash128_update(&state, backend->info->user, strlen(backend->info->user));
+	pool_hash128_update(&state, s, strlen(s));
+	if (params)
+		pool_hash128_update(&state, params, params_len);
+	pool_hash128_update(&state, backend->info->database, strlen(backend->info->database));
+	pool_hash128_final(&state, query_hash->query_hash);
+}
+
+/*
+ * Calculate 32bit binary hash key (i.e. location in hash header) from the
+ * query hash.  The low bits of the hash are used as is.
 */
 static uint32
 create_hash_key(POOL_QUERY_HASH *key)
 {
-#define POOL_HASH_NCHARS 8
-
-	char		md5[POOL_HASH_NCHARS + 1];
-	uint32		mask;
-
-	memcpy(md5, key->query_hash, POOL_HASH_NCHARS);
-	md5[POOL_HASH_NCHARS] = '\0';
-	mask = strtoul(md5, NULL, 16);
-	mask &= hash_header->mask;
-	return mask;
+	return (uint32) key->query_hash[0] & hash_header->mask;
 }
 
 /*
@@ -4585,13 +6576,19 @@ pool_get_shmem_storage_stats(void)
 	/* number of total hash entries */
 	mystats.num_hash_entries = hash_header->nhash;
 
-	/* number of used hash entries */
+	/* number of used hash entries and their hits */
 	for (i = 0; i < hash_header->nhash; i++)
 	{
 		element = hash_header->elements[i].element;
 		while (element)
 		{
+			uint32		hits = pool_atomic_read_u32(&element->hits);
+
 			mystats.used_hash_entries++;
+			if (hits > 0)
+				mystats.hot_cache_entries++;
+			if (hits > mystats.max_cache_entry_hits)
+				mystats.max_cache_entry_hits = hits;
 			element = element->next;
 		}
 	}
@@ -4809,6 +6806,52 @@ inject_cached_message(POOL_CONNECTION *backend, char *qcache, int qcachelen)
 	pool_pop(backend, &len);
 }
 
+/*
+ * Count up number of cache items not admitted by pool_cache_admit().
+ */
+static void
+pool_stats_count_up_admission_rejects(void)
+{
+	pool_sigset_t oldmask;
+
+	POOL_SETMASK2(&BlockSig, &oldmask);
+	pool_semaphore_lock(QUERY_CACHE_STATS_SEM);
+	stats->num_admission_rejects++;
+	pool_semaphore_unlock(QUERY_CACHE_STATS_SEM);
+	POOL_SETMASK(&oldmask);
+}
+
+/*
+ * Count up number of cache misses which waited for a concurrent execution
+ * of the same query.
+ */
+static void
+pool_stats_count_up_coalesced_misses(void)
+{
+	pool_sigset_t oldmask;
+
+	POOL_SETMASK2(&BlockSig, &oldmask);
+	pool_semaphore_lock(QUERY_CACHE_STATS_SEM);
+	stats->num_coalesced_misses++;
+	pool_semaphore_unlock(QUERY_CACHE_STATS_SEM);
+	POOL_SETMASK(&oldmask);
+}
+
+/*
+ * Count up number of cache blocks reused by pool_reuse_block().
+ */
+static void
+pool_stats_count_up_evicted_blocks(void)
+{
+	pool_sigset_t oldmask;
+
+	POOL_SETMASK2(&BlockSig, &oldmask);
+	pool_semaphore_lock(QUERY_CACHE_STATS_SEM);
+	stats->num_evicted_blocks++;
+	pool_semaphore_unlock(QUERY_CACHE_STATS_SEM);
+	POOL_SETMASK(&oldmask);
+}
+
 /*
  * Public API to invalidate query cache specified by the table/database oids.
  */
@@ -4823,7 +6866,7 @@ InvalidateQueryCache(int tableoid, int dboid)
 	/* Invalidate query cache */
 	pool_invalidate_query_cache(1, &tableoid, true, dboid);
 
-	pool_semaphore_unlock(QUERY_CACHE_STATS_SEM);
+	pool_shmem_unlock();
 	POOL_SETMASK(&oldmask);
 }
 
@@ -4841,22 +6884,16 @@ query_cache_delete_by_stmt(char *query, POOL_CONNECTION_POOL *backend)
 {
 	bool		rtn = true;
 	pool_sigset_t oldmask;
-
-	char		key[MAX_KEY];
 	POOL_CACHEID *cacheid;
 
 	POOL_SETMASK2(&BlockSig, &oldmask);
 	pool_shmem_lock(POOL_MEMQ_EXCLUSIVE_LOCK);
 
-	/* encode md5key */
-	encode_key(query, key, backend);
-
 	if (pool_is_shmem_cache())
-
 	{
 		POOL_QUERY_HASH hashkey;
 
-		memcpy(hashkey.query_hash, key, POOL_MD5_HASHKEYLEN);
+		encode_query_hash(query, NULL, 0, &hashkey, backend);
 		cacheid = pool_hash_search(&hashkey);
 		if (cacheid == NULL)
 			rtn = false;
@@ -4866,6 +6903,10 @@ query_cache_delete_by_stmt(char *query, POOL_CONNECTION_POOL *backend)
 	else
 #ifdef USE_MEMCACHED
 	{
+		char		key[MAX_KEY];
+
+		/* encode md5key */
+		encode_key(query, NULL, 0, key, backend);
 		if (delete_cache_on_memcached(key) == 0)
 			rtn = false;
 	}
@@ -4875,7 +6916,7 @@ query_cache_delete_by_stmt(char *query, POOL_CONNECTION_POOL *backend)
 				(errmsg("failed to delete query cache on memcached, memcached support is not enabled")));
 	}
 #endif
-	pool_semaphore_unlock(QUERY_CACHE_STATS_SEM);
+	pool_shmem_unlock();
 	POOL_SETMASK(&oldmask);
 
 	return rtn;
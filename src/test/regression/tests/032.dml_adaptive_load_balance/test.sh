@@ -142,6 +142,73 @@ EOF
 	fi
 	echo ok: T2 final read was load balanced.
 
+# restart with routing cache enabled and one more relationship
+	./shutdownall
+	echo "routing_cache_size = 128" >> etc/pgpool.conf
+	echo "dml_adaptive_object_relationship_list= 't1:t2,f1():tF,f2():t4'" >> etc/pgpool.conf
+	./startall
+	wait_for_pgpool_startup
+
+	$PSQL test <<EOF
+CREATE TABLE t4(i INTEGER);
+CREATE FUNCTION f2(INTEGER) returns INTEGER AS 'SELECT \$1' LANGUAGE SQL;
+EOF
+# wait for the newly created objects replicated
+sleep 1;
+$PSQL test <<EOF
+BEGIN;
+SELECT f1(1);						-- register routing cache
+COMMIT;
+BEGIN;
+SELECT i, 'QUERY ID T3-1' FROM tF; 			-- LOAD balance
+SELECT f1(1);						-- routing cache hit
+SELECT i, 'QUERY ID T3-2' FROM tF; 			-- NO LOAD balance
+COMMIT;
+BEGIN;
+SELECT i, 'QUERY ID T3-3' FROM t4; 			-- LOAD balance
+SELECT f1(2), f2(2);					-- f2 follows writing function
+SELECT i, 'QUERY ID T3-4' FROM t4; 			-- NO LOAD balance
+COMMIT;
+EOF
+
+	fgrep "SELECT i, 'QUERY ID T3-1' FROM tF;" log/pgpool.log |grep "DB node id: 1">/dev/null 2>&1
+	if [ $? != 0 ];then
+	# expected result not found
+		echo fail: "SELECT i, 'QUERY ID T3-1' FROM tF;" was not load balanced.
+		./shutdownall
+		exit 1
+	fi
+	echo ok: T3 first read was load balanced.
+
+# check if relationship is followed on routing cache hit
+	fgrep "SELECT i, 'QUERY ID T3-2' FROM tF;" log/pgpool.log |grep "DB node id: 0">/dev/null 2>&1
+	if [ $? != 0 ];then
+	# expected result not found
+		echo fail: "SELECT i, 'QUERY ID T3-2' FROM tF;" was wrongly load balanced.
+		./shutdownall
+		exit 1
+	fi
+	echo ok: adaptive load balance test with routing cache works.
+
+	fgrep "SELECT i, 'QUERY ID T3-3' FROM t4;" log/pgpool.log |grep "DB node id: 1">/dev/null 2>&1
+	if [ $? != 0 ];then
+	# expected result not found
+		echo fail: "SELECT i, 'QUERY ID T3-3' FROM t4;" was not load balanced.
+		./shutdownall
+		exit 1
+	fi
+	echo ok: T3 third read was load balanced.
+
+# check if relationship of the second function is followed
+	fgrep "SELECT i, 'QUERY ID T3-4' FROM t4;" log/pgpool.log |grep "DB node id: 0">/dev/null 2>&1
+	if [ $? != 0 ];then
+	# expected result not found
+		echo fail: "SELECT i, 'QUERY ID T3-4' FROM t4;" was wrongly load balanced.
+		./shutdownall
+		exit 1
+	fi
+	echo ok: adaptive load balance test with multiple functions works.
+
         ./shutdownall
         cd ..
 done
@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+#-------------------------------------------------------------------
+# test script for health_check_ping_period.
+#
+# 1) The health check connection is kept and pinged between checks.
+# 2) If the kept connection is broken, the health check process
+#    reconnects.  This must not trigger failover even if
+#    failover_on_backend_error is on.
+# 3) If the backend really goes down, failover still happens.
+#
+source $TESTLIBS
+TESTDIR=testdir
+PG_CTL=$PGBIN/pg_ctl
+PSQL=$PGBIN/psql
+export PGDATABASE=test
+
+rm -fr $TESTDIR
+mkdir $TESTDIR
+cd $TESTDIR
+
+# create test environment
+echo -n "creating test environment..."
+$PGPOOL_SETUP -m s -n 2 || exit 1
+echo "done."
+
+for i in 0 1
+do
+    echo "health_check_period$i = 1" >> etc/pgpool.conf
+    echo "health_check_max_retries$i = 3" >> etc/pgpool.conf
+    echo "health_check_retry_delay$i = 1" >> etc/pgpool.conf
+done
+echo "health_check_ping_period = 200" >> etc/pgpool.conf
+echo "failover_on_backend_error = on" >> etc/pgpool.conf
+# make sure that queries below are sent to node 0
+echo "backend_weight1 = 0" >> etc/pgpool.conf
+
+source ./bashrc.ports
+export PGPORT=$PGPOOL_PORT
+
+./startall
+wait_for_pgpool_startup
+
+# returns pid of the health check connection to node 0
+function health_check_pid
+{
+    $PSQL -t -A -c "SELECT pid FROM pg_stat_activity WHERE application_name = 'health_check0'"
+}
+
+sleep 3
+pid1=`health_check_pid`
+sleep 3
+pid2=`health_check_pid`
+
+# test1: the health check connection is kept
+if [ -z "$pid1" -o "$pid1" != "$pid2" ];then
+    echo "test1 failed: health check connection is not kept ($pid1, $pid2)."
+    ./shutdownall
+    exit 1
+fi
+echo "test1 ok."
+
+# test2: a broken health check connection is reconnected without failover
+$PSQL -c "SELECT pg_terminate_backend($pid1)"
+sleep 5
+
+grep "health check ping failed on DB node 0, reconnecting" log/pgpool.log
+if [ $? != 0 ];then
+    echo "test2 failed: broken health check connection is not detected."
+    ./shutdownall
+    exit 1
+fi
+
+$PSQL -c "show pool_nodes" |grep down
+if [ $? = 0 ];then
+    echo "test2 failed: failover is triggered by health check ping."
+    ./shutdownall
+    exit 1
+fi
+
+pid3=`health_check_pid`
+if [ -z "$pid3" -o "$pid3" = "$pid1" ];then
+    echo "test2 failed: health check connection is not reconnected ($pid1, $pid3)."
+    ./shutdownall
+    exit 1
+fi
+echo "test2 ok."
+
+# test3: failover still happens if the backend goes down
+$PG_CTL -D data1 -w -m f stop
+sleep 10
+
+$PSQL -c "show pool_nodes" |grep down
+if [ $? != 0 ];then
+    echo "test3 failed: failover is not triggered."
+    ./shutdownall
+    exit 1
+fi
+echo "test3 ok."
+
+./shutdownall
+exit 0
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+#-------------------------------------------------------------------
+# test script for skip_reset_for_stateless_session.
+#
+# Settings changed by set_config() must not leak to the next session
+# sharing the pooled backend connection, while reset queries of a
+# stateless session are skipped.
+#
+source $TESTLIBS
+TESTDIR=testdir
+PSQL=$PGBIN/psql
+export PGDATABASE=test
+
+rm -fr $TESTDIR
+mkdir $TESTDIR
+cd $TESTDIR
+
+# create test environment
+echo -n "creating test environment..."
+$PGPOOL_SETUP -m s -n 1 || exit 1
+echo "done."
+
+# let all sessions use the same backend connection
+echo "num_init_children = 1" >> etc/pgpool.conf
+echo "max_pool = 1" >> etc/pgpool.conf
+echo "skip_reset_for_stateless_session = on" >> etc/pgpool.conf
+echo "log_min_messages = debug1" >> etc/pgpool.conf
+
+source ./bashrc.ports
+export PGPORT=$PGPOOL_PORT
+
+./startall
+wait_for_pgpool_startup
+
+$PSQL -c "CREATE ROLE regress_role"
+
+default_path=`$PSQL -t -A -c "SHOW search_path"`
+
+# test1: reset queries of a stateless session are skipped
+$PSQL -c "SELECT 1"
+$PSQL -c "SELECT 1"
+grep "skipping reset query" log/pgpool.log
+if [ $? != 0 ];then
+    echo "test1 failed: reset queries are not skipped."
+    ./shutdownall
+    exit 1
+fi
+echo "test1 ok."
+
+# test2: search_path changed by set_config() does not leak
+$PSQL -c "SELECT set_config('search_path', 'pg_catalog', false)"
+path=`$PSQL -t -A -c "SHOW search_path"`
+if [ "$path" != "$default_path" ];then
+    echo "test2 failed: search_path leaked ($path)."
+    ./shutdownall
+    exit 1
+fi
+echo "test2 ok."
+
+# test3: role changed by set_config() does not leak
+$PSQL -c "SELECT set_config('role', 'regress_role', false)"
+role=`$PSQL -t -A -c "SELECT current_user"`
+if [ "$role" = "regress_role" ];then
+    echo "test3 failed: role leaked."
+    ./shutdownall
+    exit 1
+fi
+echo "test3 ok."
+
+# test4: same for set_config() called by an INSERT
+$PSQL -c "CREATE TABLE t1(s text)"
+$PSQL -c "INSERT INTO t1 SELECT set_config('search_path', 'pg_catalog', false)"
+path=`$PSQL -t -A -c "SHOW search_path"`
+if [ "$path" != "$default_path" ];then
+    echo "test4 failed: search_path leaked ($path)."
+    ./shutdownall
+    exit 1
+fi
+echo "test4 ok."
+
+./shutdownall
+exit 0
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+#-------------------------------------------------------------------
+# test script for multiplex_prepared_statements.
+#
+# Sessions sharing a backend connection must share a named prepared
+# statement of the same query, Close must not drop it from the backend,
+# and DEALLOCATE/DISCARD ALL must make pgbalancer forget it.
+#
+source $TESTLIBS
+TESTDIR=testdir
+PSQL=$PGBIN/psql
+PGPROTO=$PGPOOL_INSTALL_DIR/bin/pgproto
+export PGDATABASE=test
+
+rm -fr $TESTDIR
+mkdir $TESTDIR
+cd $TESTDIR
+
+# create test environment
+echo -n "creating test environment..."
+$PGPOOL_SETUP -m s -n 1 || exit 1
+echo "done."
+
+# let all sessions use the same backend connection and keep prepared
+# statements on it when a session ends
+echo "num_init_children = 1" >> etc/pgpool.conf
+echo "max_pool = 1" >> etc/pgpool.conf
+echo "reset_query_list = 'ABORT'" >> etc/pgpool.conf
+echo "multiplex_prepared_statements = on" >> etc/pgpool.conf
+
+source ./bashrc.ports
+export PGPORT=$PGPOOL_PORT
+
+./startall
+wait_for_pgpool_startup
+
+# run a pgproto session and fail if the backend reported an error
+function run_pgproto
+{
+	$PGPROTO -d $PGDATABASE -p $PGPOOL_PORT -f $1 > pgproto.out 2>&1
+	if [ $? != 0 ] || grep -q ErrorResponse pgproto.out; then
+		cat pgproto.out
+		echo "$2 failed."
+		./shutdownall
+		exit 1
+	fi
+}
+
+# check the number of pooled statements on the backend connection
+function check_pooled
+{
+	n=`$PSQL -t -A -c "SELECT count(*) FROM pg_prepared_statements WHERE name LIKE 'pgbalancer\_ps\_%'"`
+	if [ "$n" != "$1" ]; then
+		echo "$2 failed: $n pooled statements, expected $1."
+		./shutdownall
+		exit 1
+	fi
+}
+
+# test1: Close followed by re-Parse of the same name
+run_pgproto ../pgproto.data test1
+check_pooled 1 test1
+
+# test2: another session prepares the same query under another name
+run_pgproto ../pgproto2.data test2
+check_pooled 1 test2
+
+# test3: DEALLOCATE ALL clears the pooled set, so the statement is
+# prepared on the backend again
+$PSQL -c "DEALLOCATE ALL"
+check_pooled 0 test3
+run_pgproto ../pgproto.data test3
+check_pooled 1 test3
+
+# test4: same for DISCARD ALL
+$PSQL -c "DISCARD ALL"
+check_pooled 0 test4
+run_pgproto ../pgproto2.data test4
+check_pooled 1 test4
+
+./shutdownall
+exit 0
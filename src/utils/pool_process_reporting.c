@@ -102,7 +102,6 @@ send_row_description(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend,
 			pool_write(frontend, &s, sizeof(fsize));	/* field format (text) */
 		}
 	}
-	pool_flush(frontend);
 }
 
 /*
@@ -342,6 +341,11 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "whether to serialize accept() call", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "exclusive_accept", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->exclusive_accept);
+	StrNCpy(status[i].desc, "whether to wake up only one child for a connection", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	StrNCpy(status[i].name, "reserved_connections", POOLCONFIG_MAXNAMELEN);
 	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->reserved_connections);
 	StrNCpy(status[i].desc, "number of reserved connections", POOLCONFIG_MAXDESCLEN);
@@ -520,6 +524,16 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "queries issued at the end of session", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "skip_reset_for_stateless_session", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->skip_reset_for_stateless_session);
+	StrNCpy(status[i].desc, "skip reset queries if session left no state", POOLCONFIG_MAXDESCLEN);
+	i++;
+
+	StrNCpy(status[i].name, "multiplex_prepared_statements", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->multiplex_prepared_statements);
+	StrNCpy(status[i].desc, "share named prepared statements among sessions", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	/* REPLICATION MODE */
 
 	StrNCpy(status[i].name, "replicate_select", POOLCONFIG_MAXNAMELEN);
@@ -713,6 +727,11 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "health check retry delay", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "health_check_ping_period", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->health_check_ping_period);
+	StrNCpy(status[i].desc, "health check ping period in milliseconds", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	StrNCpy(status[i].name, "connect_timeout", POOLCONFIG_MAXNAMELEN);
 	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->connect_timeout);
 	StrNCpy(status[i].desc, "connect timeout", POOLCONFIG_MAXDESCLEN);
@@ -804,6 +823,11 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "number of relation cache entry", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "routing_cache_size", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->routing_cache_size);
+	StrNCpy(status[i].desc, "number of routing cache entry", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	StrNCpy(status[i].name, "check_temp_table", POOLCONFIG_MAXNAMELEN);
 	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->check_temp_table);
 	StrNCpy(status[i].desc, "enable temporary table check", POOLCONFIG_MAXDESCLEN);
@@ -819,6 +843,11 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "If true, relation cache stored in memory cache", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "shared_relcache_size", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->shared_relcache_size);
+	StrNCpy(status[i].desc, "number of shared relation cache entry", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	StrNCpy(status[i].name, "relcache_query_target", POOLCONFIG_MAXNAMELEN);
 	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->relcache_query_target);
 	StrNCpy(status[i].desc, "Target node to send relcache queries", POOLCONFIG_MAXDESCLEN);
@@ -1103,6 +1132,31 @@ get_config(int *nrows)
 	StrNCpy(status[i].desc, "Temporary work directory to record table oids", POOLCONFIG_MAXDESCLEN);
 	i++;
 
+	StrNCpy(status[i].name, "memqcache_oiddir_fallback", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->memqcache_oiddir_fallback);
+	StrNCpy(status[i].desc, "If true, record table oids in memqcache_oiddir when the oid map is full", POOLCONFIG_MAXDESCLEN);
+	i++;
+
+	StrNCpy(status[i].name, "memqcache_lazy_invalidation", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->memqcache_lazy_invalidation);
+	StrNCpy(status[i].desc, "If true, invalidate query cache by per table generation counters", POOLCONFIG_MAXDESCLEN);
+	i++;
+
+	StrNCpy(status[i].name, "memqcache_compress_threshold", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->memqcache_compress_threshold);
+	StrNCpy(status[i].desc, "Minimum SELECT result size in bytes to compress. 0 disables compression", POOLCONFIG_MAXDESCLEN);
+	i++;
+
+	StrNCpy(status[i].name, "memqcache_admission_control", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->memqcache_admission_control);
+	StrNCpy(status[i].desc, "If true, admit and evict query cache by query frequency", POOLCONFIG_MAXDESCLEN);
+	i++;
+
+	StrNCpy(status[i].name, "memqcache_coalesce_timeout", POOLCONFIG_MAXNAMELEN);
+	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%d", pool_config->memqcache_coalesce_timeout);
+	StrNCpy(status[i].desc, "Milliseconds to wait for the same query running concurrently on cache miss", POOLCONFIG_MAXDESCLEN);
+	i++;
+
 	StrNCpy(status[i].name, "memqcache_stats_start_time", POOLCONFIG_MAXNAMELEN);
 	snprintf(status[i].value, POOLCONFIG_MAXVALLEN, "%s", ctime(&pool_get_memqcache_stats()->start_time));
 	StrNCpy(status[i].desc, "Start time of query cache stats", POOLCONFIG_MAXDESCLEN);
@@ -1692,6 +1746,10 @@ get_pools(int *nrows)
 					elog(LOG, "pi->node_ids[0]:%ld pi->node_ids[1]:%ld",
 						 pi->node_ids[0], pi->node_ids[1]);
 				}
+				snprintf(pools[lines].pool_hits, sizeof(pools[lines].pool_hits),
+						 UINT64_FORMAT, pi->pool_hits);
+				snprintf(pools[lines].pool_misses, sizeof(pools[lines].pool_misses),
+						 UINT64_FORMAT, pi->pool_misses);
 				lines++;
 			}
 		}
@@ -1712,19 +1770,30 @@ pools_reporting(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend)
 		"backend_id", "database", "username", "backend_connection_time",
 		"client_connection_time", "client_disconnection_time", "client_idle_duration",
 		"majorversion", "minorversion", "pool_counter", "pool_backendpid", "pool_connected",
-	"status", "load_balance_node", "client_host", "client_port", "statement"};
+	"status", "load_balance_node", "client_host", "client_port", "statement",
+	"pool_hits", "pool_misses"};
 	int			n;
 	int		   *offsettbl;
 	int			nrows;
 	POOL_REPORT_POOLS *pools;
 
 	num_fields = sizeof(field_names) / sizeof(char *);
-	offsettbl = pool_report_pools_offsets(&n);
+
+	/*
+	 * pool_report_pools_offsets() is shared with pcp_proc_info, whose
+	 * protocol has a fixed number of fields. Add the hit and miss counters
+	 * here.
+	 */
+	offsettbl = palloc(sizeof(int) * num_fields);
+	memcpy(offsettbl, pool_report_pools_offsets(&n), sizeof(int) * n);
+	offsettbl[n] = offsetof(POOL_REPORT_POOLS, pool_hits);
+	offsettbl[n + 1] = offsetof(POOL_REPORT_POOLS, pool_misses);
 	pools = get_pools(&nrows);
 
 	send_row_description_and_data_rows(frontend, backend, num_fields, field_names, offsettbl,
 									   (char *) pools, sizeof(POOL_REPORT_POOLS), nrows);
 
+	pfree(offsettbl);
 	pfree(pools);
 }
 
@@ -1899,7 +1968,7 @@ version_reporting(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend)
 void
 cache_reporting(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend)
 {
-	static char *field_names[] = {"num_cache_hits", "num_selects", "cache_hit_ratio", "num_hash_entries", "used_hash_entries", "num_cache_entries", "used_cache_entries_size", "free_cache_entries_size", "fragment_cache_entries_size"};
+	static char *field_names[] = {"num_cache_hits", "num_selects", "cache_hit_ratio", "num_hash_entries", "used_hash_entries", "num_cache_entries", "used_cache_entries_size", "free_cache_entries_size", "fragment_cache_entries_size", "num_admission_rejects", "num_evicted_blocks", "hot_cache_entries", "max_cache_entry_hits", "num_coalesced_misses"};
 	short		num_fields = sizeof(field_names) / sizeof(char *);
 	int			i;
 	short		s;
@@ -1964,6 +2033,11 @@ cache_reporting(POOL_CONNECTION *frontend, POOL_CONNECTION_POOL *backend)
 	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%ld", mystats->used_cache_entries_size);
 	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%ld", mystats->free_cache_entries_size);
 	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%ld", mystats->fragment_cache_entries_size);
+	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%lld", mystats->cache_stats.num_admission_rejects);
+	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%lld", mystats->cache_stats.num_evicted_blocks);
+	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%d", mystats->hot_cache_entries);
+	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%u", mystats->max_cache_entry_hits);
+	snprintf(strp[i++].string, POOL_CACHE_STATS_MAX_STRING_LEN + 1, "%lld", mystats->cache_stats.num_coalesced_misses);
 
 	/*
 	 * Calculate total data length
@@ -9,6 +9,9 @@
  *-------------------------------------------------------------------------
  */
 #include "config.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -25,10 +28,74 @@
 #include "utils/memutils.h"
 #include "utils/elog.h"
 #include "parser/scansup.h"
+#include "auth/md5.h"
+#include "utils/pool_atomics.h"
+
+/*
+ * Shared relation cache.  If enable_shared_relcache is on and
+ * shared_relcache_size is greater than 0, results of relation cache queries
+ * are shared among child processes in this hash table rather than in the
+ * query cache.  Entries are keyed by md5 of the user name, the database name
+ * and the query, which contains the relation or function name and the kind
+ * of the lookup.  The user name is needed because unqualified names are
+ * resolved through search_path, which may differ among users.  Each bucket
+ * holds SHARED_RELCACHE_WAYS entries and has its own lock.
+ *
+ * A relation cache query sent before a DDL commits may see the old catalog,
+ * and one sent by the session running the DDL sees uncommitted catalog
+ * which vanishes on ROLLBACK.  So DDL invalidates the relation cache again
+ * when the transaction ends.  See pool_relcache_transaction_end().
+ */
+#define SHARED_RELCACHE_WAYS	4
+#define SHARED_RELCACHE_DATA_SIZE	256
+
+typedef struct
+{
+	char		key[33];		/* md5 of user, dbname and query, empty if
+								 * unused */
+	uint32		generation;		/* shared relcache generation at
+								 * registration */
+	time_t		expire;			/* cache expiration absolute time, or 0 */
+	int			datalen;		/* length of data */
+	char		data[SHARED_RELCACHE_DATA_SIZE];	/* serialized query result */
+} SharedRelCacheEntry;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int			next_victim;	/* entry to be replaced next */
+	SharedRelCacheEntry entries[SHARED_RELCACHE_WAYS];
+} SharedRelCacheBucket;
+
+typedef struct
+{
+	pool_atomic_uint32 generation;	/* incremented to invalidate all entries */
+	int			nbuckets;		/* number of buckets, power of 2 */
+} SharedRelCacheHeader;
+
+static SharedRelCacheHeader *shared_relcache;
+static SharedRelCacheBucket *shared_relcache_buckets;
+static pool_sigset_t shared_relcache_oldmask;
+
+/* Incremented to invalidate the local relation cache of this process */
+static uint32 local_relcache_generation = 0;
+
+/* DDL has been executed in the current transaction */
+static bool relcache_invalidate_at_end = false;
+static bool relcache_invalidate_shared_at_end = false;
 
 static void SearchRelCacheErrorCb(void *arg);
 static POOL_SELECT_RESULT *query_cache_to_relation_cache(char *data, size_t size);
 static char *relation_cache_to_query_cache(POOL_SELECT_RESULT *res, size_t *size);
+static uint32 relcache_hash(const char *dbname, const char *relname);
+static void relcache_unlink(POOL_RELCACHE *relcache, int index);
+static uint32 relcache_generation(void);
+static int	shared_relcache_nbuckets(void);
+static void shared_relcache_key(const char *user, const char *dbname, const char *query, char *key);
+static bool shared_relcache_search(const char *key, char **data, size_t *len);
+static void shared_relcache_store(const char *key, uint32 generation, const char *data, size_t len);
+static void shared_relcache_lock(SharedRelCacheBucket *bucket);
+static void shared_relcache_unlock(SharedRelCacheBucket *bucket);
 
 
 /*
@@ -42,6 +109,8 @@ pool_create_relcache(int cachesize, char *sql,
 	POOL_RELCACHE *p;
 	PoolRelCache *ip;
 	MemoryContext old_context;
+	int			nbuckets;
+	int			i;
 
 	if (cachesize < 0)
 	{
@@ -59,8 +128,17 @@ pool_create_relcache(int cachesize, char *sql,
 	ip = (PoolRelCache *) palloc0(sizeof(PoolRelCache) * cachesize);
 	p = (POOL_RELCACHE *) palloc(sizeof(POOL_RELCACHE));
 
+	for (nbuckets = 8; nbuckets < cachesize; nbuckets <<= 1)
+		;
+	p->buckets = (int *) palloc(sizeof(int) * nbuckets);
+
 	MemoryContextSwitchTo(old_context);
 
+	for (i = 0; i < nbuckets; i++)
+		p->buckets[i] = -1;
+	for (i = 0; i < cachesize; i++)
+		ip[i].next = -1;
+
 	p->num = cachesize;
 	strlcpy(p->sql, sql, sizeof(p->sql));
 	p->register_func = register_func;
@@ -68,6 +146,7 @@ pool_create_relcache(int cachesize, char *sql,
 	p->cache_is_session_local = issessionlocal;
 	p->no_cache_if_zero = false;
 	p->cache = ip;
+	p->nbuckets = nbuckets;
 
 	return p;
 }
@@ -84,6 +163,7 @@ pool_discard_relcache(POOL_RELCACHE *relcache)
 	{
 		(*relcache->unregister_func) (relcache->cache[i].data);
 	}
+	pfree(relcache->buckets);
 	pfree(relcache->cache);
 	pfree(relcache);
 }
@@ -112,6 +192,13 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 	size_t		query_cache_len;
 	POOL_SESSION_CONTEXT *session_context;
 	int			node_id;
+	uint32		hash;
+	uint32		generation;
+	uint32		shared_generation = 0;
+	int			expired = -1;
+	bool		use_shared_relcache;
+	bool		use_query_cache;
+	char		shared_key[33];
 
 	session_context = pool_get_session_context(false);
 
@@ -153,9 +240,11 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 	}
 
 	now = time(NULL);
+	generation = relcache_generation();
+	hash = relcache_hash(dbname, table);
 
 	/* Look for cache first */
-	for (i = 0; i < relcache->num; i++)
+	for (i = relcache->buckets[hash & (relcache->nbuckets - 1)]; i >= 0; i = relcache->cache[i].next)
 	{
 		/*
 		 * If cache is session local, we need to check session id
@@ -166,7 +255,8 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 				continue;
 		}
 
-		if (strcasecmp(relcache->cache[i].dbname, dbname) == 0 &&
+		if (relcache->cache[i].hash == hash &&
+			strcasecmp(relcache->cache[i].dbname, dbname) == 0 &&
 			strcasecmp(relcache->cache[i].relname, table) == 0)
 		{
 			if (relcache->cache[i].expire > 0)
@@ -178,10 +268,23 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 							 errdetail("relcache for database:%s table:%s expired. now:%ld expiration time:%ld", dbname, table, now, relcache->cache[i].expire)));
 
 					relcache->cache[i].refcnt = 0;
+					expired = i;
 					break;
 				}
 			}
 
+			/* Invalidated by DDL? */
+			if (relcache->cache[i].generation != generation)
+			{
+				ereport(DEBUG1,
+						(errmsg("searching relcache"),
+						 errdetail("relcache for database:%s table:%s invalidated", dbname, table)));
+
+				relcache->cache[i].refcnt = 0;
+				expired = i;
+				break;
+			}
+
 			/* Found */
 			if (relcache->cache[i].refcnt < INT_MAX)
 				relcache->cache[i].refcnt++;
@@ -209,10 +312,25 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 
 	locked = pool_is_shmem_lock();
 
+	/*
+	 * Session local caches are never shared.  The dedicated shared relation
+	 * cache is used instead of the query cache if it exists.
+	 */
+	use_shared_relcache = shared_relcache != NULL && !relcache->cache_is_session_local;
+	use_query_cache = pool_config->enable_shared_relcache && shared_relcache == NULL;
+
+	if (use_shared_relcache)
+	{
+		shared_generation = pool_atomic_read_u32(&shared_relcache->generation);
+		shared_relcache_key(backend->info->user, dbname, query, shared_key);
+		if (shared_relcache_search(shared_key, &query_cache_data, &query_cache_len))
+			query_cache_not_found = 0;
+	}
+
 	/*
 	 * if enable_shared_relcache is true, search query cache.
 	 */
-	if (pool_config->enable_shared_relcache)
+	else if (use_query_cache)
 	{
 		/* if shmem is not locked by this process, get the lock */
 		if (!locked)
@@ -223,7 +341,7 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 		PG_TRY();
 		{
 			/* search catalog cache in query cache */
-			query_cache_not_found = pool_fetch_cache(backend, query, &query_cache_data, &query_cache_len);
+			query_cache_not_found = pool_fetch_cache(backend, query, NULL, 0, &query_cache_data, &query_cache_len);
 		}
 		PG_CATCH();
 		{
@@ -243,8 +361,14 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 		do_query(CONNECTION(backend, node_id), query, &res, MAJOR(backend));
 		/* Register cache */
 		result = (*relcache->register_func) (res);
+		if (use_shared_relcache)
+		{
+			query_cache_data = relation_cache_to_query_cache(res, &query_cache_len);
+			shared_relcache_store(shared_key, shared_generation, query_cache_data, query_cache_len);
+		}
+
 		/* save local catalog cache in query cache */
-		if (pool_config->enable_shared_relcache)
+		else if (use_query_cache)
 		{
 			query_cache_data = relation_cache_to_query_cache(res, &query_cache_len);
 
@@ -275,7 +399,7 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 		result = (*relcache->register_func) (res);
 	}
 	/* if shmem is locked by this function, unlock it */
-	if (pool_config->enable_shared_relcache && !locked)
+	if (use_query_cache && !locked)
 	{
 		pool_shmem_unlock();
 		POOL_SETMASK(&oldmask);
@@ -284,9 +408,12 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 	error_context_stack = callback.previous;
 
 	/*
-	 * Look for replacement in cache
+	 * Look for replacement in cache.  An expired entry for the same relation
+	 * is replaced by itself.
 	 */
-	for (i = 0; i < relcache->num; i++)
+	if (expired >= 0)
+		index = expired;
+	for (i = 0; expired < 0 && i < relcache->num; i++)
 	{
 		/*
 		 * If cache is session local, we can discard old cache immediately
@@ -323,10 +450,15 @@ pool_search_relcache(POOL_RELCACHE *relcache, POOL_CONNECTION_POOL *backend, cha
 
 	if (!pool_is_ignore_till_sync() && (!relcache->no_cache_if_zero || result))
 	{
+		relcache_unlink(relcache, index);
 		strlcpy(relcache->cache[index].dbname, dbname, MAX_ITEM_LENGTH);
 		strlcpy(relcache->cache[index].relname, table, MAX_ITEM_LENGTH);
 		relcache->cache[index].refcnt = 1;
 		relcache->cache[index].session_id = local_session_id;
+		relcache->cache[index].generation = generation;
+		relcache->cache[index].hash = hash;
+		relcache->cache[index].next = relcache->buckets[hash & (relcache->nbuckets - 1)];
+		relcache->buckets[hash & (relcache->nbuckets - 1)] = index;
 		if (pool_config->relcache_expire > 0)
 		{
 			relcache->cache[index].expire = now + pool_config->relcache_expire;
@@ -354,6 +486,343 @@ SearchRelCacheErrorCb(void *arg)
 	errcontext("while searching system catalog, When relcache is missed");
 }
 
+/*
+ * Case insensitive hash of database name and relation name.
+ */
+static uint32
+relcache_hash(const char *dbname, const char *relname)
+{
+	uint32		h = 2166136261U;
+	const char *p;
+
+	for (p = dbname; *p; p++)
+	{
+		h ^= (unsigned char) tolower((unsigned char) *p);
+		h *= 16777619U;
+	}
+	h *= 16777619U;				/* separate dbname and relname */
+	for (p = relname; *p; p++)
+	{
+		h ^= (unsigned char) tolower((unsigned char) *p);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Remove the cache entry from its hash chain if it's in one.
+ */
+static void
+relcache_unlink(POOL_RELCACHE *relcache, int index)
+{
+	int		   *p = &relcache->buckets[relcache->cache[index].hash & (relcache->nbuckets - 1)];
+
+	while (*p >= 0)
+	{
+		if (*p == index)
+		{
+			*p = relcache->cache[index].next;
+			relcache->cache[index].next = -1;
+			return;
+		}
+		p = &relcache->cache[*p].next;
+	}
+}
+
+/*
+ * Current relcache generation.  Local cache entries registered with another
+ * generation are regarded as invalidated.
+ */
+static uint32
+relcache_generation(void)
+{
+	uint32		generation = local_relcache_generation;
+
+	if (shared_relcache)
+		generation += pool_atomic_read_u32(&shared_relcache->generation);
+	return generation;
+}
+
+/*
+ * Invalidate all relation cache entries of this process.  If "shared" is
+ * true, entries of other processes and the shared relation cache are
+ * invalidated as well.  Called when DDL which may change results of
+ * relation cache queries has been executed.  Statements only affecting
+ * temporary objects need not to invalidate other processes' cache.
+ *
+ * The cache is invalidated once more at the end of the transaction, since
+ * entries registered until then may reflect the catalog before the commit
+ * or uncommitted catalog.
+ */
+void
+pool_relcache_invalidate(bool shared)
+{
+	local_relcache_generation++;
+
+	if (shared && shared_relcache)
+		pool_atomic_fetch_add_u32(&shared_relcache->generation, 1);
+
+	relcache_invalidate_at_end = true;
+	if (shared)
+		relcache_invalidate_shared_at_end = true;
+
+	ereport(DEBUG1,
+			(errmsg("relation cache invalidated"),
+			 errdetail("shared: %d", shared)));
+}
+
+/*
+ * Called when the backend reports that it is out of transaction.  If DDL
+ * was executed in the transaction, invalidate the relation cache again.
+ */
+void
+pool_relcache_transaction_end(void)
+{
+	bool		shared = relcache_invalidate_shared_at_end;
+
+	if (!relcache_invalidate_at_end)
+		return;
+
+	relcache_invalidate_at_end = false;
+	relcache_invalidate_shared_at_end = false;
+
+	local_relcache_generation++;
+
+	if (shared && shared_relcache)
+		pool_atomic_fetch_add_u32(&shared_relcache->generation, 1);
+
+	ereport(DEBUG1,
+			(errmsg("relation cache invalidated at transaction end"),
+			 errdetail("shared: %d", shared)));
+}
+
+static int
+shared_relcache_nbuckets(void)
+{
+	size_t		nbuckets;
+
+	/* shared_relcache_size is limited far below INT_MAX by the config */
+	for (nbuckets = 1; nbuckets * SHARED_RELCACHE_WAYS < (size_t) pool_config->shared_relcache_size; nbuckets <<= 1)
+		;
+	return (int) nbuckets;
+}
+
+/*
+ * Returns the shared memory size needed for the shared relation cache.
+ */
+size_t
+pool_shared_relcache_size(void)
+{
+	return MAXALIGN(sizeof(SharedRelCacheHeader)) +
+		sizeof(SharedRelCacheBucket) * shared_relcache_nbuckets();
+}
+
+/*
+ * Allocate and initialize the shared relation cache.  This should be called
+ * only once from pgpool main process at the process staring up time.
+ */
+void
+pool_init_shared_relcache(void)
+{
+	pthread_mutexattr_t attr;
+	char	   *p;
+	int			rc;
+	int			i;
+
+	p = pool_shared_memory_segment_get_chunk(pool_shared_relcache_size());
+	shared_relcache = (SharedRelCacheHeader *) p;
+	shared_relcache_buckets = (SharedRelCacheBucket *) (p + MAXALIGN(sizeof(SharedRelCacheHeader)));
+
+	memset(p, 0, pool_shared_relcache_size());
+	pool_atomic_init_u32(&shared_relcache->generation, 0);
+	shared_relcache->nbuckets = shared_relcache_nbuckets();
+
+	rc = pthread_mutexattr_init(&attr);
+	if (rc == 0)
+		rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (rc == 0)
+		rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (i = 0; rc == 0 && i < shared_relcache->nbuckets; i++)
+		rc = pthread_mutex_init(&shared_relcache_buckets[i].lock, &attr);
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to initialize shared relation cache lock"),
+				 errdetail("%s", strerror(rc))));
+
+	pthread_mutexattr_destroy(&attr);
+
+	ereport(LOG,
+			(errmsg("shared relation cache initialized"),
+			 errdetail("%d entries", shared_relcache->nbuckets * SHARED_RELCACHE_WAYS)));
+}
+
+/*
+ * Compute the shared relation cache key of the query run by the user in the
+ * database.
+ */
+static void
+shared_relcache_key(const char *user, const char *dbname, const char *query, char *key)
+{
+	char		buf[MAX_ITEM_LENGTH * 2 + MAX_QUERY_LENGTH + 1];
+	int			userlen = strlen(user) + 1;
+	int			dblen = strlen(dbname) + 1;
+	int			len;
+
+	if (userlen > MAX_ITEM_LENGTH)
+		userlen = MAX_ITEM_LENGTH;
+	memcpy(buf, user, userlen);
+	if (dblen > MAX_ITEM_LENGTH)
+		dblen = MAX_ITEM_LENGTH;
+	memcpy(buf + userlen, dbname, dblen);
+	len = strlcpy(buf + userlen + dblen, query, MAX_QUERY_LENGTH + 1);
+	if (len > MAX_QUERY_LENGTH)
+		len = MAX_QUERY_LENGTH;
+
+	pool_md5_hash(buf, userlen + dblen + len, key);
+}
+
+/*
+ * Lock or unlock a bucket of the shared relation cache.  Signals are
+ * blocked while holding the lock so that the process does not exit leaving
+ * the bucket locked.  If a process crashed while holding the lock anyway,
+ * the entries of the bucket are discarded since they may be half written.
+ */
+static void
+shared_relcache_lock(SharedRelCacheBucket *bucket)
+{
+	int			rc;
+
+	POOL_SETMASK2(&BlockSig, &shared_relcache_oldmask);
+
+	rc = pthread_mutex_lock(&bucket->lock);
+	if (rc == EOWNERDEAD)
+	{
+		ereport(LOG,
+				(errmsg("shared relation cache lock was held by a process which exited abnormally")));
+
+		memset(bucket->entries, 0, sizeof(bucket->entries));
+		bucket->next_victim = 0;
+		rc = pthread_mutex_consistent(&bucket->lock);
+	}
+
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to lock shared relation cache"),
+				 errdetail("%s", strerror(rc))));
+}
+
+static void
+shared_relcache_unlock(SharedRelCacheBucket *bucket)
+{
+	int			rc;
+
+	rc = pthread_mutex_unlock(&bucket->lock);
+	POOL_SETMASK(&shared_relcache_oldmask);
+
+	if (rc != 0)
+		ereport(FATAL,
+				(errmsg("failed to unlock shared relation cache"),
+				 errdetail("%s", strerror(rc))));
+}
+
+/*
+ * Search the shared relation cache.  If found, return true and set palloc'd
+ * copy of the serialized query result to *data.
+ */
+static bool
+shared_relcache_search(const char *key, char **data, size_t *len)
+{
+	SharedRelCacheBucket *bucket;
+	uint32		generation;
+	time_t		now = time(NULL);
+	bool		found = false;
+	int			i;
+
+	bucket = &shared_relcache_buckets[hash_any((unsigned char *) key, 32) & (shared_relcache->nbuckets - 1)];
+	generation = pool_atomic_read_u32(&shared_relcache->generation);
+
+	shared_relcache_lock(bucket);
+
+	for (i = 0; i < SHARED_RELCACHE_WAYS; i++)
+	{
+		SharedRelCacheEntry *entry = &bucket->entries[i];
+
+		if (strcmp(entry->key, key) != 0)
+			continue;
+
+		if (entry->generation == generation &&
+			(entry->expire == 0 || entry->expire >= now))
+		{
+			*data = palloc(entry->datalen);
+			memcpy(*data, entry->data, entry->datalen);
+			*len = entry->datalen;
+			found = true;
+		}
+		break;
+	}
+
+	shared_relcache_unlock(bucket);
+
+	ereport(DEBUG1,
+			(errmsg("searching shared relation cache"),
+			 errdetail("key: %s found: %d", key, found)));
+
+	return found;
+}
+
+/*
+ * Store the serialized query result into the shared relation cache.
+ * "generation" is the shared relcache generation when the query was sent.
+ */
+static void
+shared_relcache_store(const char *key, uint32 generation, const char *data, size_t len)
+{
+	SharedRelCacheBucket *bucket;
+	SharedRelCacheEntry *entry = NULL;
+	uint32		current;
+	time_t		now = time(NULL);
+	int			i;
+
+	/* Too large results are not shared */
+	if (len > SHARED_RELCACHE_DATA_SIZE)
+		return;
+
+	bucket = &shared_relcache_buckets[hash_any((unsigned char *) key, 32) & (shared_relcache->nbuckets - 1)];
+	current = pool_atomic_read_u32(&shared_relcache->generation);
+
+	shared_relcache_lock(bucket);
+
+	/* Same key, unused, invalidated or expired entry can be used */
+	for (i = 0; i < SHARED_RELCACHE_WAYS; i++)
+	{
+		SharedRelCacheEntry *e = &bucket->entries[i];
+
+		if (strcmp(e->key, key) == 0)
+		{
+			entry = e;
+			break;
+		}
+		if (entry == NULL &&
+			(e->key[0] == '\0' || e->generation != current ||
+			 (e->expire > 0 && e->expire < now)))
+			entry = e;
+	}
+
+	if (entry == NULL)
+	{
+		entry = &bucket->entries[bucket->next_victim];
+		bucket->next_victim = (bucket->next_victim + 1) % SHARED_RELCACHE_WAYS;
+	}
+
+	strlcpy(entry->key, key, sizeof(entry->key));
+	entry->generation = generation;
+	entry->expire = pool_config->relcache_expire > 0 ? now + pool_config->relcache_expire : 0;
+	entry->datalen = len;
+	memcpy(entry->data, data, len);
+
+	shared_relcache_unlock(bucket);
+}
+
 
 /*
  * SplitIdentifierString --- parse a string containing identifiers
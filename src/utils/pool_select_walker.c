@@ -33,6 +33,9 @@ typedef enum
 } FUNC_VOLATILE_PROPERTY;
 
 static bool function_call_walker(Node *node, void *context);
+static bool is_writing_function(char *fname);
+static bool is_cache_unsafe_function(char *fname);
+static bool routing_facts_walker(Node *node, void *context);
 static bool system_catalog_walker(Node *node, void *context);
 static bool is_system_catalog(char *table_name);
 static bool temp_table_walker(Node *node, void *context);
@@ -45,6 +48,7 @@ static bool insertinto_or_locking_clause_walker(Node *node, void *context);
 static bool is_immutable_function(char *fname);
 static bool select_table_walker(Node *node, void *context);
 static bool non_immutable_function_call_walker(Node *node, void *context);
+static bool session_function_call_walker(Node *node, void *context);
 static char *strip_quote(char *str);
 static bool function_volatile_property(char *fname, FUNC_VOLATILE_PROPERTY property);
 static bool function_has_return_type(char *fname, char *typename);
@@ -215,6 +219,37 @@ pool_has_insertinto_or_locking_clause(Node *node)
 	return ctx.has_insertinto_or_locking_clause;
 }
 
+/*
+ * Collect facts about this SELECT which are used to decide where to send it
+ * and whether to cache it, walking the parse tree only once.  "requested" is
+ * OR'ed ROUTING_FACT_* flags.  Since every consumer treats any of the facts
+ * as a reason to give up load balancing or caching, the walk stops as soon
+ * as one of the requested facts is found, and the rest are left false.
+ * This also avoids issuing relation cache queries that cannot change the
+ * decision anymore.
+ */
+void
+pool_get_query_routing_facts(Node *node, int requested, QueryRoutingFacts *facts)
+{
+	memset(facts, 0, sizeof(*facts));
+	facts->requested = requested;
+
+	if (requested == 0 || !IsA(node, SelectStmt))
+		return;
+
+	raw_expression_tree_walker(node, routing_facts_walker, facts);
+
+	ereport(DEBUG1,
+			(errmsg("collected query routing facts"),
+			 errdetail("requested = 0x%x found = %d system catalog = %d temp table = %d unlogged table = %d view = %d row security = %d function call = %d non immutable function call = %d insert into or locking clause = %d",
+					   requested, facts->found,
+					   facts->has_system_catalog, facts->has_temp_table,
+					   facts->has_unlogged_table, facts->has_view,
+					   facts->has_row_security, facts->has_function_call,
+					   facts->has_non_immutable_function_call,
+					   facts->has_insertinto_or_locking_clause)));
+}
+
 /*
  * Search function name in readonlylist or writelist regex array
  * Return 1 on success (found in list)
@@ -231,26 +266,27 @@ pattern_compare(char *str, const int type, const char *param_name)
 
 	RegPattern *lists_patterns;
 	int		   *pattc;
+	RegLiteralIndex *literals;
 
 	if (strcmp(param_name, "read_only_function_list") == 0 ||
 		strcmp(param_name, "write_function_list") == 0)
 	{
 		lists_patterns = pool_config->lists_patterns;
 		pattc = &pool_config->pattc;
-
+		literals = &pool_config->patterns_literals;
 	}
 	else if (strcmp(param_name, "cache_safe_memqcache_table_list") == 0 ||
 			 strcmp(param_name, "cache_unsafe_memqcache_table_list") == 0)
 	{
 		lists_patterns = pool_config->lists_memqcache_table_patterns;
 		pattc = &pool_config->memqcache_table_pattc;
-
+		literals = &pool_config->memqcache_table_patterns_literals;
 	}
 	else if (strcmp(param_name, "primary_routing_query_pattern_list") == 0)
 	{
 		lists_patterns = pool_config->lists_query_patterns;
 		pattc = &pool_config->query_pattc;
-
+		literals = &pool_config->query_patterns_literals;
 	}
 	else
 	{
@@ -259,54 +295,74 @@ pattern_compare(char *str, const int type, const char *param_name)
 		return -1;
 	}
 
-	s = strip_quote(str);
-	if (!s)
+	if (*pattc == 0)
+		return 0;
+
+	/* Most names are not quoted. Avoid copying them. */
+	if (strchr(str, '"'))
 	{
-		elog(WARNING, "pattern_compare: strip_quote() returns error");
-		return -1;
+		s = strip_quote(str);
+		if (!s)
+		{
+			elog(WARNING, "pattern_compare: strip_quote() returns error");
+			return -1;
+		}
 	}
+	else
+		s = str;
 
-	for (i = 0; i < *pattc; i++)
+	/*
+	 * Patterns without regex special characters are looked up in the hash
+	 * index.  Only if none of them matches, try the regular expressions.
+	 */
+	i = regex_literal_match(literals, s, type);
+	if (i < 0)
 	{
-		if (lists_patterns[i].type != type)
-			continue;
+		for (i = 0; i < *pattc; i++)
+		{
+			if (lists_patterns[i].type != type || lists_patterns[i].literal)
+				continue;
+
+			if (regexec(&lists_patterns[i].regexv, s, 0, 0, 0) == 0)
+				break;
+
+			ereport(DEBUG2,
+					(errmsg("comparing function name in write/readonly list regex array"),
+					 errdetail("pattern_compare: %s (%s) not matched: %s",
+							   param_name, lists_patterns[i].pattern, s)));
+		}
+	}
 
-		if (regexec(&lists_patterns[i].regexv, s, 0, 0, 0) == 0)
+	if (i < *pattc)
+	{
+		switch (type)
 		{
-			switch (type)
-			{
-					/* return 1 if string matches readonly list pattern */
-				case READONLYLIST:
-					ereport(DEBUG2,
-							(errmsg("comparing function name in readonly list regex array"),
-							 errdetail("pattern_compare: %s (%s) matched: %s",
-									   param_name, lists_patterns[i].pattern, s)));
-					result = 1;
-					break;
-					/* return 1 if string matches writelist pattern */
-				case WRITELIST:
-					ereport(DEBUG2,
-							(errmsg("comparing function name in writelist regex array"),
-							 errdetail("pattern_compare: %s (%s) matched: %s",
-									   param_name, lists_patterns[i].pattern, s)));
-					result = 1;
-					break;
-				default:
-					ereport(WARNING,
-							(errmsg("pattern_compare: \"%s\" unknown pattern match type: \"%s\"", param_name, s)));
-					result = -1;
-					break;
-			}
-			/* return the result */
-			break;
+				/* return 1 if string matches readonly list pattern */
+			case READONLYLIST:
+				ereport(DEBUG2,
+						(errmsg("comparing function name in readonly list regex array"),
+						 errdetail("pattern_compare: %s (%s) matched: %s",
+								   param_name, lists_patterns[i].pattern, s)));
+				result = 1;
+				break;
+				/* return 1 if string matches writelist pattern */
+			case WRITELIST:
+				ereport(DEBUG2,
+						(errmsg("comparing function name in writelist regex array"),
+						 errdetail("pattern_compare: %s (%s) matched: %s",
+								   param_name, lists_patterns[i].pattern, s)));
+				result = 1;
+				break;
+			default:
+				ereport(WARNING,
+						(errmsg("pattern_compare: \"%s\" unknown pattern match type: \"%s\"", param_name, s)));
+				result = -1;
+				break;
 		}
-		ereport(DEBUG2,
-				(errmsg("comparing function name in write/readonly list regex array"),
-				 errdetail("pattern_compare: %s (%s) not matched: %s",
-						   param_name, lists_patterns[i].pattern, s)));
 	}
 
-	free(s);
+	if (s != str)
+		free(s);
 	return result;
 }
 
@@ -396,63 +452,49 @@ function_call_walker(Node *node, void *context)
 				}
 			}
 
-			/*
-			 * If both read_only_function_list and write_function_list is
-			 * empty, check volatile property of the function in the system
-			 * catalog.
-			 */
-			if (pool_config->num_read_only_function_list == 0 &&
-				pool_config->num_write_function_list == 0)
+			if (is_writing_function(fname))
 			{
-				if (function_volatile_property(fname, FUNC_VOLATILE))
-				{
-					ctx->has_function_call = true;
-					return false;
-				}
-				return raw_expression_tree_walker(node, function_call_walker, context);
-			}
-
-			/*
-			 * Check read_only list if any.
-			 */
-			if (pool_config->num_read_only_function_list > 0)
-			{
-				/* Search function in the read_only list regex patterns */
-				if (pattern_compare(fname, READONLYLIST, "read_only_function_list") == 1)
-				{
-					/*
-					 * If the function is found in the read_only list, we can
-					 * ignore it
-					 */
-					return raw_expression_tree_walker(node, function_call_walker, context);
-				}
-
-				/*
-				 * Since the function was not found in read_only list, we have
-				 * found a writing function.
-				 */
 				ctx->has_function_call = true;
 				return false;
 			}
-
-			/*
-			 * Check write list if any.
-			 */
-			if (pool_config->num_write_function_list > 0)
-			{
-				/* Search function in the write list regex patterns */
-				if (pattern_compare(fname, WRITELIST, "write_function_list") == 1)
-				{
-					/* Found. */
-					ctx->has_function_call = true;
-					return false;
-				}
-			}
 		}
 	}
 	return raw_expression_tree_walker(node, function_call_walker, context);
 }
 
+/*
+ * Return true if the function is supposed to write database.  We check
+ * write/read_only function list, or volatile property of the function if
+ * both lists are empty.
+ */
+static bool
+is_writing_function(char *fname)
+{
+	/*
+	 * If both read_only_function_list and write_function_list is empty,
+	 * check volatile property of the function in the system catalog.
+	 */
+	if (pool_config->num_read_only_function_list == 0 &&
+		pool_config->num_write_function_list == 0)
+		return function_volatile_property(fname, FUNC_VOLATILE);
+
+	/*
+	 * Check read_only list if any.  If the function is found in the
+	 * read_only list, we can ignore it.  Otherwise we have found a writing
+	 * function.
+	 */
+	if (pool_config->num_read_only_function_list > 0)
+		return pattern_compare(fname, READONLYLIST, "read_only_function_list") != 1;
+
+	/*
+	 * Check write list if any.
+	 */
+	if (pool_config->num_write_function_list > 0)
+		return pattern_compare(fname, WRITELIST, "write_function_list") == 1;
+
+	return false;
+}
+
 /*
  * Walker function to find a system catalog
  */
@@ -597,6 +639,131 @@ row_security_enabled_walker(Node *node, void *context)
 	return raw_expression_tree_walker(node, row_security_enabled_walker, context);
 }
 
+#define ROUTING_FACT_REQUESTED(facts, fact) (((facts)->requested & (fact)) != 0)
+
+/*
+ * Walker function for pool_get_query_routing_facts().  Does the checks of
+ * the walkers above in one pass.  Returns true to abort the walk once a
+ * requested fact is found.
+ *
+ * If function calls are requested and dml_adaptive_object_relationship_list
+ * is in effect, every function call must be passed to
+ * check_object_relationship_list().  In this case the walk goes on after a
+ * fact is found, but only looks at function calls.
+ */
+static bool
+routing_facts_walker(Node *node, void *context)
+{
+	QueryRoutingFacts *facts = (QueryRoutingFacts *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (facts->found)
+	{
+		if (IsA(node, FuncCall) && list_length(((FuncCall *) node)->funcname) > 0)
+			check_object_relationship_list(strVal(llast(((FuncCall *) node)->funcname)), true);
+	}
+	else if (IsA(node, IntoClause) || IsA(node, LockingClause))
+	{
+		if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_INTO_OR_LOCKING))
+			facts->has_insertinto_or_locking_clause = true;
+	}
+	else if (IsA(node, RangeVar))
+	{
+		RangeVar   *rgv = (RangeVar *) node;
+		char	   *relname = NULL;
+
+		ereport(DEBUG1,
+				(errmsg("routing facts walker. checking relation \"%s\"", rgv->relname)));
+
+		if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_SYSTEM_CATALOG) &&
+			is_system_catalog(rgv->relname))
+			facts->has_system_catalog = true;
+		else if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_TEMP_TABLE) &&
+				 is_temp_table(rgv->relname))
+			facts->has_temp_table = true;
+		else if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_UNLOGGED_TABLE |
+										ROUTING_FACT_VIEW |
+										ROUTING_FACT_ROW_SECURITY))
+		{
+			relname = make_table_name_from_rangevar(rgv);
+
+			if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_UNLOGGED_TABLE) &&
+				is_unlogged_table(relname))
+				facts->has_unlogged_table = true;
+			else if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_VIEW) &&
+					 is_view(relname))
+				facts->has_view = true;
+			else if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_ROW_SECURITY) &&
+					 row_security_enabled(relname))
+				facts->has_row_security = true;
+		}
+	}
+	else if (IsA(node, FuncCall))
+	{
+		FuncCall   *fcall = (FuncCall *) node;
+		char	   *fname;
+
+		if (list_length(fcall->funcname) > 0)
+		{
+			fname = make_function_name_from_funccall(fcall);
+
+			ereport(DEBUG1,
+					(errmsg("routing facts walker. checking function \"%s\"", fname)));
+
+			if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_FUNCTION_CALL))
+			{
+				check_object_relationship_list(strVal(llast(fcall->funcname)), true);
+
+				if (is_writing_function(fname))
+					facts->has_function_call = true;
+			}
+			if (!facts->has_function_call &&
+				ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_NON_IMMUTABLE_FUNCTION) &&
+				is_cache_unsafe_function(fname))
+				facts->has_non_immutable_function_call = true;
+		}
+	}
+	else if (IsA(node, TypeCast))
+	{
+		/*
+		 * TIMESTAMP WITH TIME ZONE and TIME WITH TIME ZONE should not be
+		 * cached.
+		 */
+		TypeCast   *tc = (TypeCast *) node;
+
+		if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_NON_IMMUTABLE_FUNCTION) &&
+			(isSystemType((Node *) tc->typeName, "timestamptz") ||
+			 isSystemType((Node *) tc->typeName, "timetz")))
+			facts->has_non_immutable_function_call = true;
+	}
+	else if (IsA(node, SQLValueFunction))
+	{
+		/*
+		 * SQLValueFunctions (CURRENT_TIME, CURRENT_USER etc.) are regarded as
+		 * non immutable functions.
+		 */
+		if (ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_NON_IMMUTABLE_FUNCTION))
+			facts->has_non_immutable_function_call = true;
+	}
+
+	if (!facts->found &&
+		(facts->has_system_catalog || facts->has_temp_table ||
+		 facts->has_unlogged_table || facts->has_view ||
+		 facts->has_row_security || facts->has_function_call ||
+		 facts->has_non_immutable_function_call ||
+		 facts->has_insertinto_or_locking_clause))
+	{
+		facts->found = true;
+		if (!ROUTING_FACT_REQUESTED(facts, ROUTING_FACT_FUNCTION_CALL) ||
+			!is_object_relationship_check_needed())
+			return true;
+	}
+
+	return raw_expression_tree_walker(node, routing_facts_walker, context);
+}
+
 /*
  * Determine whether table_name is a system catalog or not.
  */
@@ -1083,6 +1250,63 @@ insertinto_or_locking_clause_walker(Node *node, void *context)
 	return raw_expression_tree_walker(node, insertinto_or_locking_clause_walker, ctx);
 }
 
+/*
+ * Return POOL_SESSION_STATE_* bits of session level state created by
+ * function calls in this query, which survives the end of transaction:
+ * session level advisory locks, and settings changed by set_config() other
+ * than transaction local ones, setseed() or dblink_connect().
+ */
+int
+pool_session_function_call_state(Node *node)
+{
+	int			state = 0;
+
+	raw_expression_tree_walker(node, session_function_call_walker, &state);
+
+	return state;
+}
+
+static bool
+session_function_call_walker(Node *node, void *context)
+{
+	int		   *state = (int *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, FuncCall))
+	{
+		FuncCall   *fcall = (FuncCall *) node;
+		char	   *fname = strVal(llast(fcall->funcname));
+
+		if (!strcmp(fname, "pg_advisory_lock") ||
+			!strcmp(fname, "pg_advisory_lock_shared") ||
+			!strcmp(fname, "pg_try_advisory_lock") ||
+			!strcmp(fname, "pg_try_advisory_lock_shared"))
+		{
+			*state |= POOL_SESSION_STATE_LOCK;
+		}
+		else if (!strcmp(fname, "set_config"))
+		{
+			Node	   *is_local = list_length(fcall->args) == 3 ? lthird(fcall->args) : NULL;
+
+			/* Unless is_local is literally true, the setting survives */
+			if (!(is_local && IsA(is_local, A_Const) &&
+				  !((A_Const *) is_local)->isnull &&
+				  IsA(&((A_Const *) is_local)->val, Boolean) &&
+				  boolVal(&((A_Const *) is_local)->val)))
+				*state |= POOL_SESSION_STATE_SET;
+		}
+		else if (!strcmp(fname, "setseed") ||
+				 !strcmp(fname, "dblink_connect") ||
+				 !strcmp(fname, "dblink_connect_u"))
+		{
+			*state |= POOL_SESSION_STATE_SET;
+		}
+	}
+	return raw_expression_tree_walker(node, session_function_call_walker, context);
+}
+
 /*
  * Return true if this SELECT has non immutable function calls.
  */
@@ -1129,26 +1353,8 @@ non_immutable_function_call_walker(Node *node, void *context)
 			ereport(DEBUG1,
 					(errmsg("non immutable function walker. checking function \"%s\"", fname)));
 
-			/* Check system catalog if the function is immutable */
-			if (is_immutable_function(fname) == false)
+			if (is_cache_unsafe_function(fname))
 			{
-				/* Non immutable function call found */
-				ctx->has_non_immutable_function_call = true;
-				return false;
-			}
-
-			/* check return type is timestamptz */
-			if (function_has_return_type(fname, "timestamptz"))
-			{
-				/* timestamptz should not be cached */
-				ctx->has_non_immutable_function_call = true;
-				return false;
-			}
-
-			/* return type is timetz */
-			if (function_has_return_type(fname, "timetz"))
-			{
-				/* timetz should not be cached */
 				ctx->has_non_immutable_function_call = true;
 				return false;
 			}
@@ -1184,6 +1390,25 @@ non_immutable_function_call_walker(Node *node, void *context)
 	return raw_expression_tree_walker(node, non_immutable_function_call_walker, context);
 }
 
+/*
+ * Return true if the result of the function must not be cached, that is,
+ * the function is not immutable or returns timestamptz or timetz.
+ */
+static bool
+is_cache_unsafe_function(char *fname)
+{
+	/* Check system catalog if the function is immutable */
+	if (is_immutable_function(fname) == false)
+		return true;
+
+	/* timestamptz and timetz should not be cached */
+	if (function_has_return_type(fname, "timestamptz") ||
+		function_has_return_type(fname, "timetz"))
+		return true;
+
+	return false;
+}
+
 /*
  * Check if the function is stable.
  */
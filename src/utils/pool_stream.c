@@ -19,6 +19,13 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
 
 
 #include "pool.h"
@@ -35,11 +42,19 @@ static int	mystrlen(char *str, int upper, int *flag);
 static int	mystrlinelen(char *str, int upper, int *flag);
 static int	save_pending_data(POOL_CONNECTION *cp, void *data, int len);
 static int	consume_pending_data(POOL_CONNECTION *cp, void *data, int len);
+static void reserve_pending_data(POOL_CONNECTION *cp, int len);
+static int	pool_read_socket(POOL_CONNECTION *cp, char *buf, int size, int64 *deadline);
+static int	pool_wait_readable(POOL_CONNECTION *cp, int64 *deadline);
+#ifdef __linux__
+static int	splice_socket(POOL_CONNECTION *dst, POOL_CONNECTION *src, int len);
+static int	wait_writable(int fd);
+#endif
 static MemoryContext SwitchToConnectionContext(bool backend_connection);
 #ifdef DEBUG
 static void dump_buffer(char *buf, int len);
 #endif
-static int	pool_write_flush(POOL_CONNECTION *cp, void *buf, int len);
+static int	pool_flush_iov(POOL_CONNECTION *cp, void *buf, int len);
+static int	append_write_buffer(POOL_CONNECTION *cp, void *buf, int len);
 
 /* timeout sec for pool_check_fd */
 static int	timeoutsec = -1;
@@ -75,16 +90,19 @@ pool_open(int fd, bool backend_connection)
 	cp->wbuf = palloc(WRITEBUFSZ);
 	cp->wbufsz = WRITEBUFSZ;
 	cp->wbufpo = 0;
+	cp->wiov = palloc(sizeof(struct iovec) * WRITEIOVMAX);
+	cp->wiovcnt = 0;
 
 	/* initialize pending data buffer */
 	cp->hp = palloc(READBUFSZ);
 	cp->bufsz = READBUFSZ;
 	cp->po = 0;
 	cp->len = 0;
+	cp->grow_hp = false;
+	cp->hp_pinned = false;
+	cp->retired_hp = NULL;
 	cp->sbuf = NULL;
 	cp->sbufsz = 0;
-	cp->buf2 = NULL;
-	cp->bufsz2 = 0;
 	cp->buf3 = NULL;
 	cp->bufsz3 = 0;
 
@@ -110,11 +128,12 @@ pool_close(POOL_CONNECTION *cp)
 	close(cp->fd);
 	cp->socket_state = POOL_SOCKET_CLOSED;
 	pfree(cp->wbuf);
+	pfree(cp->wiov);
 	pfree(cp->hp);
+	if (cp->retired_hp)
+		pfree(cp->retired_hp);
 	if (cp->sbuf)
 		pfree(cp->sbuf);
-	if (cp->buf2)
-		pfree(cp->buf2);
 	if (cp->buf3)
 		pfree(cp->buf3);
 	pool_discard_params(&cp->params);
@@ -139,14 +158,18 @@ pool_read_with_error(POOL_CONNECTION *cp, void *buf, int len,
 /*
 * read len bytes from cp
 * returns 0 on success otherwise throws an ereport.
+*
+* Data is read from the socket directly into the pending data buffer, as
+* much as it can hold, and copied out from there.
 */
 int
 pool_read(POOL_CONNECTION *cp, void *buf, int len)
 {
-	static char readbuf[READBUFSZ];
-
 	int			consume_size;
 	int			readlen;
+	int			readsize;
+	char	   *readbuf;
+	int64		deadline = 0;
 
 	consume_size = consume_pending_data(cp, buf, len);
 	len -= consume_size;
@@ -154,11 +177,13 @@ pool_read(POOL_CONNECTION *cp, void *buf, int len)
 
 	while (len > 0)
 	{
-		/*
-		 * If select(2) timeout is disabled, there's no need to call
-		 * pool_check_fd().
-		 */
-		if (pool_get_timeout() >= 0 && pool_check_fd(cp))
+		reserve_pending_data(cp, READBUFSZ);
+		readbuf = cp->hp + cp->po + cp->len;
+		readsize = cp->bufsz - cp->po - cp->len;
+
+		readlen = pool_read_socket(cp, readbuf, readsize, &deadline);
+
+		if (readlen == -2)
 		{
 			if (!IS_MAIN_NODE_ID(cp->db_node_id) && (getpid() != mypid))
 			{
@@ -175,22 +200,14 @@ pool_read(POOL_CONNECTION *cp, void *buf, int len)
 			}
 		}
 
-		if (cp->ssl_active > 0)
+		if (cp->isbackend && cp->ssl_active <= 0)
 		{
-			readlen = pool_ssl_read(cp, readbuf, READBUFSZ);
-		}
-		else
-		{
-			readlen = read(cp->fd, readbuf, READBUFSZ);
-			if (cp->isbackend)
-			{
-				ereport(DEBUG5,
-						(errmsg("pool_read: read %d bytes from backend %d",
-								readlen, cp->db_node_id)));
+			ereport(DEBUG5,
+					(errmsg("pool_read: read %d bytes from backend %d",
+							readlen, cp->db_node_id)));
 #ifdef DEBUG
-				dump_buffer(readbuf, readlen);
+			dump_buffer(readbuf, readlen);
 #endif
-			}
 		}
 
 		if (readlen == -1)
@@ -274,17 +291,13 @@ pool_read(POOL_CONNECTION *cp, void *buf, int len)
 			}
 		}
 
-		if (len < readlen)
-		{
-			/* overrun. we need to save remaining data to pending buffer */
-			save_pending_data(cp, readbuf + len, readlen - len);
-			memmove(buf, readbuf, len);
-			break;
-		}
+		cp->len += readlen;
+		if (readlen == readsize)
+			cp->grow_hp = true;
 
-		memmove(buf, readbuf, readlen);
-		buf += readlen;
-		len -= readlen;
+		consume_size = consume_pending_data(cp, buf, len);
+		buf += consume_size;
+		len -= consume_size;
 	}
 
 	return 0;
@@ -293,39 +306,38 @@ pool_read(POOL_CONNECTION *cp, void *buf, int len)
 /*
 * read exactly len bytes from cp
 * returns buffer address on success otherwise NULL.
+*
+* The returned address points into the pending data buffer, so no copy is
+* made.  It stays valid until the next call of pool_read2() for the same
+* connection, whatever else is read or unread in between: see
+* reserve_pending_data().
 */
 char *
 pool_read2(POOL_CONNECTION *cp, int len)
 {
 	char	   *buf;
-	int			req_size;
-	int			alloc_size;
-	int			consume_size;
+	char	   *readbuf;
+	int			readsize;
 	int			readlen;
-	MemoryContext oldContext = SwitchToConnectionContext(cp->isbackend);
-
-	req_size = cp->len + len;
+	int64		deadline = 0;
 
-	if (req_size > cp->bufsz2)
+	/* The data returned by the previous call is not used anymore */
+	if (cp->retired_hp)
 	{
-		alloc_size = ((req_size + 1) / READBUFSZ + 1) * READBUFSZ;
-		cp->buf2 = repalloc(cp->buf2, alloc_size);
-		cp->bufsz2 = alloc_size;
+		pfree(cp->retired_hp);
+		cp->retired_hp = NULL;
 	}
+	cp->hp_pinned = false;
 
-	buf = cp->buf2;
+	while (cp->len < len)
+	{
+		reserve_pending_data(cp, len - cp->len);
+		readbuf = cp->hp + cp->po + cp->len;
+		readsize = cp->bufsz - cp->po - cp->len;
 
-	consume_size = consume_pending_data(cp, buf, len);
-	len -= consume_size;
-	buf += consume_size;
+		readlen = pool_read_socket(cp, readbuf, readsize, &deadline);
 
-	while (len > 0)
-	{
-		/*
-		 * If select(2) timeout is disabled, there's no need to call
-		 * pool_check_fd().
-		 */
-		if (pool_get_timeout() >= 0 && pool_check_fd(cp))
+		if (readlen == -2)
 		{
 			if (!IS_MAIN_NODE_ID(cp->db_node_id))
 			{
@@ -342,18 +354,10 @@ pool_read2(POOL_CONNECTION *cp, int len)
 			}
 		}
 
-		if (cp->ssl_active > 0)
-		{
-			readlen = pool_ssl_read(cp, buf, len);
-		}
-		else
-		{
-			readlen = read(cp->fd, buf, len);
-			if (cp->isbackend)
-				ereport(DEBUG5,
-						(errmsg("pool_read2: read %d bytes from backend %d",
-								readlen, cp->db_node_id)));
-		}
+		if (cp->isbackend && cp->ssl_active <= 0)
+			ereport(DEBUG5,
+					(errmsg("pool_read2: read %d bytes from backend %d",
+							readlen, cp->db_node_id)));
 
 		if (readlen == -1)
 		{
@@ -424,11 +428,17 @@ pool_read2(POOL_CONNECTION *cp, int len)
 			}
 		}
 
-		buf += readlen;
-		len -= readlen;
+		cp->len += readlen;
+		if (readlen == readsize)
+			cp->grow_hp = true;
 	}
-	MemoryContextSwitchTo(oldContext);
-	return cp->buf2;
+
+	buf = cp->hp + cp->po;
+	cp->po += len;
+	cp->len -= len;
+	cp->hp_pinned = true;
+
+	return buf;
 }
 
 /*
@@ -468,44 +478,46 @@ pool_write_noerror(POOL_CONNECTION *cp, void *buf, int len)
 					(errmsg("pool_write: to frontend: length:%d po:%d", len, cp->wbufpo)));
 	}
 
-	while (len > 0)
-	{
-		int			remainder = WRITEBUFSZ - cp->wbufpo;
-
-		/*
-		 * If requested data cannot be added to the write buffer, flush the
-		 * buffer and directly write the requested data.  This could avoid
-		 * unwanted write in the middle of message boundary.
-		 */
-		if (remainder < len)
-		{
-			if (pool_flush_it(cp) == -1)
-				return -1;
+	if (len == 0)
+		return 0;
 
-			if (pool_write_flush(cp, buf, len) < 0)
-				return -1;
-			return 0;
-		}
+	/*
+	 * If requested data cannot be added to the write buffer, write it out
+	 * directly together with the buffered data.  This avoids copying large
+	 * data and could avoid unwanted write in the middle of message boundary.
+	 */
+	if (WRITEBUFSZ - cp->wbufpo < len)
+		return pool_flush_iov(cp, buf, len);
 
-		if (cp->wbufpo >= WRITEBUFSZ)
-		{
-			/*
-			 * Write buffer is full. so flush buffer. wbufpo is reset in
-			 * pool_flush_it().
-			 */
-			if (pool_flush_it(cp) == -1)
-				return -1;
-			remainder = WRITEBUFSZ;
-		}
+	return append_write_buffer(cp, buf, len);
+}
 
-		/* check buffer size */
-		remainder = Min(remainder, len);
+/*
+ * Copy len bytes, which must fit, into the write buffer.  If output is
+ * queued as a vector, the copied data is added to it as well.
+ * returns 0 on success otherwise -1.
+ */
+static int
+append_write_buffer(POOL_CONNECTION *cp, void *buf, int len)
+{
+	if (cp->wiovcnt > 0)
+	{
+		struct iovec *last = &cp->wiov[cp->wiovcnt - 1];
 
-		memcpy(cp->wbuf + cp->wbufpo, buf, remainder);
-		cp->wbufpo += remainder;
-		buf += remainder;
-		len -= remainder;
+		if ((char *) last->iov_base + last->iov_len == cp->wbuf + cp->wbufpo)
+			last->iov_len += len;
+		else if (cp->wiovcnt < WRITEIOVMAX)
+		{
+			cp->wiov[cp->wiovcnt].iov_base = cp->wbuf + cp->wbufpo;
+			cp->wiov[cp->wiovcnt].iov_len = len;
+			cp->wiovcnt++;
+		}
+		else if (pool_flush_it(cp) == -1)
+			return -1;
 	}
+
+	memcpy(cp->wbuf + cp->wbufpo, buf, len);
+	cp->wbufpo += len;
 	return 0;
 }
 
@@ -531,110 +543,100 @@ pool_write(POOL_CONNECTION *cp, void *buf, int len)
 
 
 /*
- * Direct write.
- * This function does not throws an ereport in case of an error
+ * Queue len bytes at buf to be written to cp without copying them.  The data
+ * must be kept unchanged until the write buffer is flushed.  Small data is
+ * just copied to the write buffer since that is cheaper than an iovec.
+ * returns 0 on success otherwise ereport.
  */
-static int
-pool_write_flush(POOL_CONNECTION *cp, void *buf, int len)
+int
+pool_write_ref(POOL_CONNECTION *cp, void *buf, int len)
 {
-	int			sts;
-	int			wlen;
-	int			offset;
+	if (len < WRITEREFMINSZ || cp->no_forward)
+		return pool_write(cp, buf, len);
 
-	wlen = len;
-
-	ereport(DEBUG5,
-			(errmsg("pool_write_flush: write size: %d", wlen)));
+	if (cp->wiovcnt >= WRITEIOVMAX - 1 && pool_flush_it(cp) == -1)
+		ereport(ERROR,
+				(errmsg("unable to write data to %s", cp->isbackend ? "backend" : "frontend"),
+				 errdetail("pool_flush failed")));
 
-	if (wlen == 0)
+	/* The write buffer so far becomes the first element of the vector */
+	if (cp->wiovcnt == 0 && cp->wbufpo > 0)
 	{
-		return 0;
+		cp->wiov[0].iov_base = cp->wbuf;
+		cp->wiov[0].iov_len = cp->wbufpo;
+		cp->wiovcnt = 1;
 	}
 
-	offset = 0;
-
-	for (;;)
-	{
-		errno = 0;
-
-		if (cp->ssl_active > 0)
-		{
-			sts = pool_ssl_write(cp, buf + offset, wlen);
-		}
-		else
-		{
-			sts = write(cp->fd, buf + offset, wlen);
-		}
-
-		if (sts >= 0)
-		{
-			wlen -= sts;
-
-			if (wlen == 0)
-			{
-				/* write completed */
-				break;
-			}
-
-			else if (wlen < 0)
-			{
-				ereport(WARNING,
-						(errmsg("pool_write_flush: invalid write size %d", sts)));
-				return -1;
-			}
+	cp->wiov[cp->wiovcnt].iov_base = buf;
+	cp->wiov[cp->wiovcnt].iov_len = len;
+	cp->wiovcnt++;
 
-			else
-			{
-				/* need to write remaining data */
-				ereport(DEBUG5,
-						(errmsg("pool_write_flush: write retry: %d", wlen)));
-
-				offset += sts;
-				continue;
-			}
-		}
+	return 0;
+}
 
-		else if (errno == EAGAIN || errno == EINTR)
-		{
-			continue;
-		}
+/*
+ * Write a V3 protocol message, kind and length header followed by len bytes
+ * of data, to cp.  Large data is not copied but written out together with
+ * the write buffer by a single writev(2).
+ * returns 0 on success otherwise ereport.
+ */
+int
+pool_write_message(POOL_CONNECTION *cp, char kind, void *data, int len)
+{
+	char		header[5];
+	int32		sendlen;
 
-		else
-		{
-			/*
-			 * If this is the backend stream, report error. Otherwise just
-			 * report debug message.
-			 */
-			if (cp->isbackend)
-				ereport(WARNING,
-						(errmsg("write on backend %d failed with error :\"%m\"", cp->db_node_id),
-						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen)));
-			else
-				ereport(DEBUG5,
-						(errmsg("write on frontend failed with error :\"%m\""),
-						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen)));
-			return -1;
-		}
-	}
+	header[0] = kind;
+	sendlen = htonl(len + 4);
+	memcpy(header + 1, &sendlen, sizeof(sendlen));
 
-	return 0;
+	pool_write(cp, header, sizeof(header));
+	return pool_write(cp, data, len);
 }
 
 /*
- * flush write buffer
+ * Write out the write buffer, or the queued output vector, followed by len
+ * bytes at buf if len > 0, with a single writev(2) call.
  * This function does not throws an ereport in case of an error
  */
-int
-pool_flush_it(POOL_CONNECTION *cp)
+static int
+pool_flush_iov(POOL_CONNECTION *cp, void *buf, int len)
 {
+	struct iovec iovbuf[WRITEIOVMAX + 1];
+	struct iovec *iov = iovbuf;
+	int			iovcnt = 0;
 	int			sts;
-	int			wlen;
+	int			wlen = 0;
 	int			offset;
+	int			i;
+
+	if (cp->wiovcnt > 0)
+	{
+		memcpy(iovbuf, cp->wiov, sizeof(struct iovec) * cp->wiovcnt);
+		iovcnt = cp->wiovcnt;
+	}
+	else if (cp->wbufpo > 0)
+	{
+		iovbuf[0].iov_base = cp->wbuf;
+		iovbuf[0].iov_len = cp->wbufpo;
+		iovcnt = 1;
+	}
+	if (len > 0)
+	{
+		iovbuf[iovcnt].iov_base = buf;
+		iovbuf[iovcnt].iov_len = len;
+		iovcnt++;
+	}
 
-	wlen = cp->wbufpo;
+	/* The buffered data is consumed whether the write succeeds or not */
+	cp->wbufpo = 0;
+	cp->wiovcnt = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		wlen += iovbuf[i].iov_len;
 
 	ereport(DEBUG5,
-			(errmsg("pool_flush_it: flush size: %d", wlen)));
+			(errmsg("pool_flush_it: flush size: %d iovcnt: %d", wlen, iovcnt)));
 
 	if (wlen == 0)
 	{
@@ -649,40 +651,37 @@ pool_flush_it(POOL_CONNECTION *cp)
 
 		if (cp->ssl_active > 0)
 		{
-			sts = pool_ssl_write(cp, cp->wbuf + offset, wlen);
+			sts = pool_ssl_write(cp, iov->iov_base, iov->iov_len);
 		}
 		else
 		{
-			sts = write(cp->fd, cp->wbuf + offset, wlen);
+			sts = writev(cp->fd, iov, iovcnt);
 		}
 
 		if (sts >= 0)
 		{
-			wlen -= sts;
+			offset += sts;
 
-			if (wlen == 0)
+			/* skip the written part of the vector */
+			while (iovcnt > 0 && sts >= (int) iov->iov_len)
 			{
-				/* write completed */
-				break;
+				sts -= iov->iov_len;
+				iov++;
+				iovcnt--;
 			}
 
-			else if (wlen < 0)
+			if (iovcnt == 0)
 			{
-				ereport(WARNING,
-						(errmsg("pool_flush_it: invalid write size %d", sts)));
-				cp->wbufpo = 0;
-				return -1;
+				/* write completed */
+				break;
 			}
 
-			else
-			{
-				/* need to write remaining data */
-				ereport(DEBUG5,
-						(errmsg("pool_flush_it: write retry: %d", wlen)));
-
-				offset += sts;
-				continue;
-			}
+			/* need to write remaining data */
+			iov->iov_base = (char *) iov->iov_base + sts;
+			iov->iov_len -= sts;
+			ereport(DEBUG5,
+					(errmsg("pool_flush_it: write retry: %d", wlen - offset)));
+			continue;
 		}
 
 		else if (errno == EAGAIN || errno == EINTR)
@@ -699,21 +698,28 @@ pool_flush_it(POOL_CONNECTION *cp)
 			if (cp->isbackend)
 				ereport(WARNING,
 						(errmsg("write on backend %d failed with error :\"%m\"", cp->db_node_id),
-						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen)));
+						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen - offset)));
 			else
 				ereport(DEBUG5,
 						(errmsg("write on frontend failed with error :\"%m\""),
-						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen)));
-			cp->wbufpo = 0;
+						 errdetail("while trying to write data from offset: %d wlen: %d", offset, wlen - offset)));
 			return -1;
 		}
 	}
 
-	cp->wbufpo = 0;
-
 	return 0;
 }
 
+/*
+ * flush write buffer
+ * This function does not throws an ereport in case of an error
+ */
+int
+pool_flush_it(POOL_CONNECTION *cp)
+{
+	return pool_flush_iov(cp, NULL, 0);
+}
+
 /*
  * flush write buffer and degenerate/failover if error occurs
  */
@@ -846,6 +852,185 @@ pool_write_and_flush_noerror(POOL_CONNECTION *cp, void *buf, int len)
 	return ret;
 }
 
+/*
+ * Forward len bytes of data from src to dst without interpreting them.
+ * On Linux, the data which has not been read from src yet is moved to dst by
+ * splice(2) through a pipe, without being copied to user space, if neither
+ * connection uses SSL.  dst is flushed before that to keep the order of
+ * data.
+ * returns 0 on success otherwise ereport.
+ */
+int
+pool_splice(POOL_CONNECTION *dst, POOL_CONNECTION *src, int len)
+{
+	char	   *p;
+	int			n;
+
+	/* Data already in the pending data buffer */
+	n = Min(src->len, len);
+	if (n > 0)
+	{
+		p = pool_read2(src, n);
+		pool_write(dst, p, n);
+		len -= n;
+	}
+
+#ifdef __linux__
+	if (len > 0 && src->ssl_active <= 0 && dst->ssl_active <= 0 && !dst->no_forward)
+	{
+		if (pool_flush_it(dst) == -1)
+			ereport(ERROR,
+					(errmsg("unable to write data to %s", dst->isbackend ? "backend" : "frontend"),
+					 errdetail("pool_flush failed")));
+
+		len -= splice_socket(dst, src, len);
+	}
+#endif
+
+	/*
+	 * Copy the rest.  If splice(2) stopped because of an error or EOF on src,
+	 * pool_read2() handles it.
+	 */
+	while (len > 0)
+	{
+		n = Min(len, READBUFMAXSZ);
+		p = pool_read2(src, n);
+		if (p == NULL)
+			ereport(ERROR,
+					(errmsg("unable to forward data"),
+					 errdetail("read from %s failed", src->isbackend ? "backend" : "frontend")));
+		pool_write(dst, p, n);
+		len -= n;
+	}
+
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * Move up to len bytes from src socket to dst socket by splice(2).  Returns
+ * the number of bytes moved, which is less than len if splice(2) is not
+ * usable, reading src timed out or failed, or EOF was found.
+ */
+static int
+splice_socket(POOL_CONNECTION *dst, POOL_CONNECTION *src, int len)
+{
+	static int	pipefd[2] = {-1, -1};
+	int64		deadline = 0;
+	ssize_t		inpipe;
+	ssize_t		sts;
+	int			moved = 0;
+
+	if (pipefd[0] < 0 && pipe(pipefd) < 0)
+	{
+		ereport(DEBUG1,
+				(errmsg("splice_socket: could not create pipe: \"%m\"")));
+		return 0;
+	}
+
+	while (moved < len)
+	{
+		if (timeoutsec >= 0 && pool_wait_readable(src, &deadline))
+			break;
+
+		inpipe = splice(src->fd, NULL, pipefd[1], NULL, len - moved,
+						SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (inpipe < 0 && errno == EINTR)
+			continue;
+		if (inpipe < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (pool_wait_readable(src, &deadline))
+				break;
+			continue;
+		}
+		if (inpipe <= 0)
+			break;
+
+		while (inpipe > 0)
+		{
+			sts = splice(pipefd[0], NULL, dst->fd, NULL, inpipe,
+						 SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (sts < 0 && errno == EINTR)
+				continue;
+			/* dst socket is full, wait for it to drain */
+			if (sts < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+				wait_writable(dst->fd) == 0)
+				continue;
+			if (sts <= 0)
+			{
+				int			save_errno = errno;
+
+				/* The pipe may hold data, so do not reuse it */
+				close(pipefd[0]);
+				close(pipefd[1]);
+				pipefd[0] = pipefd[1] = -1;
+
+				errno = save_errno;
+				ereport(ERROR,
+						(errmsg("unable to write data to %s", dst->isbackend ? "backend" : "frontend"),
+						 errdetail("splice failed with error \"%m\"")));
+			}
+			inpipe -= sts;
+			moved += sts;
+		}
+	}
+
+	ereport(DEBUG5,
+			(errmsg("splice_socket: moved %d of %d bytes", moved, len)));
+
+	return moved;
+}
+
+/*
+ * Wait until fd becomes writable.  Returns 0 if so, -1 on error.
+ */
+static int
+wait_writable(int fd)
+{
+	struct pollfd pfd;
+
+	for (;;)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+#endif
+
+/*
+ * Find the run of complete V3 messages of the given kind at the head of the
+ * pending data buffer, up to maxlen bytes in total.  Returns the length of
+ * the run, and the number of the messages in *nmsgs.  Data is not consumed.
+ */
+int
+pool_scan_messages(POOL_CONNECTION *cp, char kind, int maxlen, int *nmsgs)
+{
+	const unsigned char *p = (const unsigned char *) cp->hp + cp->po;
+	int			avail = Min(cp->len, maxlen);
+	int			off = 0;
+	int			n = 0;
+	uint32		mlen;
+
+	while (avail - off > 4 && p[off] == (unsigned char) kind)
+	{
+		mlen = ((uint32) p[off + 1] << 24) | ((uint32) p[off + 2] << 16) |
+			((uint32) p[off + 3] << 8) | (uint32) p[off + 4];
+		if (mlen < 4 || mlen >= (uint32) (avail - off))
+			break;
+		off += 1 + mlen;
+		n++;
+	}
+
+	*nmsgs = n;
+	return off;
+}
+
 /*
  * read a string until EOF or NULL is encountered.
  * if line is not 0, read until new line is encountered.
@@ -1112,35 +1297,78 @@ mystrlinelen(char *str, int upper, int *flag)
 static int
 save_pending_data(POOL_CONNECTION *cp, void *data, int len)
 {
-	int			reqlen;
-	size_t		realloc_size;
-	char	   *p;
+	reserve_pending_data(cp, len);
 
-	/* to be safe */
-	if (cp->len == 0)
-		cp->po = 0;
+	memmove(cp->hp + cp->po + cp->len, data, len);
+	cp->len += len;
+
+	return 0;
+}
+
+/*
+ * Make room for at least len bytes after the pending data.
+ *
+ * If the last read filled all the room it was given, the buffer is doubled,
+ * up to READBUFMAXSZ, so that a large result is read with a few large
+ * reads rather than many small ones.
+ *
+ * While the buffer is pinned by pool_read2(), the data before po must stay
+ * where it is.  If there is not enough room after the pending data then, the
+ * pending data is moved to a new buffer, and the old one is freed at the
+ * next pool_read2().
+ */
+static void
+reserve_pending_data(POOL_CONNECTION *cp, int len)
+{
+	int			size = cp->bufsz;
+	char	   *p;
+	MemoryContext oldContext;
 
-	reqlen = cp->po + cp->len + len;
+	if (cp->grow_hp && size < READBUFMAXSZ)
+		size = Min(size * 2, READBUFMAXSZ);
+	cp->grow_hp = false;
 
-	/* pending buffer is enough? */
-	if (reqlen > cp->bufsz)
+	if (size == cp->bufsz)
 	{
-		/* too small, enlarge it */
-		realloc_size = (reqlen / READBUFSZ + 1) * READBUFSZ;
+		/* enough room already? */
+		if (cp->bufsz - cp->po - cp->len >= len)
+			return;
 
-		MemoryContext oldContext = SwitchToConnectionContext(cp->isbackend);
+		/* enough room once the pending data is moved to the head? */
+		if (!cp->hp_pinned && cp->bufsz - cp->len >= len)
+		{
+			if (cp->len > 0)
+				memmove(cp->hp, cp->hp + cp->po, cp->len);
+			cp->po = 0;
+			return;
+		}
+	}
 
-		p = repalloc(cp->hp, realloc_size);
-		MemoryContextSwitchTo(oldContext);
+	if (cp->len + len > size)
+		size = ((cp->len + len) / READBUFSZ + 1) * READBUFSZ;
 
-		cp->bufsz = realloc_size;
-		cp->hp = p;
+	oldContext = SwitchToConnectionContext(cp->isbackend);
+
+	if (cp->hp_pinned)
+	{
+		p = palloc(size);
+		if (cp->len > 0)
+			memcpy(p, cp->hp + cp->po, cp->len);
+		cp->retired_hp = cp->hp;
+		cp->hp_pinned = false;
+	}
+	else
+	{
+		if (cp->len > 0 && cp->po > 0)
+			memmove(cp->hp, cp->hp + cp->po, cp->len);
+		p = repalloc(cp->hp, size);
 	}
 
-	memmove(cp->hp + cp->po + cp->len, data, len);
-	cp->len += len;
+	MemoryContextSwitchTo(oldContext);
 
-	return 0;
+	cp->hp = p;
+	cp->po = 0;
+	cp->bufsz = size;
 }
 
 /*
@@ -1158,7 +1386,7 @@ consume_pending_data(POOL_CONNECTION *cp, void *data, int len)
 	memmove(data, cp->hp + cp->po, consume_size);
 	cp->len -= consume_size;
 
-	if (cp->len <= 0)
+	if (cp->len <= 0 && !cp->hp_pinned)
 		cp->po = 0;
 	else
 		cp->po += consume_size;
@@ -1178,9 +1406,10 @@ pool_unread(POOL_CONNECTION *cp, void *data, int len)
 
 	/*
 	 * Optimization to avoid mmove. If there's enough space in front of
-	 * existing data, we can use it.
+	 * existing data, we can use it.  Not if the space is still referenced by
+	 * the result of pool_read2().
 	 */
-	if (cp->po >= len)
+	if (cp->po >= len && !cp->hp_pinned)
 	{
 		memmove(cp->hp + cp->po - len, data, len);
 		cp->po -= len;
@@ -1188,6 +1417,28 @@ pool_unread(POOL_CONNECTION *cp, void *data, int len)
 		return 0;
 	}
 
+	if (cp->hp_pinned)
+	{
+		/* Keep the pinned buffer and move to a new one */
+		realloc_size = Max(cp->bufsz, (n / READBUFSZ + 1) * READBUFSZ);
+
+		MemoryContext oldContext = SwitchToConnectionContext(cp->isbackend);
+
+		p = palloc(realloc_size);
+		MemoryContextSwitchTo(oldContext);
+
+		if (cp->len != 0)
+			memcpy(p + len, cp->hp + cp->po, cp->len);
+		cp->retired_hp = cp->hp;
+		cp->hp_pinned = false;
+		cp->hp = p;
+		cp->bufsz = realloc_size;
+		memmove(p, data, len);
+		cp->len = n;
+		cp->po = 0;
+		return 0;
+	}
+
 	if (cp->bufsz < n)
 	{
 		realloc_size = (n / READBUFSZ + 1) * READBUFSZ;
@@ -1314,48 +1565,92 @@ pool_get_timeout(void)
 }
 
 /*
- * Wait until read data is ready.
+ * Read up to size bytes from the connection into buf.
+ *
+ * The socket is read first and waited for only if no data is available, so
+ * that reading data which has already arrived takes a single system call.
+ * If a timeout is set by pool_set_timeout(), the read is done with
+ * MSG_DONTWAIT whatever the blocking mode of the socket, and the waits are
+ * bounded by *deadline, which is set at the first wait if it is 0.  An SSL
+ * connection is waited for before reading, since SSL_read() might block.
+ *
+ * Returns what read(2) returns, or -2 if the timeout expired or the wait
+ * failed.
+ */
+static int
+pool_read_socket(POOL_CONNECTION *cp, char *buf, int size, int64 *deadline)
+{
+	int			readlen;
+
+	if (cp->ssl_active > 0)
+	{
+		if (timeoutsec >= 0 && pool_wait_readable(cp, deadline))
+			return -2;
+		return pool_ssl_read(cp, buf, size);
+	}
+
+	for (;;)
+	{
+		if (timeoutsec >= 0)
+			readlen = recv(cp->fd, buf, size, MSG_DONTWAIT);
+		else
+			readlen = read(cp->fd, buf, size);
+
+		if (readlen >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return readlen;
+
+		/* No data yet.  This happens with no timeout if the socket is non-blocking */
+		if (pool_wait_readable(cp, deadline))
+			return -2;
+	}
+}
+
+static int64
+monotonic_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait until read data is ready, or *deadline has passed if a timeout is
+ * set.  If *deadline is 0, it is set to the timeout from now.
  * return values: 0: normal 1: data is not ready -1: error
  */
-int
-pool_check_fd(POOL_CONNECTION *cp)
+static int
+pool_wait_readable(POOL_CONNECTION *cp, int64 *deadline)
 {
-	fd_set		readmask;
-	fd_set		exceptmask;
-	int			fd;
+	struct pollfd pfd;
+	int			timeout;
 	int			fds;
-	struct timeval timeout;
-	struct timeval *timeoutp;
 	int			save_errno;
 
 	/*
 	 * If SSL is enabled, we need to check SSL internal buffer is empty or not
-	 * first. Otherwise select(2) will stuck.
+	 * first. Otherwise poll(2) will stuck.
 	 */
 	if (pool_ssl_pending(cp))
 	{
 		return 0;
 	}
 
-	fd = cp->fd;
-
-	if (timeoutsec >= 0)
-	{
-		timeout.tv_sec = timeoutsec;
-		timeout.tv_usec = 0;
-		timeoutp = &timeout;
-	}
-	else
-		timeoutp = NULL;
+	if (timeoutsec >= 0 && *deadline == 0)
+		*deadline = monotonic_msec() + (int64) timeoutsec * 1000;
 
 	for (;;)
 	{
-		FD_ZERO(&readmask);
-		FD_ZERO(&exceptmask);
-		FD_SET(fd, &readmask);
-		FD_SET(fd, &exceptmask);
+		if (timeoutsec >= 0)
+			timeout = (int) Max(*deadline - monotonic_msec(), 0);
+		else
+			timeout = -1;
 
-		fds = select(fd + 1, &readmask, NULL, &exceptmask, timeoutp);
+		pfd.fd = cp->fd;
+		pfd.events = POLLIN | POLLPRI;
+		pfd.revents = 0;
+
+		fds = poll(&pfd, 1, timeout);
 		save_errno = errno;
 		if (fds == -1)
 		{
@@ -1371,16 +1666,16 @@ pool_check_fd(POOL_CONNECTION *cp)
 				continue;
 
 			ereport(WARNING,
-					(errmsg("waiting for reading data. select failed with error: \"%m\"")));
+					(errmsg("waiting for reading data. poll failed with error: \"%m\"")));
 			break;
 		}
 		else if (fds == 0)		/* timeout */
 			return 1;
 
-		if (FD_ISSET(fd, &exceptmask))
+		if (pfd.revents & (POLLPRI | POLLNVAL))
 		{
 			ereport(WARNING,
-					(errmsg("waiting for reading data. exception occurred in select ")));
+					(errmsg("waiting for reading data. exception occurred in poll ")));
 			break;
 		}
 		errno = save_errno;
@@ -1388,3 +1683,15 @@ pool_check_fd(POOL_CONNECTION *cp)
 	}
 	return -1;
 }
+
+/*
+ * Wait until read data is ready.
+ * return values: 0: normal 1: data is not ready -1: error
+ */
+int
+pool_check_fd(POOL_CONNECTION *cp)
+{
+	int64		deadline = 0;
+
+	return pool_wait_readable(cp, &deadline);
+}
@@ -8,6 +8,7 @@
  *
  *-------------------------------------------------------------------------
  */
+#include <ctype.h>
 #include <string.h>
 
 #include "pool.h"
@@ -32,6 +33,7 @@ create_regex_array(void)
 	ar->pos = 0;
 	ar->size = AR_ALLOC_UNIT;
 	ar->regex = (regex_t **) palloc(sizeof(regex_t *) * ar->size);
+	memset(&ar->literals, 0, sizeof(ar->literals));
 
 	return ar;
 }
@@ -45,6 +47,7 @@ add_regex_array(RegArray *ar, char *pattern)
 	int			regex_flags;
 	regex_t    *regex;
 	char	   *pat;
+	char	   *literal;
 	int			len;
 
 	if (ar == NULL)
@@ -87,15 +90,22 @@ add_regex_array(RegArray *ar, char *pattern)
 		strncat(pat, "$", 2);
 	}
 
-	/* Compile our regex */
-	regex = palloc(sizeof(regex_t));
-	if (regcomp(regex, pat, regex_flags) != 0)
+	/* Literal patterns do not need to be compiled */
+	literal = regex_literal(pat);
+	if (literal)
+		regex = NULL;
+	else
 	{
-		ereport(WARNING,
-				(errmsg("failed to add regex pattern, invalid regex pattern: \"%s\" (%s)", pattern, pat)));
-		pfree(regex);
-		pfree(pat);
-		return -1;
+		/* Compile our regex */
+		regex = palloc(sizeof(regex_t));
+		if (regcomp(regex, pat, regex_flags) != 0)
+		{
+			ereport(WARNING,
+					(errmsg("failed to add regex pattern, invalid regex pattern: \"%s\" (%s)", pattern, pat)));
+			pfree(regex);
+			pfree(pat);
+			return -1;
+		}
 	}
 	pfree(pat);
 
@@ -105,6 +115,8 @@ add_regex_array(RegArray *ar, char *pattern)
 		ar->regex = repalloc(ar->regex, sizeof(regex_t *) * ar->size);
 	}
 	ar->regex[ar->pos] = regex;
+	if (literal)
+		add_regex_literal(&ar->literals, literal, 0, ar->pos);
 	ar->pos++;
 
 	return 0;
@@ -117,6 +129,8 @@ int
 regex_array_match(RegArray *ar, char *pattern)
 {
 	int			i;
+	int			found;
+	int			end;
 
 	if (ar == NULL)
 	{
@@ -132,12 +146,19 @@ regex_array_match(RegArray *ar, char *pattern)
 		return -1;
 	}
 
-	for (i = 0; i < ar->pos; i++)
+	/*
+	 * The first matching pattern wins.  So look up literal patterns first,
+	 * and then try regular expressions placed before the matched literal.
+	 */
+	found = regex_literal_match(&ar->literals, pattern, 0);
+	end = found >= 0 ? found : ar->pos;
+
+	for (i = 0; i < end; i++)
 	{
-		if (regexec(ar->regex[i], pattern, 0, 0, 0) == 0)
+		if (ar->regex[i] && regexec(ar->regex[i], pattern, 0, 0, 0) == 0)
 			return i;
 	}
-	return -1;
+	return found;
 }
 
 /*
@@ -146,10 +167,127 @@ regex_array_match(RegArray *ar, char *pattern)
 void
 destroy_regex_array(RegArray *ar)
 {
+	if (ar->literals.slots)
+		pfree(ar->literals.slots);
 	pfree(ar->regex);
 	pfree(ar);
 }
 
+/*
+ * Case insensitive hash of a string for RegLiteralIndex.
+ */
+static uint32
+regex_literal_hash(const char *str)
+{
+	uint32		h = 2166136261U;
+
+	while (*str)
+	{
+		h ^= (unsigned char) tolower((unsigned char) *str++);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * If the anchored pattern ("^...$") has no regular expression special
+ * characters, return palloc'd lower case string it matches.  Otherwise
+ * return NULL.
+ */
+char *
+regex_literal(const char *pattern)
+{
+	const char *start = pattern;
+	int			len = strlen(pattern);
+	char	   *literal;
+	int			i;
+
+	if (len < 2 || pattern[0] != '^' || pattern[len - 1] != '$')
+		return NULL;
+
+	start++;
+	len -= 2;
+
+	for (i = 0; i < len; i++)
+	{
+		if (strchr(".[]()*+?{}|\\^$", start[i]))
+			return NULL;
+	}
+
+	literal = palloc(len + 1);
+	for (i = 0; i < len; i++)
+		literal[i] = tolower((unsigned char) start[i]);
+	literal[len] = '\0';
+
+	return literal;
+}
+
+/*
+ * Add a literal pattern to the index.  "pos" is the index of the pattern in
+ * its pattern array.
+ */
+void
+add_regex_literal(RegLiteralIndex *index, char *literal, int type, int pos)
+{
+	uint32		i;
+
+	if ((index->used + 1) * 2 > index->size)
+	{
+		RegLiteralSlot *old_slots = index->slots;
+		int			old_size = index->size;
+		int			j;
+
+		index->size = old_size > 0 ? old_size * 2 : AR_ALLOC_UNIT;
+		index->slots = palloc(sizeof(RegLiteralSlot) * index->size);
+		memset(index->slots, 0, sizeof(RegLiteralSlot) * index->size);
+		index->used = 0;
+
+		for (j = 0; j < old_size; j++)
+		{
+			if (old_slots[j].literal)
+				add_regex_literal(index, old_slots[j].literal,
+								  old_slots[j].type, old_slots[j].pos);
+		}
+		if (old_slots)
+			pfree(old_slots);
+	}
+
+	i = regex_literal_hash(literal) & (index->size - 1);
+	while (index->slots[i].literal)
+		i = (i + 1) & (index->size - 1);
+
+	index->slots[i].literal = literal;
+	index->slots[i].type = type;
+	index->slots[i].pos = pos;
+	index->used++;
+}
+
+/*
+ * Look up the string in the literal pattern index.  Returns the smallest
+ * index of matching pattern of the type, or -1 if none matches.
+ */
+int
+regex_literal_match(RegLiteralIndex *index, const char *str, int type)
+{
+	uint32		i;
+	int			found = -1;
+
+	if (index->size == 0)
+		return -1;
+
+	i = regex_literal_hash(str) & (index->size - 1);
+	while (index->slots[i].literal)
+	{
+		RegLiteralSlot *slot = &index->slots[i];
+
+		if (slot->type == type && (found < 0 || slot->pos < found) &&
+			strcasecmp(slot->literal, str) == 0)
+			found = slot->pos;
+		i = (i + 1) & (index->size - 1);
+	}
+	return found;
+}
+
 /*
  * Create L-R token array
  */